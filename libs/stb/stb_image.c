@@ -1,3 +1,14 @@
+#include <stdlib.h>
+#include "stb_image_alloc.h"
+
+void* (*stbi_malloc_hook)(size_t size) = malloc;
+void* (*stbi_realloc_hook)(void* ptr, size_t newSize) = realloc;
+void (*stbi_free_hook)(void* ptr) = free;
+
+#define STBI_MALLOC(sz) stbi_malloc_hook(sz)
+#define STBI_REALLOC(p, newsz) stbi_realloc_hook(p, newsz)
+#define STBI_FREE(p) stbi_free_hook(p)
+
 #define STB_IMAGE_IMPLEMENTATION
 #if defined(__clang__)
   #pragma clang diagnostic push
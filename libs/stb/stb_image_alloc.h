@@ -0,0 +1,18 @@
+#pragma once
+#include <stddef.h>
+
+// Allocation hooks used by stb_image.c in place of malloc/realloc/free.
+// They default to the C heap; swap them to route decode buffers elsewhere.
+// Blocks returned by stbi_load*() are released through stbi_free_hook too,
+// so only change the hooks while no decoded image is outstanding.
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern void* (*stbi_malloc_hook)(size_t size);
+extern void* (*stbi_realloc_hook)(void* ptr, size_t newSize);
+extern void (*stbi_free_hook)(void* ptr);
+
+#ifdef __cplusplus
+}
+#endif
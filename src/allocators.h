@@ -0,0 +1,183 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Tagged heap allocations and resettable arenas. Every tagged allocation
+// carries a small header naming the subsystem it belongs to, so
+// memoryTagStats() can attribute live and peak bytes per subsystem. The
+// sokol libraries get these through their allocator hooks (see
+// sokolAlloc/sokolFree); the texture loader decodes into a scratch arena.
+//
+// Not thread-safe: every current user allocates on the main thread.
+
+enum mem_tag_t {
+  MemTag_Gfx,      // sokol_gfx pools and staging
+  MemTag_Fetch,    // sokol_fetch channels and request pools
+  MemTag_Decode,   // texture decode buffers and upload staging
+  MemTag_Count,
+};
+
+static const char* memTagNames[MemTag_Count] = {"gfx", "fetch", "decode"};
+
+typedef struct {
+  uint64_t liveBytes;
+  uint64_t peakBytes;
+  uint64_t allocations;
+  uint64_t frees;
+} mem_tag_stats_t;
+
+static mem_tag_stats_t memTagStats[MemTag_Count];
+
+// Keeps the payload 16-byte aligned like malloc on 64-bit targets.
+typedef struct {
+  size_t size;
+  uint32_t tag;
+  uint32_t pad;
+} mem_header_t;
+
+static void mem_track_alloc(mem_tag_t tag, size_t size) {
+  mem_tag_stats_t& stats = memTagStats[tag];
+  stats.liveBytes += size;
+  stats.allocations++;
+  if (stats.liveBytes > stats.peakBytes) {
+    stats.peakBytes = stats.liveBytes;
+  }
+}
+
+static void mem_track_free(mem_tag_t tag, size_t size) {
+  memTagStats[tag].liveBytes -= size;
+  memTagStats[tag].frees++;
+}
+
+static void* taggedAlloc(size_t size, mem_tag_t tag) {
+  mem_header_t* header = (mem_header_t*)malloc(sizeof(mem_header_t) + size);
+  if (!header) {
+    return nullptr;
+  }
+  header->size = size;
+  header->tag = (uint32_t)tag;
+  mem_track_alloc(tag, size);
+  return header + 1;
+}
+
+static void taggedFree(void* ptr) {
+  if (!ptr) {
+    return;
+  }
+  mem_header_t* header = (mem_header_t*)ptr - 1;
+  mem_track_free((mem_tag_t)header->tag, header->size);
+  free(header);
+}
+
+static size_t taggedSize(const void* ptr) {
+  return ptr ? ((const mem_header_t*)ptr - 1)->size : 0;
+}
+
+// sg_allocator / sfetch_allocator_t hooks; pass the mem_tag_t as user_data.
+static void* sokolAlloc(size_t size, void* userData) {
+  return taggedAlloc(size, (mem_tag_t)(intptr_t)userData);
+}
+
+static void sokolFree(void* ptr, void* userData) {
+  (void)userData;
+  taggedFree(ptr);
+}
+
+// Bump allocator over one tagged block. Frees only count down the live
+// allocations; once none are left the arena rewinds on its own, so a
+// decode/upload cycle reuses the same memory without touching the heap.
+// Requests that do not fit spill to the tagged heap and are counted.
+typedef struct {
+  uint8_t* base;
+  size_t capacity;
+  size_t used;
+  size_t peak;
+  int live;
+  uint64_t spills;
+  mem_tag_t tag;
+} arena_t;
+
+#define ARENA_ALIGN (16)
+
+static void arenaInit(arena_t* arena, size_t capacity, mem_tag_t tag) {
+  memset(arena, 0, sizeof(*arena));
+  arena->tag = tag;
+  arena->base = (uint8_t*)taggedAlloc(capacity, tag);
+  arena->capacity = arena->base ? capacity : 0;
+}
+
+static void arenaDestroy(arena_t* arena) {
+  taggedFree(arena->base);
+  memset(arena, 0, sizeof(*arena));
+}
+
+static bool arenaOwns(const arena_t* arena, const void* ptr) {
+  return ptr >= arena->base && ptr < arena->base + arena->capacity;
+}
+
+// Rewinds the arena. Anything still allocated from it becomes invalid.
+static void arenaReset(arena_t* arena) {
+  arena->used = 0;
+  arena->live = 0;
+}
+
+static void* arenaAlloc(arena_t* arena, size_t size) {
+  size_t needed = sizeof(mem_header_t) + size;
+  size_t start = (arena->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  if (start + needed > arena->capacity) {
+    arena->spills++;
+    return taggedAlloc(size, arena->tag);
+  }
+  mem_header_t* header = (mem_header_t*)(arena->base + start);
+  header->size = size;
+  header->tag = (uint32_t)arena->tag;
+  arena->used = start + needed;
+  if (arena->used > arena->peak) {
+    arena->peak = arena->used;
+  }
+  arena->live++;
+  return header + 1;
+}
+
+static void arenaFree(arena_t* arena, void* ptr) {
+  if (!ptr) {
+    return;
+  }
+  if (!arenaOwns(arena, ptr)) {
+    taggedFree(ptr);
+    return;
+  }
+  if (--arena->live == 0) {
+    arena->used = 0;
+  }
+}
+
+// Grows in place when `ptr` is the most recent allocation.
+static void* arenaRealloc(arena_t* arena, void* ptr, size_t newSize) {
+  if (!ptr) {
+    return arenaAlloc(arena, newSize);
+  }
+  mem_header_t* header = (mem_header_t*)ptr - 1;
+  if (arenaOwns(arena, ptr) &&
+      (uint8_t*)ptr + header->size == arena->base + arena->used &&
+      (size_t)((uint8_t*)ptr - arena->base) + newSize <= arena->capacity) {
+    header->size = newSize;
+    arena->used = (size_t)((uint8_t*)ptr - arena->base) + newSize;
+    if (arena->used > arena->peak) {
+      arena->peak = arena->used;
+    }
+    return ptr;
+  }
+  void* grown = arenaAlloc(arena, newSize);
+  if (grown) {
+    memcpy(grown, ptr, header->size < newSize ? header->size : newSize);
+    arenaFree(arena, ptr);
+  }
+  return grown;
+}
+
+static mem_tag_stats_t memoryTagStats(mem_tag_t tag) {
+  return memTagStats[tag];
+}
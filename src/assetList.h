@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+// Reads the file names listed in assets.yml, for the offline tools. Only
+// the `- "name"` entries are picked up; an unreadable file gives an empty
+// list.
+static std::vector<std::string> readAssetList(const char* path) {
+  std::vector<std::string> files;
+  FILE* fp = fopen(path, "rb");
+  if (!fp) {
+    return files;
+  }
+  char line[512];
+  while (fgets(line, sizeof(line), fp)) {
+    const char* start = strchr(line, '"');
+    if (!start || !strstr(line, "-")) {
+      continue;
+    }
+    const char* end = strchr(start + 1, '"');
+    if (end) {
+      files.push_back(std::string(start + 1, end - start - 1));
+    }
+  }
+  fclose(fp);
+  return files;
+}
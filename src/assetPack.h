@@ -0,0 +1,145 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(_WIN32)
+  #define WIN32_LEAN_AND_MEAN
+  #define NOMINMAX
+  #include <windows.h>
+#else
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+#include "assetPackFormat.h"
+
+// Runtime reader for the asset pack described in assetPackFormat.h. The whole
+// file is memory-mapped once and lookups return pointers straight into the
+// mapping.
+#define ASSET_PACK_PATH "assets.pak"
+
+typedef struct {
+  const uint8_t* base;
+  size_t size;
+  const apak_entry_t* entries;
+  uint32_t numEntries;
+#if defined(_WIN32)
+  HANDLE file;
+  HANDLE mapping;
+#endif
+} asset_pack_t;
+
+static asset_pack_t assetPack;
+
+static void closeAssetPack(void) {
+  if (!assetPack.base) {
+    return;
+  }
+#if defined(_WIN32)
+  UnmapViewOfFile(assetPack.base);
+  CloseHandle(assetPack.mapping);
+  CloseHandle(assetPack.file);
+#else
+  munmap((void*)assetPack.base, assetPack.size);
+#endif
+  memset(&assetPack, 0, sizeof(assetPack));
+}
+
+// Maps the pack at `path`. Returns false (and leaves no pack open) if the
+// file is missing or malformed; callers then fall back to loose files.
+static bool openAssetPack(const char* path) {
+  closeAssetPack();
+#if defined(_WIN32)
+  HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  LARGE_INTEGER fileSize;
+  GetFileSizeEx(file, &fileSize);
+  HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (!mapping) {
+    CloseHandle(file);
+    return false;
+  }
+  const uint8_t* base =
+      (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  if (!base) {
+    CloseHandle(mapping);
+    CloseHandle(file);
+    return false;
+  }
+  assetPack.file = file;
+  assetPack.mapping = mapping;
+  size_t size = (size_t)fileSize.QuadPart;
+#else
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+  size_t size = (size_t)st.st_size;
+  void* mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    return false;
+  }
+  const uint8_t* base = (const uint8_t*)mapped;
+#endif
+  assetPack.base = base;
+  assetPack.size = size;
+
+  const apak_header_t* header = (const apak_header_t*)base;
+  if (size < sizeof(apak_header_t) || header->magic != APAK_MAGIC ||
+      header->version != APAK_VERSION ||
+      sizeof(apak_header_t) +
+              (size_t)header->numEntries * sizeof(apak_entry_t) >
+          size) {
+    closeAssetPack();
+    return false;
+  }
+  assetPack.entries = (const apak_entry_t*)(base + sizeof(apak_header_t));
+  assetPack.numEntries = header->numEntries;
+  return true;
+}
+
+static bool assetPackIsOpen(void) {
+  return assetPack.base != nullptr;
+}
+
+// Looks up `name` in the open pack. On success `data` points into the
+// mapping and stays valid until closeAssetPack().
+static bool assetPackFind(const char* name,
+                          const uint8_t** data,
+                          size_t* size) {
+  if (!assetPack.base) {
+    return false;
+  }
+  uint64_t hash = apak_hash(name);
+  uint32_t lo = 0, hi = assetPack.numEntries;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (assetPack.entries[mid].nameHash < hash) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == assetPack.numEntries || assetPack.entries[lo].nameHash != hash) {
+    return false;
+  }
+  const apak_entry_t* entry = &assetPack.entries[lo];
+  if (entry->offset + entry->size > assetPack.size) {
+    return false;
+  }
+  *data = assetPack.base + entry->offset;
+  *size = (size_t)entry->size;
+  return true;
+}
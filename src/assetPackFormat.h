@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include "fnvHash.h"
+
+// Single-file asset pack written by the asset-packer tool. Layout:
+//
+//   apak_header_t
+//   apak_entry_t[numEntries]   sorted by name hash
+//   blobs                      each starting on an APAK_BLOB_ALIGN boundary
+//
+// Shared by the asset-packer tool, which writes it, and assetPack.h, which
+// maps it at runtime.
+#define APAK_MAGIC (0x4b415041)  // 'APAK'
+#define APAK_VERSION (1)
+#define APAK_BLOB_ALIGN (64)
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t numEntries;
+  uint32_t reserved;
+} apak_header_t;
+
+typedef struct {
+  uint64_t nameHash;
+  uint64_t offset;
+  uint64_t size;
+} apak_entry_t;
+
+// 64-bit FNV-1a of the asset name as listed in assets.yml.
+static uint64_t apak_hash(const char* name) {
+  return fnvHash(name, strlen(name));
+}
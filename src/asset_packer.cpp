@@ -0,0 +1,123 @@
+// Offline asset packer: bundles every file listed in assets.yml, plus its
+// baked .dtex when one exists next to it, into a single memory-mappable pack.
+//
+//   asset-packer <assets.yml> <source dir> <output.pak>
+//
+// See assetPackFormat.h for the file layout.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "assetList.h"
+#include "assetPackFormat.h"
+
+typedef struct {
+  std::string name;
+  std::vector<uint8_t> data;
+  apak_entry_t entry;
+} pack_item_t;
+
+static bool read_file(const std::string& path, std::vector<uint8_t>* out) {
+  FILE* fp = fopen(path.c_str(), "rb");
+  if (!fp) {
+    return false;
+  }
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  out->resize((size_t)size);
+  bool ok = fread(out->data(), 1, out->size(), fp) == out->size();
+  fclose(fp);
+  return ok;
+}
+
+static bool add_item(std::vector<pack_item_t>* items,
+                     const std::string& sourceDir,
+                     const std::string& name) {
+  pack_item_t item;
+  item.name = name;
+  if (!read_file(sourceDir + "/" + name, &item.data)) {
+    return false;
+  }
+  item.entry.nameHash = apak_hash(name.c_str());
+  item.entry.size = item.data.size();
+  item.entry.offset = 0;
+  items->push_back(item);
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 4) {
+    fprintf(stderr,
+            "usage: asset-packer <assets.yml> <source dir> <output.pak>\n");
+    return 1;
+  }
+  std::vector<std::string> files = readAssetList(argv[1]);
+  if (files.empty()) {
+    fprintf(stderr, "asset-packer: no files listed in %s\n", argv[1]);
+    return 1;
+  }
+
+  std::vector<pack_item_t> items;
+  for (const std::string& file : files) {
+    if (!add_item(&items, argv[2], file)) {
+      fprintf(stderr, "asset-packer: failed to read %s\n", file.c_str());
+      return 1;
+    }
+    size_t dot = file.find_last_of('.');
+    if (dot != std::string::npos) {
+      // Baked textures are optional; pack them when the baker has run.
+      add_item(&items, argv[2], file.substr(0, dot) + ".dtex");
+    }
+  }
+
+  std::sort(items.begin(), items.end(),
+            [](const pack_item_t& a, const pack_item_t& b) {
+              return a.entry.nameHash < b.entry.nameHash;
+            });
+  for (size_t i = 1; i < items.size(); i++) {
+    if (items[i].entry.nameHash == items[i - 1].entry.nameHash) {
+      fprintf(stderr, "asset-packer: hash collision between %s and %s\n",
+              items[i - 1].name.c_str(), items[i].name.c_str());
+      return 1;
+    }
+  }
+
+  uint64_t offset =
+      sizeof(apak_header_t) + items.size() * sizeof(apak_entry_t);
+  for (pack_item_t& item : items) {
+    offset = (offset + APAK_BLOB_ALIGN - 1) & ~(uint64_t)(APAK_BLOB_ALIGN - 1);
+    item.entry.offset = offset;
+    offset += item.entry.size;
+  }
+
+  FILE* fp = fopen(argv[3], "wb");
+  if (!fp) {
+    fprintf(stderr, "asset-packer: failed to write %s\n", argv[3]);
+    return 1;
+  }
+  apak_header_t header = {};
+  header.magic = APAK_MAGIC;
+  header.version = APAK_VERSION;
+  header.numEntries = (uint32_t)items.size();
+  fwrite(&header, sizeof(header), 1, fp);
+  for (const pack_item_t& item : items) {
+    fwrite(&item.entry, sizeof(apak_entry_t), 1, fp);
+  }
+  static const uint8_t padding[APAK_BLOB_ALIGN] = {0};
+  uint64_t written =
+      sizeof(apak_header_t) + items.size() * sizeof(apak_entry_t);
+  for (const pack_item_t& item : items) {
+    fwrite(padding, 1, (size_t)(item.entry.offset - written), fp);
+    fwrite(item.data.data(), 1, item.data.size(), fp);
+    written = item.entry.offset + item.entry.size;
+  }
+  fclose(fp);
+
+  printf("asset-packer: wrote %zu assets, %llu bytes to %s\n", items.size(),
+         (unsigned long long)written, argv[3]);
+  return 0;
+}
@@ -0,0 +1,287 @@
+#pragma once
+
+#include <math.h>
+#include <string.h>
+#include <vector>
+#include "sokol_gfx.h"
+#include "sokol_time.h"
+#include "glm/glm.hpp"
+
+// Clustered forward lighting on the dungeon's tile grid. The dungeon is a
+// single storey, so a cluster is one grid cell spanning the full height
+// rather than a froxel. Every frame updateLightClusters() bins the active
+// lights into the cells their radius touches and uploads three data
+// textures (GL 3.3 / GLES3 have no SSBOs):
+//
+//   cluster texture  RGBA32F, one texel per cell: first index, light count
+//   index texture    R32F, the compact light index list all cells share
+//   light texture    RGBA32F, CLUSTER_LIGHT_ROWS texels per light:
+//                      row 0  position.xyz, radius
+//                      row 1  color * intensity, ambient fraction
+//                      row 2  constant, linear, quadratic attenuation
+//
+// The phong shader looks up its cell and loops over that cell's lights only.
+// The texture sizes below are baked into light_shaders.glsl as well.
+
+#define CLUSTER_MAX_LIGHTS (1024)
+#define CLUSTER_LIGHT_ROWS (3)
+#define CLUSTER_INDEX_WIDTH (1024)
+#define CLUSTER_INDEX_HEIGHT (32)
+#define CLUSTER_MAX_INDICES (CLUSTER_INDEX_WIDTH * CLUSTER_INDEX_HEIGHT)
+// Matches MAX_CLUSTER_LIGHTS in light_shaders.glsl.
+#define CLUSTER_MAX_CELL_LIGHTS (64)
+
+#define INVALID_CLUSTER_LIGHT (-1)
+
+typedef struct {
+  glm::vec3 position;
+  glm::vec3 color;
+  // Share of the color applied regardless of the surface's facing.
+  float ambient;
+  // Scales the color; animate this for flicker.
+  float intensity;
+  // Constant, linear and quadratic terms.
+  glm::vec3 attenuation;
+  // The shader fades the light out to nothing at this distance, so it is
+  // also the binning radius.
+  float radius;
+  bool active;
+} cluster_light_t;
+
+typedef struct {
+  int lights;
+  int indices;
+  // Light/cell pairs dropped because the index list or a cell was full.
+  int dropped;
+  int busiestCell;
+  double binMs;
+  double worstBinMs;
+} cluster_stats_t;
+
+typedef struct {
+  float originX;
+  float originZ;
+  float cellSize;
+  int width;
+  int length;
+  sg_image clusterImage;
+  sg_image indexImage;
+  sg_image lightImage;
+  std::vector<cluster_light_t> lights;
+  std::vector<int> freeLights;
+  // Per-frame scratch, kept around so binning does not allocate.
+  std::vector<uint32_t> pairs;
+  std::vector<uint32_t> counts;
+  std::vector<uint32_t> cursors;
+  std::vector<float> clusterTexels;
+  std::vector<float> indexTexels;
+  std::vector<float> lightTexels;
+  cluster_stats_t stats;
+} light_clusters_t;
+
+static light_clusters_t lightClusters;
+
+static sg_image cluster_make_image(int width,
+                                   int height,
+                                   sg_pixel_format format,
+                                   const char* label) {
+  sg_image_desc imageDesc = {0};
+  imageDesc.width = width;
+  imageDesc.height = height;
+  imageDesc.usage = SG_USAGE_DYNAMIC;
+  imageDesc.pixel_format = format;
+  // Float textures are not filterable everywhere, and the shader samples
+  // texel centers anyway.
+  imageDesc.min_filter = SG_FILTER_NEAREST;
+  imageDesc.mag_filter = SG_FILTER_NEAREST;
+  imageDesc.wrap_u = SG_WRAP_CLAMP_TO_EDGE;
+  imageDesc.wrap_v = SG_WRAP_CLAMP_TO_EDGE;
+  imageDesc.label = label;
+  return sg_make_image(&imageDesc);
+}
+
+// Sets up a `width` x `length` grid of square cells whose (0, 0) corner is
+// at (originX, originZ) in world space.
+static void initLightClusters(float originX,
+                              float originZ,
+                              float cellSize,
+                              int width,
+                              int length) {
+  light_clusters_t& lc = lightClusters;
+  lc.originX = originX;
+  lc.originZ = originZ;
+  lc.cellSize = cellSize;
+  lc.width = width;
+  lc.length = length;
+  lc.stats = {};
+  lc.clusterImage = cluster_make_image(width, length, SG_PIXELFORMAT_RGBA32F,
+                                       "light-clusters");
+  lc.indexImage =
+      cluster_make_image(CLUSTER_INDEX_WIDTH, CLUSTER_INDEX_HEIGHT,
+                         SG_PIXELFORMAT_R32F, "light-cluster-indices");
+  lc.lightImage = cluster_make_image(CLUSTER_MAX_LIGHTS, CLUSTER_LIGHT_ROWS,
+                                     SG_PIXELFORMAT_RGBA32F, "cluster-lights");
+  lc.counts.assign((size_t)width * length, 0);
+  lc.cursors.assign((size_t)width * length, 0);
+  lc.clusterTexels.assign((size_t)width * length * 4, 0.0f);
+  lc.indexTexels.assign(CLUSTER_MAX_INDICES, 0.0f);
+  lc.lightTexels.assign(CLUSTER_MAX_LIGHTS * CLUSTER_LIGHT_ROWS * 4, 0.0f);
+  lc.pairs.reserve(CLUSTER_MAX_INDICES);
+}
+
+static void destroyLightClusters(void) {
+  light_clusters_t& lc = lightClusters;
+  sg_destroy_image(lc.clusterImage);
+  sg_destroy_image(lc.indexImage);
+  sg_destroy_image(lc.lightImage);
+  lc = light_clusters_t();
+}
+
+// Returns a light id, or INVALID_CLUSTER_LIGHT once CLUSTER_MAX_LIGHTS are
+// in use.
+static int addClusterLight(const cluster_light_t& light) {
+  light_clusters_t& lc = lightClusters;
+  int id;
+  if (!lc.freeLights.empty()) {
+    id = lc.freeLights.back();
+    lc.freeLights.pop_back();
+  } else if (lc.lights.size() < CLUSTER_MAX_LIGHTS) {
+    id = (int)lc.lights.size();
+    lc.lights.push_back(light);
+  } else {
+    return INVALID_CLUSTER_LIGHT;
+  }
+  lc.lights[id] = light;
+  lc.lights[id].active = true;
+  return id;
+}
+
+static void removeClusterLight(int id) {
+  if (id < 0 || id >= (int)lightClusters.lights.size()) {
+    return;
+  }
+  lightClusters.lights[id].active = false;
+  lightClusters.freeLights.push_back(id);
+}
+
+static cluster_light_t* clusterLight(int id) {
+  if (id < 0 || id >= (int)lightClusters.lights.size()) {
+    return nullptr;
+  }
+  return &lightClusters.lights[id];
+}
+
+static void cluster_bin_light(light_clusters_t& lc, int id) {
+  const cluster_light_t& light = lc.lights[id];
+  float invCell = 1.0f / lc.cellSize;
+  float lx = (light.position.x - lc.originX) * invCell;
+  float lz = (light.position.z - lc.originZ) * invCell;
+  float r = light.radius * invCell;
+  int x0 = glm::max((int)floorf(lx - r), 0);
+  int x1 = glm::min((int)floorf(lx + r), lc.width - 1);
+  int z0 = glm::max((int)floorf(lz - r), 0);
+  int z1 = glm::min((int)floorf(lz + r), lc.length - 1);
+  for (int z = z0; z <= z1; z++) {
+    float dz = glm::max(glm::max((float)z - lz, lz - (float)(z + 1)), 0.0f);
+    for (int x = x0; x <= x1; x++) {
+      // Skip the corners of the bounding square the circle misses.
+      float dx = glm::max(glm::max((float)x - lx, lx - (float)(x + 1)), 0.0f);
+      if (dx * dx + dz * dz > r * r) {
+        continue;
+      }
+      uint32_t cell = (uint32_t)(z * lc.width + x);
+      lc.pairs.push_back(cell * CLUSTER_MAX_LIGHTS + (uint32_t)id);
+      lc.counts[cell]++;
+    }
+  }
+}
+
+// Bins the active lights and uploads the cluster textures. Call once per
+// frame outside a pass, after the lights have been moved or animated.
+static void updateLightClusters(void) {
+  light_clusters_t& lc = lightClusters;
+  if (lc.width == 0) {
+    return;
+  }
+  uint64_t start = stm_now();
+  cluster_stats_t& stats = lc.stats;
+  stats.lights = 0;
+  stats.dropped = 0;
+  stats.busiestCell = 0;
+
+  lc.pairs.clear();
+  memset(lc.counts.data(), 0, lc.counts.size() * sizeof(uint32_t));
+  for (int id = 0; id < (int)lc.lights.size(); id++) {
+    const cluster_light_t& light = lc.lights[id];
+    if (!light.active || light.intensity <= 0.0f) {
+      continue;
+    }
+    float* texel = &lc.lightTexels[(size_t)id * 4];
+    const size_t row = CLUSTER_MAX_LIGHTS * 4;
+    texel[0] = light.position.x;
+    texel[1] = light.position.y;
+    texel[2] = light.position.z;
+    texel[3] = light.radius;
+    texel[row + 0] = light.color.x * light.intensity;
+    texel[row + 1] = light.color.y * light.intensity;
+    texel[row + 2] = light.color.z * light.intensity;
+    texel[row + 3] = light.ambient;
+    texel[2 * row + 0] = light.attenuation.x;
+    texel[2 * row + 1] = light.attenuation.y;
+    texel[2 * row + 2] = light.attenuation.z;
+    cluster_bin_light(lc, id);
+    stats.lights++;
+  }
+
+  // Counting sort of the (cell, light) pairs into the shared index list.
+  uint32_t offset = 0;
+  for (size_t cell = 0; cell < lc.counts.size(); cell++) {
+    uint32_t count =
+        glm::min(lc.counts[cell], (uint32_t)CLUSTER_MAX_CELL_LIGHTS);
+    count = glm::min(count, (uint32_t)CLUSTER_MAX_INDICES - offset);
+    stats.dropped += (int)(lc.counts[cell] - count);
+    stats.busiestCell = glm::max(stats.busiestCell, (int)lc.counts[cell]);
+    lc.clusterTexels[cell * 4 + 0] = (float)offset;
+    lc.clusterTexels[cell * 4 + 1] = (float)count;
+    lc.cursors[cell] = offset;
+    lc.counts[cell] = offset + count;
+    offset += count;
+  }
+  for (uint32_t pair : lc.pairs) {
+    uint32_t cell = pair / CLUSTER_MAX_LIGHTS;
+    if (lc.cursors[cell] < lc.counts[cell]) {
+      lc.indexTexels[lc.cursors[cell]++] = (float)(pair % CLUSTER_MAX_LIGHTS);
+    }
+  }
+  stats.indices = (int)offset;
+  stats.binMs = stm_ms(stm_since(start));
+  stats.worstBinMs = glm::max(stats.worstBinMs, stats.binMs);
+
+  sg_image_data data = {0};
+  data.subimage[0][0].ptr = lc.clusterTexels.data();
+  data.subimage[0][0].size = lc.clusterTexels.size() * sizeof(float);
+  sg_update_image(lc.clusterImage, data);
+  data.subimage[0][0].ptr = lc.indexTexels.data();
+  data.subimage[0][0].size = lc.indexTexels.size() * sizeof(float);
+  sg_update_image(lc.indexImage, data);
+  data.subimage[0][0].ptr = lc.lightTexels.data();
+  data.subimage[0][0].size = lc.lightTexels.size() * sizeof(float);
+  sg_update_image(lc.lightImage, data);
+}
+
+// Grid placement for the shader: xy is the world-space corner of cell
+// (0, 0) on the xz plane, z is 1 / cell size.
+static glm::vec4 lightClusterGrid(void) {
+  return glm::vec4(lightClusters.originX, lightClusters.originZ,
+                   1.0f / lightClusters.cellSize, 0.0f);
+}
+
+// Grid size in cells, x by z.
+static glm::vec4 lightClusterDims(void) {
+  return glm::vec4((float)lightClusters.width, (float)lightClusters.length,
+                   0.0f, 0.0f);
+}
+
+static cluster_stats_t lightClusterStats(void) {
+  return lightClusters.stats;
+}
@@ -0,0 +1,416 @@
+#pragma once
+
+#include <string.h>
+#include <vector>
+#include "sokol_gfx.h"
+#include "sokol_time.h"
+#include "glm/glm.hpp"
+#include "clusteredLights.h"
+#include "light_shaders.glsl.h"
+
+// Deferred alternative to the clustered forward path in light_shaders.glsl.
+// The dungeon is drawn once into a G-buffer of three render targets:
+//
+//   albedo   RGBA8,   albedo in rgb, per-vertex ambient occlusion in a
+//   normal   RGBA16F, octahedral normal in xy, distance to the eye in z,
+//                     1 in w wherever a surface was drawn
+//   light    RGBA16F, the baked lightmap and flood light, already applied
+//
+// The light pass then draws every active cluster light as an instanced box
+// around its radius and adds its contribution into the light target, and
+// the compose pass copies that target into the frame, fogging it by the
+// normal target's eye distance. Light cost scales with the pixels each light
+// covers instead of the lights in a surface's cluster.
+//
+// Needs multiple render targets and blendable half-float targets, so it is
+// unavailable on GLES2/WebGL1; see deferredLightingSupported().
+
+// Floats per light instance: position and radius, color * intensity and
+// ambient fraction, attenuation terms.
+#define DEFERRED_LIGHT_FLOATS (12)
+
+enum lighting_path_t {
+  LightingPath_Forward,
+  LightingPath_Deferred,
+  LightingPath_Count,
+};
+
+enum deferred_target_t {
+  DeferredTarget_Albedo,
+  DeferredTarget_Normal,
+  DeferredTarget_Light,
+  DeferredTarget_Count,
+};
+
+static const sg_pixel_format deferred_target_formats[DeferredTarget_Count] = {
+    SG_PIXELFORMAT_RGBA8,
+    SG_PIXELFORMAT_RGBA16F,
+    SG_PIXELFORMAT_RGBA16F,
+};
+
+typedef struct {
+  int lights;
+  // CPU time spent recording each pass, for comparing against the forward
+  // path's single pass.
+  double geometryMs;
+  double lightMs;
+  double composeMs;
+} deferred_stats_t;
+
+typedef struct {
+  bool valid;
+  int width;
+  int height;
+  sg_image targets[DeferredTarget_Count];
+  sg_image depth;
+  sg_pass geometryPass;
+  sg_pass lightPass;
+  sg_pipeline lightPip;
+  sg_shader composeShader;
+  sg_pipeline composePip;
+  sg_buffer cubeVertices;
+  sg_buffer cubeIndices;
+  sg_buffer lightInstances;
+  sg_buffer screenTriangle;
+  std::vector<float> instanceData;
+  // See setDeferredFog().
+  glm::vec4 fogColor;
+  glm::vec4 fogParams;
+  uint64_t geometryStart;
+  deferred_stats_t stats;
+} deferred_lighting_t;
+
+static deferred_lighting_t deferredLighting;
+
+// sokol-shdc only emits sources for real backends. The dummy backend used
+// for headless validation accepts any of them, so it gets the GL ones.
+static sg_backend shaderBackend(void) {
+  sg_backend backend = sg_query_backend();
+  return backend == SG_BACKEND_DUMMY ? SG_BACKEND_GLCORE33 : backend;
+}
+
+static bool deferredLightingSupported(void) {
+  if (!sg_query_features().multiple_render_targets) {
+    return false;
+  }
+  for (int i = 0; i < DeferredTarget_Count; i++) {
+    sg_pixelformat_info info = sg_query_pixelformat(deferred_target_formats[i]);
+    if (!info.render || !info.blend) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Fills in the G-buffer attachments of a pipeline that draws into
+// beginDeferredGeometryPass().
+static void deferredGeometryTargets(sg_pipeline_desc* desc) {
+  desc->color_count = DeferredTarget_Count;
+  for (int i = 0; i < DeferredTarget_Count; i++) {
+    desc->colors[i].pixel_format = deferred_target_formats[i];
+  }
+  desc->depth.pixel_format = SG_PIXELFORMAT_DEPTH;
+  desc->sample_count = 1;
+}
+
+static void deferred_make_compose_pipeline(deferred_lighting_t& dl,
+                                           int sampleCount) {
+  sg_pipeline_desc pipe_desc = {0};
+  pipe_desc.shader = dl.composeShader;
+  pipe_desc.layout.attrs[0].format = SG_VERTEXFORMAT_FLOAT2;
+  pipe_desc.depth.compare = SG_COMPAREFUNC_ALWAYS;
+  pipe_desc.sample_count = sampleCount;
+  pipe_desc.label = "deferred-compose-pipeline";
+  dl.composePip = sg_make_pipeline(&pipe_desc);
+}
+
+static void initDeferredLighting(void) {
+  deferred_lighting_t& dl = deferredLighting;
+  dl = deferred_lighting_t();
+
+  // Wound counter-clockwise seen from outside; the light pass draws the
+  // inside so it still covers the screen when the eye is in the volume.
+  const float cube[] = {
+      -1.0f, -1.0f, -1.0f,
+      1.0f,  -1.0f, -1.0f,
+      -1.0f, 1.0f,  -1.0f,
+      1.0f,  1.0f,  -1.0f,
+      -1.0f, -1.0f, 1.0f,
+      1.0f,  -1.0f, 1.0f,
+      -1.0f, 1.0f,  1.0f,
+      1.0f,  1.0f,  1.0f,
+  };
+  const uint16_t cubeIndices[] = {
+      0, 2, 3, 0, 3, 1, 4, 5, 7, 4, 7, 6, 0, 4, 6, 0, 6, 2,
+      1, 3, 7, 1, 7, 5, 0, 1, 5, 0, 5, 4, 2, 6, 7, 2, 7, 3,
+  };
+  const float triangle[] = {-1.0f, -1.0f, 3.0f, -1.0f, -1.0f, 3.0f};
+
+  sg_buffer_desc buf_desc = {0};
+  buf_desc.data = SG_RANGE(cube);
+  buf_desc.label = "deferred-light-volume";
+  dl.cubeVertices = sg_make_buffer(&buf_desc);
+  buf_desc = {0};
+  buf_desc.type = SG_BUFFERTYPE_INDEXBUFFER;
+  buf_desc.data = SG_RANGE(cubeIndices);
+  buf_desc.label = "deferred-light-volume-indices";
+  dl.cubeIndices = sg_make_buffer(&buf_desc);
+  buf_desc = {0};
+  buf_desc.data = SG_RANGE(triangle);
+  buf_desc.label = "deferred-screen-triangle";
+  dl.screenTriangle = sg_make_buffer(&buf_desc);
+  buf_desc = {0};
+  buf_desc.size = CLUSTER_MAX_LIGHTS * DEFERRED_LIGHT_FLOATS * sizeof(float);
+  buf_desc.usage = SG_USAGE_STREAM;
+  buf_desc.label = "deferred-light-instances";
+  dl.lightInstances = sg_make_buffer(&buf_desc);
+  dl.instanceData.reserve(CLUSTER_MAX_LIGHTS * DEFERRED_LIGHT_FLOATS);
+
+  sg_pipeline_desc pipe_desc = {0};
+  pipe_desc.shader =
+      sg_make_shader(deferred_light_shader_desc(shaderBackend()));
+  pipe_desc.layout.buffers[1].stride = DEFERRED_LIGHT_FLOATS * sizeof(float);
+  pipe_desc.layout.buffers[1].step_func = SG_VERTEXSTEP_PER_INSTANCE;
+  pipe_desc.layout.attrs[0].format = SG_VERTEXFORMAT_FLOAT3;
+  for (int i = 1; i <= 3; i++) {
+    pipe_desc.layout.attrs[i].buffer_index = 1;
+    pipe_desc.layout.attrs[i].offset = (i - 1) * 4 * (int)sizeof(float);
+    pipe_desc.layout.attrs[i].format = SG_VERTEXFORMAT_FLOAT4;
+  }
+  pipe_desc.index_type = SG_INDEXTYPE_UINT16;
+  pipe_desc.face_winding = SG_FACEWINDING_CCW;
+  pipe_desc.cull_mode = SG_CULLMODE_FRONT;
+  // Back faces pass where the volume's far side is behind the surface.
+  pipe_desc.depth.pixel_format = SG_PIXELFORMAT_DEPTH;
+  pipe_desc.depth.compare = SG_COMPAREFUNC_GREATER_EQUAL;
+  pipe_desc.depth.write_enabled = false;
+  pipe_desc.colors[0].pixel_format =
+      deferred_target_formats[DeferredTarget_Light];
+  pipe_desc.colors[0].blend.enabled = true;
+  pipe_desc.colors[0].blend.src_factor_rgb = SG_BLENDFACTOR_ONE;
+  pipe_desc.colors[0].blend.dst_factor_rgb = SG_BLENDFACTOR_ONE;
+  pipe_desc.colors[0].blend.src_factor_alpha = SG_BLENDFACTOR_ZERO;
+  pipe_desc.colors[0].blend.dst_factor_alpha = SG_BLENDFACTOR_ONE;
+  pipe_desc.sample_count = 1;
+  pipe_desc.label = "deferred-light-pipeline";
+  dl.lightPip = sg_make_pipeline(&pipe_desc);
+
+  dl.composeShader =
+      sg_make_shader(deferred_compose_shader_desc(shaderBackend()));
+  deferred_make_compose_pipeline(dl, sg_query_desc().context.sample_count);
+  dl.valid = true;
+}
+
+// The compose pass draws into whatever pass the frame's scene goes to, so
+// its sample count follows that pass's.
+static void setDeferredComposeSampleCount(int sampleCount) {
+  deferred_lighting_t& dl = deferredLighting;
+  sg_destroy_pipeline(dl.composePip);
+  deferred_make_compose_pipeline(dl, sampleCount);
+}
+
+static void deferred_destroy_targets(deferred_lighting_t& dl) {
+  sg_destroy_pass(dl.geometryPass);
+  sg_destroy_pass(dl.lightPass);
+  for (int i = 0; i < DeferredTarget_Count; i++) {
+    sg_destroy_image(dl.targets[i]);
+  }
+  sg_destroy_image(dl.depth);
+  dl.width = 0;
+  dl.height = 0;
+}
+
+static void destroyDeferredLighting(void) {
+  deferred_lighting_t& dl = deferredLighting;
+  if (!dl.valid) {
+    return;
+  }
+  deferred_destroy_targets(dl);
+  sg_destroy_pipeline(dl.lightPip);
+  sg_destroy_pipeline(dl.composePip);
+  sg_destroy_buffer(dl.cubeVertices);
+  sg_destroy_buffer(dl.cubeIndices);
+  sg_destroy_buffer(dl.lightInstances);
+  sg_destroy_buffer(dl.screenTriangle);
+  dl = deferred_lighting_t();
+}
+
+static sg_image deferred_make_target(int width,
+                                     int height,
+                                     sg_pixel_format format,
+                                     const char* label) {
+  sg_image_desc imageDesc = {0};
+  imageDesc.render_target = true;
+  imageDesc.width = width;
+  imageDesc.height = height;
+  imageDesc.pixel_format = format;
+  imageDesc.sample_count = 1;
+  // Every pass reads the texel under the fragment it shades.
+  imageDesc.min_filter = SG_FILTER_NEAREST;
+  imageDesc.mag_filter = SG_FILTER_NEAREST;
+  imageDesc.wrap_u = SG_WRAP_CLAMP_TO_EDGE;
+  imageDesc.wrap_v = SG_WRAP_CLAMP_TO_EDGE;
+  imageDesc.label = label;
+  return sg_make_image(&imageDesc);
+}
+
+static void deferred_make_targets(deferred_lighting_t& dl,
+                                  int width,
+                                  int height) {
+  static const char* labels[DeferredTarget_Count] = {
+      "gbuffer-albedo",
+      "gbuffer-normal",
+      "gbuffer-light",
+  };
+  deferred_destroy_targets(dl);
+  dl.width = width;
+  dl.height = height;
+  sg_pass_desc pass_desc = {0};
+  for (int i = 0; i < DeferredTarget_Count; i++) {
+    dl.targets[i] = deferred_make_target(width, height,
+                                         deferred_target_formats[i], labels[i]);
+    pass_desc.color_attachments[i].image = dl.targets[i];
+  }
+  dl.depth = deferred_make_target(width, height, SG_PIXELFORMAT_DEPTH,
+                                  "gbuffer-depth");
+  pass_desc.depth_stencil_attachment.image = dl.depth;
+  pass_desc.label = "gbuffer-pass";
+  dl.geometryPass = sg_make_pass(&pass_desc);
+
+  // Same light target and depth, without the attachments the light pass
+  // reads from.
+  pass_desc = {0};
+  pass_desc.color_attachments[0].image = dl.targets[DeferredTarget_Light];
+  pass_desc.depth_stencil_attachment.image = dl.depth;
+  pass_desc.label = "deferred-light-pass";
+  dl.lightPass = sg_make_pass(&pass_desc);
+}
+
+// Begins the G-buffer pass, (re)creating the targets at the framebuffer
+// size. The dungeon's surfaces are drawn with the pipeline set up through
+// deferredGeometryTargets(); uncovered pixels end up `clear`.
+static void beginDeferredGeometryPass(int width, int height, sg_color clear) {
+  deferred_lighting_t& dl = deferredLighting;
+  dl.geometryStart = stm_now();
+  if (width != dl.width || height != dl.height) {
+    deferred_make_targets(dl, width, height);
+  }
+  sg_pass_action action = {0};
+  for (int i = 0; i < DeferredTarget_Count; i++) {
+    action.colors[i].action = SG_ACTION_CLEAR;
+    action.colors[i].value = sg_color{0.0f, 0.0f, 0.0f, 0.0f};
+  }
+  action.colors[DeferredTarget_Light].value = clear;
+  action.depth.action = SG_ACTION_CLEAR;
+  action.depth.value = 1.0f;
+  sg_begin_pass(dl.geometryPass, &action);
+}
+
+static void endDeferredGeometryPass(void) {
+  sg_end_pass();
+  deferredLighting.stats.geometryMs =
+      stm_ms(stm_since(deferredLighting.geometryStart));
+}
+
+// Adds every active cluster light into the G-buffer's light target. Runs its
+// own pass, so call it between endDeferredGeometryPass() and the pass that
+// composes the frame.
+static void renderDeferredLights(const glm::mat4& viewproj,
+                                 glm::vec3 viewPos,
+                                 float shininess) {
+  deferred_lighting_t& dl = deferredLighting;
+  uint64_t start = stm_now();
+  dl.instanceData.clear();
+  for (const cluster_light_t& light : lightClusters.lights) {
+    if (!light.active || light.intensity <= 0.0f) {
+      continue;
+    }
+    const float instance[DEFERRED_LIGHT_FLOATS] = {
+        light.position.x,
+        light.position.y,
+        light.position.z,
+        light.radius,
+        light.color.x * light.intensity,
+        light.color.y * light.intensity,
+        light.color.z * light.intensity,
+        light.ambient,
+        light.attenuation.x,
+        light.attenuation.y,
+        light.attenuation.z,
+        0.0f,
+    };
+    dl.instanceData.insert(dl.instanceData.end(), instance,
+                           instance + DEFERRED_LIGHT_FLOATS);
+  }
+  dl.stats.lights = (int)(dl.instanceData.size() / DEFERRED_LIGHT_FLOATS);
+
+  sg_pass_action action = {0};
+  action.colors[0].action = SG_ACTION_LOAD;
+  action.depth.action = SG_ACTION_LOAD;
+  sg_begin_pass(dl.lightPass, &action);
+  if (dl.stats.lights > 0) {
+    sg_range instances = {dl.instanceData.data(),
+                          dl.instanceData.size() * sizeof(float)};
+    sg_update_buffer(dl.lightInstances, instances);
+
+    sg_apply_pipeline(dl.lightPip);
+    sg_bindings bind = {0};
+    bind.vertex_buffers[0] = dl.cubeVertices;
+    bind.vertex_buffers[1] = dl.lightInstances;
+    bind.index_buffer = dl.cubeIndices;
+    bind.fs_images[SLOT_gbuffer_albedo_texture] =
+        dl.targets[DeferredTarget_Albedo];
+    bind.fs_images[SLOT_gbuffer_normal_texture] =
+        dl.targets[DeferredTarget_Normal];
+    sg_apply_bindings(&bind);
+    deferred_vs_params_t vs_params;
+    vs_params.viewproj = viewproj;
+    sg_apply_uniforms(SG_SHADERSTAGE_VS, SLOT_deferred_vs_params,
+                      SG_RANGE(vs_params));
+    deferred_fs_params_t fs_params = {};
+    fs_params.view_pos = viewPos;
+    fs_params.material_shininess = shininess;
+    fs_params.gbuffer_size =
+        glm::vec4((float)dl.width, (float)dl.height, 0.0f, 0.0f);
+    sg_apply_uniforms(SG_SHADERSTAGE_FS, SLOT_deferred_fs_params,
+                      SG_RANGE(fs_params));
+    sg_draw(0, 36, dl.stats.lights);
+  }
+  sg_end_pass();
+  dl.stats.lightMs = stm_ms(stm_since(start));
+}
+
+// Matches the forward path's fog: surfaces fade to `color` from `start` to
+// `end` units from the eye. Applied by composeDeferredLighting().
+static void setDeferredFog(glm::vec3 color, float start, float end) {
+  deferredLighting.fogColor = glm::vec4(color, 1.0f);
+  deferredLighting.fogParams =
+      glm::vec4(start, 1.0f / glm::max(end - start, 1e-3f), 0.0f, 0.0f);
+}
+
+// Draws the lit G-buffer over the whole of the current pass, which must be
+// the size passed to beginDeferredGeometryPass().
+static void composeDeferredLighting(void) {
+  deferred_lighting_t& dl = deferredLighting;
+  uint64_t start = stm_now();
+  sg_apply_pipeline(dl.composePip);
+  sg_bindings bind = {0};
+  bind.vertex_buffers[0] = dl.screenTriangle;
+  bind.fs_images[SLOT_gbuffer_light_texture] = dl.targets[DeferredTarget_Light];
+  bind.fs_images[SLOT_gbuffer_normal_texture] =
+      dl.targets[DeferredTarget_Normal];
+  sg_apply_bindings(&bind);
+  deferred_fs_params_t fs_params = {};
+  fs_params.gbuffer_size =
+      glm::vec4((float)dl.width, (float)dl.height, 0.0f, 0.0f);
+  fs_params.fog_color = dl.fogColor;
+  fs_params.fog_params = dl.fogParams;
+  sg_apply_uniforms(SG_SHADERSTAGE_FS, SLOT_deferred_fs_params,
+                    SG_RANGE(fs_params));
+  sg_draw(0, 3, 1);
+  dl.stats.composeMs = stm_ms(stm_since(start));
+}
+
+static deferred_stats_t deferredLightingStats(void) {
+  return deferredLighting.stats;
+}
@@ -1,173 +1,850 @@
 #pragma once
 
+#include <math.h>
+#include <algorithm>
+#include <numeric>
 #include <vector>
 #include "glm/glm.hpp"
+#include "clusteredLights.h"
+#include "lightmapBaker.h"
+#include "floodLight.h"
 #include "dungeon_surface.h"
 #include "dungeon_surface_renderer.h"
+#include "dungeon_portals.h"
+#include "occlusionBuffer.h"
 #include "dungeon_params.h"
 
-static bool tile_has_left_neighbor(
-    const std::vector<std::vector<uint16_t>>& layout,
-    uint32_t tileX,
-    uint32_t tileY) {
-  if (tileX <= 0)
-    return false;
-  return layout[tileX - 1][tileY] == 1;
-}
-
-static bool tile_has_right_neighbor(
-    const std::vector<std::vector<uint16_t>>& layout,
-    uint32_t tileX,
-    uint32_t tileY) {
-  if (tileX >= layout.size() - 1)
-    return false;
-  return layout[tileX + 1][tileY] == 1;
-}
-
-static bool tile_has_front_neighbor(
-    const std::vector<std::vector<uint16_t>>& layout,
-    uint32_t tileX,
-    uint32_t tileY) {
-  if (tileY <= 0)
-    return false;
-  return layout[tileX][tileY - 1] == 1;
-}
-
-static bool tile_has_back_neighbor(
-    const std::vector<std::vector<uint16_t>>& layout,
-    uint32_t tileX,
-    uint32_t tileY) {
-  if (tileY >= layout[tileX].size() - 1)
-    return false;
-  return layout[tileX][tileY + 1] == 1;
-}
-
-static DungeonSurface create_left_surface(uint32_t x, uint32_t z) {
+// Surfaces cover `span` tiles (walls) or spanX by spanZ tiles (floors and
+// ceilings) centered on the fractional tile coordinate (x, z).
+static DungeonSurface create_left_surface(float x, float z, float span) {
   DungeonSurface surf;
   glm::vec3 pos = glm::vec3(x * DUNGEON_TILE_WIDTH - DUNGEON_TILE_WIDTH_OFFSET,
                             0.0f, z * DUNGEON_TILE_LENGTH);
   glm::mat4 trans = glm::translate(glm::mat4(1.0f), glm::vec3(pos));
-  surf.model = trans * DUNGEON_LEFT_ROT_MAT * DUNGEON_WALL_SCALE_MAT;
+  surf.model = trans * DUNGEON_LEFT_ROT_MAT * DUNGEON_WALL_SCALE_MAT *
+               glm::scale(glm::mat4(1.0f), glm::vec3(span, 1.0f, 1.0f));
   surf.color = DUNGEON_LEFT_COLOR;
   return surf;
 }
 
-static DungeonSurface create_right_surface(uint32_t x, uint32_t z) {
+static DungeonSurface create_right_surface(float x, float z, float span) {
   DungeonSurface surf;
   glm::vec3 pos = glm::vec3(x * DUNGEON_TILE_WIDTH + DUNGEON_TILE_WIDTH_OFFSET,
                             0.0f, z * DUNGEON_TILE_LENGTH);
   glm::mat4 trans = glm::translate(glm::mat4(1.0f), glm::vec3(pos));
-  surf.model = trans * DUNGEON_RIGHT_ROT_MAT * DUNGEON_WALL_SCALE_MAT;
+  surf.model = trans * DUNGEON_RIGHT_ROT_MAT * DUNGEON_WALL_SCALE_MAT *
+               glm::scale(glm::mat4(1.0f), glm::vec3(span, 1.0f, 1.0f));
   surf.color = DUNGEON_RIGHT_COLOR;
   return surf;
 }
 
-static DungeonSurface create_front_surface(uint32_t x, uint32_t z) {
+static DungeonSurface create_front_surface(float x, float z, float span) {
   DungeonSurface surf;
   glm::vec3 pos =
       glm::vec3(x * DUNGEON_TILE_WIDTH, 0.0f,
                 z * DUNGEON_TILE_LENGTH - DUNGEON_TILE_LENGTH_OFFSET);
   glm::mat4 trans = glm::translate(glm::mat4(1.0f), glm::vec3(pos));
-  surf.model = trans * DUNGEON_FRONT_ROT_MAT * DUNGEON_WALL_SCALE_MAT;
+  surf.model = trans * DUNGEON_FRONT_ROT_MAT * DUNGEON_WALL_SCALE_MAT *
+               glm::scale(glm::mat4(1.0f), glm::vec3(span, 1.0f, 1.0f));
   surf.color = DUNGEON_FRONT_COLOR;
   return surf;
 }
 
-static DungeonSurface create_back_surface(uint32_t x, uint32_t z) {
+static DungeonSurface create_back_surface(float x, float z, float span) {
   DungeonSurface surf;
   glm::vec3 pos =
       glm::vec3(x * DUNGEON_TILE_WIDTH, 0.0f,
                 z * DUNGEON_TILE_LENGTH + DUNGEON_TILE_LENGTH_OFFSET);
   glm::mat4 trans = glm::translate(glm::mat4(1.0f), glm::vec3(pos));
-  surf.model = trans * DUNGEON_BACK_ROT_MAT * DUNGEON_WALL_SCALE_MAT;
+  surf.model = trans * DUNGEON_BACK_ROT_MAT * DUNGEON_WALL_SCALE_MAT *
+               glm::scale(glm::mat4(1.0f), glm::vec3(span, 1.0f, 1.0f));
   surf.color = DUNGEON_BACK_COLOR;
   return surf;
 }
 
-static DungeonSurface create_top_surface(uint32_t x, uint32_t z) {
+static DungeonSurface create_top_surface(float x,
+                                         float z,
+                                         float spanX,
+                                         float spanZ) {
   DungeonSurface surf;
   glm::vec3 pos = glm::vec3(x * DUNGEON_TILE_WIDTH, DUNGEON_TILE_HEIGHT_OFFSET,
                             z * DUNGEON_TILE_LENGTH);
   glm::mat4 trans = glm::translate(glm::mat4(1.0f), glm::vec3(pos));
-  surf.model = trans * DUNGEON_TOP_ROT_MAT * DUNGEON_FLOOR_SCALE_MAT;
+  surf.model = trans * DUNGEON_TOP_ROT_MAT * DUNGEON_FLOOR_SCALE_MAT *
+               glm::scale(glm::mat4(1.0f), glm::vec3(spanX, spanZ, 1.0f));
   surf.color = DUNGEON_TOP_COLOR;
   return surf;
 }
 
-static DungeonSurface create_bottom_surface(uint32_t x, uint32_t z) {
+static DungeonSurface create_bottom_surface(float x,
+                                            float z,
+                                            float spanX,
+                                            float spanZ) {
   DungeonSurface surf;
   glm::vec3 pos = glm::vec3(x * DUNGEON_TILE_WIDTH, -DUNGEON_TILE_HEIGHT_OFFSET,
                             z * DUNGEON_TILE_LENGTH);
   glm::mat4 trans = glm::translate(glm::mat4(1.0f), glm::vec3(pos));
-  surf.model = trans * DUNGEON_BOTTOM_ROT_MAT * DUNGEON_FLOOR_SCALE_MAT;
+  surf.model = trans * DUNGEON_BOTTOM_ROT_MAT * DUNGEON_FLOOR_SCALE_MAT *
+               glm::scale(glm::mat4(1.0f), glm::vec3(spanX, spanZ, 1.0f));
   surf.color = DUNGEON_BOTTOM_COLOR;
   return surf;
 }
 
+static DungeonSurface create_wall_surface(SurfaceType type,
+                                          float x,
+                                          float z,
+                                          float span) {
+  switch (type) {
+    case SurfaceType_Left:
+      return create_left_surface(x, z, span);
+    case SurfaceType_Right:
+      return create_right_surface(x, z, span);
+    case SurfaceType_Front:
+      return create_front_surface(x, z, span);
+    case SurfaceType_Back:
+    default:
+      return create_back_surface(x, z, span);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Meshing
+//------------------------------------------------------------------------------
+
+static bool tile_is_open(const std::vector<std::vector<uint16_t>>& layout,
+                         int x,
+                         int z) {
+  if (x < 0 || z < 0 || x >= (int)layout.size() ||
+      z >= (int)layout[x].size()) {
+    return false;
+  }
+  return layout[x][z] == 1;
+}
+
+// Voxel-style corner AO for a floor or ceiling vertex of tile (x, z) in
+// corner direction (dx, dz): 3 is open, 0 is boxed in on both sides.
+static uint8_t floor_corner_ao(const std::vector<std::vector<uint16_t>>& layout,
+                               int x,
+                               int z,
+                               int dx,
+                               int dz) {
+  int side1 = !tile_is_open(layout, x + dx, z);
+  int side2 = !tile_is_open(layout, x, z + dz);
+  int corner = !tile_is_open(layout, x + dx, z + dz);
+  if (side1 && side2) {
+    return 0;
+  }
+  return (uint8_t)(3 - (side1 + side2 + corner));
+}
+
+// Walls only look at the tile beside them along the wall: an end meeting
+// another wall (an inside corner) is occluded, one where the wall carries
+// on or turns away is not. Walls are a single tile tall, so the floor and
+// ceiling creases would darken them evenly; the floor's AO covers those.
+static uint8_t wall_corner_ao(const std::vector<std::vector<uint16_t>>& layout,
+                              int x,
+                              int z,
+                              int ax,
+                              int az) {
+  return tile_is_open(layout, x + ax, z + az) ? 3 : 1;
+}
+
+// Unit quad corners: local x, y and texcoord u, v.
+static const float dungeon_quad_corners[4][4] = {
+    {-0.5f, -0.5f, 0.0f, 1.0f},
+    {0.5f, -0.5f, 1.0f, 1.0f},
+    {0.5f, 0.5f, 1.0f, 0.0f},
+    {-0.5f, 0.5f, 0.0f, 0.0f},
+};
+static const uint32_t dungeon_quad_indices[6] = {0, 2, 1, 0, 3, 2};
+
+static int axis_sign(float v) {
+  return v > 1e-3f ? 1 : (v < -1e-3f ? -1 : 0);
+}
+
+// Per-corner AO for a single-tile surface on tile (x, z).
+static void surface_corner_ao(
+    const std::vector<std::vector<uint16_t>>& layout,
+    const DungeonSurface& surf,
+    int x,
+    int z,
+    bool wall,
+    uint8_t ao[4]) {
+  glm::vec3 along = glm::vec3(surf.model[0]);
+  glm::vec3 up = glm::vec3(surf.model[1]);
+  for (int i = 0; i < 4; i++) {
+    glm::vec3 offset = along * dungeon_quad_corners[i][0];
+    if (wall) {
+      ao[i] = wall_corner_ao(layout, x, z, axis_sign(offset.x),
+                             axis_sign(offset.z));
+    } else {
+      offset += up * dungeon_quad_corners[i][1];
+      ao[i] = floor_corner_ao(layout, x, z, axis_sign(offset.x),
+                              axis_sign(offset.z));
+    }
+  }
+}
+
+static void mesh_emit_quad(DungeonMesh& mesh,
+                           DungeonSurface& surf,
+                           float spanU,
+                           float spanV,
+                           const uint8_t ao[4]) {
+  uint32_t base = (uint32_t)mesh.vertices.size();
+  surf.first_index = (uint32_t)mesh.indices.size();
+  for (int i = 0; i < 4; i++) {
+    DungeonVertex vertex = {};
+    vertex.x = dungeon_quad_corners[i][0];
+    vertex.y = dungeon_quad_corners[i][1];
+    vertex.u = dungeon_quad_corners[i][2] * spanU;
+    vertex.v = dungeon_quad_corners[i][3] * spanV;
+    vertex.ao[0] = (uint8_t)(ao[i] * 85);
+    mesh.vertices.push_back(vertex);
+  }
+  for (uint32_t index : dungeon_quad_indices) {
+    mesh.indices.push_back(base + index);
+  }
+}
+
+// Walls of one type, facing into open tiles from the solid neighbour in
+// direction (dx, dz). Runs along (ax, az) merge into one quad while every
+// tile in the run has the same AO at both ends and the same portal cell; a
+// tile whose ends differ keeps its own quad so the AO gradient survives.
+// Coarse walls drop the AO and merge along the whole of a cell's edge.
+static void mesh_walls(const std::vector<std::vector<uint16_t>>& layout,
+                       const DungeonPortalGraph& graph,
+                       SurfaceType type,
+                       int dx,
+                       int dz,
+                       int ax,
+                       int az,
+                       bool coarse,
+                       std::vector<DungeonSurface>& surfaces,
+                       DungeonMesh& mesh) {
+  int width = (int)layout.size();
+  int length = (int)layout[0].size();
+  int lines = ax ? length : width;
+  int steps = ax ? width : length;
+  for (int line = 0; line < lines; line++) {
+    int step = 0;
+    while (step < steps) {
+      int x = ax ? step : line, z = ax ? line : step;
+      if (!tile_is_open(layout, x, z) ||
+          tile_is_open(layout, x + dx, z + dz)) {
+        step++;
+        continue;
+      }
+      uint8_t lo = coarse ? 3 : wall_corner_ao(layout, x, z, -ax, -az);
+      uint8_t hi = coarse ? 3 : wall_corner_ao(layout, x, z, ax, az);
+      int32_t cell = portal_graph_cell(graph, x, z);
+      int run = 1;
+      if (lo == hi) {
+        for (;; run++) {
+          int nx = x + ax * run, nz = z + az * run;
+          if (step + run >= steps || !tile_is_open(layout, nx, nz) ||
+              tile_is_open(layout, nx + dx, nz + dz) ||
+              portal_graph_cell(graph, nx, nz) != cell) {
+            break;
+          }
+          if (!coarse && (wall_corner_ao(layout, nx, nz, -ax, -az) != lo ||
+                          wall_corner_ao(layout, nx, nz, ax, az) != lo)) {
+            break;
+          }
+        }
+      }
+      float cx = (float)x + (float)(ax * (run - 1)) * 0.5f;
+      float cz = (float)z + (float)(az * (run - 1)) * 0.5f;
+      DungeonSurface surf = create_wall_surface(type, cx, cz, (float)run);
+      surf.cell = cell;
+      uint8_t ao[4] = {lo, lo, lo, lo};
+      if (lo != hi) {
+        surface_corner_ao(layout, surf, x, z, true, ao);
+      }
+      mesh_emit_quad(mesh, surf, (float)run, 1.0f, ao);
+      surfaces.push_back(surf);
+      step += run;
+    }
+  }
+}
+
+// Floors and ceilings share their AO, so both are merged into the same
+// greedy rectangles of tiles whose four corners all have one AO level,
+// kept within a portal cell.
+static void mesh_floors(const std::vector<std::vector<uint16_t>>& layout,
+                        const DungeonPortalGraph& graph,
+                        std::vector<DungeonSurface>& tops,
+                        std::vector<DungeonSurface>& bottoms,
+                        DungeonMesh& topMesh,
+                        DungeonMesh& bottomMesh) {
+  int width = (int)layout.size();
+  int length = (int)layout[0].size();
+  // AO level of tiles with uniform corners, -1 for mixed, -2 for solid.
+  std::vector<int8_t> key((size_t)width * length, -2);
+  std::vector<uint8_t> done((size_t)width * length, 0);
+  for (int z = 0; z < length; z++) {
+    for (int x = 0; x < width; x++) {
+      if (!tile_is_open(layout, x, z)) {
+        continue;
+      }
+      uint8_t ao = floor_corner_ao(layout, x, z, -1, -1);
+      bool uniform = floor_corner_ao(layout, x, z, 1, -1) == ao &&
+                     floor_corner_ao(layout, x, z, 1, 1) == ao &&
+                     floor_corner_ao(layout, x, z, -1, 1) == ao;
+      key[(size_t)z * width + x] = uniform ? (int8_t)ao : -1;
+    }
+  }
+  for (int z = 0; z < length; z++) {
+    for (int x = 0; x < width; x++) {
+      int8_t k = key[(size_t)z * width + x];
+      if (k == -2 || done[(size_t)z * width + x]) {
+        continue;
+      }
+      int32_t cell = portal_graph_cell(graph, x, z);
+      auto mergeable = [&](int tx, int tz) {
+        size_t tile = (size_t)tz * width + tx;
+        return key[tile] == k && !done[tile] &&
+               portal_graph_cell(graph, tx, tz) == cell;
+      };
+      int spanX = 1, spanZ = 1;
+      if (k >= 0) {
+        while (x + spanX < width && mergeable(x + spanX, z)) {
+          spanX++;
+        }
+        for (bool grow = true; grow && z + spanZ < length;) {
+          for (int i = 0; i < spanX; i++) {
+            if (!mergeable(x + i, z + spanZ)) {
+              grow = false;
+              break;
+            }
+          }
+          spanZ += grow ? 1 : 0;
+        }
+      }
+      for (int j = 0; j < spanZ; j++) {
+        for (int i = 0; i < spanX; i++) {
+          done[(size_t)(z + j) * width + x + i] = 1;
+        }
+      }
+      float cx = (float)x + (float)(spanX - 1) * 0.5f;
+      float cz = (float)z + (float)(spanZ - 1) * 0.5f;
+      DungeonSurface top =
+          create_top_surface(cx, cz, (float)spanX, (float)spanZ);
+      DungeonSurface bottom =
+          create_bottom_surface(cx, cz, (float)spanX, (float)spanZ);
+      top.cell = cell;
+      bottom.cell = cell;
+      uint8_t ao[4] = {(uint8_t)k, (uint8_t)k, (uint8_t)k, (uint8_t)k};
+      if (k < 0) {
+        surface_corner_ao(layout, top, x, z, false, ao);
+      }
+      mesh_emit_quad(topMesh, top, (float)spanX, (float)spanZ, ao);
+      if (k < 0) {
+        surface_corner_ao(layout, bottom, x, z, false, ao);
+      }
+      mesh_emit_quad(bottomMesh, bottom, (float)spanX, (float)spanZ, ao);
+      tops.push_back(top);
+      bottoms.push_back(bottom);
+    }
+  }
+}
+
+// Coarse floors: a portal cell is a rectangle of open tiles, so one quad
+// each, without AO. Coarse cells have no ceiling.
+static void mesh_coarse_floors(const DungeonPortalGraph& graph,
+                               std::vector<DungeonSurface>& bottoms,
+                               DungeonMesh& mesh) {
+  static const uint8_t open[4] = {3, 3, 3, 3};
+  for (int32_t cell = 0; cell < (int32_t)graph.cells.size(); cell++) {
+    const DungeonCell& c = graph.cells[cell];
+    float spanX = (float)(c.x1 - c.x0), spanZ = (float)(c.z1 - c.z0);
+    DungeonSurface bottom =
+        create_bottom_surface((float)c.x0 + (spanX - 1.0f) * 0.5f,
+                              (float)c.z0 + (spanZ - 1.0f) * 0.5f, spanX,
+                              spanZ);
+    bottom.cell = cell;
+    mesh_emit_quad(mesh, bottom, spanX, spanZ, open);
+    bottoms.push_back(bottom);
+  }
+}
+
+// Distance from `p` to the nearest point on a surface's quad.
+static float surface_distance(const DungeonSurface& surf, const glm::vec3& p) {
+  glm::vec3 origin = glm::vec3(surf.model[3]);
+  glm::vec3 along = glm::vec3(surf.model[0]);
+  glm::vec3 up = glm::vec3(surf.model[1]);
+  glm::vec3 local = p - origin;
+  float s = glm::clamp(glm::dot(local, along) / glm::dot(along, along), -0.5f,
+                       0.5f);
+  float t = glm::clamp(glm::dot(local, up) / glm::dot(up, up), -0.5f, 0.5f);
+  return glm::length(p - (origin + along * s + up * t));
+}
+
+// Sorts a bucket of surfaces that all face one way by their plane's offset
+// along that facing, filling `planes` with the offsets in the same order.
+// Returns the shared unit normal (zero for an empty bucket).
+static glm::vec3 sort_surfaces_by_plane(std::vector<DungeonSurface>& surfaces,
+                                        std::vector<float>& planes) {
+  planes.clear();
+  if (surfaces.empty()) {
+    return glm::vec3(0.0f);
+  }
+  const glm::mat4& model = surfaces[0].model;
+  glm::vec3 normal = glm::normalize(
+      glm::cross(glm::vec3(model[0]), glm::vec3(model[1])));
+  std::sort(surfaces.begin(), surfaces.end(),
+            [&](const DungeonSurface& a, const DungeonSurface& b) {
+              return glm::dot(normal, glm::vec3(a.model[3])) <
+                     glm::dot(normal, glm::vec3(b.model[3]));
+            });
+  for (const DungeonSurface& surf : surfaces) {
+    planes.push_back(glm::dot(normal, glm::vec3(surf.model[3])));
+  }
+  return normal;
+}
+
+typedef struct {
+  int light;
+  float phase;
+  float rate;
+} DungeonTorch;
+
+// Distances from the eye, in world units. Cells further than
+// coarseDistance draw their coarse mesh, cells further than farDistance are
+// not drawn, and surfaces fade into fogColor from fogStart to farDistance.
+typedef struct {
+  float coarseDistance;
+  float fogStart;
+  float farDistance;
+  glm::vec3 fogColor;
+} DungeonDetail;
+
+// What culling reads, copied so it can run on another thread than the one
+// changing the settings.
+typedef struct {
+  bool portalCulling;
+  bool occlusionCulling;
+  float coarseDistance;
+  float farDistance;
+} DungeonCullSettings;
+
+// The surfaces of one cell of a LOD and type that face the eye: the first
+// `count` of the cell's list.
+typedef struct {
+  uint32_t cell;
+  uint32_t count;
+} DungeonVisibleRun;
+
+// What one eye sees, from Dungeon::cull().
+typedef struct {
+  std::vector<uint32_t> cells;
+  std::vector<uint32_t> lodCells[DungeonLod_Count];
+  std::vector<DungeonVisibleRun> runs[DungeonLod_Count][SurfaceType_Count];
+  uint32_t surfaces;
+} DungeonVisibleSet;
+
 class Dungeon {
  public:
   Dungeon() { renderer = new DungeonSurfaceRenderer(); }
 
   void create(const std::vector<std::vector<uint16_t>> _layout) {
     renderer->init();
+    layout = _layout;
     dungeonWidth = (uint32_t)_layout.size();
     dungeonLength = (uint32_t)_layout[0].size();
 
-    for (uint32_t x = 0; x < dungeonWidth; x++) {
-      for (uint32_t z = 0; z < dungeonLength; z++) {
-        if (_layout[x][z] == 0)
-          continue;
-        else {
-          if (!tile_has_left_neighbor(_layout, x, z)) {
-            left_surfaces.push_back(create_left_surface(x, z));
-          }
-          if (!tile_has_right_neighbor(_layout, x, z)) {
-            right_surfaces.push_back(create_right_surface(x, z));
-          }
-          if (!tile_has_front_neighbor(_layout, x, z)) {
-            front_surfaces.push_back(create_front_surface(x, z));
-          }
-          if (!tile_has_back_neighbor(_layout, x, z)) {
-            back_surfaces.push_back(create_back_surface(x, z));
-          }
-          top_surfaces.push_back(create_top_surface(x, z));
-          bottom_surfaces.push_back(create_bottom_surface(x, z));
+    build_portal_graph(layout, portals);
+
+    // Mesh each surface type into one buffer, merging coplanar faces with
+    // matching AO in the same portal cell into larger quads.
+    DungeonMesh meshes[SurfaceType_Count];
+    mesh_walls(layout, portals, SurfaceType_Left, -1, 0, 0, 1, false,
+               left_surfaces, meshes[SurfaceType_Left]);
+    mesh_walls(layout, portals, SurfaceType_Right, 1, 0, 0, 1, false,
+               right_surfaces, meshes[SurfaceType_Right]);
+    mesh_walls(layout, portals, SurfaceType_Front, 0, -1, 1, 0, false,
+               front_surfaces, meshes[SurfaceType_Front]);
+    mesh_walls(layout, portals, SurfaceType_Back, 0, 1, 1, 0, false,
+               back_surfaces, meshes[SurfaceType_Back]);
+    mesh_floors(layout, portals, top_surfaces, bottom_surfaces,
+                meshes[SurfaceType_Top], meshes[SurfaceType_Bottom]);
+    // And again with whole cell edges and floors for the distant cells.
+    DungeonMesh coarse[SurfaceType_Count];
+    mesh_walls(layout, portals, SurfaceType_Left, -1, 0, 0, 1, true,
+               coarse_surfaces[SurfaceType_Left], coarse[SurfaceType_Left]);
+    mesh_walls(layout, portals, SurfaceType_Right, 1, 0, 0, 1, true,
+               coarse_surfaces[SurfaceType_Right], coarse[SurfaceType_Right]);
+    mesh_walls(layout, portals, SurfaceType_Front, 0, -1, 1, 0, true,
+               coarse_surfaces[SurfaceType_Front], coarse[SurfaceType_Front]);
+    mesh_walls(layout, portals, SurfaceType_Back, 0, 1, 1, 0, true,
+               coarse_surfaces[SurfaceType_Back], coarse[SurfaceType_Back]);
+    mesh_coarse_floors(portals, coarse_surfaces[SurfaceType_Bottom],
+                       coarse[SurfaceType_Bottom]);
+    for (uint32_t type = 0; type < SurfaceType_Count; type++) {
+      renderer->set_mesh((SurfaceType)type, DungeonLod_Full, meshes[type]);
+      renderer->set_mesh((SurfaceType)type, DungeonLod_Coarse, coarse[type]);
+    }
+    // Surfaces keep their offset into the mesh, so the buckets can be
+    // reordered for facing_count().
+    std::vector<DungeonSurface>* buckets[SurfaceType_Count] = {
+        &left_surfaces, &right_surfaces, &front_surfaces,
+        &back_surfaces, &top_surfaces,   &bottom_surfaces};
+    for (uint32_t type = 0; type < SurfaceType_Count; type++) {
+      std::vector<DungeonSurface>* lods[DungeonLod_Count] = {
+          buckets[type], &coarse_surfaces[type]};
+      // Both levels face the same way, and the full one is never empty
+      // when the coarse one isn't.
+      facing_normals[type] = sort_surfaces_by_plane(
+          *lods[DungeonLod_Full], facing_planes[DungeonLod_Full][type]);
+      sort_surfaces_by_plane(*lods[DungeonLod_Coarse],
+                             facing_planes[DungeonLod_Coarse][type]);
+      // Walked in plane order, so each cell's list stays sorted too.
+      for (uint32_t lod = 0; lod < DungeonLod_Count; lod++) {
+        for (uint32_t i = 0; i < (uint32_t)lods[lod]->size(); i++) {
+          portals.cells[(*lods[lod])[i].cell].surfaces[lod][type].push_back(
+              i);
         }
       }
     }
+
+    // One light cluster per tile; tiles are square.
+    initLightClusters(-DUNGEON_TILE_WIDTH_OFFSET, -DUNGEON_TILE_LENGTH_OFFSET,
+                      DUNGEON_TILE_WIDTH, (int)dungeonWidth,
+                      (int)dungeonLength);
+    initFloodLight(layout);
+    initOcclusionBuffer(layout, -DUNGEON_TILE_WIDTH_OFFSET,
+                        -DUNGEON_TILE_LENGTH_OFFSET, DUNGEON_TILE_WIDTH,
+                        -DUNGEON_TILE_HEIGHT_OFFSET,
+                        DUNGEON_TILE_HEIGHT_OFFSET);
+    set_detail({DUNGEON_COARSE_DISTANCE, DUNGEON_FOG_START,
+                DUNGEON_FAR_DISTANCE, DUNGEON_FOG_COLOR});
   }
-  void render(const glm::mat4 viewproj) {
-    renderer->begin_render(viewproj);
 
-    renderer->apply_textures(SurfaceType_Left);
-    for (auto& surf : left_surfaces) {
-      renderer->render_surface(surf);
+  // Spreads `count` torches evenly over the wall tiles, doubling up when
+  // there are more torches than wall tiles. Every `dynamicEvery`th torch is
+  // a flickering clustered light; the rest, and any past the clustered light
+  // budget, are left for bake_lightmap() and do not flicker. 0 bakes them
+  // all.
+  void place_torches(uint32_t count, uint32_t dynamicEvery = 1) {
+    // One slot per tile of wall, as an offset along its (merged) surface.
+    std::vector<std::pair<const DungeonSurface*, float>> slots;
+    for (auto* bucket : {&left_surfaces, &right_surfaces, &front_surfaces,
+                         &back_surfaces}) {
+      for (auto& surf : *bucket) {
+        float width = glm::length(glm::vec3(surf.model[0]));
+        int span = glm::max((int)(width / DUNGEON_TILE_WIDTH + 0.5f), 1);
+        for (int k = 0; k < span; k++) {
+          slots.push_back(
+              {&surf, ((float)k + 0.5f - (float)span * 0.5f) *
+                          DUNGEON_TILE_WIDTH});
+        }
+      }
     }
+    if (slots.empty()) {
+      return;
+    }
+    // Torch i goes to slot i * slots / count, so they stride across every
+    // wall; a slot only takes more than one once there are more torches
+    // than slots, and then spaces them out along its tile.
+    const uint64_t numSlots = slots.size();
+    for (uint32_t i = 0; i < count; i++) {
+      uint64_t s = (uint64_t)i * numSlots / count;
+      uint64_t first = (s * count + numSlots - 1) / numSlots;
+      uint64_t next = ((s + 1) * count + numSlots - 1) / numSlots;
+      const DungeonSurface* wall = slots[s].first;
+      float slot = slots[s].second;
+      glm::vec3 along = glm::normalize(glm::vec3(wall->model[0]));
+      glm::vec3 up = glm::normalize(glm::vec3(wall->model[1]));
+      glm::vec3 out = glm::cross(along, up);
+      float u = ((float)(i - first) + 0.5f) / (float)(next - first) - 0.5f;
 
-    renderer->apply_textures(SurfaceType_Right);
-    for (auto& surf : right_surfaces) {
-      renderer->render_surface(surf);
+      cluster_light_t light = {};
+      light.position = glm::vec3(wall->model[3]) + out * DUNGEON_TORCH_INSET +
+                       up * DUNGEON_TORCH_HEIGHT +
+                       along * (slot + u * DUNGEON_TILE_WIDTH * 0.8f);
+      light.color = DUNGEON_TORCH_COLOR;
+      light.ambient = DUNGEON_TORCH_AMBIENT;
+      light.intensity = 1.0f;
+      light.attenuation = DUNGEON_TORCH_ATTENUATION;
+      light.radius = DUNGEON_TORCH_RADIUS;
+      if (dynamicEvery == 0 || i % dynamicEvery != 0) {
+        static_lights.push_back(light);
+        continue;
+      }
+      DungeonTorch torch;
+      torch.light = addClusterLight(light);
+      // Past the cluster light budget they can still be baked.
+      if (torch.light == INVALID_CLUSTER_LIGHT) {
+        static_lights.push_back(light);
+        continue;
+      }
+      // Golden-angle phases so neighbouring torches don't pulse together.
+      torch.phase = fmodf((float)i * 2.39996f, 6.28318f);
+      torch.rate = 6.0f + (float)(i % 5);
+      torches.push_back(torch);
     }
+  }
 
-    renderer->apply_textures(SurfaceType_Front);
-    for (auto& surf : front_surfaces) {
-      renderer->render_surface(surf);
+  // Bakes the static lights into a lightmap atlas on all cores and hands it
+  // to the renderer. Blocks, so call it at load time.
+  bool bake_lightmap(float texelsPerUnit, uint32_t bounceSamples) {
+    // The coarse surfaces go first and only take light.
+    std::vector<DungeonSurface*> faces;
+    for (auto& bucket : coarse_surfaces) {
+      for (auto& surf : bucket) {
+        faces.push_back(&surf);
+      }
+    }
+    uint32_t numCoarseFaces = (uint32_t)faces.size();
+    for (auto* bucket : {&left_surfaces, &right_surfaces, &front_surfaces,
+                         &back_surfaces, &top_surfaces, &bottom_surfaces}) {
+      for (auto& surf : *bucket) {
+        faces.push_back(&surf);
+      }
+    }
+    std::vector<glm::mat4> models;
+    for (DungeonSurface* surf : faces) {
+      models.push_back(surf->model);
     }
 
-    renderer->apply_textures(SurfaceType_Back);
-    for (auto& surf : back_surfaces) {
-      renderer->render_surface(surf);
+    lightmap_bake_desc_t desc = {};
+    desc.layout = &layout;
+    desc.originX = -DUNGEON_TILE_WIDTH_OFFSET;
+    desc.originZ = -DUNGEON_TILE_LENGTH_OFFSET;
+    desc.cellSize = DUNGEON_TILE_WIDTH;
+    desc.floorY = -DUNGEON_TILE_HEIGHT_OFFSET;
+    desc.ceilingY = DUNGEON_TILE_HEIGHT_OFFSET;
+    desc.faces = models.data();
+    desc.numFaces = (uint32_t)models.size();
+    desc.numCoarseFaces = numCoarseFaces;
+    desc.coarseTexelsPerUnit = texelsPerUnit * DUNGEON_COARSE_LIGHTMAP_SCALE;
+    desc.lights = static_lights.data();
+    desc.numLights = (uint32_t)static_lights.size();
+    desc.texelsPerUnit = texelsPerUnit;
+    desc.bounceSamples = bounceSamples;
+    desc.bounceAlbedo = 0.5f;
+    lightmap_t lightmap;
+    if (!bakeLightmap(desc, &lightmap)) {
+      return false;
     }
+    for (size_t i = 0; i < faces.size(); i++) {
+      faces[i]->lightmap_rect = lightmap.rects[i];
+    }
+    lightmapBakeMs = lightmap.bakeMs;
+    renderer->set_lightmap(lightmap.pixels, lightmap.width, lightmap.height);
+    return true;
+  }
+
+  double lightmap_bake_ms() const { return lightmapBakeMs; }
 
-    renderer->apply_textures(SurfaceType_Top);
-    for (auto& surf : top_surfaces) {
-      renderer->render_surface(surf);
+  // Keeps the player's light on the tile they stand on.
+  void carry_light(const glm::vec3& position) {
+    int x = (int)floorf((position.x + DUNGEON_TILE_WIDTH_OFFSET) /
+                        DUNGEON_TILE_WIDTH);
+    int z = (int)floorf((position.z + DUNGEON_TILE_LENGTH_OFFSET) /
+                        DUNGEON_TILE_LENGTH);
+    if (carried_light == INVALID_FLOOD_LIGHT) {
+      carried_light = addFloodLight(x, z, DUNGEON_CARRIED_LIGHT[0],
+                                    DUNGEON_CARRIED_LIGHT[1],
+                                    DUNGEON_CARRIED_LIGHT[2]);
+    } else {
+      moveFloodLight(carried_light, x, z);
     }
+  }
 
-    renderer->apply_textures(SurfaceType_Bottom);
-    for (auto& surf : bottom_surfaces) {
-      renderer->render_surface(surf);
+  // Flickers the torches, rebins the lights and uploads the flood light
+  // grid. `time` is in seconds.
+  void update_lights(float time) {
+    for (const DungeonTorch& torch : torches) {
+      cluster_light_t* light = clusterLight(torch.light);
+      float t = time * torch.rate + torch.phase;
+      light->intensity =
+          0.8f + 0.12f * sinf(t) + 0.08f * sinf(t * 2.7f + torch.phase);
     }
+    updateLightClusters();
+    updateFloodLight();
+  }
+
+  // Tells the texture streamer how large each surface type's texture appears
+  // on screen, based on the nearest surface of that type facing the eye.
+  // `pixelsPerUnit` is the on-screen size in pixels of one world unit at
+  // distance 1.
+  void update_texture_residency(const glm::vec3& viewPos, float pixelsPerUnit) {
+    const std::vector<DungeonSurface>* buckets[SurfaceType_Count] = {
+        &left_surfaces, &right_surfaces, &front_surfaces,
+        &back_surfaces, &top_surfaces,   &bottom_surfaces};
+    for (uint32_t type = 0; type < SurfaceType_Count; type++) {
+      float nearest = 1e30f;
+      size_t facing = facing_count(type, viewPos);
+      for (size_t i = 0; i < facing; i++) {
+        nearest =
+            glm::min(nearest, surface_distance((*buckets[type])[i], viewPos));
+      }
+      if (nearest < 1e30f) {
+        float distance = glm::max(nearest, 0.1f);
+        renderer->request_texture_residency(
+            (SurfaceType)type, DUNGEON_TILE_WIDTH * pixelsPerUnit / distance);
+      }
+    }
+  }
+
+  // Starts rasterizing this frame's occluders on the occlusion worker. Call
+  // it as early in the frame as the camera is known, then render() with the
+  // same viewproj waits for it and skips the cells it hides.
+  void begin_occlusion(const glm::mat4 viewproj, const glm::vec3 viewPos) {
+    begin_occlusion(viewproj, viewPos, cull_settings());
+  }
+
+  void begin_occlusion(const glm::mat4 viewproj,
+                       const glm::vec3 viewPos,
+                       const DungeonCullSettings& settings) {
+    if (settings.occlusionCulling) {
+      beginOcclusionFrame(viewproj, viewPos);
+    }
+  }
+
+  // Culling and drawing in one, on the calling thread.
+  void render(const glm::mat4 viewproj, const glm::vec3 viewPos) {
+    cull(viewproj, viewPos, cull_settings(), visible);
+    draw(viewproj, viewPos, visible);
+  }
+
+  // Works out what draw() draws from the eye without touching the GPU or
+  // the renderer, so it can run on another thread than draw(). Waits for
+  // the occlusion frame begun with the same viewproj, if any. Only one
+  // thread may cull at a time.
+  void cull(const glm::mat4 viewproj,
+            const glm::vec3 viewPos,
+            const DungeonCullSettings& settings,
+            DungeonVisibleSet& out) {
+    // Cells seen through the portals from the eye's cell; every cell when
+    // the eye is outside the open tiles.
+    if (!settings.portalCulling ||
+        !portal_graph_visible_cells(portals, viewPos, viewproj, out.cells)) {
+      out.cells.resize(portals.cells.size());
+      std::iota(out.cells.begin(), out.cells.end(), 0u);
+    }
+    if (waitOcclusionFrame()) {
+      cull_occluded_cells(out.cells);
+    }
+    split_cells_by_distance(viewPos, settings, out);
+    out.surfaces = 0;
+    for (uint32_t lod = 0; lod < DungeonLod_Count; lod++) {
+      for (uint32_t type = 0; type < SurfaceType_Count; type++) {
+        // Only the surfaces whose front the eye is on; the rest would be
+        // back face culled anyway.
+        std::vector<DungeonVisibleRun>& runs = out.runs[lod][type];
+        runs.clear();
+        for (uint32_t cell : out.lodCells[lod]) {
+          const std::vector<uint32_t>& list =
+              portals.cells[cell].surfaces[lod][type];
+          size_t facing = cell_facing_count(type, (DungeonLod)lod, list,
+                                            viewPos);
+          if (facing > 0) {
+            runs.push_back({cell, (uint32_t)facing});
+            out.surfaces += (uint32_t)facing;
+          }
+        }
+      }
+    }
+  }
+
+  // Queues and submits the surfaces `visible` holds, as culled for the same
+  // viewproj and eye. The renderer sorts them by state.
+  void draw(const glm::mat4 viewproj,
+            const glm::vec3 viewPos,
+            const DungeonVisibleSet& visible) {
+    renderer->begin_render(viewproj, viewPos);
+
+    const std::vector<DungeonSurface>* buckets[SurfaceType_Count] = {
+        &left_surfaces, &right_surfaces, &front_surfaces,
+        &back_surfaces, &top_surfaces,   &bottom_surfaces};
+    for (uint32_t lod = 0; lod < DungeonLod_Count; lod++) {
+      for (uint32_t type = 0; type < SurfaceType_Count; type++) {
+        const std::vector<DungeonVisibleRun>& runs = visible.runs[lod][type];
+        if (runs.empty()) {
+          continue;
+        }
+        const std::vector<DungeonSurface>& bucket =
+            lod == DungeonLod_Full ? *buckets[type] : coarse_surfaces[type];
+        renderer->apply_textures((SurfaceType)type, (DungeonLod)lod);
+        for (const DungeonVisibleRun& run : runs) {
+          const std::vector<uint32_t>& list =
+              portals.cells[run.cell].surfaces[lod][type];
+          for (uint32_t i = 0; i < run.count; i++) {
+            renderer->render_surface(bucket[list[i]]);
+          }
+        }
+      }
+    }
+    drawn_surfaces = visible.surfaces;
+    renderer->end_render();
+  }
+
+  DungeonCullSettings cull_settings() const {
+    DungeonCullSettings settings;
+    settings.portalCulling = portal_culling;
+    settings.occlusionCulling = occlusion_culling;
+    settings.coarseDistance = detail_settings.coarseDistance;
+    settings.farDistance = detail_settings.farDistance;
+    return settings;
+  }
+
+  // Surfaces submitted by the last render().
+  uint32_t drawn_surface_count() const { return drawn_surfaces; }
+
+  // Every surface is one quad.
+  uint32_t drawn_triangle_count() const { return drawn_surfaces * 2; }
+
+  // Takes effect from the next render(); the caller's projection should
+  // end at farDistance too.
+  void set_detail(const DungeonDetail& settings) {
+    detail_settings = settings;
+    detail_settings.fogStart =
+        glm::min(settings.fogStart, settings.farDistance);
+    renderer->set_fog(detail_settings.fogColor, detail_settings.fogStart,
+                      detail_settings.farDistance);
+  }
+
+  const DungeonDetail& detail() const { return detail_settings; }
+
+  // Portal culling is on by default; turning it off draws every surface
+  // facing the eye, for comparison.
+  void set_portal_culling(bool enabled) { portal_culling = enabled; }
+
+  bool portal_culling_enabled() const { return portal_culling; }
+
+  // Cells reached and the cost of the last render()'s portal walk.
+  DungeonPortalStats portal_stats() const { return portals.stats; }
+
+  // Occlusion culling is on by default and needs begin_occlusion() every
+  // frame; see occlusionBufferStats() for its cost.
+  void set_occlusion_culling(bool enabled) { occlusion_culling = enabled; }
+
+  bool occlusion_culling_enabled() const { return occlusion_culling; }
+
+  // Forward shades the surfaces in the caller's pass. Deferred expects
+  // render() inside beginDeferredGeometryPass(), then render_lights(), then
+  // composeDeferredLighting() in the frame's pass (see deferredLighting.h).
+  bool set_lighting_path(lighting_path_t path) {
+    return renderer->set_lighting_path(path);
+  }
+
+  lighting_path_t lighting_path() const { return renderer->lighting_path(); }
+
+  // State order by default; see DungeonDrawOrder for the others.
+  void set_draw_order(DungeonDrawOrder order) {
+    renderer->set_draw_order(order);
+  }
+
+  DungeonDrawOrder draw_order() const { return renderer->draw_order(); }
+
+  // For the pass the dungeon is drawn into, e.g. sceneSampleCount().
+  void set_sample_count(int sampleCount) {
+    renderer->set_sample_count(sampleCount);
+  }
+
+  void render_lights(const glm::mat4 viewproj, const glm::vec3 viewPos) {
+    renderer->render_lights(viewproj, viewPos);
   }
 
  private:
@@ -178,5 +855,93 @@ class Dungeon {
   std::vector<DungeonSurface> back_surfaces;
   std::vector<DungeonSurface> bottom_surfaces;
   std::vector<DungeonSurface> top_surfaces;
+  std::vector<DungeonTorch> torches;
+  std::vector<cluster_light_t> static_lights;
+  std::vector<std::vector<uint16_t>> layout;
+  double lightmapBakeMs = 0.0;
+  int carried_light = INVALID_FLOOD_LIGHT;
   DungeonSurfaceRenderer* renderer;
+
+  // Surfaces of a type the eye is in front of. Buckets are sorted by plane
+  // offset along their facing, so these are a prefix found in O(log n).
+  size_t facing_count(uint32_t type, const glm::vec3& viewPos) const {
+    const std::vector<float>& planes = facing_planes[DungeonLod_Full][type];
+    float eye = glm::dot(facing_normals[type], viewPos);
+    return (size_t)(std::lower_bound(planes.begin(), planes.end(), eye) -
+                    planes.begin());
+  }
+
+  // Drops the cells whose floor-to-ceiling box the occlusion buffer hides.
+  void cull_occluded_cells(std::vector<uint32_t>& cells) const {
+    size_t kept = 0;
+    for (uint32_t cell : cells) {
+      const DungeonCell& c = portals.cells[cell];
+      glm::vec3 boxMin(
+          (float)c.x0 * DUNGEON_TILE_WIDTH - DUNGEON_TILE_WIDTH_OFFSET,
+          -DUNGEON_TILE_HEIGHT_OFFSET,
+          (float)c.z0 * DUNGEON_TILE_LENGTH - DUNGEON_TILE_LENGTH_OFFSET);
+      glm::vec3 boxMax(
+          (float)c.x1 * DUNGEON_TILE_WIDTH - DUNGEON_TILE_WIDTH_OFFSET,
+          DUNGEON_TILE_HEIGHT_OFFSET,
+          (float)c.z1 * DUNGEON_TILE_LENGTH - DUNGEON_TILE_LENGTH_OFFSET);
+      if (!occlusionBoxHidden(boxMin, boxMax)) {
+        cells[kept++] = cell;
+      }
+    }
+    cells.resize(kept);
+  }
+
+  // Sorts the visible cells into lodCells by the xz distance from the eye
+  // to the nearest point of the cell, dropping those past the far distance.
+  void split_cells_by_distance(const glm::vec3& viewPos,
+                               const DungeonCullSettings& settings,
+                               DungeonVisibleSet& out) const {
+    for (auto& cells : out.lodCells) {
+      cells.clear();
+    }
+    for (uint32_t cell : out.cells) {
+      const DungeonCell& c = portals.cells[cell];
+      glm::vec2 boxMin(
+          (float)c.x0 * DUNGEON_TILE_WIDTH - DUNGEON_TILE_WIDTH_OFFSET,
+          (float)c.z0 * DUNGEON_TILE_LENGTH - DUNGEON_TILE_LENGTH_OFFSET);
+      glm::vec2 boxMax(
+          (float)c.x1 * DUNGEON_TILE_WIDTH - DUNGEON_TILE_WIDTH_OFFSET,
+          (float)c.z1 * DUNGEON_TILE_LENGTH - DUNGEON_TILE_LENGTH_OFFSET);
+      glm::vec2 eye(viewPos.x, viewPos.z);
+      float distance = glm::length(eye - glm::clamp(eye, boxMin, boxMax));
+      if (distance > settings.farDistance) {
+        continue;
+      }
+      out.lodCells[distance > settings.coarseDistance ? DungeonLod_Coarse
+                                                      : DungeonLod_Full]
+          .push_back(cell);
+    }
+  }
+
+  // The same prefix within one cell's list of indices into the bucket.
+  size_t cell_facing_count(uint32_t type,
+                           DungeonLod lod,
+                           const std::vector<uint32_t>& list,
+                           const glm::vec3& viewPos) const {
+    const std::vector<float>& planes = facing_planes[lod][type];
+    float eye = glm::dot(facing_normals[type], viewPos);
+    return (size_t)(std::lower_bound(list.begin(), list.end(), eye,
+                                     [&](uint32_t i, float value) {
+                                       return planes[i] < value;
+                                     }) -
+                    list.begin());
+  }
+
+  glm::vec3 facing_normals[SurfaceType_Count];
+  std::vector<float> facing_planes[DungeonLod_Count][SurfaceType_Count];
+  uint32_t drawn_surfaces = 0;
+
+  std::vector<DungeonSurface> coarse_surfaces[SurfaceType_Count];
+  DungeonDetail detail_settings = {};
+
+  DungeonPortalGraph portals;
+  // What render() culls into.
+  DungeonVisibleSet visible = {};
+  bool portal_culling = true;
+  bool occlusion_culling = true;
 };
@@ -13,6 +13,26 @@ enum SurfaceType {
   SurfaceType_Count
 };
 
+// Full detail near the eye; coarse cells beyond the LOD distance have their
+// walls merged along whole cell edges, one floor quad and no ceiling.
+enum DungeonLod {
+  DungeonLod_Full = 0,
+  DungeonLod_Coarse,
+  DungeonLod_Count
+};
+
+// How the visible surfaces are ordered; see Dungeon::set_draw_order().
+enum DungeonDrawOrder {
+  // By pipeline and material, front to back within each.
+  DungeonDrawOrder_State = 0,
+  // Strictly front to back, changing material as often as it takes.
+  DungeonDrawOrder_FrontToBack,
+  // Front to back into depth only, then shaded by state with depth EQUAL,
+  // so each pixel is shaded once.
+  DungeonDrawOrder_DepthPrepass,
+  DungeonDrawOrder_Count
+};
+
 const float DUNGEON_TILE_WIDTH = 2.0f;
 const float DUNGEON_TILE_WIDTH_OFFSET = DUNGEON_TILE_WIDTH / 2.0f;
 const float DUNGEON_TILE_LENGTH = 2.0f;
@@ -60,9 +80,32 @@ const glm::vec3 DUNGEON_FRONT_COLOR =
 const glm::vec3 DUNGEON_BACK_COLOR =
     glm::vec3(155.0f / 255.0f, 42.0f / 255.0f, 66.0f / 255.0f);  // cyan?
 
-const char* wall_image_paths[SurfaceType_Count] = {
-    "bricks2.jpg",   "bricks2.jpg",         "brickwall.jpg",
-    "brickwall.jpg", "toy_box_diffuse.png", "wood.png",
+// Wall torches: warm, short-ranged point lights for the clustered renderer.
+const glm::vec3 DUNGEON_TORCH_COLOR = glm::vec3(1.0f, 0.62f, 0.28f);
+const glm::vec3 DUNGEON_TORCH_ATTENUATION = glm::vec3(1.0f, 0.35f, 0.44f);
+const float DUNGEON_TORCH_RADIUS = 3.5f;
+const float DUNGEON_TORCH_AMBIENT = 0.1f;
+// Height above the tile center and distance out from the wall.
+const float DUNGEON_TORCH_HEIGHT = 0.4f;
+const float DUNGEON_TORCH_INSET = 0.2f;
+
+// Flood light levels (0..FLOOD_LIGHT_MAX per channel) of the light the
+// player carries.
+const uint8_t DUNGEON_CARRIED_LIGHT[3] = {14, 12, 9};
+
+// Distances from the eye, in world units, for Dungeon::set_detail(). The
+// fog fades to the clear color by the far distance, which both mains also
+// use as the far plane; the switch to coarse cells happens well into it.
+const float DUNGEON_COARSE_DISTANCE = 32.0f;
+const float DUNGEON_FOG_START = 16.0f;
+const float DUNGEON_FAR_DISTANCE = 60.0f;
+const glm::vec3 DUNGEON_FOG_COLOR = glm::vec3(0.05f, 0.05f, 0.05f);
+// Lightmap density of the coarse surfaces, as a share of the full one.
+const float DUNGEON_COARSE_LIGHTMAP_SCALE = 0.25f;
+
+// Names from materialLibrary in material.h.
+const char* wall_material_names[SurfaceType_Count] = {
+    "bricks2", "bricks2", "brickwall", "brickwall", "toy_box", "wood",
 };
 
 // const char* wall_bump_image_
\ No newline at end of file
@@ -0,0 +1,337 @@
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+#include "glm/glm.hpp"
+#include "sokol_time.h"
+#include "dungeon_params.h"
+
+// Portal graph over the dungeon's open tiles. At build time the open tiles
+// are split into cells, greedy rectangles, so every cell is convex and all
+// of it can be seen from anywhere inside. Cells sharing an edge are joined
+// by a portal along that edge. Walls run floor to ceiling on a single
+// storey, so visibility is worked out top-down on the xz plane: the view is
+// a wedge of directions from the eye, narrowed by every portal it passes
+// through, and only the cells it reaches are drawn. The cost follows what
+// is visible rather than the size of the map.
+
+#define DUNGEON_NO_CELL (-1)
+// Guards against degenerate loops when the eye sits on a portal's line.
+#define DUNGEON_PORTAL_MAX_CELL_VISITS (64)
+
+typedef struct _dungeon_portal {
+  // Segment on the xz plane, stored as (x, z).
+  glm::vec2 a;
+  glm::vec2 b;
+  int32_t cells[2];
+} DungeonPortal;
+
+typedef struct _dungeon_cell {
+  // Tile rectangle [x0, x1) by [z0, z1).
+  int x0, z0, x1, z1;
+  std::vector<uint32_t> portals;
+  // Indices into the dungeon's surface buckets for each level of detail,
+  // in bucket order.
+  std::vector<uint32_t> surfaces[DungeonLod_Count][SurfaceType_Count];
+} DungeonCell;
+
+typedef struct _dungeon_portal_stats {
+  int visibleCells;
+  int portalsTested;
+  double visitMs;
+} DungeonPortalStats;
+
+typedef struct _dungeon_portal_graph {
+  int width = 0;
+  int length = 0;
+  // Cell per tile, [z * width + x]; DUNGEON_NO_CELL for solid tiles.
+  std::vector<int32_t> cell_at;
+  std::vector<DungeonCell> cells;
+  std::vector<DungeonPortal> portals;
+  // Per-frame scratch.
+  std::vector<uint32_t> visit_stamp;
+  std::vector<uint16_t> visit_count;
+  uint32_t stamp = 0;
+  DungeonPortalStats stats = {};
+} DungeonPortalGraph;
+
+// Directions from the eye between `right` and, counter-clockwise from it,
+// `left`; less than half a turn unless `full`.
+typedef struct {
+  glm::vec2 right;
+  glm::vec2 left;
+  bool full;
+} portal_wedge_t;
+
+typedef struct {
+  int32_t cell;
+  int32_t from;
+  portal_wedge_t wedge;
+} portal_visit_t;
+
+static glm::vec2 portal_tile_corner(int x, int z) {
+  return glm::vec2((float)x * DUNGEON_TILE_WIDTH - DUNGEON_TILE_WIDTH_OFFSET,
+                   (float)z * DUNGEON_TILE_LENGTH - DUNGEON_TILE_LENGTH_OFFSET);
+}
+
+// Adds portals along one edge of `cell`: tiles just outside it in direction
+// (dx, dz), merged while they belong to the same neighbouring cell. Only
+// the +x and +z edges are walked, so each shared edge is added once.
+static void portal_graph_link(DungeonPortalGraph& graph,
+                              int32_t cell,
+                              int dx,
+                              int dz) {
+  // Only the cells' portal lists grow here, so `c` stays valid.
+  const DungeonCell& c = graph.cells[cell];
+  int outer = dx ? c.x1 : c.z1;
+  if (outer >= (dx ? graph.width : graph.length)) {
+    return;
+  }
+  int begin = dx ? c.z0 : c.x0;
+  int end = dx ? c.z1 : c.x1;
+  int i = begin;
+  while (i < end) {
+    int x = dx ? outer : i, z = dx ? i : outer;
+    int32_t other = graph.cell_at[(size_t)z * graph.width + x];
+    if (other == DUNGEON_NO_CELL) {
+      i++;
+      continue;
+    }
+    int run = 1;
+    while (i + run < end &&
+           graph.cell_at[(size_t)(dx ? i + run : outer) * graph.width +
+                         (dx ? outer : i + run)] == other) {
+      run++;
+    }
+    DungeonPortal portal;
+    portal.a = dx ? portal_tile_corner(outer, i) : portal_tile_corner(i, outer);
+    portal.b = dx ? portal_tile_corner(outer, i + run)
+                  : portal_tile_corner(i + run, outer);
+    portal.cells[0] = cell;
+    portal.cells[1] = other;
+    uint32_t id = (uint32_t)graph.portals.size();
+    graph.portals.push_back(portal);
+    graph.cells[cell].portals.push_back(id);
+    graph.cells[other].portals.push_back(id);
+    i += run;
+  }
+}
+
+// Splits the open tiles (layout value 1, indexed [x][z]) into cells and
+// links them.
+static void build_portal_graph(
+    const std::vector<std::vector<uint16_t>>& layout,
+    DungeonPortalGraph& graph) {
+  graph = DungeonPortalGraph();
+  graph.width = (int)layout.size();
+  graph.length = graph.width > 0 ? (int)layout[0].size() : 0;
+  graph.cell_at.assign((size_t)graph.width * graph.length, DUNGEON_NO_CELL);
+  auto open = [&](int x, int z) {
+    return layout[x][z] == 1 &&
+           graph.cell_at[(size_t)z * graph.width + x] == DUNGEON_NO_CELL;
+  };
+  for (int z = 0; z < graph.length; z++) {
+    for (int x = 0; x < graph.width; x++) {
+      if (!open(x, z)) {
+        continue;
+      }
+      int x1 = x + 1, z1 = z + 1;
+      while (x1 < graph.width && open(x1, z)) {
+        x1++;
+      }
+      for (bool grow = true; grow && z1 < graph.length;) {
+        for (int i = x; i < x1; i++) {
+          if (!open(i, z1)) {
+            grow = false;
+            break;
+          }
+        }
+        z1 += grow ? 1 : 0;
+      }
+      int32_t id = (int32_t)graph.cells.size();
+      DungeonCell cell;
+      cell.x0 = x;
+      cell.z0 = z;
+      cell.x1 = x1;
+      cell.z1 = z1;
+      graph.cells.push_back(cell);
+      for (int j = z; j < z1; j++) {
+        for (int i = x; i < x1; i++) {
+          graph.cell_at[(size_t)j * graph.width + i] = id;
+        }
+      }
+    }
+  }
+  for (int32_t cell = 0; cell < (int32_t)graph.cells.size(); cell++) {
+    portal_graph_link(graph, cell, 1, 0);
+    portal_graph_link(graph, cell, 0, 1);
+  }
+  graph.visit_stamp.assign(graph.cells.size(), 0);
+  graph.visit_count.assign(graph.cells.size(), 0);
+}
+
+static int32_t portal_graph_cell(const DungeonPortalGraph& graph,
+                                 int x,
+                                 int z) {
+  if (x < 0 || z < 0 || x >= graph.width || z >= graph.length) {
+    return DUNGEON_NO_CELL;
+  }
+  return graph.cell_at[(size_t)z * graph.width + x];
+}
+
+static float portal_cross(glm::vec2 a, glm::vec2 b) {
+  return a.x * b.y - a.y * b.x;
+}
+
+static bool portal_wedge_contains(const portal_wedge_t& w, glm::vec2 d) {
+  const float eps = 1e-5f;
+  return w.full || (portal_cross(w.right, d) >= -eps &&
+                    portal_cross(d, w.left) >= -eps);
+}
+
+// Narrows `w` to the directions that pass through the portal, false if none
+// do. An eye standing in the portal's opening leaves `w` as it is; one
+// elsewhere on its line sees it edge on.
+static bool portal_wedge_clip(portal_wedge_t* w,
+                              glm::vec2 eye,
+                              const DungeonPortal& portal) {
+  glm::vec2 edge = portal.b - portal.a;
+  float span = glm::length(edge);
+  float offset = portal_cross(edge, eye - portal.a) / span;
+  if (fabsf(offset) < 1e-3f) {
+    float along = glm::dot(edge, eye - portal.a) / span;
+    return along >= 0.0f && along <= span;
+  }
+  glm::vec2 da = glm::normalize(portal.a - eye);
+  glm::vec2 db = glm::normalize(portal.b - eye);
+  // The eye's side of the portal decides which end is clockwise.
+  bool ccw = offset > 0.0f;
+  portal_wedge_t p;
+  p.right = ccw ? da : db;
+  p.left = ccw ? db : da;
+  p.full = false;
+  if (w->full) {
+    *w = p;
+    return true;
+  }
+  portal_wedge_t out;
+  out.full = false;
+  if (portal_wedge_contains(*w, p.right)) {
+    out.right = p.right;
+  } else if (portal_wedge_contains(p, w->right)) {
+    out.right = w->right;
+  } else {
+    return false;
+  }
+  if (portal_wedge_contains(*w, p.left)) {
+    out.left = p.left;
+  } else if (portal_wedge_contains(p, w->left)) {
+    out.left = w->left;
+  } else {
+    return false;
+  }
+  if (portal_cross(out.right, out.left) < -1e-5f) {
+    return false;
+  }
+  *w = out;
+  return true;
+}
+
+// The view frustum's footprint on the xz plane as a wedge around the eye;
+// full when the frustum looks steeply enough down or up to surround it.
+static portal_wedge_t portal_view_wedge(const glm::mat4& viewproj,
+                                        glm::vec3 eye) {
+  portal_wedge_t wedge;
+  wedge.full = true;
+  glm::mat4 inv = glm::inverse(viewproj);
+  glm::vec2 reference(0.0f);
+  float lo = 0.0f, hi = 0.0f;
+  bool first = true;
+  for (int i = 0; i < 8; i++) {
+    glm::vec4 ndc((i & 1) ? 1.0f : -1.0f, (i & 2) ? 1.0f : -1.0f,
+                  (i & 4) ? 1.0f : -1.0f, 1.0f);
+    glm::vec4 corner = inv * ndc;
+    glm::vec2 d = glm::vec2(corner.x / corner.w - eye.x,
+                            corner.z / corner.w - eye.z);
+    if (glm::length(d) < 1e-4f) {
+      continue;
+    }
+    d = glm::normalize(d);
+    if (first) {
+      reference = d;
+      first = false;
+      continue;
+    }
+    float angle =
+        atan2f(portal_cross(reference, d), glm::dot(reference, d));
+    lo = glm::min(lo, angle);
+    hi = glm::max(hi, angle);
+  }
+  if (first || hi - lo >= 3.1f) {
+    return wedge;
+  }
+  wedge.full = false;
+  wedge.right = glm::vec2(reference.x * cosf(lo) - reference.y * sinf(lo),
+                          reference.x * sinf(lo) + reference.y * cosf(lo));
+  wedge.left = glm::vec2(reference.x * cosf(hi) - reference.y * sinf(hi),
+                         reference.x * sinf(hi) + reference.y * cosf(hi));
+  return wedge;
+}
+
+// Fills `visible` with the cells seen from `eye` through the portals.
+// Returns false, leaving `visible` empty, when the eye is not in any cell
+// (inside a wall or off the map) and nothing can be culled.
+static bool portal_graph_visible_cells(DungeonPortalGraph& graph,
+                                       glm::vec3 eye,
+                                       const glm::mat4& viewproj,
+                                       std::vector<uint32_t>& visible) {
+  uint64_t start = stm_now();
+  visible.clear();
+  graph.stats = {};
+  int32_t origin = portal_graph_cell(
+      graph,
+      (int)floorf((eye.x + DUNGEON_TILE_WIDTH_OFFSET) / DUNGEON_TILE_WIDTH),
+      (int)floorf((eye.z + DUNGEON_TILE_LENGTH_OFFSET) / DUNGEON_TILE_LENGTH));
+  if (origin == DUNGEON_NO_CELL) {
+    return false;
+  }
+  if (++graph.stamp == 0) {
+    graph.visit_stamp.assign(graph.cells.size(), 0);
+    graph.stamp = 1;
+  }
+  glm::vec2 eye2(eye.x, eye.z);
+  std::vector<portal_visit_t> stack;
+  stack.push_back({origin, -1, portal_view_wedge(viewproj, eye)});
+  graph.visit_stamp[origin] = graph.stamp;
+  graph.visit_count[origin] = 1;
+  visible.push_back((uint32_t)origin);
+  while (!stack.empty()) {
+    portal_visit_t visit = stack.back();
+    stack.pop_back();
+    for (uint32_t id : graph.cells[visit.cell].portals) {
+      if ((int32_t)id == visit.from) {
+        continue;
+      }
+      const DungeonPortal& portal = graph.portals[id];
+      int32_t next =
+          portal.cells[0] == visit.cell ? portal.cells[1] : portal.cells[0];
+      graph.stats.portalsTested++;
+      portal_wedge_t wedge = visit.wedge;
+      if (!portal_wedge_clip(&wedge, eye2, portal)) {
+        continue;
+      }
+      if (graph.visit_stamp[next] != graph.stamp) {
+        graph.visit_stamp[next] = graph.stamp;
+        graph.visit_count[next] = 0;
+        visible.push_back((uint32_t)next);
+      }
+      if (graph.visit_count[next]++ < DUNGEON_PORTAL_MAX_CELL_VISITS) {
+        stack.push_back({next, (int32_t)id, wedge});
+      }
+    }
+  }
+  graph.stats.visibleCells = (int)visible.size();
+  graph.stats.visitMs = stm_ms(stm_since(start));
+  return true;
+}
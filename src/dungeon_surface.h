@@ -1,8 +1,32 @@
 #pragma once
 
+#include <stdint.h>
+#include <vector>
 #include "glm/glm.hpp"
 
 typedef struct _dungeon_surface {
+  // Unit quad in the model's xy plane, scaled to the tiles it covers.
   glm::mat4 model;
   glm::vec3 color;
-} DungeonSurface;
\ No newline at end of file
+  // Where the face sits in the baked lightmap atlas: uv offset in xy, uv
+  // scale in zw.
+  glm::vec4 lightmap_rect = glm::vec4(0.0f);
+  // First of the quad's six indices in its surface type's mesh.
+  uint32_t first_index = 0;
+  // Portal graph cell the surface bounds; meshing never merges across cells.
+  int32_t cell = -1;
+} DungeonSurface;
+
+// Position in the surface's unit quad, texcoord repeating once per tile,
+// and the corner's ambient occlusion level (0 = boxed in .. 3 = open)
+// scaled to 0..255 in ao[0].
+typedef struct _dungeon_vertex {
+  float x, y, z;
+  float u, v;
+  uint8_t ao[4];
+} DungeonVertex;
+
+typedef struct _dungeon_mesh {
+  std::vector<DungeonVertex> vertices;
+  std::vector<uint32_t> indices;
+} DungeonMesh;
@@ -2,6 +2,13 @@
 
 #include "sokol_gfx.h"
 #include "textureLoader.h"
+#include "textureStreamer.h"
+#include "textureRegistry.h"
+#include "material.h"
+#include "clusteredLights.h"
+#include "floodLight.h"
+#include "deferredLighting.h"
+#include "renderQueue.h"
 #include "light_shaders.glsl.h"
 #include "glm/glm.hpp"
 #include "glm/gtc/matrix_transform.hpp"
@@ -11,68 +18,278 @@
 class DungeonSurfaceRenderer {
  public:
   void init() {
-    float vertices[] = {
-        -0.5f, -0.5f, 0.0f, 0.0f, 1.0f,  // bottom left
-        0.5f,  -0.5f, 0.0f, 1.0f, 1.0f,  // top left
-        0.5f,  0.5f,  0.0f, 1.0f, 0.0f,  // top right
-        -0.5f, 0.5f,  0.0f, 0.0f, 0.0f,  // bottom right
-    };
-    uint16_t indices[] = {0, 2, 1, 0, 3, 2};
+    phong_shader = sg_make_shader(phong_shader_desc(shaderBackend()));
+    depth_shader = sg_make_shader(depth_only_shader_desc(shaderBackend()));
+    // The forward path draws into the default pass until told otherwise.
+    sample_count = sg_query_desc().context.sample_count;
+    make_forward_pipelines();
 
-    sg_pipeline_desc pipe_desc = {0};
-    pipe_desc.face_winding = SG_FACEWINDING_CW;
-    pipe_desc.shader = sg_make_shader(surface_shader_desc(sg_query_backend()));
-    pipe_desc.layout.attrs[0].format = SG_VERTEXFORMAT_FLOAT3;
-    pipe_desc.layout.attrs[1].format = SG_VERTEXFORMAT_FLOAT2;
-    pipe_desc.layout.buffers[0].stride = 5 * sizeof(float);
-    pipe_desc.index_type = SG_INDEXTYPE_UINT16;
-    pipe_desc.sample_count = 4;
-    pipe_desc.cull_mode = SG_CULLMODE_BACK;
-    pipe_desc.depth.write_enabled = true;
-    pipe_desc.depth.compare = SG_COMPAREFUNC_LESS_EQUAL;
-    pipe_desc.label = "dungeon-surface-pipeline";
-    wall_pip = sg_make_pipeline(&pipe_desc);
+    // Same vertex layout and shader inputs, drawn into the G-buffer.
+    path = LightingPath_Forward;
+    if (deferredLightingSupported()) {
+      initDeferredLighting();
+      sg_pipeline_desc pipe_desc = surface_pipeline_desc(
+          sg_make_shader(gbuffer_shader_desc(shaderBackend())));
+      deferredGeometryTargets(&pipe_desc);
+      pipe_desc.label = "dungeon-gbuffer-pipeline";
+      make_pipelines(LightingPath_Deferred, pipe_desc);
+    }
+    order = DungeonDrawOrder_State;
+
+    vs_params = {};
+    fs_params = {};
+    fs_params.material_shininess = 32.0f;
+    fs_params.parallax_scale = 0.04f;
+    for (uint32_t i = 0; i < SurfaceType_Count; i++) {
+      wall_materials[i] = loadMaterial(wall_material_names[i]);
+    }
+
+    // Unlit until a lightmap is baked.
+    static const uint8_t black[4] = {0, 0, 0, 255};
+    sg_image_desc lightmap_desc = {0};
+    lightmap_desc.width = 1;
+    lightmap_desc.height = 1;
+    lightmap_desc.pixel_format = SG_PIXELFORMAT_RGBA8;
+    lightmap_desc.data.subimage[0][0] = SG_RANGE(black);
+    lightmap_desc.label = "dungeon-lightmap-empty";
+    lightmap = sg_make_image(&lightmap_desc);
+  }
 
+  // Uploads the meshed quads of one surface type at one level of detail;
+  // render_surface() draws a surface's quad out of it.
+  void set_mesh(SurfaceType type, DungeonLod lod, const DungeonMesh& mesh) {
+    if (mesh.indices.empty()) {
+      return;
+    }
     sg_buffer_desc buf_desc = {0};
     buf_desc.label = "dungeon-surface-vertices";
-    buf_desc.data = SG_RANGE(vertices);
-    wall_bind.vertex_buffers[0] = sg_make_buffer(&buf_desc);
+    buf_desc.data.ptr = mesh.vertices.data();
+    buf_desc.data.size = mesh.vertices.size() * sizeof(DungeonVertex);
+    vertex_buffers[lod][type] = sg_make_buffer(&buf_desc);
     buf_desc.label = "dungeon-surface-indices";
     buf_desc.type = SG_BUFFERTYPE_INDEXBUFFER;
-    buf_desc.data = SG_RANGE(indices);
-    wall_bind.index_buffer = sg_make_buffer(&buf_desc);
-    vs_params = {};
-    for (uint32_t i = 0; i < SurfaceType_Count; i++) {
-      wall_images[i] = sg_alloc_image();
-      loadTexture(wall_image_paths[i], wall_images[i], SLOT_surfaceTex);
+    buf_desc.data.ptr = mesh.indices.data();
+    buf_desc.data.size = mesh.indices.size() * sizeof(uint32_t);
+    index_buffers[lod][type] = sg_make_buffer(&buf_desc);
+  }
+
+  // Takes ownership of malloc'ed RGBA8 `pixels` and swaps the atlas in once
+  // the upload queue gets to it.
+  void set_lightmap(uint8_t* pixels, uint32_t width, uint32_t height) {
+    sg_destroy_image(lightmap);
+    lightmap = sg_alloc_image();
+    sg_image_desc lightmap_desc = {0};
+    lightmap_desc.width = (int)width;
+    lightmap_desc.height = (int)height;
+    lightmap_desc.pixel_format = SG_PIXELFORMAT_RGBA8;
+    lightmap_desc.min_filter = SG_FILTER_LINEAR;
+    lightmap_desc.mag_filter = SG_FILTER_LINEAR;
+    lightmap_desc.wrap_u = SG_WRAP_CLAMP_TO_EDGE;
+    lightmap_desc.wrap_v = SG_WRAP_CLAMP_TO_EDGE;
+    lightmap_desc.label = "dungeon-lightmap";
+    lightmap_desc.data.subimage[0][0].ptr = pixels;
+    lightmap_desc.data.subimage[0][0].size = (size_t)width * height * 4;
+    queueImageUpload(lightmap, lightmap_desc,
+                     lightmap_desc.data.subimage[0][0].size,
+                     UploadPriority_High, pixels, free);
+  }
+
+  // Returns false, keeping the current path, when the deferred path is not
+  // supported.
+  bool set_lighting_path(lighting_path_t lightingPath) {
+    if (lightingPath == LightingPath_Deferred &&
+        !deferredLightingSupported()) {
+      return false;
     }
+    path = lightingPath;
+    return true;
   }
 
-  void begin_render(glm::mat4 viewproj) {
-    sg_apply_pipeline(wall_pip);
+  lighting_path_t lighting_path() const { return path; }
+
+  // Rebuilds the pipelines that draw into the frame's scene pass, forward
+  // surfaces and the deferred compose, for a pass with `sampleCount`.
+  void set_sample_count(int sampleCount) {
+    if (sampleCount == sample_count) {
+      return;
+    }
+    for (sg_pipeline pip :
+         {shade_pips[LightingPath_Forward], equal_pips[LightingPath_Forward],
+          depth_pips[LightingPath_Forward]}) {
+      sg_destroy_pipeline(pip);
+    }
+    sample_count = sampleCount;
+    make_forward_pipelines();
+    if (deferredLightingSupported()) {
+      setDeferredComposeSampleCount(sampleCount);
+    }
+  }
+
+  void set_draw_order(DungeonDrawOrder drawOrder) { order = drawOrder; }
+
+  DungeonDrawOrder draw_order() const { return order; }
+
+  // Surfaces fade to `color` from `start` to `end` units from the eye, on
+  // either lighting path.
+  void set_fog(glm::vec3 color, float start, float end) {
+    fs_params.fog_color = glm::vec4(color, 1.0f);
+    fs_params.fog_params =
+        glm::vec4(start, 1.0f / glm::max(end - start, 1e-3f), 0.0f, 0.0f);
+    setDeferredFog(color, start, end);
+  }
+
+  // Starts queueing the frame's surfaces; end_render() draws them.
+  void begin_render(glm::mat4 viewproj, glm::vec3 viewPos) {
+    wall_bind = {};
+    beginRenderQueue();
+    bool prepass = order == DungeonDrawOrder_DepthPrepass;
+    pipeline = renderQueuePipeline(prepass ? equal_pips[path]
+                                           : shade_pips[path]);
+    if (prepass) {
+      depth_pipeline = renderQueuePipeline(depth_pips[path]);
+    }
 
     vs_params.viewproj = viewproj;
+    fs_params.view_pos = viewPos;
+    view_pos = viewPos;
+    renderQueuePipelineUniforms(pipeline, SG_SHADERSTAGE_FS,
+                                SLOT_lighting_fs_params, SG_RANGE(fs_params));
+    cluster_fs_params_t cluster_params;
+    cluster_params.cluster_grid = lightClusterGrid();
+    cluster_params.cluster_dims = lightClusterDims();
+    renderQueuePipelineUniforms(pipeline, SG_SHADERSTAGE_FS,
+                                SLOT_cluster_fs_params,
+                                SG_RANGE(cluster_params));
+    if (path == LightingPath_Deferred) {
+      // Point lights are added afterwards by render_lights().
+      wall_bind.fs_images[SLOT_gbuffer_lightmap_texture] = lightmap;
+      wall_bind.fs_images[SLOT_gbuffer_flood_texture] = floodLight.image;
+      return;
+    }
+    wall_bind.fs_images[SLOT_cluster_texture] = lightClusters.clusterImage;
+    wall_bind.fs_images[SLOT_light_index_texture] = lightClusters.indexImage;
+    wall_bind.fs_images[SLOT_light_texture] = lightClusters.lightImage;
+    wall_bind.fs_images[SLOT_lightmap_texture] = lightmap;
+    wall_bind.fs_images[SLOT_flood_light_texture] = floodLight.image;
+  }
+
+  // The mesh and material the following render_surface() calls draw with.
+  void apply_textures(SurfaceType type, DungeonLod lod = DungeonLod_Full) {
+    wall_bind.vertex_buffers[0] = vertex_buffers[lod][type];
+    wall_bind.index_buffer = index_buffers[lod][type];
+    bindMaterial(wall_materials[type], &wall_bind, SLOT_diffuse_texture,
+                 SLOT_surface_texture);
+    bindings = renderQueueBindings(wall_bind);
+    if (order == DungeonDrawOrder_DepthPrepass) {
+      sg_bindings mesh_bind = {};
+      mesh_bind.vertex_buffers[0] = wall_bind.vertex_buffers[0];
+      mesh_bind.index_buffer = wall_bind.index_buffer;
+      depth_bindings = renderQueueBindings(mesh_bind);
+    }
+  }
+
+  // Sorts and draws the queued surfaces; see renderQueueStats().
+  void end_render() { submitRenderQueue(); }
+
+  // Deferred path only: lights the G-buffer once the surfaces are drawn.
+  void render_lights(glm::mat4 viewproj, glm::vec3 viewPos) {
+    renderDeferredLights(viewproj, viewPos, fs_params.material_shininess);
   }
 
-  void apply_textures(SurfaceType type) {
-    wall_bind.fs_images[SLOT_surfaceTex] = wall_images[type];
-    sg_apply_bindings(&wall_bind);
+  void request_texture_residency(SurfaceType type, float projectedPixels) {
+    textureStreamerRequest(materialAlbedoImage(wall_materials[type]),
+                           projectedPixels);
   }
 
   void update_light() {}
 
-  void render_surface(DungeonSurface& surf) {
+  void render_surface(const DungeonSurface& surf) {
     vs_params.model = surf.model;
-    vs_params.color = surf.color;
+    vs_params.lightmap_rect = surf.lightmap_rect;
 
-    sg_apply_uniforms(SG_SHADERSTAGE_VS, SLOT_surface_vs_params,
-                      &SG_RANGE(vs_params));
-    sg_draw(0, 6, 1);
+    float depth = glm::length(glm::vec3(surf.model[3]) - view_pos);
+    uint64_t key =
+        order == DungeonDrawOrder_FrontToBack
+            ? renderQueueDepthKey(RenderLayer_Opaque, pipeline, bindings,
+                                  depth)
+            : renderQueueKey(RenderLayer_Opaque, pipeline, bindings, depth);
+    renderQueueDraw(key, pipeline, bindings, (int)surf.first_index, 6, 1,
+                    SG_SHADERSTAGE_VS, SLOT_lighting_vs_params,
+                    SG_RANGE(vs_params));
+    if (order == DungeonDrawOrder_DepthPrepass) {
+      // Same uniforms, so the positions come out identical.
+      renderQueueDraw(renderQueueDepthKey(RenderLayer_DepthPrepass,
+                                          depth_pipeline, depth_bindings,
+                                          depth),
+                      depth_pipeline, depth_bindings, (int)surf.first_index,
+                      6, 1, SG_SHADERSTAGE_VS, SLOT_lighting_vs_params,
+                      SG_RANGE(vs_params));
+    }
   }
 
  private:
-  sg_pipeline wall_pip;
+  sg_pipeline_desc surface_pipeline_desc(sg_shader shader) {
+    sg_pipeline_desc pipe_desc = {0};
+    pipe_desc.face_winding = SG_FACEWINDING_CW;
+    pipe_desc.shader = shader;
+    pipe_desc.layout.attrs[0].format = SG_VERTEXFORMAT_FLOAT3;
+    pipe_desc.layout.attrs[1].format = SG_VERTEXFORMAT_FLOAT2;
+    pipe_desc.layout.attrs[2].format = SG_VERTEXFORMAT_UBYTE4N;
+    pipe_desc.layout.buffers[0].stride = sizeof(DungeonVertex);
+    pipe_desc.index_type = SG_INDEXTYPE_UINT32;
+    pipe_desc.cull_mode = SG_CULLMODE_BACK;
+    pipe_desc.depth.write_enabled = true;
+    pipe_desc.depth.compare = SG_COMPAREFUNC_LESS_EQUAL;
+    return pipe_desc;
+  }
+
+  void make_forward_pipelines() {
+    sg_pipeline_desc pipe_desc = surface_pipeline_desc(phong_shader);
+    pipe_desc.sample_count = sample_count;
+    pipe_desc.label = "dungeon-surface-pipeline";
+    make_pipelines(LightingPath_Forward, pipe_desc);
+  }
+
+  // The shading pipeline `desc` plus, from it, one that only shades pixels
+  // whose depth is EQUAL to the prepass's, and the depth-only prepass one.
+  void make_pipelines(lighting_path_t lightingPath, sg_pipeline_desc desc) {
+    shade_pips[lightingPath] = sg_make_pipeline(&desc);
+    desc.depth.write_enabled = false;
+    desc.depth.compare = SG_COMPAREFUNC_EQUAL;
+    desc.label = "dungeon-equal-pipeline";
+    equal_pips[lightingPath] = sg_make_pipeline(&desc);
+
+    desc.shader = depth_shader;
+    desc.layout.attrs[1].format = SG_VERTEXFORMAT_INVALID;
+    desc.layout.attrs[2].format = SG_VERTEXFORMAT_INVALID;
+    desc.depth.write_enabled = true;
+    desc.depth.compare = SG_COMPAREFUNC_LESS_EQUAL;
+    for (int i = 0; i < SG_MAX_COLOR_ATTACHMENTS; i++) {
+      desc.colors[i].write_mask = SG_COLORMASK_NONE;
+    }
+    desc.label = "dungeon-depth-pipeline";
+    depth_pips[lightingPath] = sg_make_pipeline(&desc);
+  }
+
+  sg_shader phong_shader;
+  sg_shader depth_shader;
+  int sample_count;
+  sg_pipeline shade_pips[LightingPath_Count];
+  sg_pipeline equal_pips[LightingPath_Count];
+  sg_pipeline depth_pips[LightingPath_Count];
+  lighting_path_t path;
+  DungeonDrawOrder order;
   sg_bindings wall_bind;
-  sg_image wall_images[SurfaceType_Count];
-  surface_vs_params_t vs_params;
+  // This frame's render queue ids.
+  uint32_t pipeline;
+  uint32_t bindings;
+  uint32_t depth_pipeline;
+  uint32_t depth_bindings;
+  glm::vec3 view_pos;
+  sg_buffer vertex_buffers[DungeonLod_Count][SurfaceType_Count];
+  sg_buffer index_buffers[DungeonLod_Count][SurfaceType_Count];
+  int wall_materials[SurfaceType_Count];
+  sg_image lightmap;
+  lighting_vs_params_t vs_params;
+  lighting_fs_params_t fs_params;
 };
\ No newline at end of file
@@ -0,0 +1,426 @@
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+#include "sokol_gfx.h"
+#include "sokol_time.h"
+#include "glm/glm.hpp"
+#include "deferredLighting.h"
+#include "light_shaders.glsl.h"
+
+// The GL backends can't be probed for a sample count (see
+// sceneAntiAliasingSupported()), so they ask GL directly.
+#if defined(SOKOL_GLCORE33) || defined(SOKOL_GLES3)
+  #define DYNRES_GL_SAMPLE_LIMIT
+  #if defined(_WIN32)
+    #ifndef WIN32_LEAN_AND_MEAN
+      #define WIN32_LEAN_AND_MEAN
+    #endif
+    #include <windows.h>
+    #include <GL/gl.h>
+  #elif defined(__APPLE__) && defined(SOKOL_GLES3)
+    #include <OpenGLES/ES3/gl.h>
+  #elif defined(__APPLE__)
+    #include <OpenGL/gl3.h>
+  #elif defined(SOKOL_GLES3)
+    #include <GLES3/gl3.h>
+  #else
+    #include <GL/gl.h>
+  #endif
+  #ifndef GL_MAX_SAMPLES
+    #define GL_MAX_SAMPLES 0x8D57
+  #endif
+#endif
+
+// Dynamic resolution: the scene is drawn into an offscreen target a fraction
+// of the frame's size, which an upscale pass then stretches over the frame.
+// Once per frame dynamicResolutionFrame() measures the time since the last
+// frame with stm_laptime() and steers the fraction towards a frame time
+// target: it shrinks a step when the average stays more than
+// DYNRES_OVER_BUDGET over the target, and grows a step back once frames have
+// met the target for a while. Growing into a size that then misses doubles
+// that wait, so the scale settles instead of bouncing between two steps.
+//
+// The scene target also carries the anti-aliasing: MSAA at 1, 2, 4 or 8
+// samples, resolved when the scene pass ends, or a single-sampled scene
+// that an FXAA pass smooths while upscaling. Pipelines drawn into the scene
+// pass must match sceneSampleCount().
+//
+// At full scale, with the default pass's sample count and no FXAA, the
+// scene pass is the frame's default pass and nothing is copied. The target
+// is remade whenever the scene size or sample count changes, as the
+// G-buffer is, so the scale moves in coarse steps.
+
+#define DYNRES_MIN_SCALE (0.5f)
+#define DYNRES_MAX_SCALE (1.0f)
+#define DYNRES_STEP (0.1f)
+// Shrinks when the average frame runs this much over the target, grows when
+// it is within DYNRES_MEETS_BUDGET of it.
+#define DYNRES_OVER_BUDGET (1.1f)
+#define DYNRES_MEETS_BUDGET (1.02f)
+// Frames a new size is given before its timings count.
+#define DYNRES_SETTLE_FRAMES (20)
+// Frames the average must stay over budget before shrinking. A single frame
+// counts as at most twice the target, so one hitch can't do it alone.
+#define DYNRES_OVER_FRAMES (8)
+// Frames within budget before growing, doubled after every failed grow.
+#define DYNRES_GROW_FRAMES (60)
+#define DYNRES_MAX_GROW_FRAMES (960)
+
+enum scene_aa_t {
+  SceneAA_Off = 0,
+  SceneAA_MSAA2,
+  SceneAA_MSAA4,
+  SceneAA_MSAA8,
+  SceneAA_FXAA,
+  SceneAA_Count
+};
+
+static const int scene_aa_samples[SceneAA_Count] = {1, 2, 4, 8, 1};
+
+typedef struct {
+  float scale;
+  int sceneWidth;
+  int sceneHeight;
+  // Smoothed time between frames.
+  double frameMs;
+  double targetMs;
+  // The last copy into the default pass, zero when there was none.
+  double upscaleMs;
+} dynamic_resolution_stats_t;
+
+typedef struct {
+  bool valid;
+  bool enabled;
+  float scale;
+  double targetMs;
+  uint64_t lastFrame;
+  double averageMs;
+  int settleFrames;
+  int overBudget;
+  int withinBudget;
+  int growFrames;
+  bool grew;
+  scene_aa_t aa;
+  // Of the default pass, which only the final copy draws into.
+  int frameSamples;
+  // The offscreen scene target, at its current size and sample count.
+  int width;
+  int height;
+  int samples;
+  sg_image color;
+  sg_image depth;
+  sg_pass pass;
+  // Whether the current frame's scene pass is the offscreen one.
+  bool offscreen;
+  int frameWidth;
+  int frameHeight;
+  sg_pipeline upscalePip;
+  sg_pipeline fxaaPip;
+  sg_buffer screenTriangle;
+  dynamic_resolution_stats_t stats;
+} dynamic_resolution_t;
+
+static dynamic_resolution_t dynamicResolution;
+
+// `targetMs` is the frame time to hold, e.g. 1000 / 60. Without MSAA
+// render targets the scale stays at 1.
+static void initDynamicResolution(double targetMs) {
+  dynamic_resolution_t& dr = dynamicResolution;
+  dr = dynamic_resolution_t();
+  dr.scale = DYNRES_MAX_SCALE;
+  dr.targetMs = targetMs;
+  dr.growFrames = DYNRES_GROW_FRAMES;
+  dr.settleFrames = DYNRES_SETTLE_FRAMES;
+  dr.enabled = sg_query_features().msaa_render_targets;
+  dr.frameSamples = sg_query_desc().context.sample_count;
+  // Whatever the default pass has, until setSceneAntiAliasing().
+  dr.aa = SceneAA_Off;
+  for (int aa = SceneAA_Off; aa < SceneAA_FXAA; aa++) {
+    if (scene_aa_samples[aa] == dr.frameSamples) {
+      dr.aa = (scene_aa_t)aa;
+    }
+  }
+
+  const float triangle[] = {-1.0f, -1.0f, 3.0f, -1.0f, -1.0f, 3.0f};
+  sg_buffer_desc buf_desc = {0};
+  buf_desc.data = SG_RANGE(triangle);
+  buf_desc.label = "upscale-screen-triangle";
+  dr.screenTriangle = sg_make_buffer(&buf_desc);
+
+  sg_pipeline_desc pipe_desc = {0};
+  pipe_desc.shader = sg_make_shader(upscale_shader_desc(shaderBackend()));
+  pipe_desc.layout.attrs[0].format = SG_VERTEXFORMAT_FLOAT2;
+  pipe_desc.depth.compare = SG_COMPAREFUNC_ALWAYS;
+  pipe_desc.label = "upscale-pipeline";
+  dr.upscalePip = sg_make_pipeline(&pipe_desc);
+  pipe_desc.shader = sg_make_shader(fxaa_shader_desc(shaderBackend()));
+  pipe_desc.label = "fxaa-pipeline";
+  dr.fxaaPip = sg_make_pipeline(&pipe_desc);
+  dr.valid = true;
+}
+
+static void dynres_destroy_target(dynamic_resolution_t& dr) {
+  sg_destroy_pass(dr.pass);
+  sg_destroy_image(dr.color);
+  sg_destroy_image(dr.depth);
+  dr.width = 0;
+  dr.height = 0;
+  dr.samples = 0;
+}
+
+static void destroyDynamicResolution(void) {
+  dynamic_resolution_t& dr = dynamicResolution;
+  if (!dr.valid) {
+    return;
+  }
+  dynres_destroy_target(dr);
+  sg_destroy_pipeline(dr.upscalePip);
+  sg_destroy_pipeline(dr.fxaaPip);
+  sg_destroy_buffer(dr.screenTriangle);
+  dr = dynamic_resolution_t();
+}
+
+// Same formats as the default pass, so pipelines drawn into the frame can
+// draw into the scene target once their sample count matches. MSAA targets
+// are resolved when their pass ends.
+static void dynres_make_target(dynamic_resolution_t& dr,
+                               int width,
+                               int height,
+                               int samples) {
+  dynres_destroy_target(dr);
+  sg_context_desc context = sg_query_desc().context;
+  sg_image_desc imageDesc = {0};
+  imageDesc.render_target = true;
+  imageDesc.width = width;
+  imageDesc.height = height;
+  imageDesc.pixel_format = context.color_format;
+  imageDesc.sample_count = samples;
+  imageDesc.min_filter = SG_FILTER_LINEAR;
+  imageDesc.mag_filter = SG_FILTER_LINEAR;
+  imageDesc.wrap_u = SG_WRAP_CLAMP_TO_EDGE;
+  imageDesc.wrap_v = SG_WRAP_CLAMP_TO_EDGE;
+  imageDesc.label = "dynres-scene-color";
+  dr.color = sg_make_image(&imageDesc);
+  imageDesc.pixel_format = context.depth_format;
+  imageDesc.label = "dynres-scene-depth";
+  dr.depth = sg_make_image(&imageDesc);
+
+  sg_pass_desc pass_desc = {0};
+  pass_desc.color_attachments[0].image = dr.color;
+  pass_desc.depth_stencil_attachment.image = dr.depth;
+  pass_desc.label = "dynres-scene-pass";
+  dr.pass = sg_make_pass(&pass_desc);
+  dr.width = width;
+  dr.height = height;
+  dr.samples = samples;
+}
+
+static void dynres_set_scale(dynamic_resolution_t& dr, float scale) {
+  // Whole steps, so repeated steps land on the same sizes.
+  scale = roundf(scale / DYNRES_STEP) * DYNRES_STEP;
+  dr.scale = glm::clamp(scale, DYNRES_MIN_SCALE, DYNRES_MAX_SCALE);
+  dr.averageMs = 0.0;
+  dr.settleFrames = DYNRES_SETTLE_FRAMES;
+  dr.overBudget = 0;
+  dr.withinBudget = 0;
+}
+
+// Call once at the start of every frame.
+static void dynamicResolutionFrame(void) {
+  dynamic_resolution_t& dr = dynamicResolution;
+  bool first = dr.lastFrame == 0;
+  double frameMs = stm_ms(stm_laptime(&dr.lastFrame));
+  if (first || !dr.enabled) {
+    return;
+  }
+  frameMs = glm::min(frameMs, dr.targetMs * 2.0);
+  dr.stats.frameMs = dr.averageMs =
+      dr.averageMs > 0.0 ? dr.averageMs * 0.9 + frameMs * 0.1 : frameMs;
+  if (dr.settleFrames > 0) {
+    dr.settleFrames--;
+    return;
+  }
+  if (dr.averageMs > dr.targetMs * DYNRES_OVER_BUDGET) {
+    dr.withinBudget = 0;
+    if (++dr.overBudget >= DYNRES_OVER_FRAMES &&
+        dr.scale > DYNRES_MIN_SCALE) {
+      // The last grow did not fit, so wait longer before the next one.
+      if (dr.grew) {
+        dr.growFrames = glm::min(dr.growFrames * 2, DYNRES_MAX_GROW_FRAMES);
+      }
+      dr.grew = false;
+      dynres_set_scale(dr, dr.scale - DYNRES_STEP);
+    }
+    return;
+  }
+  dr.overBudget = 0;
+  if (dr.averageMs > dr.targetMs * DYNRES_MEETS_BUDGET) {
+    dr.withinBudget = 0;
+    return;
+  }
+  if (++dr.withinBudget < dr.growFrames) {
+    return;
+  }
+  if (dr.grew) {
+    // The last grow held for a whole wait.
+    dr.growFrames = glm::max(dr.growFrames / 2, DYNRES_GROW_FRAMES);
+  }
+  dr.withinBudget = 0;
+  if (dr.scale < DYNRES_MAX_SCALE) {
+    dr.grew = true;
+    dynres_set_scale(dr, dr.scale + DYNRES_STEP);
+  }
+}
+
+// Turning it off renders at full scale; turning it on starts from there.
+static void setDynamicResolutionEnabled(bool enabled) {
+  dynamic_resolution_t& dr = dynamicResolution;
+  dr.enabled = enabled && sg_query_features().msaa_render_targets;
+  dr.grew = false;
+  dr.growFrames = DYNRES_GROW_FRAMES;
+  dynres_set_scale(dr, DYNRES_MAX_SCALE);
+}
+
+static bool dynamicResolutionEnabled(void) {
+  return dynamicResolution.enabled;
+}
+
+static void setDynamicResolutionTarget(double targetMs) {
+  dynamicResolution.targetMs = targetMs;
+}
+
+static float dynamicResolutionScale(void) { return dynamicResolution.scale; }
+
+// Whether this device can render the scene with `aa`: multisampled render
+// targets, and as many samples as asked for. sokol has no query for the
+// sample count limit. On GL it comes from GL_MAX_SAMPLES, as sokol's GL
+// images report valid even when the multisampled renderbuffer was refused.
+// Elsewhere a small target is tried, which relies on the backend failing
+// image creation for a sample count it can't do.
+static bool sceneAntiAliasingSupported(scene_aa_t aa) {
+  int samples = scene_aa_samples[aa];
+  if (samples == 1) {
+    return true;
+  }
+  if (!sg_query_features().msaa_render_targets) {
+    return false;
+  }
+#if defined(DYNRES_GL_SAMPLE_LIMIT)
+  GLint maxSamples = 0;
+  glGetIntegerv(GL_MAX_SAMPLES, &maxSamples);
+  return samples <= maxSamples;
+#else
+  sg_image_desc imageDesc = {0};
+  imageDesc.render_target = true;
+  imageDesc.width = 16;
+  imageDesc.height = 16;
+  imageDesc.pixel_format = sg_query_desc().context.color_format;
+  imageDesc.sample_count = samples;
+  imageDesc.label = "scene-aa-probe";
+  sg_image probe = sg_make_image(&imageDesc);
+  bool valid = sg_query_image_state(probe) == SG_RESOURCESTATE_VALID;
+  sg_destroy_image(probe);
+  return valid;
+#endif
+}
+
+// Returns false, keeping the current mode, when `aa` is not supported.
+// Rebuild the scene pass's pipelines for sceneSampleCount() afterwards.
+static bool setSceneAntiAliasing(scene_aa_t aa) {
+  if (!sceneAntiAliasingSupported(aa)) {
+    return false;
+  }
+  dynamicResolution.aa = aa;
+  return true;
+}
+
+static scene_aa_t sceneAntiAliasing(void) { return dynamicResolution.aa; }
+
+static int sceneSampleCount(void) {
+  return scene_aa_samples[dynamicResolution.aa];
+}
+
+// The size to render the scene at, G-buffer included, for a frame of
+// `width` by `height`.
+static void dynamicResolutionSceneSize(int width,
+                                       int height,
+                                       int* sceneWidth,
+                                       int* sceneHeight) {
+  float scale = dynamicResolution.scale;
+  *sceneWidth = glm::max((int)lroundf((float)width * scale), 1);
+  *sceneHeight = glm::max((int)lroundf((float)height * scale), 1);
+}
+
+// Begins the pass the scene is drawn into, at the scene size for a frame of
+// `width` by `height`. End it with endScenePass().
+static void beginScenePass(const sg_pass_action* action,
+                           int width,
+                           int height) {
+  dynamic_resolution_t& dr = dynamicResolution;
+  int sceneWidth, sceneHeight;
+  dynamicResolutionSceneSize(width, height, &sceneWidth, &sceneHeight);
+  int samples = sceneSampleCount();
+  dr.frameWidth = width;
+  dr.frameHeight = height;
+  dr.offscreen = sceneWidth != width || sceneHeight != height ||
+                 samples != dr.frameSamples || dr.aa == SceneAA_FXAA;
+  if (!dr.offscreen) {
+    sg_begin_default_pass(action, width, height);
+    return;
+  }
+  if (sceneWidth != dr.width || sceneHeight != dr.height ||
+      samples != dr.samples) {
+    dynres_make_target(dr, sceneWidth, sceneHeight, samples);
+  }
+  sg_begin_pass(dr.pass, action);
+}
+
+// Ends the scene pass and, when it was offscreen, copies it into the
+// frame's default pass, upscaling and applying FXAA as needed.
+static void endScenePass(void) {
+  dynamic_resolution_t& dr = dynamicResolution;
+  sg_end_pass();
+  dr.stats.upscaleMs = 0.0;
+  if (!dr.offscreen) {
+    return;
+  }
+  uint64_t start = stm_now();
+  sg_pass_action action = {0};
+  action.colors[0].action = SG_ACTION_DONTCARE;
+  action.depth.action = SG_ACTION_DONTCARE;
+  sg_begin_default_pass(&action, dr.frameWidth, dr.frameHeight);
+  sg_apply_pipeline(dr.aa == SceneAA_FXAA ? dr.fxaaPip : dr.upscalePip);
+  sg_bindings bind = {0};
+  bind.vertex_buffers[0] = dr.screenTriangle;
+  bind.fs_images[SLOT_scene_texture] = dr.color;
+  sg_apply_bindings(&bind);
+  glm::vec4 outputSize((float)dr.frameWidth, (float)dr.frameHeight, 0.0f,
+                       0.0f);
+  if (dr.aa == SceneAA_FXAA) {
+    fxaa_fs_params_t fs_params = {};
+    fs_params.output_size = outputSize;
+    fs_params.scene_texel = glm::vec4(1.0f / (float)dr.width,
+                                      1.0f / (float)dr.height, 0.0f, 0.0f);
+    sg_apply_uniforms(SG_SHADERSTAGE_FS, SLOT_fxaa_fs_params,
+                      SG_RANGE(fs_params));
+  } else {
+    upscale_fs_params_t fs_params = {};
+    fs_params.output_size = outputSize;
+    sg_apply_uniforms(SG_SHADERSTAGE_FS, SLOT_upscale_fs_params,
+                      SG_RANGE(fs_params));
+  }
+  sg_draw(0, 3, 1);
+  sg_end_pass();
+  dr.stats.upscaleMs = stm_ms(stm_since(start));
+}
+
+static dynamic_resolution_stats_t dynamicResolutionStats(void) {
+  dynamic_resolution_t& dr = dynamicResolution;
+  dynamic_resolution_stats_t stats = dr.stats;
+  stats.scale = dr.scale;
+  stats.targetMs = dr.targetMs;
+  dynamicResolutionSceneSize(dr.frameWidth, dr.frameHeight,
+                             &stats.sceneWidth, &stats.sceneHeight);
+  return stats;
+}
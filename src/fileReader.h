@@ -0,0 +1,490 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__) && defined(DUNGEON_USE_IO_URING)
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <liburing.h>
+  #define FILE_READER_IO_URING
+#endif
+
+// Asynchronous whole-file reader, an alternative to sokol_fetch for loading
+// many small files. On Linux builds configured with DUNGEON_USE_IO_URING, the
+// opens and reads of every request that has a buffer are submitted to an
+// io_uring in one batch per fileReaderDoWork() call. Everywhere else (or if
+// the ring cannot be created) a small thread pool does blocking reads.
+//
+// A request can also ask for just a byte range of the file, which must lie
+// inside it.
+//
+// Files are read into caller-provided pooled buffers. Requests wait in FIFO
+// order until a buffer is free. Callbacks run on the main thread from
+// fileReaderDoWork(), once per request. As with sokol_fetch, the data is
+// only valid during the callback.
+
+#define FILE_READER_MAX_PATH (256)
+#define FILE_READER_MAX_REQUESTS (128)
+#define FILE_READER_DEFAULT_THREADS (4)
+
+typedef struct {
+  uint32_t id;
+} file_read_handle_t;
+
+typedef struct {
+  file_read_handle_t handle;
+  bool fetched;
+  bool failed;
+  bool cancelled;
+  const void* buffer_ptr;
+  size_t fetched_size;
+  const char* path;
+  void* userData;
+} file_read_response_t;
+
+typedef void (*file_read_cb)(const file_read_response_t* response);
+
+typedef struct {
+  // numBuffers consecutive buffers of bufferSize bytes, owned by the caller.
+  uint8_t* buffers;
+  int numBuffers;
+  size_t bufferSize;
+  // Only used by the thread-pool fallback; 0 picks the default.
+  int numThreads;
+} file_reader_desc_t;
+
+enum file_read_state_t {
+  FileRead_Free,
+  FileRead_Queued,
+  FileRead_Opening,
+  FileRead_Reading,
+  FileRead_Done,
+};
+
+typedef struct {
+  uint32_t id;
+  file_read_state_t state;
+  char path[FILE_READER_MAX_PATH];
+  file_read_cb callback;
+  void* userData;
+  // Of the requested range; `size` 0 reads the whole file.
+  uint64_t offset;
+  size_t size;
+  int buffer;
+  size_t filled;
+  bool failed;
+  bool cancelled;
+  int fd;
+} file_read_t;
+
+typedef struct {
+  file_reader_desc_t desc;
+  file_read_t requests[FILE_READER_MAX_REQUESTS];
+  uint32_t nextId;
+  std::deque<int> queued;
+  std::vector<int> freeBuffers;
+  std::vector<int> completed;
+  bool valid;
+#if defined(FILE_READER_IO_URING)
+  bool useRing;
+  struct io_uring ring;
+  int opsInFlight;
+#endif
+  // Thread-pool fallback.
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::deque<int> jobs;
+  std::vector<int> finished;
+  bool quit;
+} file_reader_t;
+
+static file_reader_t fileReader;
+
+static uint8_t* reader_buffer(const file_read_t* request) {
+  return fileReader.desc.buffers +
+         (size_t)request->buffer * fileReader.desc.bufferSize;
+}
+
+// Bytes the next read into `request`'s buffer may fill.
+static size_t reader_remaining(const file_read_t* request) {
+  size_t limit = fileReader.desc.bufferSize;
+  if (request->size > 0 && request->size < limit) {
+    limit = request->size;
+  }
+  return limit - request->filled;
+}
+
+static void reader_worker(void) {
+  for (;;) {
+    int index;
+    {
+      std::unique_lock<std::mutex> lock(fileReader.mutex);
+      fileReader.wake.wait(lock, [] {
+        return fileReader.quit || !fileReader.jobs.empty();
+      });
+      if (fileReader.quit) {
+        return;
+      }
+      index = fileReader.jobs.front();
+      fileReader.jobs.pop_front();
+    }
+    // The main thread leaves in-flight requests alone until they finish.
+    file_read_t* request = &fileReader.requests[index];
+    FILE* fp = fopen(request->path, "rb");
+    if (fp && request->size > 0) {
+      request->failed = request->size > fileReader.desc.bufferSize ||
+                        fseek(fp, (long)request->offset, SEEK_SET) != 0;
+      if (!request->failed) {
+        request->filled =
+            fread(reader_buffer(request), 1, request->size, fp);
+        request->failed = request->filled != request->size;
+      }
+      fclose(fp);
+    } else if (fp) {
+      request->filled =
+          fread(reader_buffer(request), 1, fileReader.desc.bufferSize, fp);
+      // A full buffer is only fine if the file ends right there.
+      request->failed = ferror(fp) ||
+                        (request->filled == fileReader.desc.bufferSize &&
+                         fgetc(fp) != EOF);
+      fclose(fp);
+    } else {
+      request->failed = true;
+    }
+    std::lock_guard<std::mutex> lock(fileReader.mutex);
+    fileReader.finished.push_back(index);
+  }
+}
+
+#if defined(FILE_READER_IO_URING)
+// Closes complete asynchronously and carry no request.
+#define FILE_READER_CLOSE_TAG (~(uint64_t)0)
+
+static struct io_uring_sqe* reader_get_sqe(void) {
+  struct io_uring_sqe* sqe = io_uring_get_sqe(&fileReader.ring);
+  if (!sqe) {
+    io_uring_submit(&fileReader.ring);
+    sqe = io_uring_get_sqe(&fileReader.ring);
+  }
+  if (sqe) {
+    fileReader.opsInFlight++;
+  }
+  return sqe;
+}
+
+static bool reader_submit_read(file_read_t* request, int index) {
+  struct io_uring_sqe* sqe = reader_get_sqe();
+  if (!sqe) {
+    return false;
+  }
+  io_uring_prep_read(sqe, request->fd, reader_buffer(request) + request->filled,
+                     (unsigned)reader_remaining(request),
+                     request->offset + request->filled);
+  io_uring_sqe_set_data(sqe, (void*)(uintptr_t)index);
+  request->state = FileRead_Reading;
+  return true;
+}
+
+static void reader_close(file_read_t* request) {
+  if (request->fd < 0) {
+    return;
+  }
+  struct io_uring_sqe* sqe = reader_get_sqe();
+  if (sqe) {
+    io_uring_prep_close(sqe, request->fd);
+    io_uring_sqe_set_data(sqe, (void*)(uintptr_t)FILE_READER_CLOSE_TAG);
+  } else {
+    close(request->fd);
+  }
+  request->fd = -1;
+}
+
+static void reader_ring_finish(file_read_t* request, int index, bool failed) {
+  request->failed = failed;
+  reader_close(request);
+  request->state = FileRead_Done;
+  fileReader.completed.push_back(index);
+}
+
+static void reader_ring_start(file_read_t* request, int index) {
+  struct io_uring_sqe* sqe = reader_get_sqe();
+  if (!sqe) {
+    reader_ring_finish(request, index, true);
+    return;
+  }
+  io_uring_prep_openat(sqe, AT_FDCWD, request->path, O_RDONLY, 0);
+  io_uring_sqe_set_data(sqe, (void*)(uintptr_t)index);
+  request->state = FileRead_Opening;
+}
+
+static void reader_ring_complete(uint64_t tag, int result) {
+  fileReader.opsInFlight--;
+  if (tag == FILE_READER_CLOSE_TAG) {
+    return;
+  }
+  int index = (int)tag;
+  file_read_t* request = &fileReader.requests[index];
+  if (request->state == FileRead_Opening) {
+    if (result < 0) {
+      reader_ring_finish(request, index, true);
+      return;
+    }
+    request->fd = result;
+    if (!reader_submit_read(request, index)) {
+      reader_ring_finish(request, index, true);
+    }
+    return;
+  }
+  if (result < 0) {
+    reader_ring_finish(request, index, true);
+    return;
+  }
+  size_t requested = reader_remaining(request);
+  request->filled += (size_t)result;
+  if (request->size > 0 && request->filled == request->size) {
+    reader_ring_finish(request, index, false);
+  } else if ((size_t)result < requested) {
+    // Short read on a regular file: end of file, which a range must not
+    // reach.
+    reader_ring_finish(request, index, request->size > 0);
+  } else if (request->filled == fileReader.desc.bufferSize) {
+    // Same limit as sokol_fetch: the file must fit the buffer.
+    reader_ring_finish(request, index, true);
+  } else if (!reader_submit_read(request, index)) {
+    reader_ring_finish(request, index, true);
+  }
+}
+
+static int reader_ring_reap(void) {
+  int reaped = 0;
+  struct io_uring_cqe* cqe;
+  while (io_uring_peek_cqe(&fileReader.ring, &cqe) == 0) {
+    uint64_t tag = (uint64_t)(uintptr_t)io_uring_cqe_get_data(cqe);
+    int result = cqe->res;
+    io_uring_cqe_seen(&fileReader.ring, cqe);
+    reader_ring_complete(tag, result);
+    reaped++;
+  }
+  return reaped;
+}
+#endif
+
+static bool fileReaderUsesIoUring(void) {
+#if defined(FILE_READER_IO_URING)
+  return fileReader.useRing;
+#else
+  return false;
+#endif
+}
+
+static bool initFileReader(const file_reader_desc_t& desc) {
+  if (!desc.buffers || desc.numBuffers <= 0 || desc.bufferSize == 0) {
+    return false;
+  }
+  fileReader.desc = desc;
+  fileReader.nextId = 1;
+  fileReader.quit = false;
+  for (int i = 0; i < FILE_READER_MAX_REQUESTS; i++) {
+    fileReader.requests[i].state = FileRead_Free;
+  }
+  fileReader.freeBuffers.clear();
+  for (int i = desc.numBuffers - 1; i >= 0; i--) {
+    fileReader.freeBuffers.push_back(i);
+  }
+#if defined(FILE_READER_IO_URING)
+  fileReader.opsInFlight = 0;
+  // Room for an open or read per buffer plus the closes trailing them.
+  fileReader.useRing =
+      io_uring_queue_init((unsigned)desc.numBuffers * 4, &fileReader.ring, 0) ==
+      0;
+  if (!fileReader.useRing)
+#endif
+  {
+    int numThreads =
+        desc.numThreads > 0 ? desc.numThreads : FILE_READER_DEFAULT_THREADS;
+    for (int i = 0; i < numThreads; i++) {
+      fileReader.workers.push_back(std::thread(reader_worker));
+    }
+  }
+  fileReader.valid = true;
+  return true;
+}
+
+static void destroyFileReader(void) {
+  if (!fileReader.valid) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(fileReader.mutex);
+    fileReader.quit = true;
+  }
+  fileReader.wake.notify_all();
+  for (std::thread& worker : fileReader.workers) {
+    worker.join();
+  }
+  fileReader.workers.clear();
+#if defined(FILE_READER_IO_URING)
+  if (fileReader.useRing) {
+    // Let in-flight operations land so no fd or buffer write outlives us.
+    while (fileReader.opsInFlight > 0) {
+      struct io_uring_cqe* cqe;
+      if (io_uring_wait_cqe(&fileReader.ring, &cqe) != 0) {
+        break;
+      }
+      uint64_t tag = (uint64_t)(uintptr_t)io_uring_cqe_get_data(cqe);
+      int result = cqe->res;
+      io_uring_cqe_seen(&fileReader.ring, cqe);
+      fileReader.opsInFlight--;
+      if (tag != FILE_READER_CLOSE_TAG && result >= 0 &&
+          fileReader.requests[tag].state == FileRead_Opening) {
+        close(result);
+      }
+    }
+    for (file_read_t& request : fileReader.requests) {
+      if (request.state == FileRead_Reading && request.fd >= 0) {
+        close(request.fd);
+      }
+    }
+    io_uring_queue_exit(&fileReader.ring);
+  }
+#endif
+  fileReader.queued.clear();
+  fileReader.jobs.clear();
+  fileReader.finished.clear();
+  fileReader.completed.clear();
+  fileReader.valid = false;
+}
+
+// Queues a read of the whole file at `path`, or of the `size` bytes at
+// `offset` if `size` is not 0. Returns a handle with id 0 if the reader is
+// not set up or too many requests are outstanding.
+static file_read_handle_t fileReaderSend(const char* path,
+                                         file_read_cb callback,
+                                         void* userData,
+                                         uint64_t offset = 0,
+                                         size_t size = 0) {
+  file_read_handle_t handle = {0};
+  if (!fileReader.valid) {
+    return handle;
+  }
+  for (int i = 0; i < FILE_READER_MAX_REQUESTS; i++) {
+    file_read_t* request = &fileReader.requests[i];
+    if (request->state != FileRead_Free) {
+      continue;
+    }
+    request->id = fileReader.nextId++;
+    request->state = FileRead_Queued;
+    snprintf(request->path, FILE_READER_MAX_PATH, "%s", path);
+    request->callback = callback;
+    request->userData = userData;
+    request->offset = offset;
+    request->size = size;
+    request->buffer = -1;
+    request->filled = 0;
+    request->failed = false;
+    request->cancelled = false;
+    request->fd = -1;
+    fileReader.queued.push_back(i);
+    handle.id = request->id;
+    return handle;
+  }
+  return handle;
+}
+
+// The request still completes through its callback, with `cancelled` and
+// `failed` set. Queued requests are dropped without touching the disk.
+static void fileReaderCancel(file_read_handle_t handle) {
+  for (file_read_t& request : fileReader.requests) {
+    if (request.state != FileRead_Free && request.id == handle.id) {
+      request.cancelled = true;
+      return;
+    }
+  }
+}
+
+// Call once per frame: starts queued requests that can get a buffer, reaps
+// finished I/O and runs the callbacks of completed requests.
+static void fileReaderDoWork(void) {
+  if (!fileReader.valid) {
+    return;
+  }
+  std::vector<int> started;
+  while (!fileReader.queued.empty()) {
+    int index = fileReader.queued.front();
+    file_read_t* request = &fileReader.requests[index];
+    if (request->cancelled) {
+      fileReader.queued.pop_front();
+      request->state = FileRead_Done;
+      fileReader.completed.push_back(index);
+      continue;
+    }
+    if (fileReader.freeBuffers.empty()) {
+      break;
+    }
+    fileReader.queued.pop_front();
+    request->buffer = fileReader.freeBuffers.back();
+    fileReader.freeBuffers.pop_back();
+    started.push_back(index);
+  }
+
+#if defined(FILE_READER_IO_URING)
+  if (fileReader.useRing) {
+    for (int index : started) {
+      reader_ring_start(&fileReader.requests[index], index);
+    }
+    // Page-cache hits often complete during submit, so keep chaining
+    // open -> read -> close within this call while completions arrive.
+    do {
+      io_uring_submit(&fileReader.ring);
+    } while (reader_ring_reap() > 0);
+  } else
+#endif
+  {
+    if (!started.empty()) {
+      std::lock_guard<std::mutex> lock(fileReader.mutex);
+      for (int index : started) {
+        fileReader.requests[index].state = FileRead_Reading;
+        fileReader.jobs.push_back(index);
+      }
+    }
+    fileReader.wake.notify_all();
+    std::lock_guard<std::mutex> lock(fileReader.mutex);
+    for (int index : fileReader.finished) {
+      fileReader.requests[index].state = FileRead_Done;
+      fileReader.completed.push_back(index);
+    }
+    fileReader.finished.clear();
+  }
+
+  std::vector<int> completed;
+  completed.swap(fileReader.completed);
+  for (int index : completed) {
+    file_read_t* request = &fileReader.requests[index];
+    file_read_response_t response = {};
+    response.handle.id = request->id;
+    response.cancelled = request->cancelled;
+    response.failed = request->cancelled || request->failed;
+    response.fetched = !response.failed;
+    if (response.fetched) {
+      response.buffer_ptr = reader_buffer(request);
+      response.fetched_size = request->filled;
+    }
+    response.path = request->path;
+    response.userData = request->userData;
+    if (request->callback) {
+      request->callback(&response);
+    }
+    if (request->buffer >= 0) {
+      fileReader.freeBuffers.push_back(request->buffer);
+    }
+    request->state = FileRead_Free;
+  }
+}
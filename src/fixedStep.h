@@ -0,0 +1,99 @@
+#pragma once
+
+#include <stdint.h>
+#include "sokol_time.h"
+
+// Fixed-step simulation clock. Each frame hands beginFixedStep() the real
+// time since the last one; it banks the time and fixedStepNext() then
+// returns true once per whole step owed, so the simulation always advances
+// by the same step whatever the frame rate:
+//
+//   beginFixedStep(frameSeconds);
+//   while (fixedStepNext()) {
+//     simulate(fixedStepSeconds());
+//   }
+//   render(lerp(previous, current, fixedStepAlpha()));
+//
+// The time left over, less than a step, is fixedStepAlpha() of the way from
+// the previous step's state to the current one, so the frame draws between
+// the two instead of snapping to whole steps.
+//
+// After a long frame (a hitch, a breakpoint, the window being dragged) the
+// steps owed are capped, so catching up can't make the next frame longer
+// still; the time past the cap is dropped and the simulation runs slow.
+
+#define FIXED_STEP_DEFAULT_HZ (60)
+#define FIXED_STEP_MAX_CATCH_UP (5)
+
+typedef struct {
+  // Of the last frame.
+  int steps;
+  double simMs;
+  // Real time that frame dropped past the catch-up cap.
+  double droppedMs;
+} fixed_step_stats_t;
+
+typedef struct {
+  double stepSeconds;
+  int maxSteps;
+  double accumulator;
+  int pending;
+  uint64_t tick;
+  uint64_t simStart;
+  fixed_step_stats_t stats;
+} fixed_step_t;
+
+static fixed_step_t fixedStep;
+
+// `hz` steps per second, running at most `maxSteps` of them a frame.
+static void initFixedStep(int hz, int maxSteps) {
+  fixed_step_t& fs = fixedStep;
+  fs = fixed_step_t();
+  fs.stepSeconds = 1.0 / hz;
+  fs.maxSteps = maxSteps;
+}
+
+static void beginFixedStep(double frameSeconds) {
+  fixed_step_t& fs = fixedStep;
+  fs.accumulator += frameSeconds > 0.0 ? frameSeconds : 0.0;
+  int owed = (int)(fs.accumulator / fs.stepSeconds);
+  fs.stats = {};
+  if (owed > fs.maxSteps) {
+    double dropped = (owed - fs.maxSteps) * fs.stepSeconds;
+    fs.accumulator -= dropped;
+    fs.stats.droppedMs = dropped * 1000.0;
+    owed = fs.maxSteps;
+  }
+  fs.pending = owed;
+  fs.simStart = stm_now();
+}
+
+// True while another step is owed this frame; run it before asking again.
+static bool fixedStepNext(void) {
+  fixed_step_t& fs = fixedStep;
+  if (fs.pending == 0) {
+    fs.stats.simMs = stm_ms(stm_since(fs.simStart));
+    return false;
+  }
+  fs.pending--;
+  fs.accumulator -= fs.stepSeconds;
+  fs.tick++;
+  fs.stats.steps++;
+  return true;
+}
+
+static double fixedStepSeconds(void) { return fixedStep.stepSeconds; }
+
+// From 0 at the previous step's state to 1 at the current one's.
+static float fixedStepAlpha(void) {
+  fixed_step_t& fs = fixedStep;
+  float alpha = (float)(fs.accumulator / fs.stepSeconds);
+  return alpha < 0.0f ? 0.0f : (alpha < 1.0f ? alpha : 1.0f);
+}
+
+// Simulated seconds up to the current step.
+static double fixedStepTime(void) {
+  return (double)fixedStep.tick * fixedStep.stepSeconds;
+}
+
+static fixed_step_stats_t fixedStepStats(void) { return fixedStep.stats; }
@@ -0,0 +1,356 @@
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "sokol_gfx.h"
+#include "sokol_time.h"
+
+// Voxel-style light levels over the tile grid for dynamic and carried
+// lights. Each open tile holds a 0..FLOOD_LIGHT_MAX level per color
+// channel that drops by one per tile walked from the source, so light flows
+// around corners but not through solid tiles. Changes are incremental: a
+// removed source clears the levels it produced with a removal BFS, which
+// queues the border tiles still lit by something else, and an add BFS
+// refills from there. Only the affected neighbourhood is touched.
+//
+// The levels are uploaded as an RGBA8 grid texture (rgb brightness, a set
+// on open tiles) that the phong shader filters across open tiles only.
+
+#define FLOOD_LIGHT_MAX (15)
+#define FLOOD_LIGHT_CHANNELS (3)
+#define INVALID_FLOOD_LIGHT (-1)
+
+typedef struct {
+  int x;
+  int z;
+  uint8_t level[FLOOD_LIGHT_CHANNELS];
+  bool active;
+} flood_source_t;
+
+typedef struct {
+  uint32_t tile;
+  uint8_t level;
+} flood_node_t;
+
+typedef struct {
+  // Tiles touched by the last update, and how long it took.
+  int visited;
+  double updateUs;
+  double worstUpdateUs;
+} flood_light_stats_t;
+
+typedef struct {
+  int width;
+  int length;
+  std::vector<uint8_t> open;
+  // Per tile and channel: current level and strongest source on the tile.
+  std::vector<uint8_t> levels;
+  std::vector<uint8_t> emission;
+  std::vector<flood_source_t> sources;
+  std::vector<int> freeSources;
+  std::vector<flood_node_t> removeQueue;
+  std::vector<uint32_t> addQueue;
+  std::vector<uint8_t> texels;
+  sg_image image;
+  bool dirty;
+  flood_light_stats_t stats;
+} flood_light_t;
+
+static flood_light_t floodLight;
+
+// Brightness per level; each step loses 20%, like block light in voxel
+// games.
+static uint8_t floodLightCurve[FLOOD_LIGHT_MAX + 1];
+
+static uint8_t& flood_level(uint32_t tile, int channel) {
+  return floodLight.levels[tile * FLOOD_LIGHT_CHANNELS + channel];
+}
+
+static uint32_t flood_neighbors(uint32_t tile, uint32_t out[4]) {
+  const flood_light_t& fl = floodLight;
+  int x = (int)(tile % fl.width), z = (int)(tile / fl.width);
+  uint32_t count = 0;
+  if (x > 0) out[count++] = tile - 1;
+  if (x < fl.width - 1) out[count++] = tile + 1;
+  if (z > 0) out[count++] = tile - fl.width;
+  if (z < fl.length - 1) out[count++] = tile + fl.width;
+  return count;
+}
+
+static void flood_propagate(int channel) {
+  flood_light_t& fl = floodLight;
+  uint32_t neighbors[4];
+  for (size_t head = 0; head < fl.addQueue.size(); head++) {
+    uint32_t tile = fl.addQueue[head];
+    uint8_t level = flood_level(tile, channel);
+    fl.stats.visited++;
+    if (level <= 1) {
+      continue;
+    }
+    uint32_t count = flood_neighbors(tile, neighbors);
+    for (uint32_t i = 0; i < count; i++) {
+      uint32_t next = neighbors[i];
+      if (fl.open[next] && flood_level(next, channel) + 1 < level) {
+        flood_level(next, channel) = level - 1;
+        fl.addQueue.push_back(next);
+      }
+    }
+  }
+  fl.addQueue.clear();
+}
+
+// Clears what `tile`'s current level lit, then refills from the edges of
+// the cleared region and from any sources inside it.
+static void flood_remove(uint32_t tile, int channel) {
+  flood_light_t& fl = floodLight;
+  uint32_t neighbors[4];
+  fl.removeQueue.clear();
+  fl.removeQueue.push_back({tile, flood_level(tile, channel)});
+  flood_level(tile, channel) = 0;
+  for (size_t head = 0; head < fl.removeQueue.size(); head++) {
+    flood_node_t node = fl.removeQueue[head];
+    fl.stats.visited++;
+    uint8_t emitted = fl.emission[node.tile * FLOOD_LIGHT_CHANNELS + channel];
+    if (emitted > 0 && fl.open[node.tile]) {
+      flood_level(node.tile, channel) = emitted;
+      fl.addQueue.push_back(node.tile);
+    }
+    uint32_t count = flood_neighbors(node.tile, neighbors);
+    for (uint32_t i = 0; i < count; i++) {
+      uint32_t next = neighbors[i];
+      uint8_t level = flood_level(next, channel);
+      if (level != 0 && level < node.level) {
+        flood_level(next, channel) = 0;
+        fl.removeQueue.push_back({next, level});
+      } else if (level >= node.level) {
+        // Lit from elsewhere; it seeds the refill.
+        fl.addQueue.push_back(next);
+      }
+    }
+  }
+  flood_propagate(channel);
+}
+
+static void flood_set_emission(uint32_t tile) {
+  flood_light_t& fl = floodLight;
+  uint8_t strongest[FLOOD_LIGHT_CHANNELS] = {0, 0, 0};
+  int x = (int)(tile % fl.width), z = (int)(tile / fl.width);
+  for (const flood_source_t& source : fl.sources) {
+    if (!source.active || source.x != x || source.z != z) {
+      continue;
+    }
+    for (int c = 0; c < FLOOD_LIGHT_CHANNELS; c++) {
+      if (source.level[c] > strongest[c]) {
+        strongest[c] = source.level[c];
+      }
+    }
+  }
+  for (int c = 0; c < FLOOD_LIGHT_CHANNELS; c++) {
+    uint8_t& emitted = fl.emission[tile * FLOOD_LIGHT_CHANNELS + c];
+    uint8_t old = emitted;
+    emitted = strongest[c];
+    if (strongest[c] < old) {
+      flood_remove(tile, c);
+    } else if (strongest[c] > flood_level(tile, c) && fl.open[tile]) {
+      flood_level(tile, c) = strongest[c];
+      fl.addQueue.push_back(tile);
+      flood_propagate(c);
+    }
+  }
+}
+
+static void flood_begin_update(void) {
+  floodLight.stats.visited = 0;
+}
+
+static void flood_end_update(uint64_t start) {
+  flood_light_stats_t& stats = floodLight.stats;
+  stats.updateUs = stm_us(stm_since(start));
+  if (stats.updateUs > stats.worstUpdateUs) {
+    stats.worstUpdateUs = stats.updateUs;
+  }
+  floodLight.dirty = true;
+}
+
+static bool flood_in_grid(int x, int z) {
+  return x >= 0 && z >= 0 && x < floodLight.width && z < floodLight.length;
+}
+
+// `layout` is indexed [x][z] with 0 for solid tiles, like Dungeon::create.
+static void initFloodLight(const std::vector<std::vector<uint16_t>>& layout) {
+  flood_light_t& fl = floodLight;
+  fl.width = (int)layout.size();
+  fl.length = fl.width > 0 ? (int)layout[0].size() : 0;
+  size_t tiles = (size_t)fl.width * fl.length;
+  fl.open.assign(tiles, 0);
+  for (int x = 0; x < fl.width; x++) {
+    for (int z = 0; z < fl.length; z++) {
+      fl.open[(size_t)z * fl.width + x] = layout[x][z] != 0;
+    }
+  }
+  fl.levels.assign(tiles * FLOOD_LIGHT_CHANNELS, 0);
+  fl.emission.assign(tiles * FLOOD_LIGHT_CHANNELS, 0);
+  fl.texels.assign(tiles * 4, 0);
+  fl.removeQueue.reserve(tiles);
+  fl.addQueue.reserve(tiles);
+  fl.stats = {};
+  fl.dirty = true;
+  for (int level = 0; level <= FLOOD_LIGHT_MAX; level++) {
+    float brightness = powf(0.8f, (float)(FLOOD_LIGHT_MAX - level));
+    floodLightCurve[level] =
+        level == 0 ? 0 : (uint8_t)(255.0f * brightness + 0.5f);
+  }
+
+  sg_image_desc imageDesc = {0};
+  imageDesc.width = fl.width;
+  imageDesc.height = fl.length;
+  imageDesc.usage = SG_USAGE_DYNAMIC;
+  imageDesc.pixel_format = SG_PIXELFORMAT_RGBA8;
+  imageDesc.min_filter = SG_FILTER_NEAREST;
+  imageDesc.mag_filter = SG_FILTER_NEAREST;
+  imageDesc.wrap_u = SG_WRAP_CLAMP_TO_EDGE;
+  imageDesc.wrap_v = SG_WRAP_CLAMP_TO_EDGE;
+  imageDesc.label = "flood-light";
+  fl.image = sg_make_image(&imageDesc);
+}
+
+static void destroyFloodLight(void) {
+  sg_destroy_image(floodLight.image);
+  floodLight = flood_light_t();
+}
+
+// Adds a light source on tile (x, z) with a 0..FLOOD_LIGHT_MAX level per
+// channel.
+static int addFloodLight(int x, int z, uint8_t r, uint8_t g, uint8_t b) {
+  flood_light_t& fl = floodLight;
+  if (!flood_in_grid(x, z)) {
+    return INVALID_FLOOD_LIGHT;
+  }
+  uint64_t start = stm_now();
+  flood_begin_update();
+  flood_source_t source = {x, z, {r, g, b}, true};
+  for (uint8_t& level : source.level) {
+    level = level > FLOOD_LIGHT_MAX ? FLOOD_LIGHT_MAX : level;
+  }
+  int id;
+  if (!fl.freeSources.empty()) {
+    id = fl.freeSources.back();
+    fl.freeSources.pop_back();
+    fl.sources[id] = source;
+  } else {
+    id = (int)fl.sources.size();
+    fl.sources.push_back(source);
+  }
+  flood_set_emission((uint32_t)(z * fl.width + x));
+  flood_end_update(start);
+  return id;
+}
+
+static void removeFloodLight(int id) {
+  flood_light_t& fl = floodLight;
+  if (id < 0 || id >= (int)fl.sources.size() || !fl.sources[id].active) {
+    return;
+  }
+  uint64_t start = stm_now();
+  flood_begin_update();
+  flood_source_t& source = fl.sources[id];
+  source.active = false;
+  fl.freeSources.push_back(id);
+  flood_set_emission((uint32_t)(source.z * fl.width + source.x));
+  flood_end_update(start);
+}
+
+// Moves a source to tile (x, z). Cheap enough to call every frame; it does
+// nothing until the light crosses into another tile.
+static void moveFloodLight(int id, int x, int z) {
+  flood_light_t& fl = floodLight;
+  if (id < 0 || id >= (int)fl.sources.size() || !fl.sources[id].active ||
+      !flood_in_grid(x, z)) {
+    return;
+  }
+  flood_source_t& source = fl.sources[id];
+  if (source.x == x && source.z == z) {
+    return;
+  }
+  uint64_t start = stm_now();
+  flood_begin_update();
+  uint32_t from = (uint32_t)(source.z * fl.width + source.x);
+  source.x = x;
+  source.z = z;
+  // Light the new tile first so the removal refills against it.
+  flood_set_emission((uint32_t)(z * fl.width + x));
+  flood_set_emission(from);
+  flood_end_update(start);
+}
+
+// Opens or fills in tile (x, z) and relights around it.
+static void setFloodTileOpen(int x, int z, bool open) {
+  flood_light_t& fl = floodLight;
+  if (!flood_in_grid(x, z)) {
+    return;
+  }
+  uint32_t tile = (uint32_t)(z * fl.width + x);
+  if ((fl.open[tile] != 0) == open) {
+    return;
+  }
+  uint64_t start = stm_now();
+  flood_begin_update();
+  fl.open[tile] = open;
+  uint32_t neighbors[4];
+  for (int c = 0; c < FLOOD_LIGHT_CHANNELS; c++) {
+    if (!open) {
+      flood_remove(tile, c);
+      continue;
+    }
+    // Pull light in from the neighbours, plus anything emitted here.
+    uint8_t emitted = fl.emission[tile * FLOOD_LIGHT_CHANNELS + c];
+    if (emitted > 0) {
+      flood_level(tile, c) = emitted;
+      fl.addQueue.push_back(tile);
+    }
+    uint32_t count = flood_neighbors(tile, neighbors);
+    for (uint32_t i = 0; i < count; i++) {
+      if (flood_level(neighbors[i], c) > 1) {
+        fl.addQueue.push_back(neighbors[i]);
+      }
+    }
+    flood_propagate(c);
+  }
+  flood_end_update(start);
+}
+
+// Light level of tile (x, z) for one channel.
+static uint8_t floodLightLevel(int x, int z, int channel) {
+  if (!flood_in_grid(x, z)) {
+    return 0;
+  }
+  return flood_level((uint32_t)(z * floodLight.width + x), channel);
+}
+
+// Uploads the grid texture if anything changed. Call once per frame outside
+// a pass.
+static void updateFloodLight(void) {
+  flood_light_t& fl = floodLight;
+  if (!fl.dirty || fl.width == 0) {
+    return;
+  }
+  size_t tiles = (size_t)fl.width * fl.length;
+  for (size_t tile = 0; tile < tiles; tile++) {
+    uint8_t* texel = &fl.texels[tile * 4];
+    for (int c = 0; c < FLOOD_LIGHT_CHANNELS; c++) {
+      texel[c] = floodLightCurve[fl.levels[tile * FLOOD_LIGHT_CHANNELS + c]];
+    }
+    texel[3] = fl.open[tile] ? 255 : 0;
+  }
+  sg_image_data data = {0};
+  data.subimage[0][0].ptr = fl.texels.data();
+  data.subimage[0][0].size = fl.texels.size();
+  sg_update_image(fl.image, data);
+  fl.dirty = false;
+}
+
+static flood_light_stats_t floodLightStats(void) {
+  return floodLight.stats;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 64-bit FNV-1a, shared by the asset pack's name index, the procedural
+// texture cache key and the texture registry's content hashes. Pass the
+// result of one call as `hash` to continue over more bytes.
+
+#define FNV_HASH_INIT (0xcbf29ce484222325ull)
+#define FNV_HASH_PRIME (0x100000001b3ull)
+
+static inline uint64_t fnvHash(const void* data,
+                               size_t size,
+                               uint64_t hash = FNV_HASH_INIT) {
+  const uint8_t* bytes = (const uint8_t*)data;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= FNV_HASH_PRIME;
+  }
+  return hash;
+}
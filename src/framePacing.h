@@ -0,0 +1,199 @@
+#pragma once
+
+#include <stdint.h>
+#include <chrono>
+#include <thread>
+#include "sokol_time.h"
+
+// Frame pacing and input latency. Under vsync a frame that starts as soon
+// as the last one is presented samples its input most of a refresh before
+// that input can reach the screen. In low-latency mode beginPacedFrame()
+// first sleeps until only the frame's expected work, plus a margin, is left
+// of the refresh, and the caller samples input after it returns:
+//
+//   beginPacedFrame();
+//   poll input, simulate, build the view, draw
+//   sg_commit();
+//   submitPacedFrame();
+//   present
+//   presentedPacedFrame();
+//
+// The expected work is how long recent frames took from beginPacedFrame()
+// to submitPacedFrame(); it rises at once to a slower frame and decays
+// back slowly, so one spike doesn't make the next frame miss its refresh.
+//
+// Input events are stamped with framePacingInput(), and submitPacedFrame()
+// and presentedPacedFrame() measure from the earliest one since the last
+// submit. An event polled from a window system queue is only seen when the
+// poll runs, long after it may have arrived, so around a poll
+// beginInputPoll() and endInputPoll() let framePacingPolledInput() stamp
+// it halfway between the end of the previous poll and the start of this
+// one instead: the mean arrival time, if input arrives at random. That
+// counts the time events wait in the queue, which is what polling late
+// saves.
+
+// Slack left between the expected end of the frame's work and vsync.
+#define FRAME_PACING_MARGIN_MS (1.5)
+// Sleeps can overshoot by about this much, so the last of a wait spins.
+#define FRAME_PACING_SPIN_MS (1.0)
+#define FRAME_PACING_WORK_DECAY (0.05)
+
+typedef struct {
+  // Since the last resetFramePacingStats().
+  int frames;
+  int inputFrames;
+  // Means over frames with input, and over all frames. Input to present
+  // only counts with presentedPacedFrame() being called.
+  double latencyMs;
+  double maxLatencyMs;
+  double presentLatencyMs;
+  double sleepMs;
+  // The current expected work per frame.
+  double workMs;
+} frame_pacing_stats_t;
+
+typedef struct {
+  bool lowLatency;
+  double periodMs;
+  double workMs;
+  bool presented;
+  uint64_t presentTime;
+  uint64_t frameStart;
+  bool polled;
+  uint64_t pollStart;
+  uint64_t pollEnd;
+  bool input;
+  uint64_t firstInput;
+  // The earliest input of the frame submitted but not yet presented.
+  bool submittedInput;
+  uint64_t submittedFirstInput;
+  int presentInputFrames;
+  double latencySumMs;
+  double presentLatencySumMs;
+  double sleepSumMs;
+  frame_pacing_stats_t stats;
+} frame_pacing_t;
+
+static frame_pacing_t framePacing;
+
+// `periodMs` is the display's refresh period, e.g. 1000 / 60.
+static void initFramePacing(double periodMs) {
+  frame_pacing_t& fp = framePacing;
+  fp = frame_pacing_t();
+  fp.periodMs = periodMs;
+}
+
+static void setLowLatencyMode(bool enabled) {
+  framePacing.lowLatency = enabled;
+}
+
+static bool lowLatencyMode(void) { return framePacing.lowLatency; }
+
+// Stamps an input event with when it arrived, from stm_now().
+static void framePacingInput(uint64_t timestamp) {
+  frame_pacing_t& fp = framePacing;
+  if (!fp.input || timestamp < fp.firstInput) {
+    fp.firstInput = timestamp;
+  }
+  fp.input = true;
+}
+
+// Around polling the window system for events.
+static void beginInputPoll(void) { framePacing.pollStart = stm_now(); }
+
+static void endInputPoll(void) {
+  framePacing.pollEnd = stm_now();
+  framePacing.polled = true;
+}
+
+// Stamps an event seen by the poll in progress with its estimated arrival,
+// between the end of the previous poll and the start of this one.
+static void framePacingPolledInput(void) {
+  frame_pacing_t& fp = framePacing;
+  if (!fp.polled) {
+    framePacingInput(fp.pollStart);
+    return;
+  }
+  framePacingInput(fp.pollEnd + stm_diff(fp.pollStart, fp.pollEnd) / 2);
+}
+
+static void beginPacedFrame(void) {
+  frame_pacing_t& fp = framePacing;
+  uint64_t start = stm_now();
+  if (fp.lowLatency && fp.presented) {
+    double waitMs = fp.periodMs - fp.workMs - FRAME_PACING_MARGIN_MS;
+    double sleepMs = waitMs - stm_ms(stm_since(fp.presentTime));
+    if (sleepMs > FRAME_PACING_SPIN_MS) {
+      std::this_thread::sleep_for(std::chrono::microseconds(
+          (int64_t)((sleepMs - FRAME_PACING_SPIN_MS) * 1000.0)));
+    }
+    while (stm_ms(stm_since(fp.presentTime)) < waitMs) {
+      std::this_thread::yield();
+    }
+  }
+  fp.frameStart = stm_now();
+  fp.sleepSumMs += stm_ms(stm_diff(fp.frameStart, start));
+}
+
+// Right after sg_commit().
+static void submitPacedFrame(void) {
+  frame_pacing_t& fp = framePacing;
+  uint64_t now = stm_now();
+  double workMs = stm_ms(stm_diff(now, fp.frameStart));
+  if (workMs > fp.workMs) {
+    fp.workMs = workMs;
+  } else {
+    fp.workMs += (workMs - fp.workMs) * FRAME_PACING_WORK_DECAY;
+  }
+  fp.stats.frames++;
+  fp.submittedInput = fp.input;
+  fp.submittedFirstInput = fp.firstInput;
+  if (fp.input) {
+    double latencyMs = stm_ms(stm_diff(now, fp.firstInput));
+    fp.latencySumMs += latencyMs;
+    if (latencyMs > fp.stats.maxLatencyMs) {
+      fp.stats.maxLatencyMs = latencyMs;
+    }
+    fp.stats.inputFrames++;
+    fp.input = false;
+  }
+}
+
+// Right after the present returns, which under vsync is about when the
+// refresh started.
+static void presentedPacedFrame(void) {
+  frame_pacing_t& fp = framePacing;
+  fp.presentTime = stm_now();
+  fp.presented = true;
+  if (fp.submittedInput) {
+    fp.presentLatencySumMs +=
+        stm_ms(stm_diff(fp.presentTime, fp.submittedFirstInput));
+    fp.presentInputFrames++;
+    fp.submittedInput = false;
+  }
+}
+
+static frame_pacing_stats_t framePacingStats(void) {
+  frame_pacing_t& fp = framePacing;
+  frame_pacing_stats_t stats = fp.stats;
+  if (stats.inputFrames > 0) {
+    stats.latencyMs = fp.latencySumMs / stats.inputFrames;
+  }
+  if (fp.presentInputFrames > 0) {
+    stats.presentLatencyMs = fp.presentLatencySumMs / fp.presentInputFrames;
+  }
+  if (stats.frames > 0) {
+    stats.sleepMs = fp.sleepSumMs / stats.frames;
+  }
+  stats.workMs = fp.workMs;
+  return stats;
+}
+
+static void resetFramePacingStats(void) {
+  frame_pacing_t& fp = framePacing;
+  fp.stats = {};
+  fp.latencySumMs = 0.0;
+  fp.presentLatencySumMs = 0.0;
+  fp.presentInputFrames = 0;
+  fp.sleepSumMs = 0.0;
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <stdint.h>
+#include <condition_variable>
+#include <mutex>
+#include <utility>
+#include "glm/glm.hpp"
+#include "dungeon.h"
+#include "fixedStep.h"
+
+// Triple-buffered frame snapshots, handed from the simulation thread to
+// the render thread. A snapshot holds everything the render thread needs
+// from the simulation for one frame, so while it submits frame N the
+// simulation thread steps and culls frame N + 1:
+//
+//   simulation thread                 render thread
+//   while (snapshot = begin...()) {   snapshot = acquireFrameSnapshot();
+//     fill *snapshot                  draw from *snapshot
+//     publishFrameSnapshot();         sg_commit();
+//   }
+//
+// The three slots are the one the render thread draws from, the newest
+// published one and the one being filled, so neither side ever waits on
+// the other's slot. The simulation only starts a snapshot once the render
+// thread has taken the last one, staying at most a frame ahead instead of
+// simulating frames that are never drawn.
+
+typedef struct {
+  // Published snapshots before this one.
+  uint64_t frame;
+  // Where the player is as of the last step, which carries the light.
+  glm::vec3 playerPos;
+  // The interpolated eye the frame is drawn from.
+  glm::vec3 viewPos;
+  glm::mat4 viewproj;
+  // Vertical field of view, in degrees.
+  float fovY;
+  // Simulated seconds at the frame's point between steps.
+  double lightTime;
+  DungeonVisibleSet visible;
+  fixed_step_stats_t steps;
+  // Stepping, culling and filling in the snapshot, on the simulation
+  // thread.
+  double buildMs;
+} frame_snapshot_t;
+
+typedef struct {
+  frame_snapshot_t slots[3];
+  int drawing;
+  int latest;
+  int filling;
+  uint64_t published;
+  // A snapshot was published that the render thread hasn't taken yet.
+  bool fresh;
+  bool quit;
+  std::mutex mutex;
+  std::condition_variable taken;
+  std::condition_variable ready;
+} frame_snapshots_t;
+
+static frame_snapshots_t frameSnapshots;
+
+static void initFrameSnapshots(void) {
+  frame_snapshots_t& fs = frameSnapshots;
+  fs.drawing = 0;
+  fs.latest = 1;
+  fs.filling = 2;
+  fs.published = 0;
+  fs.fresh = false;
+  fs.quit = false;
+}
+
+// Simulation thread: waits until the render thread has taken the last
+// snapshot, then returns the slot to fill; nullptr once stopped.
+static frame_snapshot_t* beginFrameSnapshot(void) {
+  frame_snapshots_t& fs = frameSnapshots;
+  std::unique_lock<std::mutex> lock(fs.mutex);
+  fs.taken.wait(lock, [] {
+    return !frameSnapshots.fresh || frameSnapshots.quit;
+  });
+  if (fs.quit) {
+    return nullptr;
+  }
+  frame_snapshot_t* snapshot = &fs.slots[fs.filling];
+  snapshot->frame = fs.published;
+  return snapshot;
+}
+
+// Simulation thread: makes the filled slot the newest snapshot. Does
+// nothing once stopped.
+static void publishFrameSnapshot(void) {
+  frame_snapshots_t& fs = frameSnapshots;
+  {
+    std::lock_guard<std::mutex> lock(fs.mutex);
+    if (fs.quit) {
+      return;
+    }
+    std::swap(fs.filling, fs.latest);
+    fs.published++;
+    fs.fresh = true;
+  }
+  fs.ready.notify_one();
+}
+
+// Render thread: the newest snapshot, which stays valid until the next
+// call. Only waits before the first one is published; after that a slow
+// simulation means drawing the last snapshot again.
+static const frame_snapshot_t* acquireFrameSnapshot(void) {
+  frame_snapshots_t& fs = frameSnapshots;
+  {
+    std::unique_lock<std::mutex> lock(fs.mutex);
+    fs.ready.wait(lock, [] {
+      return frameSnapshots.fresh || frameSnapshots.published > 0;
+    });
+    if (!fs.fresh) {
+      return &fs.slots[fs.drawing];
+    }
+    std::swap(fs.drawing, fs.latest);
+    fs.fresh = false;
+  }
+  fs.taken.notify_one();
+  return &fs.slots[fs.drawing];
+}
+
+// Wakes the simulation thread out of beginFrameSnapshot() for good.
+static void stopFrameSnapshots(void) {
+  frame_snapshots_t& fs = frameSnapshots;
+  {
+    std::lock_guard<std::mutex> lock(fs.mutex);
+    fs.quit = true;
+    fs.fresh = false;
+  }
+  fs.taken.notify_all();
+}
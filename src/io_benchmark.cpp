@@ -0,0 +1,187 @@
+// Asset read benchmark: loads every file listed in assets.yml through
+// sokol_fetch and through the file reader (io_uring when built with
+// DUNGEON_USE_IO_URING, thread pool otherwise), with a cold and a warm page
+// cache.
+//
+//   io-benchmark <assets.yml> <source dir> [--runs N]
+//
+// Cold runs evict each file from the page cache with posix_fadvise() first,
+// which only works on Linux. Elsewhere they are reported as warm. Failed
+// reads are counted over all runs of a row.
+#define SOKOL_FETCH_IMPL
+#include "sokol_fetch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+  #include <fcntl.h>
+  #include <unistd.h>
+#endif
+
+#include "assetList.h"
+#include "fileReader.h"
+
+#define BENCH_NUM_CHANNELS (4)
+#define BENCH_NUM_LANES (8)
+#define BENCH_BUFFER_SIZE (10 * 1024 * 1024)
+
+static uint8_t buffers[BENCH_NUM_CHANNELS * BENCH_NUM_LANES]
+                      [BENCH_BUFFER_SIZE];
+
+typedef struct {
+  int completed;
+  int failed;
+  uint64_t bytes;
+} bench_result_t;
+
+static bench_result_t result;
+static bool readerUsedIoUring = false;
+
+static bool drop_page_cache(const std::vector<std::string>& paths) {
+#if defined(__linux__)
+  for (const std::string& path : paths) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      continue;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+  }
+  return true;
+#else
+  (void)paths;
+  return false;
+#endif
+}
+
+static void fetch_callback(const sfetch_response_t* response) {
+  if (response->dispatched) {
+    sfetch_bind_buffer(
+        response->handle,
+        buffers[response->channel * BENCH_NUM_LANES + response->lane],
+        BENCH_BUFFER_SIZE);
+  }
+  if (response->fetched) {
+    result.bytes += response->fetched_size;
+  }
+  if (response->finished) {
+    result.completed++;
+    result.failed += response->failed ? 1 : 0;
+  }
+}
+
+static void reader_callback(const file_read_response_t* response) {
+  if (response->fetched) {
+    result.bytes += response->fetched_size;
+  }
+  result.completed++;
+  result.failed += response->failed ? 1 : 0;
+}
+
+static double run_fetch(const std::vector<std::string>& paths) {
+  sfetch_desc_t desc = {0};
+  desc.num_channels = BENCH_NUM_CHANNELS;
+  desc.num_lanes = BENCH_NUM_LANES;
+  desc.max_requests = (uint32_t)paths.size() + 1;
+  sfetch_setup(&desc);
+  result = {};
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < paths.size(); i++) {
+    sfetch_request_t request = {0};
+    request.path = paths[i].c_str();
+    request.channel = (uint32_t)(i % BENCH_NUM_CHANNELS);
+    request.callback = fetch_callback;
+    sfetch_send(&request);
+  }
+  while (result.completed < (int)paths.size()) {
+    sfetch_dowork();
+    std::this_thread::yield();
+  }
+  double ms = std::chrono::duration<double, std::milli>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
+  sfetch_shutdown();
+  return ms;
+}
+
+static double run_reader(const std::vector<std::string>& paths) {
+  file_reader_desc_t desc = {0};
+  desc.buffers = &buffers[0][0];
+  desc.numBuffers = BENCH_NUM_CHANNELS * BENCH_NUM_LANES;
+  desc.bufferSize = BENCH_BUFFER_SIZE;
+  desc.numThreads = BENCH_NUM_CHANNELS;
+  initFileReader(desc);
+  readerUsedIoUring = fileReaderUsesIoUring();
+  result = {};
+  auto start = std::chrono::steady_clock::now();
+  size_t sent = 0;
+  while (result.completed < (int)paths.size()) {
+    // The reader holds at most FILE_READER_MAX_REQUESTS at a time.
+    while (sent < paths.size() &&
+           fileReaderSend(paths[sent].c_str(), reader_callback, nullptr).id) {
+      sent++;
+    }
+    fileReaderDoWork();
+    std::this_thread::yield();
+  }
+  double ms = std::chrono::duration<double, std::milli>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
+  destroyFileReader();
+  return ms;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 3) {
+    fprintf(stderr,
+            "usage: io-benchmark <assets.yml> <source dir> [--runs N]\n");
+    return 1;
+  }
+  int runs = 5;
+  for (int i = 3; i + 1 < argc; i++) {
+    if (strcmp(argv[i], "--runs") == 0) {
+      runs = atoi(argv[i + 1]);
+    }
+  }
+  std::vector<std::string> paths;
+  for (const std::string& file : readAssetList(argv[1])) {
+    paths.push_back(std::string(argv[2]) + "/" + file);
+  }
+  if (paths.empty()) {
+    fprintf(stderr, "io-benchmark: no files listed in %s\n", argv[1]);
+    return 1;
+  }
+
+  printf("io-benchmark: %zu files, %d runs\n", paths.size(), runs);
+  for (int cold = 1; cold >= 0; cold--) {
+    for (int backend = 0; backend < 2; backend++) {
+      double best = 1e30, total = 0.0;
+      int failed = 0;
+      for (int run = 0; run < runs; run++) {
+        bool dropped = cold && drop_page_cache(paths);
+        if (cold && !dropped && run == 0) {
+          printf("  (page cache eviction unsupported, cold == warm)\n");
+        }
+        double ms = backend == 0 ? run_fetch(paths) : run_reader(paths);
+        best = ms < best ? ms : best;
+        total += ms;
+        failed += result.failed;
+      }
+      const char* name = backend == 0 ? "sokol_fetch"
+                         : readerUsedIoUring ? "io_uring"
+                                             : "thread pool";
+      printf("  %-4s %-12s best %8.2f ms  avg %8.2f ms  %7.1f MB/s  "
+             "%d/%zu reads failed\n",
+             cold ? "cold" : "warm", name, best, total / runs,
+             (double)result.bytes / (1024.0 * 1024.0) / (best / 1000.0),
+             failed, paths.size() * (size_t)runs);
+    }
+  }
+  return 0;
+}
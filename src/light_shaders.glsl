@@ -38,44 +38,182 @@ void main() {
 
 @program surface surfaceVS surfaceFS
 
+// shared by the forward (phong) and deferred (gbuffer) surface shaders,
+// which declare the uniforms and samplers these read
+@block surface_shading
+// baked static lighting is stored / LIGHTMAP_RANGE (see lightmapBaker.h)
+#define LIGHTMAP_RANGE 2.0
+
+// single-step parallax offset from the material's packed height
+vec2 parallax_uv(vec2 uv, vec3 view_dir, vec3 t, vec3 b, vec3 n) {
+    vec3 view_ts = vec3(dot(view_dir, t), dot(view_dir, b), dot(view_dir, n));
+    float height = texture(surface_texture, uv).b - 0.5;
+    vec2 offset = view_ts.xy / max(view_ts.z, 0.25) * height * parallax_scale;
+    return uv + vec2(offset.x, -offset.y);
+}
+
+// material surface map: normal.xy in rg, height in b (see material.h)
+vec3 surface_normal(vec2 uv, vec3 t, vec3 b, vec3 n) {
+    vec2 nxy = texture(surface_texture, uv).rg * 2.0 - 1.0;
+    float nz = sqrt(max(1.0 - dot(nxy, nxy), 0.0));
+    return normalize(t * nxy.x + b * nxy.y + n * nz);
+}
+
+// bilinear over the four nearest tile centers of a flood light texture
+// (see floodLight.h), skipping solid tiles so walls don't darken the light
+// next to them
+vec3 sample_flood_light(sampler2D flood, vec2 xz) {
+    vec2 g = (xz - cluster_grid.xy) * cluster_grid.z - 0.5;
+    vec2 base = floor(g);
+    vec2 f = g - base;
+    vec4 sum = vec4(0.0);
+    for (int i = 0; i < 4; ++i) {
+        vec2 corner = vec2(float(i - (i / 2) * 2), float(i / 2));
+        vec2 cell = clamp(base + corner, vec2(0.0), cluster_dims.xy - 1.0);
+        vec4 s = texture(flood, (cell + 0.5) / cluster_dims.xy);
+        vec2 w2 = mix(vec2(1.0) - f, f, corner);
+        float w = w2.x * w2.y * s.a;
+        sum += vec4(s.rgb * w, w);
+    }
+    return sum.w > 0.0 ? sum.rgb / sum.w : vec3(0.0);
+}
+@end
+
+@block point_lighting
+struct point_light_t {
+    vec3 position;
+    float radius;
+    float constant;
+    float linear;
+    float quadratic;
+    vec3 ambient;
+    vec3 diffuse;
+    vec3 specular;
+};
+
+vec3 calc_point_light(point_light_t light, vec3 normal, vec3 frag_pos, vec3 view_dir, vec3 albedo, float shininess) {
+    vec3 light_dir = normalize(light.position - frag_pos);
+    // diffuse shading
+    float diff = max(dot(normal, light_dir), 0.0);
+    // specular shading
+    vec3 reflect_dir = reflect(-light_dir, normal);
+    float spec = pow(max(dot(view_dir, reflect_dir), 0.0), shininess);
+    // attenuation
+    float distance    = length(light.position - frag_pos);
+    float attenuation = 1.0 / (light.constant + light.linear * distance +
+  			     light.quadratic * (distance * distance));
+    // fade to zero at the light's radius so cluster borders don't show
+    float falloff = clamp(1.0 - pow(distance / light.radius, 4.0), 0.0, 1.0);
+    attenuation *= falloff * falloff;
+    // combine results
+    vec3 ambient  = light.ambient  * albedo;
+    vec3 diffuse  = light.diffuse  * diff * albedo;
+    vec3 specular = light.specular * spec;// * vec3(texture(specular_texture, tex_coords));
+    ambient  *= attenuation;
+    diffuse  *= attenuation;
+    specular *= attenuation;
+    return (ambient + diffuse + specular);
+}
+@end
+
+@block octahedral
+// unit normals folded onto an octahedron and unwrapped to [-1, 1]^2, so two
+// half floats hold them
+vec2 oct_wrap(vec2 v) {
+    return (1.0 - abs(v.yx)) * vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+}
+
+vec2 oct_encode(vec3 n) {
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    return n.z >= 0.0 ? n.xy : oct_wrap(n.xy);
+}
+
+vec3 oct_decode(vec2 e) {
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    if (n.z < 0.0) {
+        n.xy = oct_wrap(n.xy);
+    }
+    return normalize(n);
+}
+@end
+
+@block distance_fog
+// linear fog from fog_params.x to the far plane, fog_params.y being
+// 1 / (far - start), so geometry fades out before it is clipped
+vec3 apply_fog(vec3 color, float distance, vec4 fog_color, vec4 fog_params) {
+    float fog = clamp((distance - fog_params.x) * fog_params.y, 0.0, 1.0);
+    return mix(color, fog_color.rgb, fog);
+}
+@end
+
 @vs vs
 layout (location=0) in vec3 a_pos;
 layout (location=1) in vec2 a_tex_coords;
+// corner ambient occlusion level in x, quantised to 0..3 / 3 at mesh time
+layout (location=2) in vec4 a_ao;
 
 out vec3 frag_pos;
 out vec3 normal;
+out vec3 tangent;
+out vec3 bitangent;
 out vec2 tex_coords;
+out vec2 lightmap_coords;
+out float ambient_occlusion;
 
 uniform lighting_vs_params {
     mat4 viewproj;
     mat4 model;
-    vec3 a_normal;
+    // the face's rect in the lightmap atlas: offset in xy, scale in zw
+    vec4 lightmap_rect;
 };
 
+// must match depth_vs bit for bit, the shading pass tests EQUAL against it
+invariant gl_Position;
+
 void main() {
     gl_Position = viewproj * model * vec4(a_pos, 1.0);
     frag_pos = vec3(model * vec4(a_pos, 1.0));
-    // inverse tranpose is left out because:
-    // (a) glsl es 1.0 (webgl 1.0) doesn't have inverse and transpose functions
-    // (b) we're not performing non-uniform scale
-    normal = mat3(model) * a_normal;
+    // surfaces are quads in the model's xy plane with u along +x and
+    // v running down -y, so the tangent frame comes from the model matrix
+    tangent = mat3(model) * vec3(1.0, 0.0, 0.0);
+    bitangent = mat3(model) * vec3(0.0, 1.0, 0.0);
+    // the surface scale matrices flatten z, so the normal can't be
+    // transformed like the other axes; it is the quad's facing instead
+    normal = cross(tangent, bitangent);
     tex_coords = a_tex_coords;
+    // texcoords repeat per tile on merged quads; the lightmap rect covers
+    // the whole quad
+    lightmap_coords = lightmap_rect.xy + vec2(a_pos.x + 0.5, 0.5 - a_pos.y) * lightmap_rect.zw;
+    ambient_occlusion = mix(0.35, 1.0, a_ao.x);
 }
 @end
 
 @fs fs
 in vec3 frag_pos;
 in vec3 normal;
+in vec3 tangent;
+in vec3 bitangent;
 in vec2 tex_coords;
+in vec2 lightmap_coords;
+in float ambient_occlusion;
 
 out vec4 frag_color;
 
 uniform lighting_fs_params {
     vec3 view_pos;
     float material_shininess;
+    float parallax_scale;
+    // rgb: fog color, xy of params: see apply_fog()
+    vec4 fog_color;
+    vec4 fog_params;
 };
 
 uniform sampler2D diffuse_texture;
+uniform sampler2D surface_texture;
+uniform sampler2D lightmap_texture;
+// per-tile flood light brightness in rgb, a = 1 on open tiles (see
+// floodLight.h); shares the cluster grid
+uniform sampler2D flood_light_texture;
 // uniform sampler2D specular_texture;
 
 // uniform fs_dir_light {
@@ -85,24 +223,27 @@ uniform sampler2D diffuse_texture;
 //     vec3 specular;
 // } dir_light;
 
-// #define NR_POINT_LIGHTS 4  
+// clustered point lights, see clusteredLights.h for the texture layouts
+uniform cluster_fs_params {
+    // xy: world xz of cell (0, 0)'s corner, z: 1 / cell size
+    vec4 cluster_grid;
+    // xy: grid size in cells
+    vec4 cluster_dims;
+};
 
-// using arrays of vec4 to avoid alignment issues with cross shader compilation
-// uniform fs_point_lights {
-//     vec4 position[NR_POINT_LIGHTS];  
-//     vec4 ambient[NR_POINT_LIGHTS];
-//     vec4 diffuse[NR_POINT_LIGHTS];
-//     vec4 specular[NR_POINT_LIGHTS];
-//     vec4 attenuation[NR_POINT_LIGHTS];
-// } point_lights;
+uniform sampler2D cluster_texture;
+uniform sampler2D light_index_texture;
+uniform sampler2D light_texture;
 
-uniform fs_point_light {
-    vec3 position;
-    vec3 ambient;
-    vec3 diffuse;
-    vec3 specular;
-    vec3 attenuation;
-} point_light;
+// must match CLUSTER_MAX_CELL_LIGHTS, CLUSTER_INDEX_* and
+// CLUSTER_MAX_LIGHTS / CLUSTER_LIGHT_ROWS in clusteredLights.h
+#define MAX_CLUSTER_LIGHTS 64
+#define LIGHT_INDEX_SIZE vec2(1024.0, 32.0)
+#define LIGHT_TEXTURE_SIZE vec2(1024.0, 3.0)
+
+@include_block surface_shading
+@include_block point_lighting
+@include_block distance_fog
 
 // uniform fs_spot_light {
 //     vec3 position;
@@ -123,16 +264,6 @@ uniform fs_point_light {
 //     vec3 specular;
 // };  
 
-struct point_light_t {    
-    vec3 position;
-    float constant;
-    float linear;
-    float quadratic;  
-    vec3 ambient;
-    vec3 diffuse;
-    vec3 specular;
-};
-
 // struct spot_light_t {
 //     vec3 position;
 //     vec3 direction;
@@ -147,30 +278,50 @@ struct point_light_t {
 // };
 
 // dir_light_t get_directional_light();
-// point_light_t get_point_light_from_index(int index);
-point_light_t get_point_light();
+point_light_t get_cluster_light(float index);
 // spot_light_t get_spot_light();
 
 // vec3 calc_dir_light(dir_light_t light, vec3 normal, vec3 view_dir);
-vec3 calc_point_light(point_light_t light, vec3 normal, vec3 frag_pos, vec3 view_dir);
 // vec3 calc_spot_light(spot_light_t light, vec3 normal, vec3 frag_pos, vec3 view_dir);
 
 void main() {
     // properties
-    vec3 norm = normalize(normal);
+    vec3 n = normalize(normal);
+    vec3 t = normalize(tangent);
+    vec3 b = normalize(bitangent);
     vec3 view_dir = normalize(view_pos - frag_pos);
 
-    // phase 1: Directional lighting
-    vec3 result = vec3(0.0f);
+    vec2 uv = parallax_uv(tex_coords, view_dir, t, b, n);
+    vec3 norm = surface_normal(uv, t, b, n);
+    vec3 albedo = texture(diffuse_texture, uv).rgb;
+
+    // phase 1: Baked static lights, then directional lighting
+    vec3 result = albedo * texture(lightmap_texture, lightmap_coords).rgb * LIGHTMAP_RANGE;
+    result += albedo * sample_flood_light(flood_light_texture, frag_pos.xz + n.xz * 0.05);
     // calc_dir_light(get_directional_light(), norm, view_dir);
-    // phase 2: Point lights
-    // for(int i = 0; i < NR_POINT_LIGHTS; ++i) {
-    result += calc_point_light(get_point_light(), norm, frag_pos, view_dir);
-    // }
+    // phase 2: Point lights in this fragment's cluster. The lookup is
+    // nudged along the normal so walls on a cell border pick the open cell.
+    vec2 cell = floor((frag_pos.xz + n.xz * 0.05 - cluster_grid.xy) * cluster_grid.z);
+    cell = clamp(cell, vec2(0.0), cluster_dims.xy - 1.0);
+    vec4 cluster = texture(cluster_texture, (cell + 0.5) / cluster_dims.xy);
+    int count = int(cluster.y);
+    // constant bound with an early out keeps glsl es 1.0 happy; the data
+    // textures have a single level, so sampling in the loop needs no lod
+    for (int i = 0; i < MAX_CLUSTER_LIGHTS; ++i) {
+        if (i >= count) {
+            break;
+        }
+        float slot = cluster.x + float(i);
+        vec2 at = vec2(mod(slot, LIGHT_INDEX_SIZE.x), floor(slot / LIGHT_INDEX_SIZE.x));
+        float index = texture(light_index_texture, (at + 0.5) / LIGHT_INDEX_SIZE).r;
+        result += calc_point_light(get_cluster_light(index), norm, frag_pos, view_dir, albedo, material_shininess);
+    }
     // phase 3: Spot light
     // result += calc_spot_light(get_spot_light(), norm, frag_pos, view_dir);
     
-    frag_color = vec4(result, 1.0);
+    float view_distance = length(view_pos - frag_pos);
+    frag_color = vec4(apply_fog(result * ambient_occlusion, view_distance,
+                                fog_color, fog_params), 1.0);
 }
 
 // dir_light_t get_directional_light() {
@@ -182,36 +333,23 @@ void main() {
 //     );
 // }
 
-point_light_t get_point_light() {
+point_light_t get_cluster_light(float index) {
+    float u = (index + 0.5) / LIGHT_TEXTURE_SIZE.x;
+    vec4 position = texture(light_texture, vec2(u, 0.5 / LIGHT_TEXTURE_SIZE.y));
+    vec4 color = texture(light_texture, vec2(u, 1.5 / LIGHT_TEXTURE_SIZE.y));
+    vec4 attenuation = texture(light_texture, vec2(u, 2.5 / LIGHT_TEXTURE_SIZE.y));
     return point_light_t(
-                point_light.position.xyz,
-                point_light.attenuation.x,
-                point_light.attenuation.y,
-                point_light.attenuation.z,
-                point_light.ambient.xyz,
-                point_light.diffuse.xyz,
-                point_light.specular.xyz
+                position.xyz,
+                position.w,
+                attenuation.x,
+                attenuation.y,
+                attenuation.z,
+                color.rgb * color.a,
+                color.rgb,
+                color.rgb
             );
 }
 
-// point_light_t get_point_light_from_index(int index) {
-//     for (int i = 0; i < NR_POINT_LIGHTS; ++i) {
-//         // workaround because gles2 only allows dynamic array indices
-//         // with constant expressions or loop indices
-//         if (i == index) {
-//             return point_light_t(
-//                 point_lights.position[i].xyz,
-//                 point_lights.attenuation[i].x,
-//                 point_lights.attenuation[i].y,
-//                 point_lights.attenuation[i].z,
-//                 point_lights.ambient[i].xyz,
-//                 point_lights.diffuse[i].xyz,
-//                 point_lights.specular[i].xyz
-//             );
-//         }
-//     }
-// }
-
 // spot_light_t get_spot_light() {
 //     return spot_light_t(
 //         spot_light.position,
@@ -241,27 +379,6 @@ point_light_t get_point_light() {
 //     return (ambient + diffuse + specular);
 // }
 
-vec3 calc_point_light(point_light_t light, vec3 normal, vec3 frag_pos, vec3 view_dir) {
-    vec3 light_dir = normalize(light.position - frag_pos);
-    // diffuse shading
-    float diff = max(dot(normal, light_dir), 0.0);
-    // specular shading
-    vec3 reflect_dir = reflect(-light_dir, normal);
-    float spec = pow(max(dot(view_dir, reflect_dir), 0.0), material_shininess);
-    // attenuation
-    float distance    = length(light.position - frag_pos);
-    float attenuation = 1.0 / (light.constant + light.linear * distance + 
-  			     light.quadratic * (distance * distance));    
-    // combine results
-    vec3 ambient  = light.ambient  * vec3(texture(diffuse_texture, tex_coords));
-    vec3 diffuse  = light.diffuse  * diff * vec3(texture(diffuse_texture, tex_coords));
-    vec3 specular = light.specular * spec;// * vec3(texture(specular_texture, tex_coords));
-    ambient  *= attenuation;
-    diffuse  *= attenuation;
-    specular *= attenuation;
-    return (ambient + diffuse + specular);
-}
-
 // vec3 calc_spot_light(spot_light_t light, vec3 normal, vec3 frag_pos, vec3 view_dir) {
 //     vec3 light_dir = normalize(light.position - frag_pos);
 //     // diffuse shading
@@ -287,6 +404,289 @@ vec3 calc_point_light(point_light_t light, vec3 normal, vec3 frag_pos, vec3 view
 // }
 @end
 
+// deferred path (see deferredLighting.h): the gbuffer program reuses the
+// phong vertex shader and writes surface attributes plus the baked and
+// flood lighting; deferred_light adds the point lights over them one light
+// volume at a time, and deferred_compose copies the result to the screen
+@fs gbuffer_fs
+in vec3 frag_pos;
+in vec3 normal;
+in vec3 tangent;
+in vec3 bitangent;
+in vec2 tex_coords;
+in vec2 lightmap_coords;
+in float ambient_occlusion;
+
+// albedo in rgb, ambient occlusion in a
+layout(location=0) out vec4 gbuffer_albedo;
+// octahedral normal in xy, distance from the eye in z, coverage in w
+layout(location=1) out vec4 gbuffer_normal;
+// static lighting, which the light pass accumulates onto
+layout(location=2) out vec4 gbuffer_light;
+
+uniform lighting_fs_params {
+    vec3 view_pos;
+    float material_shininess;
+    float parallax_scale;
+    // rgb: fog color, xy of params: see apply_fog()
+    vec4 fog_color;
+    vec4 fog_params;
+};
+
+uniform cluster_fs_params {
+    vec4 cluster_grid;
+    vec4 cluster_dims;
+};
+
+// same material slots as phong; the rest are laid out differently there,
+// so they get their own names
+uniform sampler2D diffuse_texture;
+uniform sampler2D surface_texture;
+uniform sampler2D gbuffer_lightmap_texture;
+uniform sampler2D gbuffer_flood_texture;
+
+@include_block surface_shading
+@include_block octahedral
+
+void main() {
+    vec3 n = normalize(normal);
+    vec3 t = normalize(tangent);
+    vec3 b = normalize(bitangent);
+    vec3 to_eye = view_pos - frag_pos;
+    vec3 view_dir = normalize(to_eye);
+
+    vec2 uv = parallax_uv(tex_coords, view_dir, t, b, n);
+    vec3 norm = surface_normal(uv, t, b, n);
+    vec3 albedo = texture(diffuse_texture, uv).rgb;
+
+    vec3 result = albedo * texture(gbuffer_lightmap_texture, lightmap_coords).rgb * LIGHTMAP_RANGE;
+    result += albedo * sample_flood_light(gbuffer_flood_texture, frag_pos.xz + n.xz * 0.05);
+
+    gbuffer_albedo = vec4(albedo, ambient_occlusion);
+    gbuffer_normal = vec4(oct_encode(norm), length(to_eye), 1.0);
+    gbuffer_light = vec4(result * ambient_occlusion, 1.0);
+}
+@end
+
+@vs deferred_light_vs
+// unit cube corner, scaled to the light's radius
+layout(location=0) in vec3 a_pos;
+// per instance, see deferredLighting.h
+layout(location=1) in vec4 a_light_position;
+layout(location=2) in vec4 a_light_color;
+layout(location=3) in vec4 a_light_attenuation;
+
+uniform deferred_vs_params {
+    mat4 viewproj;
+};
+
+out vec3 volume_pos;
+out vec4 light_position;
+out vec4 light_color;
+out vec4 light_attenuation;
+
+void main() {
+    volume_pos = a_light_position.xyz + a_pos * a_light_position.w;
+    gl_Position = viewproj * vec4(volume_pos, 1.0);
+    light_position = a_light_position;
+    light_color = a_light_color;
+    light_attenuation = a_light_attenuation;
+}
+@end
+
+@fs deferred_light_fs
+in vec3 volume_pos;
+in vec4 light_position;
+in vec4 light_color;
+in vec4 light_attenuation;
+
+out vec4 frag_color;
+
+uniform deferred_fs_params {
+    vec3 view_pos;
+    float material_shininess;
+    // xy: gbuffer size in pixels
+    vec4 gbuffer_size;
+    // as in lighting_fs_params, applied by deferred_compose
+    vec4 fog_color;
+    vec4 fog_params;
+};
+
+uniform sampler2D gbuffer_albedo_texture;
+uniform sampler2D gbuffer_normal_texture;
+
+@include_block point_lighting
+@include_block octahedral
+
+void main() {
+    // render targets share the framebuffer's origin on every backend, so
+    // the fragment coordinate addresses the gbuffer directly
+    vec2 uv = gl_FragCoord.xy / gbuffer_size.xy;
+    vec4 normal_depth = texture(gbuffer_normal_texture, uv);
+    if (normal_depth.w == 0.0) {
+        discard;
+    }
+    // the surface lies along the eye ray through this volume fragment
+    vec3 ray = normalize(volume_pos - view_pos);
+    vec3 frag_pos = view_pos + ray * normal_depth.z;
+    vec4 albedo = texture(gbuffer_albedo_texture, uv);
+    point_light_t light = point_light_t(
+                light_position.xyz,
+                light_position.w,
+                light_attenuation.x,
+                light_attenuation.y,
+                light_attenuation.z,
+                light_color.rgb * light_color.a,
+                light_color.rgb,
+                light_color.rgb
+            );
+    vec3 result = calc_point_light(light, oct_decode(normal_depth.xy), frag_pos, -ray, albedo.rgb, material_shininess);
+    frag_color = vec4(result * albedo.a, 1.0);
+}
+@end
+
+@vs deferred_compose_vs
+layout(location=0) in vec2 a_pos;
+
+void main() {
+    gl_Position = vec4(a_pos, 0.5, 1.0);
+}
+@end
+
+@fs deferred_compose_fs
+out vec4 frag_color;
+
+uniform deferred_fs_params {
+    vec3 view_pos;
+    float material_shininess;
+    vec4 gbuffer_size;
+    vec4 fog_color;
+    vec4 fog_params;
+};
+
+uniform sampler2D gbuffer_light_texture;
+// after the light texture so it keeps deferred_light_fs's slot
+uniform sampler2D gbuffer_normal_texture;
+
+@include_block distance_fog
+
+void main() {
+    vec2 uv = gl_FragCoord.xy / gbuffer_size.xy;
+    vec3 light = texture(gbuffer_light_texture, uv).rgb;
+    // fogged by distance from the eye where a surface was drawn; the clear
+    // color is left alone
+    vec4 normal_depth = texture(gbuffer_normal_texture, uv);
+    vec3 fogged = apply_fog(light, normal_depth.z, fog_color, fog_params);
+    frag_color = vec4(mix(light, fogged, normal_depth.w), 1.0);
+}
+@end
+
+// depth-only prepass: positions only, from the same vertex buffers and
+// uniforms as vs
+@vs depth_vs
+layout (location=0) in vec3 a_pos;
+
+uniform lighting_vs_params {
+    mat4 viewproj;
+    mat4 model;
+    vec4 lightmap_rect;
+};
+
+invariant gl_Position;
+
+void main() {
+    gl_Position = viewproj * model * vec4(a_pos, 1.0);
+}
+@end
+
+@fs depth_fs
+void main() {
+}
+@end
+
+// stretches the scene, rendered at a reduced resolution, over the frame
+@vs upscale_vs
+layout(location=0) in vec2 a_pos;
+
+void main() {
+    gl_Position = vec4(a_pos, 0.5, 1.0);
+}
+@end
+
+@fs upscale_fs
+uniform upscale_fs_params {
+    // xy: frame size in pixels
+    vec4 output_size;
+};
+
+uniform sampler2D scene_texture;
+
+out vec4 frag_color;
+
+void main() {
+    vec2 uv = gl_FragCoord.xy / output_size.xy;
+    frag_color = vec4(texture(scene_texture, uv).rgb, 1.0);
+}
+@end
+
+// upscale with FXAA (the well-known reduced version of Lottes' FXAA): each
+// pixel blurs along the edge direction found from the luma of its diagonal
+// neighbours, unless that overshoots the neighbourhood's luma range
+@fs fxaa_fs
+uniform fxaa_fs_params {
+    // xy: frame size in pixels
+    vec4 output_size;
+    // xy: 1 / scene size in pixels
+    vec4 scene_texel;
+};
+
+uniform sampler2D scene_texture;
+
+out vec4 frag_color;
+
+#define FXAA_REDUCE_MIN (1.0 / 128.0)
+#define FXAA_REDUCE_MUL (1.0 / 8.0)
+#define FXAA_SPAN_MAX 8.0
+
+float luma(vec3 color) {
+    return dot(color, vec3(0.299, 0.587, 0.114));
+}
+
+vec3 scene(vec2 uv) {
+    return texture(scene_texture, uv).rgb;
+}
+
+void main() {
+    vec2 uv = gl_FragCoord.xy / output_size.xy;
+    vec2 texel = scene_texel.xy;
+    float luma_nw = luma(scene(uv + vec2(-1.0, -1.0) * texel));
+    float luma_ne = luma(scene(uv + vec2(1.0, -1.0) * texel));
+    float luma_sw = luma(scene(uv + vec2(-1.0, 1.0) * texel));
+    float luma_se = luma(scene(uv + vec2(1.0, 1.0) * texel));
+    float luma_m = luma(scene(uv));
+    float luma_min = min(luma_m, min(min(luma_nw, luma_ne),
+                                     min(luma_sw, luma_se)));
+    float luma_max = max(luma_m, max(max(luma_nw, luma_ne),
+                                     max(luma_sw, luma_se)));
+
+    vec2 dir = vec2(-((luma_nw + luma_ne) - (luma_sw + luma_se)),
+                    (luma_nw + luma_sw) - (luma_ne + luma_se));
+    float reduce = max((luma_nw + luma_ne + luma_sw + luma_se) *
+                       (0.25 * FXAA_REDUCE_MUL), FXAA_REDUCE_MIN);
+    float rcp_dir_min = 1.0 / (min(abs(dir.x), abs(dir.y)) + reduce);
+    dir = clamp(dir * rcp_dir_min, vec2(-FXAA_SPAN_MAX),
+                vec2(FXAA_SPAN_MAX)) * texel;
+
+    vec3 rgb_a = 0.5 * (scene(uv + dir * (1.0 / 3.0 - 0.5)) +
+                        scene(uv + dir * (2.0 / 3.0 - 0.5)));
+    vec3 rgb_b = rgb_a * 0.5 + 0.25 * (scene(uv - dir * 0.5) +
+                                       scene(uv + dir * 0.5));
+    float luma_b = luma(rgb_b);
+    vec3 result = (luma_b < luma_min || luma_b > luma_max) ? rgb_a : rgb_b;
+    frag_color = vec4(result, 1.0);
+}
+@end
+
 @vs light_cube_vs
 in vec3 a_pos;
 
@@ -310,4 +710,10 @@ void main() {
 @end
 
 @program phong vs fs
+@program gbuffer vs gbuffer_fs
+@program depth_only depth_vs depth_fs
+@program upscale upscale_vs upscale_fs
+@program fxaa upscale_vs fxaa_fs
+@program deferred_light deferred_light_vs deferred_light_fs
+@program deferred_compose deferred_compose_vs deferred_compose_fs
 @program light_cube light_cube_vs light_cube_fs
@@ -0,0 +1,521 @@
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "glm/glm.hpp"
+#include "clusteredLights.h"
+
+// CPU lightmap baker for static lights. Every face gets a rect in one atlas
+// sized by texel density; each texel traces shadow rays to the lights that
+// reach its tile with a 2D DDA over the tile grid (walls are whole tiles,
+// floor and ceiling are two planes), and can gather one diffuse bounce from
+// the direct result. Faces are spread over worker threads.
+//
+// Faces are the dungeon's meshed quads, unit quads in their model's xy
+// plane that may span several tiles (see dungeon.h). A vertex's lightmap
+// UV is its corner of the quad mapped into the face's rect.
+
+// Lighting is stored as value / LIGHTMAP_RANGE in RGBA8 so surfaces can be
+// lit past full albedo; light_shaders.glsl scales it back.
+#define LIGHTMAP_RANGE (2.0f)
+#define LIGHTMAP_DEFAULT_DENSITY (8.0f)
+#define LIGHTMAP_MAX_WIDTH (4096)
+// Border texels around each rect so bilinear filtering does not bleed.
+#define LIGHTMAP_PADDING (1)
+
+typedef struct {
+  // Tile occupancy indexed [x][z]; 0 is solid.
+  const std::vector<std::vector<uint16_t>>* layout;
+  // World xz of tile (0, 0)'s corner, and the tile size.
+  float originX;
+  float originZ;
+  float cellSize;
+  float floorY;
+  float ceilingY;
+  // Face model matrices; faces are unit quads in the model's xy plane.
+  const glm::mat4* faces;
+  uint32_t numFaces;
+  // The first numCoarseFaces faces are low-detail stand-ins for the rest:
+  // they bake at coarseTexelsPerUnit and bounce rays never land on them.
+  uint32_t numCoarseFaces;
+  float coarseTexelsPerUnit;
+  const cluster_light_t* lights;
+  uint32_t numLights;
+  float texelsPerUnit;
+  // Rays per texel for the bounce; 0 bakes direct light only.
+  uint32_t bounceSamples;
+  // Stand-in reflectance for every surface, since albedo maps live on the
+  // GPU.
+  float bounceAlbedo;
+  // 0 uses every hardware thread.
+  uint32_t numThreads;
+} lightmap_bake_desc_t;
+
+typedef struct {
+  uint32_t width;
+  uint32_t height;
+  // RGBA8, malloc'ed; the caller owns it.
+  uint8_t* pixels;
+  // Per face: uv offset in xy, uv scale in zw.
+  std::vector<glm::vec4> rects;
+  uint64_t texels;
+  uint64_t rays;
+  double bakeMs;
+} lightmap_t;
+
+typedef struct {
+  glm::vec3 origin;
+  glm::vec3 along;
+  glm::vec3 up;
+  glm::vec3 normal;
+  // Inner rect in atlas texels, and where its texels start in the direct
+  // light buffer.
+  uint32_t x, y, w, h;
+  uint32_t texelOffset;
+} lm_face_t;
+
+// Face slots per tile, named by the direction a ray travels to hit them.
+enum lm_slot_t {
+  LmSlot_NegX,
+  LmSlot_PosX,
+  LmSlot_NegZ,
+  LmSlot_PosZ,
+  LmSlot_Down,
+  LmSlot_Up,
+  LmSlot_Count,
+};
+
+typedef struct {
+  const lightmap_bake_desc_t* desc;
+  int width;
+  int length;
+  std::vector<lm_face_t> faces;
+  // Face index per tile and slot, -1 where a tile has no such face.
+  std::vector<int32_t> faceAt;
+  // Lights whose radius reaches each tile.
+  std::vector<std::vector<uint32_t>> tileLights;
+  std::vector<glm::vec3> direct;
+  std::atomic<uint64_t> rays;
+} lm_scene_t;
+
+typedef struct {
+  float t;
+  int tileX;
+  int tileZ;
+  lm_slot_t slot;
+} lm_hit_t;
+
+static bool lm_open(const lm_scene_t& scene, int x, int z) {
+  if (x < 0 || z < 0 || x >= scene.width || z >= scene.length) {
+    return false;
+  }
+  return (*scene.desc->layout)[x][z] != 0;
+}
+
+// Marches from `from`, inside an open tile, along normalized `dir` and
+// reports the first wall, floor or ceiling closer than `maxT`.
+static bool lm_trace(const lm_scene_t& scene,
+                     glm::vec3 from,
+                     glm::vec3 dir,
+                     float maxT,
+                     lm_hit_t* hit) {
+  const lightmap_bake_desc_t& desc = *scene.desc;
+  const float inf = 1e30f;
+  float gx = (from.x - desc.originX) / desc.cellSize;
+  float gz = (from.z - desc.originZ) / desc.cellSize;
+  int x = (int)floorf(gx);
+  int z = (int)floorf(gz);
+  int stepX = dir.x > 0.0f ? 1 : -1;
+  int stepZ = dir.z > 0.0f ? 1 : -1;
+  float deltaX = dir.x != 0.0f ? desc.cellSize / fabsf(dir.x) : inf;
+  float deltaZ = dir.z != 0.0f ? desc.cellSize / fabsf(dir.z) : inf;
+  float nextX = dir.x > 0.0f   ? ((float)(x + 1) - gx) * deltaX
+                : dir.x < 0.0f ? (gx - (float)x) * deltaX
+                               : inf;
+  float nextZ = dir.z > 0.0f   ? ((float)(z + 1) - gz) * deltaZ
+                : dir.z < 0.0f ? (gz - (float)z) * deltaZ
+                               : inf;
+  float planeT = dir.y > 0.0f   ? (desc.ceilingY - from.y) / dir.y
+                 : dir.y < 0.0f ? (desc.floorY - from.y) / dir.y
+                                : inf;
+  for (;;) {
+    float t = glm::min(nextX, nextZ);
+    if (planeT <= t) {
+      if (planeT > maxT) {
+        return false;
+      }
+      *hit = {planeT, x, z, dir.y > 0.0f ? LmSlot_Up : LmSlot_Down};
+      return true;
+    }
+    if (t > maxT) {
+      return false;
+    }
+    lm_slot_t slot;
+    int fromX = x, fromZ = z;
+    if (nextX < nextZ) {
+      x += stepX;
+      nextX += deltaX;
+      slot = stepX > 0 ? LmSlot_PosX : LmSlot_NegX;
+    } else {
+      z += stepZ;
+      nextZ += deltaZ;
+      slot = stepZ > 0 ? LmSlot_PosZ : LmSlot_NegZ;
+    }
+    if (!lm_open(scene, x, z)) {
+      *hit = {t, fromX, fromZ, slot};
+      return true;
+    }
+  }
+}
+
+static lm_slot_t lm_slot_for_normal(glm::vec3 n) {
+  if (n.x > 0.5f) return LmSlot_NegX;
+  if (n.x < -0.5f) return LmSlot_PosX;
+  if (n.z > 0.5f) return LmSlot_NegZ;
+  if (n.z < -0.5f) return LmSlot_PosZ;
+  return n.y > 0.0f ? LmSlot_Down : LmSlot_Up;
+}
+
+// World position of texel (tx, ty) on a face.
+static glm::vec3 lm_texel_position(const lm_face_t& face,
+                                   uint32_t tx,
+                                   uint32_t ty) {
+  // Texcoord v runs down the quad, from +0.5 at the top to -0.5.
+  float u = ((float)tx + 0.5f) / (float)face.w - 0.5f;
+  float v = 0.5f - ((float)ty + 0.5f) / (float)face.h;
+  return face.origin + face.along * u + face.up * v;
+}
+
+// The open tile a point on a face looks into; wall points sit on the
+// border between two tiles.
+static void lm_tile_in_front(const lm_scene_t& scene,
+                             glm::vec3 p,
+                             glm::vec3 normal,
+                             int* tileX,
+                             int* tileZ) {
+  const lightmap_bake_desc_t& desc = *scene.desc;
+  glm::vec3 inside = p + normal * (0.25f * desc.cellSize);
+  *tileX = glm::clamp((int)floorf((inside.x - desc.originX) / desc.cellSize),
+                      0, scene.width - 1);
+  *tileZ = glm::clamp((int)floorf((inside.z - desc.originZ) / desc.cellSize),
+                      0, scene.length - 1);
+}
+
+static glm::vec3 lm_direct(const lm_scene_t& scene,
+                           const lm_face_t& face,
+                           glm::vec3 p,
+                           uint64_t* rays) {
+  const lightmap_bake_desc_t& desc = *scene.desc;
+  glm::vec3 result(0.0f);
+  glm::vec3 from = p + face.normal * 1e-3f;
+  int tileX, tileZ;
+  lm_tile_in_front(scene, p, face.normal, &tileX, &tileZ);
+  const std::vector<uint32_t>& lights =
+      scene.tileLights[tileZ * scene.width + tileX];
+  for (uint32_t index : lights) {
+    const cluster_light_t& light = desc.lights[index];
+    glm::vec3 toLight = light.position - from;
+    float distance = glm::length(toLight);
+    if (distance >= light.radius || distance <= 0.0f) {
+      continue;
+    }
+    glm::vec3 dir = toLight / distance;
+    float diffuse = glm::max(glm::dot(face.normal, dir), 0.0f);
+    if (diffuse <= 0.0f && light.ambient <= 0.0f) {
+      continue;
+    }
+    lm_hit_t hit;
+    (*rays)++;
+    if (lm_trace(scene, from, dir, distance, &hit)) {
+      continue;
+    }
+    // Same falloff as calc_point_light() in light_shaders.glsl.
+    float attenuation =
+        1.0f / (light.attenuation.x + light.attenuation.y * distance +
+                light.attenuation.z * distance * distance);
+    float fade = glm::clamp(1.0f - powf(distance / light.radius, 4.0f), 0.0f,
+                            1.0f);
+    attenuation *= fade * fade;
+    result += light.color * light.intensity * attenuation *
+              (diffuse + light.ambient);
+  }
+  return result;
+}
+
+static uint32_t lm_hash(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352du;
+  x ^= x >> 15;
+  x *= 0x846ca68bu;
+  x ^= x >> 16;
+  return x;
+}
+
+static float lm_random(uint32_t* state) {
+  *state = lm_hash(*state + 0x9e3779b9u);
+  return (float)(*state >> 8) * (1.0f / 16777216.0f);
+}
+
+static glm::vec3 lm_bounce(const lm_scene_t& scene,
+                           const lm_face_t& face,
+                           glm::vec3 p,
+                           uint32_t seed,
+                           uint64_t* rays) {
+  const lightmap_bake_desc_t& desc = *scene.desc;
+  glm::vec3 t = glm::normalize(face.along);
+  glm::vec3 b = glm::normalize(face.up);
+  glm::vec3 from = p + face.normal * 1e-3f;
+  glm::vec3 gathered(0.0f);
+  for (uint32_t i = 0; i < desc.bounceSamples; i++) {
+    // Cosine-weighted, so the plain average is the irradiance estimate.
+    float r1 = lm_random(&seed);
+    float r2 = lm_random(&seed);
+    float phi = 6.2831853f * r1;
+    float r = sqrtf(r2);
+    glm::vec3 dir = t * (r * cosf(phi)) + b * (r * sinf(phi)) +
+                    face.normal * sqrtf(glm::max(1.0f - r2, 0.0f));
+    lm_hit_t hit;
+    (*rays)++;
+    if (!lm_trace(scene, from, dir, 1e30f, &hit)) {
+      continue;
+    }
+    int32_t index =
+        scene.faceAt[((size_t)hit.tileZ * scene.width + hit.tileX) *
+                         LmSlot_Count +
+                     hit.slot];
+    if (index < 0) {
+      continue;
+    }
+    const lm_face_t& other = scene.faces[index];
+    glm::vec3 local = from + dir * hit.t - other.origin;
+    float u = glm::dot(local, other.along) / glm::dot(other.along, other.along);
+    float v = glm::dot(local, other.up) / glm::dot(other.up, other.up);
+    uint32_t tx = (uint32_t)glm::clamp((u + 0.5f) * (float)other.w, 0.0f,
+                                       (float)(other.w - 1));
+    uint32_t ty = (uint32_t)glm::clamp((0.5f - v) * (float)other.h, 0.0f,
+                                       (float)(other.h - 1));
+    gathered += scene.direct[other.texelOffset + ty * other.w + tx];
+  }
+  return gathered * (desc.bounceAlbedo / (float)desc.bounceSamples);
+}
+
+// Runs `fn(faceIndex)` over all faces, handing out small batches to
+// `numThreads` workers including the calling thread.
+template <typename Fn>
+static void lm_parallel(uint32_t numFaces, uint32_t numThreads, Fn fn) {
+  const uint32_t batch = 32;
+  std::atomic<uint32_t> next(0);
+  auto worker = [&]() {
+    for (;;) {
+      uint32_t first = next.fetch_add(batch);
+      if (first >= numFaces) {
+        return;
+      }
+      uint32_t last = glm::min(first + batch, numFaces);
+      for (uint32_t i = first; i < last; i++) {
+        fn(i);
+      }
+    }
+  };
+  std::vector<std::thread> workers;
+  for (uint32_t t = 1; t < numThreads; t++) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : workers) {
+    thread.join();
+  }
+}
+
+// Shelf-packs the faces' rects into an atlas LIGHTMAP_MAX_WIDTH wide at
+// most, returning the atlas height (0 if the faces don't fit).
+static uint32_t lm_pack(std::vector<lm_face_t>& faces, uint32_t* width) {
+  const uint32_t pad = LIGHTMAP_PADDING;
+  std::vector<uint32_t> order(faces.size());
+  uint64_t area = 0;
+  for (uint32_t i = 0; i < faces.size(); i++) {
+    order[i] = i;
+    area += (uint64_t)(faces[i].w + 2 * pad) * (faces[i].h + 2 * pad);
+  }
+  std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    return faces[a].h > faces[b].h;
+  });
+  // Start from a square estimate and let the shelves set the height.
+  uint32_t atlasWidth = 64;
+  while ((uint64_t)atlasWidth * atlasWidth < area &&
+         atlasWidth < LIGHTMAP_MAX_WIDTH) {
+    atlasWidth *= 2;
+  }
+  uint32_t x = 0, y = 0, shelf = 0;
+  for (uint32_t index : order) {
+    lm_face_t& face = faces[index];
+    uint32_t w = face.w + 2 * pad, h = face.h + 2 * pad;
+    if (x + w > atlasWidth) {
+      x = 0;
+      y += shelf;
+      shelf = 0;
+    }
+    face.x = x + pad;
+    face.y = y + pad;
+    x += w;
+    shelf = glm::max(shelf, h);
+  }
+  uint32_t height = 1;
+  while (height < y + shelf) {
+    height *= 2;
+  }
+  *width = atlasWidth;
+  return height <= LIGHTMAP_MAX_WIDTH ? height : 0;
+}
+
+// Bakes the static lights in `desc` into a new atlas. Blocks until done;
+// returns false if the atlas would exceed LIGHTMAP_MAX_WIDTH squared.
+static bool bakeLightmap(const lightmap_bake_desc_t& desc, lightmap_t* out) {
+  auto start = std::chrono::steady_clock::now();
+  lm_scene_t scene;
+  scene.desc = &desc;
+  scene.width = (int)desc.layout->size();
+  scene.length = scene.width > 0 ? (int)(*desc.layout)[0].size() : 0;
+  scene.rays = 0;
+  scene.faceAt.assign((size_t)scene.width * scene.length * LmSlot_Count, -1);
+  scene.tileLights.resize((size_t)scene.width * scene.length);
+
+  uint32_t texels = 0;
+  scene.faces.resize(desc.numFaces);
+  for (uint32_t i = 0; i < desc.numFaces; i++) {
+    const glm::mat4& model = desc.faces[i];
+    lm_face_t& face = scene.faces[i];
+    face.origin = glm::vec3(model[3]);
+    face.along = glm::vec3(model[0]);
+    face.up = glm::vec3(model[1]);
+    face.normal = glm::normalize(glm::cross(face.along, face.up));
+    bool coarse = i < desc.numCoarseFaces;
+    float density = coarse ? desc.coarseTexelsPerUnit : desc.texelsPerUnit;
+    face.w = glm::max((uint32_t)ceilf(glm::length(face.along) * density), 1u);
+    face.h = glm::max((uint32_t)ceilf(glm::length(face.up) * density), 1u);
+    face.texelOffset = texels;
+    texels += face.w * face.h;
+    if (coarse) {
+      continue;
+    }
+    // Register the face with every tile it covers, for the bounce rays.
+    // Horizontal axes span one tile per cell size.
+    float alongLength = glm::length(face.along);
+    float upLength = glm::length(face.up);
+    int spanU = fabsf(face.along.y) < 1e-3f * alongLength
+                    ? glm::max((int)(alongLength / desc.cellSize + 0.5f), 1)
+                    : 1;
+    int spanV = fabsf(face.up.y) < 1e-3f * upLength
+                    ? glm::max((int)(upLength / desc.cellSize + 0.5f), 1)
+                    : 1;
+    for (int v = 0; v < spanV; v++) {
+      for (int u = 0; u < spanU; u++) {
+        glm::vec3 p = face.origin +
+                      face.along * (((float)u + 0.5f) / spanU - 0.5f) +
+                      face.up * (((float)v + 0.5f) / spanV - 0.5f);
+        int tileX, tileZ;
+        lm_tile_in_front(scene, p, face.normal, &tileX, &tileZ);
+        scene.faceAt[((size_t)tileZ * scene.width + tileX) * LmSlot_Count +
+                     lm_slot_for_normal(face.normal)] = (int32_t)i;
+      }
+    }
+  }
+  for (uint32_t i = 0; i < desc.numLights; i++) {
+    const cluster_light_t& light = desc.lights[i];
+    float lx = (light.position.x - desc.originX) / desc.cellSize;
+    float lz = (light.position.z - desc.originZ) / desc.cellSize;
+    float r = light.radius / desc.cellSize;
+    int x0 = glm::max((int)floorf(lx - r), 0);
+    int x1 = glm::min((int)floorf(lx + r), scene.width - 1);
+    int z0 = glm::max((int)floorf(lz - r), 0);
+    int z1 = glm::min((int)floorf(lz + r), scene.length - 1);
+    for (int z = z0; z <= z1; z++) {
+      for (int x = x0; x <= x1; x++) {
+        scene.tileLights[(size_t)z * scene.width + x].push_back(i);
+      }
+    }
+  }
+
+  uint32_t width;
+  uint32_t height = lm_pack(scene.faces, &width);
+  if (height == 0) {
+    return false;
+  }
+  uint32_t numThreads = desc.numThreads;
+  if (numThreads == 0) {
+    numThreads = glm::max(std::thread::hardware_concurrency(), 1u);
+  }
+
+  scene.direct.assign(texels, glm::vec3(0.0f));
+  lm_parallel(desc.numFaces, numThreads, [&](uint32_t i) {
+    const lm_face_t& face = scene.faces[i];
+    uint64_t rays = 0;
+    for (uint32_t ty = 0; ty < face.h; ty++) {
+      for (uint32_t tx = 0; tx < face.w; tx++) {
+        scene.direct[face.texelOffset + ty * face.w + tx] =
+            lm_direct(scene, face, lm_texel_position(face, tx, ty), &rays);
+      }
+    }
+    scene.rays += rays;
+  });
+
+  uint8_t* pixels = (uint8_t*)malloc((size_t)width * height * 4);
+  if (!pixels) {
+    return false;
+  }
+  memset(pixels, 0, (size_t)width * height * 4);
+  out->rects.resize(desc.numFaces);
+  lm_parallel(desc.numFaces, numThreads, [&](uint32_t i) {
+    const lm_face_t& face = scene.faces[i];
+    uint64_t rays = 0;
+    std::vector<glm::vec3> lit(face.w * face.h);
+    for (uint32_t ty = 0; ty < face.h; ty++) {
+      for (uint32_t tx = 0; tx < face.w; tx++) {
+        uint32_t texel = ty * face.w + tx;
+        lit[texel] = scene.direct[face.texelOffset + texel];
+        if (desc.bounceSamples > 0) {
+          lit[texel] += lm_bounce(scene, face, lm_texel_position(face, tx, ty),
+                                  face.texelOffset + texel, &rays);
+        }
+      }
+    }
+    // Write the rect plus its border, clamping to the edge texels.
+    const int pad = LIGHTMAP_PADDING;
+    for (int py = -pad; py < (int)face.h + pad; py++) {
+      for (int px = -pad; px < (int)face.w + pad; px++) {
+        int sx = glm::clamp(px, 0, (int)face.w - 1);
+        int sy = glm::clamp(py, 0, (int)face.h - 1);
+        glm::vec3 value =
+            glm::clamp(lit[sy * face.w + sx] / LIGHTMAP_RANGE, 0.0f, 1.0f);
+        uint8_t* dst = &pixels[((size_t)(face.y + py) * width + face.x + px) *
+                               4];
+        dst[0] = (uint8_t)(value.x * 255.0f + 0.5f);
+        dst[1] = (uint8_t)(value.y * 255.0f + 0.5f);
+        dst[2] = (uint8_t)(value.z * 255.0f + 0.5f);
+        dst[3] = 255;
+      }
+    }
+    out->rects[i] = glm::vec4((float)face.x / (float)width,
+                              (float)face.y / (float)height,
+                              (float)face.w / (float)width,
+                              (float)face.h / (float)height);
+    scene.rays += rays;
+  });
+
+  out->width = width;
+  out->height = height;
+  out->pixels = pixels;
+  out->texels = texels;
+  out->rays = scene.rays;
+  out->bakeMs = std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+  return true;
+}
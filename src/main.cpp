@@ -1,3 +1,5 @@
+#include <stdio.h>
+
 #include "glad.h"
 
 #include "glm/glm.hpp"
@@ -7,6 +9,7 @@
 // #pragma warning(push)
 // #pragma warning(disable : 4005)
 #include "sokol_time.h"
+#include "allocators.h"
 #include "textureLoader.h"
 
 #ifdef APIENTRY
@@ -19,10 +22,22 @@
 #include "camera.h"
 #include "dungeon.h"
 #include "dungeon_generator.h"
+#include "fixedStep.h"
+#include "framePacing.h"
 
 const int ScreenWidth = 1920;
 const int ScreenHeight = 1080;
 const float KeyCooldownTime = 0.15f;
+const uint64_t TextureBudgetBytes = STREAM_DEFAULT_BUDGET;
+const uint32_t TorchCount = 500;
+// Every Nth torch flickers as a clustered light; the rest are baked into a
+// lightmap. 1 keeps them all dynamic, 0 bakes them all.
+const uint32_t DynamicTorchEvery = 8;
+const float LightmapTexelsPerUnit = LIGHTMAP_DEFAULT_DENSITY;
+const uint32_t LightmapBounceSamples = 16;
+const int SimStepsPerSecond = FIXED_STEP_DEFAULT_HZ;
+// Of the display, which the swap interval of 1 syncs to.
+const double RefreshPeriodMs = 1000.0 / 60.0;
 
 typedef struct {
   int screenWidth;
@@ -38,11 +53,15 @@ typedef struct {
   float lastX, lastY;
   float deltaTime, lastPress, keyCooldown;
   double lastFrameTimestamp;
+  // The camera position as of the previous step, which frames draw on
+  // from, and the interpolated one they draw from.
+  glm::vec3 prevPosition, viewPos;
 } app_state_t;
 
 static app_state_t app_state;
 
 void mouse_callback(GLFWwindow* window, double xpos, double ypos) {
+  framePacingPolledInput();
   int winWidth, winHeight;
   if (app_state.firstMouse) {
     glfwGetWindowSize(window, &winWidth, &winHeight);
@@ -70,33 +89,44 @@ void mouse_callback(GLFWwindow* window, double xpos, double ypos) {
 }
 
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset) {
+  framePacingPolledInput();
   app_state.camera->ProcessMouseScroll((float)yoffset);
 }
 
+// Keys are read with glfwGetKey(); this only stamps when they changed.
+void key_callback(GLFWwindow* window,
+                  int key,
+                  int scancode,
+                  int action,
+                  int mods) {
+  framePacingPolledInput();
+}
+
+// The callbacks run inside the poll; see framePacingPolledInput().
+void pollInput() {
+  beginInputPoll();
+  glfwPollEvents();
+  endInputPoll();
+}
+
+// Reports the outgoing pacing mode's input latency and switches modes.
+void toggleLowLatency() {
+  frame_pacing_stats_t stats = framePacingStats();
+  printf("%s: input to submit %.2f ms (max %.2f), to present %.2f ms over "
+         "%d of %d frames, slept %.2f ms a frame\n",
+         lowLatencyMode() ? "low latency" : "immediate", stats.latencyMs,
+         stats.maxLatencyMs, stats.presentLatencyMs, stats.inputFrames,
+         stats.frames, stats.sleepMs);
+  setLowLatencyMode(!lowLatencyMode());
+  resetFramePacingStats();
+}
+
 void processInput(app_state_t* state) {
   state->lastPress += state->deltaTime;
   if (glfwGetKey(state->window, GLFW_KEY_ESCAPE) == GLFW_PRESS) {
     glfwSetWindowShouldClose(state->window, GLFW_TRUE);
   }
 
-  if (glfwGetKey(state->window, GLFW_KEY_W) == GLFW_PRESS) {
-    state->camera->ProcessKeyboard(FORWARD, state->deltaTime);
-  }
-  if (glfwGetKey(state->window, GLFW_KEY_S) == GLFW_PRESS) {
-    state->camera->ProcessKeyboard(BACKWARD, state->deltaTime);
-  }
-  if (glfwGetKey(state->window, GLFW_KEY_A) == GLFW_PRESS) {
-    state->camera->ProcessKeyboard(LEFT, state->deltaTime);
-  }
-  if (glfwGetKey(state->window, GLFW_KEY_D) == GLFW_PRESS) {
-    state->camera->ProcessKeyboard(RIGHT, state->deltaTime);
-  }
-  if (glfwGetKey(state->window, GLFW_KEY_SPACE) == GLFW_PRESS) {
-    state->camera->ProcessKeyboard(UP, state->deltaTime);
-  }
-  if (glfwGetKey(state->window, GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS) {
-    state->camera->ProcessKeyboard(DOWN, state->deltaTime);
-  }
   if (glfwGetKey(state->window, GLFW_KEY_G) == GLFW_PRESS &&
       state->lastPress >= state->keyCooldown) {
     state->showWireframe = !state->showWireframe;
@@ -110,6 +140,36 @@ void processInput(app_state_t* state) {
     }
     state->lastPress = 0.0f;
   }
+  if (glfwGetKey(state->window, GLFW_KEY_L) == GLFW_PRESS &&
+      state->lastPress >= state->keyCooldown) {
+    toggleLowLatency();
+    state->lastPress = 0.0f;
+  }
+}
+
+// One fixed step of the simulation: moves the camera by the keys held.
+void simulate(app_state_t* state, float stepSeconds) {
+  Camera* camera = state->camera;
+  state->prevPosition = camera->Position;
+  if (glfwGetKey(state->window, GLFW_KEY_W) == GLFW_PRESS) {
+    camera->ProcessKeyboard(FORWARD, stepSeconds);
+  }
+  if (glfwGetKey(state->window, GLFW_KEY_S) == GLFW_PRESS) {
+    camera->ProcessKeyboard(BACKWARD, stepSeconds);
+  }
+  if (glfwGetKey(state->window, GLFW_KEY_A) == GLFW_PRESS) {
+    camera->ProcessKeyboard(LEFT, stepSeconds);
+  }
+  if (glfwGetKey(state->window, GLFW_KEY_D) == GLFW_PRESS) {
+    camera->ProcessKeyboard(RIGHT, stepSeconds);
+  }
+  if (glfwGetKey(state->window, GLFW_KEY_SPACE) == GLFW_PRESS) {
+    camera->ProcessKeyboard(UP, stepSeconds);
+  }
+  if (glfwGetKey(state->window, GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS) {
+    camera->ProcessKeyboard(DOWN, stepSeconds);
+  }
+  state->dungeon->carry_light(camera->Position);
 }
 
 void updateFrameTime(app_state_t* state) {
@@ -135,25 +195,36 @@ void init(app_state_t* appState) {
 
   glfwSetCursorPosCallback(appState->window, mouse_callback);
   glfwSetScrollCallback(appState->window, scroll_callback);
+  glfwSetKeyCallback(appState->window, key_callback);
   glfwSwapInterval(1);
   // gladLoadGLLoader((GLADloadproc)glfwGetProcAddress);
 
   sg_desc d = {0};
   d.context.sample_count = 4;
+  d.allocator.alloc = sokolAlloc;
+  d.allocator.free = sokolFree;
+  d.allocator.user_data = (void*)(intptr_t)MemTag_Gfx;
   sg_setup(&d);
   assert(sg_isvalid());
   stm_setup();
 
   initTextureLoader();
+  initTextureStreamer(TextureBudgetBytes);
 
   sg_pass_action pass = {0};
   pass.colors[0].action = SG_ACTION_CLEAR;
-  pass.colors[0].value = sg_color{0.05f, 0.05f, 0.05f, 1.0f};
+  // The fog fades into the clear color.
+  pass.colors[0].value = sg_color{DUNGEON_FOG_COLOR.x, DUNGEON_FOG_COLOR.y,
+                                  DUNGEON_FOG_COLOR.z, 1.0f};
   appState->main_pass_action = pass;
 
   appState->camera = new Camera(glm::vec3(0.0f, 0.5f, 0.0f));
   appState->dungeon = new Dungeon();
   appState->dungeon->create(generate_new_dungeon(25, 25));
+  appState->dungeon->place_torches(TorchCount, DynamicTorchEvery);
+  if (DynamicTorchEvery != 1) {
+    appState->dungeon->bake_lightmap(LightmapTexelsPerUnit, LightmapBounceSamples);
+  }
 
   appState->keyCooldown = KeyCooldownTime;
   appState->lastPress = 0.0f;
@@ -165,12 +236,26 @@ void init(app_state_t* appState) {
   appState->showWireframe = false;
   appState->deltaTime = 0.0f;
   appState->lastFrameTimestamp = glfwGetTime();
+  appState->prevPosition = appState->camera->Position;
+  initFixedStep(SimStepsPerSecond, FIXED_STEP_MAX_CATCH_UP);
+  initFramePacing(RefreshPeriodMs);
 }
 
 void update(app_state_t* state) {
   updateFrameTime(state);
   processInput(state);
+  beginFixedStep(state->deltaTime);
+  while (fixedStepNext()) {
+    simulate(state, (float)fixedStepSeconds());
+  }
+  // Frames draw from between the last two steps' positions.
+  state->viewPos = glm::mix(state->prevPosition, state->camera->Position,
+                            fixedStepAlpha());
   texturePump();
+  // The torches flicker on simulated time, at the frame's point in it.
+  double time = fixedStepTime() -
+                (1.0f - fixedStepAlpha()) * fixedStepSeconds();
+  state->dungeon->update_lights((float)time);
 }
 
 void render(app_state_t* state) {
@@ -183,21 +268,43 @@ void render(app_state_t* state) {
 
   float aspectRatio =
       static_cast<float>(currWidth) / static_cast<float>(currHeight);
+  // The fog has hidden everything past the dungeon's far distance.
+  float farPlane = state->dungeon->detail().farDistance;
   glm::mat4 projection = glm::perspective(glm::radians(state->camera->Zoom),
-                                          aspectRatio, 0.1f, 100.0f);
-  glm::mat4 viewproj = projection * state->camera->GetViewMatrix();
+                                          aspectRatio, 0.1f, farPlane);
+  Camera* camera = state->camera;
+  glm::mat4 view = glm::lookAt(state->viewPos, state->viewPos + camera->Front,
+                               camera->Up);
+  glm::mat4 viewproj = projection * view;
+  state->dungeon->begin_occlusion(viewproj, state->viewPos);
+
+  float pixelsPerUnit =
+      currHeight / (2.0f * tanf(glm::radians(state->camera->Zoom) * 0.5f));
+  state->dungeon->update_texture_residency(state->viewPos, pixelsPerUnit);
+  textureStreamerUpdate();
 
   sg_begin_default_pass(&state->main_pass_action, currWidth, currHeight);
-  state->dungeon->render(viewproj);
+  state->dungeon->render(viewproj, state->viewPos);
   sg_end_pass();
   sg_commit();
+  submitPacedFrame();
   glfwSwapBuffers(state->window);
-  glfwPollEvents();
+  presentedPacedFrame();
+  if (!lowLatencyMode()) {
+    pollInput();
+  }
 }
 
 void cleanup(app_state_t* state) {
   delete state->camera;
   delete state->dungeon;
+  destroyOcclusionBuffer();
+  destroyDeferredLighting();
+  destroyFloodLight();
+  destroyLightClusters();
+  destroyMaterials();
+  destroyTextureRegistry();
+  destroyTextureStreamer();
   destroyTextureLoader();
   sg_shutdown();
   glfwDestroyWindow(state->window);
@@ -207,6 +314,12 @@ void cleanup(app_state_t* state) {
 void main() {
   init(&app_state);
   while (!glfwWindowShouldClose(app_state.window)) {
+    // In low-latency mode input is polled after the pacing sleep, just
+    // before the frame uses it, rather than right after the last present.
+    beginPacedFrame();
+    if (lowLatencyMode()) {
+      pollInput();
+    }
     update(&app_state);
     render(&app_state);
   }
@@ -0,0 +1,326 @@
+#pragma once
+
+#include <string.h>
+#include <vector>
+#include "sokol_gfx.h"
+#include "textureLoader.h"
+#include "textureRegistry.h"
+
+// Materials load an albedo map plus optional normal and height maps as one
+// unit. The albedo goes through the texture registry (shared and streamed).
+// The normal and height maps are decoded when they arrive and packed into a
+// single RGBA8 "surface" texture with its own mip chain:
+//
+//   r, g  tangent-space normal x, y  (z is rebuilt in the shader)
+//   b     height, 0.5 where the set has no height map
+//   a     unused
+//
+// so a lit draw binds two samplers instead of up to four.
+
+typedef struct {
+  const char* name;
+  const char* albedo;
+  const char* normal;  // may be null
+  const char* height;  // may be null
+} material_desc_t;
+
+// Material sets shipped in data/.
+static const material_desc_t materialLibrary[] = {
+    {"bricks2", "bricks2.jpg", "bricks2_normal.jpg", "bricks2_disp.jpg"},
+    {"brickwall", "brickwall.jpg", "brickwall_normal.jpg", nullptr},
+    {"bblock", "bblock_a.png", "bblock_norm.png", "bblock_bmp.png"},
+    {"rock_mor", "rock_mor_a.png", "rock_mor_norm.png", "rock_mor_bmp.png"},
+    {"lawn_grass", "lawn_grass_a.png", "lawn_grass_norm.png",
+     "lawn_grass_bmp.png"},
+    {"toy_box", "toy_box_diffuse.png", nullptr, nullptr},
+    {"wood", "wood.png", nullptr, nullptr},
+};
+
+#define INVALID_MATERIAL (-1)
+
+enum material_map_t {
+  MaterialMap_Normal,
+  MaterialMap_Height,
+  MaterialMap_Count,
+};
+
+typedef struct {
+  uint64_t albedoBytes;
+  uint64_t surfaceBytes;
+  // Files the set was loaded from, and samplers it needs per draw.
+  int sourceMaps;
+  int samplers;
+  int binds;
+} material_stats_t;
+
+struct material_t;
+
+typedef struct {
+  material_t* material;
+  material_map_t map;
+  // RGBA8 copy of the map's top mip in decodeArena until it is packed.
+  uint8_t* pixels;
+  uint32_t width;
+  uint32_t height;
+  bool pending;
+} material_map_load_t;
+
+struct material_t {
+  const material_desc_t* desc;
+  int albedo;
+  sg_image surface;
+  material_map_load_t maps[MaterialMap_Count];
+  material_stats_t stats;
+};
+
+static std::vector<material_t*> materials;
+
+// Flat normal, mid height.
+static const uint8_t materialFlatSurface[4] = {128, 128, 128, 255};
+
+// Decodes a fetched map to RGBA8 in decodeArena. Baked maps are expanded
+// from their top mip; channels a block format lacks are left at zero.
+static uint8_t* material_decode(const uint8_t* data,
+                                size_t size,
+                                bool baked,
+                                uint32_t* width,
+                                uint32_t* height) {
+  if (!baked) {
+    int w, h, numChannels;
+    uint8_t* pixels = stbi_load_from_memory(data, (int)size, &w, &h,
+                                            &numChannels, 4);
+    *width = (uint32_t)w;
+    *height = (uint32_t)h;
+    return pixels;
+  }
+  dtex_header_t header;
+  uint32_t offsets[DTEX_MAX_MIPS];
+  if (size < sizeof(header)) {
+    return nullptr;
+  }
+  memcpy(&header, data, sizeof(header));
+  uint32_t fileSize = dtex_layout(&header, offsets);
+  if (fileSize == 0 || fileSize > size) {
+    return nullptr;
+  }
+  size_t bytes = (size_t)header.width * header.height * 4;
+  uint8_t* pixels = (uint8_t*)arenaAlloc(&decodeArena, bytes);
+  memset(pixels, 0, bytes);
+  decompressTexture(data + offsets[0], header.width, header.height,
+                    (dtex_format_t)header.format, pixels);
+  *width = header.width;
+  *height = header.height;
+  return pixels;
+}
+
+static void material_upload_flat(material_t* mat) {
+  sg_image_desc imageDesc = {0};
+  imageDesc.width = 1;
+  imageDesc.height = 1;
+  imageDesc.pixel_format = SG_PIXELFORMAT_RGBA8;
+  imageDesc.data.subimage[0][0] = SG_RANGE(materialFlatSurface);
+  queueImageUpload(mat->surface, imageDesc, sizeof(materialFlatSurface),
+                   UploadPriority_Normal);
+  mat->stats.surfaceBytes = sizeof(materialFlatSurface);
+}
+
+static void material_pack_surface(material_t* mat) {
+  const material_map_load_t& normal = mat->maps[MaterialMap_Normal];
+  const material_map_load_t& height = mat->maps[MaterialMap_Height];
+  uint32_t width = normal.pixels ? normal.width : height.width;
+  uint32_t heightDim = normal.pixels ? normal.height : height.height;
+  if (!normal.pixels && !height.pixels) {
+    material_upload_flat(mat);
+    return;
+  }
+
+  uint32_t numMips = dtex_mip_count(width, heightDim);
+  uint32_t offsets[DTEX_MAX_MIPS];
+  size_t total = 0;
+  for (uint32_t mip = 0; mip < numMips; mip++) {
+    offsets[mip] = (uint32_t)total;
+    total += (size_t)dtex_mip_dim(width, mip) * dtex_mip_dim(heightDim, mip) *
+             4;
+  }
+  uint8_t* chain = (uint8_t*)arenaAlloc(&decodeArena, total);
+  for (uint32_t y = 0; y < heightDim; y++) {
+    for (uint32_t x = 0; x < width; x++) {
+      uint8_t* out = &chain[((size_t)y * width + x) * 4];
+      out[0] = out[1] = out[2] = 128;
+      out[3] = 255;
+      if (normal.pixels) {
+        const uint8_t* in = &normal.pixels[((size_t)y * width + x) * 4];
+        out[0] = in[0];
+        out[1] = in[1];
+      }
+      if (height.pixels) {
+        // Nearest sample in case the maps differ in size.
+        uint32_t hx = x * height.width / width;
+        uint32_t hy = y * height.height / heightDim;
+        out[2] = height.pixels[((size_t)hy * height.width + hx) * 4];
+      }
+    }
+  }
+  for (uint32_t mip = 1; mip < numMips; mip++) {
+    downsampleRGBA8(chain + offsets[mip - 1], dtex_mip_dim(width, mip - 1),
+                    dtex_mip_dim(heightDim, mip - 1), chain + offsets[mip],
+                    false);
+  }
+
+  sg_image_desc imageDesc = {0};
+  imageDesc.width = (int)width;
+  imageDesc.height = (int)heightDim;
+  imageDesc.num_mipmaps = (int)numMips;
+  imageDesc.pixel_format = SG_PIXELFORMAT_RGBA8;
+  imageDesc.min_filter = SG_FILTER_LINEAR_MIPMAP_LINEAR;
+  imageDesc.mag_filter = SG_FILTER_LINEAR;
+  for (uint32_t mip = 0; mip < numMips; mip++) {
+    imageDesc.data.subimage[0][mip].ptr = chain + offsets[mip];
+    imageDesc.data.subimage[0][mip].size =
+        (size_t)dtex_mip_dim(width, mip) * dtex_mip_dim(heightDim, mip) * 4;
+  }
+  queueImageUpload(mat->surface, imageDesc, total, UploadPriority_Normal,
+                   chain, decode_free);
+  mat->stats.surfaceBytes = total;
+}
+
+static bool material_on_map(const uint8_t* data,
+                            size_t size,
+                            bool baked,
+                            sg_image imgLoc,
+                            void* userData) {
+  material_map_load_t* load = (material_map_load_t*)userData;
+  material_t* mat = load->material;
+  if (data) {
+    load->pixels =
+        material_decode(data, size, baked, &load->width, &load->height);
+    if (!load->pixels && baked) {
+      // Let the loader retry with the source image.
+      return false;
+    }
+  }
+  load->pending = false;
+  for (const material_map_load_t& map : mat->maps) {
+    if (map.pending) {
+      return true;
+    }
+  }
+  material_pack_surface(mat);
+  for (material_map_load_t& map : mat->maps) {
+    decode_free(map.pixels);
+    map.pixels = nullptr;
+  }
+  return true;
+}
+
+static const material_desc_t* findMaterialDesc(const char* name) {
+  for (const material_desc_t& desc : materialLibrary) {
+    if (strcmp(desc.name, name) == 0) {
+      return &desc;
+    }
+  }
+  return nullptr;
+}
+
+// Returns a handle to the named material set, starting its loads on first
+// use, or INVALID_MATERIAL if the library has no such set.
+static int loadMaterial(const char* name) {
+  for (int i = 0; i < (int)materials.size(); i++) {
+    if (strcmp(materials[i]->desc->name, name) == 0) {
+      return i;
+    }
+  }
+  const material_desc_t* desc = findMaterialDesc(name);
+  if (!desc) {
+    return INVALID_MATERIAL;
+  }
+  material_t* mat = new material_t();
+  mat->desc = desc;
+  mat->albedo = acquireTexture(desc->albedo);
+  mat->surface = sg_alloc_image();
+  mat->stats.sourceMaps = 1;
+  mat->stats.samplers = 2;
+  materials.push_back(mat);
+
+  const char* mapPaths[MaterialMap_Count] = {desc->normal, desc->height};
+  for (int i = 0; i < MaterialMap_Count; i++) {
+    mat->maps[i].material = mat;
+    mat->maps[i].map = (material_map_t)i;
+    mat->maps[i].pending = mapPaths[i] != nullptr;
+  }
+  if (!desc->normal && !desc->height) {
+    material_upload_flat(mat);
+  }
+  for (int i = 0; i < MaterialMap_Count; i++) {
+    if (!mapPaths[i]) {
+      continue;
+    }
+    mat->stats.sourceMaps++;
+    if (!loadTextureData(mapPaths[i], mat->surface, 0, material_on_map,
+                         &mat->maps[i])) {
+      material_on_map(nullptr, 0, false, mat->surface, &mat->maps[i]);
+    }
+  }
+  return (int)materials.size() - 1;
+}
+
+static sg_image materialAlbedoImage(int material) {
+  if (material < 0) {
+    return sg_image{SG_INVALID_ID};
+  }
+  return textureRegistryImage(materials[material]->albedo);
+}
+
+static sg_image materialSurfaceImage(int material) {
+  if (material < 0) {
+    return sg_image{SG_INVALID_ID};
+  }
+  return materials[material]->surface;
+}
+
+// Fills the material's images into `bindings`. Pass a negative slot for
+// textures the shader does not sample.
+static void bindMaterial(int material,
+                         sg_bindings* bindings,
+                         int albedoSlot,
+                         int surfaceSlot) {
+  if (material < 0) {
+    return;
+  }
+  if (albedoSlot >= 0) {
+    bindings->fs_images[albedoSlot] = materialAlbedoImage(material);
+  }
+  if (surfaceSlot >= 0) {
+    bindings->fs_images[surfaceSlot] = materials[material]->surface;
+  }
+  materials[material]->stats.binds++;
+}
+
+static material_stats_t materialStats(int material) {
+  material_t* mat = materials[material];
+  material_stats_t stats = mat->stats;
+  streamed_texture_t* albedo = streamer_find(materialAlbedoImage(material));
+  stats.albedoBytes = albedo ? albedo->residentBytes : 0;
+  return stats;
+}
+
+static const char* materialName(int material) {
+  return material < 0 ? "" : materials[material]->desc->name;
+}
+
+static int materialCount(void) {
+  return (int)materials.size();
+}
+
+static void destroyMaterials(void) {
+  for (material_t* mat : materials) {
+    releaseTexture(mat->albedo);
+    cancelTextureRequests(mat->surface);
+    for (material_map_load_t& map : mat->maps) {
+      decode_free(map.pixels);
+    }
+    sg_destroy_image(mat->surface);
+    delete mat;
+  }
+  materials.clear();
+}
@@ -0,0 +1,456 @@
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "glm/glm.hpp"
+#include "sokol_time.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define OCCLUSION_SSE2
+#endif
+
+// Software occlusion buffer for the dungeon's tile grid. Every frame
+// beginOcclusionFrame() hands the camera to a worker thread, which clears a
+// small depth buffer and rasterizes the walls nearest the eye into it, ring
+// by ring of tiles outwards, while the main thread gets on with the rest of
+// the frame. waitOcclusionFrame() then blocks until it is done, after which
+// occlusionBoxHidden() tests bounding boxes against it before they are
+// submitted. Triangles are filled four pixels at a time with half-space edge
+// functions, using SSE2 where the compiler targets it.
+//
+// Depth is NDC z mapped to 0..1 (GL clip space), with 1 where nothing was
+// drawn. The buffer is only as exact as its resolution: box tests grow their
+// footprint by a pixel, but a far opening narrower than a buffer pixel can
+// still be filled in by the walls either side of it.
+
+#define OCCLUSION_WIDTH (256)
+#define OCCLUSION_HEIGHT (128)
+// Walls of open tiles up to this many tiles (Chebyshev) from the eye's tile.
+#define OCCLUSION_OCCLUDER_RADIUS (6)
+#define OCCLUSION_MAX_OCCLUDERS (192)
+
+typedef struct {
+  int occluders;
+  int tests;
+  int hidden;
+  // Clearing and rasterizing, on the worker.
+  double occluderMs;
+  // Box tests, on the caller.
+  double testMs;
+  // How long the caller blocked in waitOcclusionFrame().
+  double waitMs;
+} occlusion_stats_t;
+
+typedef struct {
+  int width;
+  int length;
+  float originX;
+  float originZ;
+  float cellSize;
+  float floorY;
+  float ceilingY;
+  std::vector<uint8_t> open;
+  alignas(16) float depth[OCCLUSION_WIDTH * OCCLUSION_HEIGHT];
+  // The frame being rasterized.
+  glm::mat4 viewproj;
+  glm::vec3 eye;
+  std::thread worker;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+  // A frame is queued or being rasterized.
+  bool busy;
+  // The last frame begun has not been waited for yet.
+  bool fresh;
+  bool quit;
+  bool valid;
+  occlusion_stats_t stats;
+} occlusion_buffer_t;
+
+static occlusion_buffer_t occlusionBuffer;
+
+static bool occlusion_open(int x, int z) {
+  const occlusion_buffer_t& ob = occlusionBuffer;
+  return x >= 0 && z >= 0 && x < ob.width && z < ob.length &&
+         ob.open[(size_t)z * ob.width + x];
+}
+
+static void occlusion_clear(void) {
+  float* depth = occlusionBuffer.depth;
+#if defined(OCCLUSION_SSE2)
+  __m128 far = _mm_set1_ps(1.0f);
+  for (int i = 0; i < OCCLUSION_WIDTH * OCCLUSION_HEIGHT; i += 4) {
+    _mm_store_ps(depth + i, far);
+  }
+#else
+  for (int i = 0; i < OCCLUSION_WIDTH * OCCLUSION_HEIGHT; i++) {
+    depth[i] = 1.0f;
+  }
+#endif
+}
+
+// Fills a screen-space triangle (x, y in pixels, z depth) keeping the
+// nearest depth per pixel. Pixels are sampled at their centres.
+static void occlusion_raster_triangle(glm::vec3 v0,
+                                      glm::vec3 v1,
+                                      glm::vec3 v2) {
+  float area = (v1.x - v0.x) * (v2.y - v0.y) - (v1.y - v0.y) * (v2.x - v0.x);
+  if (fabsf(area) < 1e-6f) {
+    return;
+  }
+  if (area < 0.0f) {
+    glm::vec3 t = v1;
+    v1 = v2;
+    v2 = t;
+    area = -area;
+  }
+  int minX = glm::max((int)floorf(glm::min(v0.x, glm::min(v1.x, v2.x))), 0);
+  int maxX = glm::min((int)ceilf(glm::max(v0.x, glm::max(v1.x, v2.x))),
+                      OCCLUSION_WIDTH - 1);
+  int minY = glm::max((int)floorf(glm::min(v0.y, glm::min(v1.y, v2.y))), 0);
+  int maxY = glm::min((int)ceilf(glm::max(v0.y, glm::max(v1.y, v2.y))),
+                      OCCLUSION_HEIGHT - 1);
+  if (minX > maxX || minY > maxY) {
+    return;
+  }
+  minX &= ~3;
+
+  // Edge i is positive on the inside and zero through the two vertices
+  // other than vertex i.
+  const glm::vec3* from[3] = {&v1, &v2, &v0};
+  const glm::vec3* to[3] = {&v2, &v0, &v1};
+  float a[3], b[3], c[3];
+  for (int i = 0; i < 3; i++) {
+    a[i] = from[i]->y - to[i]->y;
+    b[i] = to[i]->x - from[i]->x;
+    c[i] = -(a[i] * from[i]->x + b[i] * from[i]->y);
+  }
+  // Depth is affine in screen space: z = dzdx * x + dzdy * y + z0.
+  float dzdx = (a[1] * (v1.z - v0.z) + a[2] * (v2.z - v0.z)) / area;
+  float dzdy = (b[1] * (v1.z - v0.z) + b[2] * (v2.z - v0.z)) / area;
+  float z0 = v0.z - dzdx * v0.x - dzdy * v0.y;
+
+#if defined(OCCLUSION_SSE2)
+  __m128 zero = _mm_setzero_ps();
+  __m128 lane = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+  __m128 ea[3], step[3];
+  for (int i = 0; i < 3; i++) {
+    ea[i] = _mm_set1_ps(a[i]);
+    step[i] = _mm_set1_ps(a[i] * 4.0f);
+  }
+  __m128 za = _mm_set1_ps(dzdx);
+  __m128 zstep = _mm_set1_ps(dzdx * 4.0f);
+  for (int y = minY; y <= maxY; y++) {
+    float py = (float)y + 0.5f;
+    __m128 px = _mm_add_ps(_mm_set1_ps((float)minX), lane);
+    __m128 e[3];
+    for (int i = 0; i < 3; i++) {
+      e[i] = _mm_add_ps(_mm_mul_ps(ea[i], px), _mm_set1_ps(b[i] * py + c[i]));
+    }
+    __m128 z = _mm_add_ps(_mm_mul_ps(za, px), _mm_set1_ps(dzdy * py + z0));
+    float* row = occlusionBuffer.depth + (size_t)y * OCCLUSION_WIDTH;
+    for (int x = minX; x <= maxX; x += 4) {
+      __m128 inside = _mm_and_ps(
+          _mm_and_ps(_mm_cmpge_ps(e[0], zero), _mm_cmpge_ps(e[1], zero)),
+          _mm_cmpge_ps(e[2], zero));
+      if (_mm_movemask_ps(inside)) {
+        __m128 old = _mm_load_ps(row + x);
+        __m128 nearest = _mm_min_ps(old, z);
+        _mm_store_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearest),
+                                        _mm_andnot_ps(inside, old)));
+      }
+      for (int i = 0; i < 3; i++) {
+        e[i] = _mm_add_ps(e[i], step[i]);
+      }
+      z = _mm_add_ps(z, zstep);
+    }
+  }
+#else
+  for (int y = minY; y <= maxY; y++) {
+    float py = (float)y + 0.5f;
+    float* row = occlusionBuffer.depth + (size_t)y * OCCLUSION_WIDTH;
+    for (int x = minX; x <= maxX; x++) {
+      float px = (float)x + 0.5f;
+      if (a[0] * px + b[0] * py + c[0] >= 0.0f &&
+          a[1] * px + b[1] * py + c[1] >= 0.0f &&
+          a[2] * px + b[2] * py + c[2] >= 0.0f) {
+        row[x] = glm::min(row[x], dzdx * px + dzdy * py + z0);
+      }
+    }
+  }
+#endif
+}
+
+// Clips a quad against the near plane and rasterizes what is left.
+static void occlusion_raster_quad(const glm::mat4& viewproj,
+                                  const glm::vec3 corners[4]) {
+  glm::vec4 in[4], out[5];
+  for (int i = 0; i < 4; i++) {
+    in[i] = viewproj * glm::vec4(corners[i], 1.0f);
+  }
+  int count = 0;
+  for (int i = 0; i < 4; i++) {
+    const glm::vec4& p = in[i];
+    const glm::vec4& q = in[(i + 1) % 4];
+    float dp = p.z + p.w, dq = q.z + q.w;
+    if (dp >= 0.0f) {
+      out[count++] = p;
+    }
+    if ((dp >= 0.0f) != (dq >= 0.0f)) {
+      float t = dp / (dp - dq);
+      out[count++] = p + (q - p) * t;
+    }
+  }
+  if (count < 3) {
+    return;
+  }
+  glm::vec3 screen[5];
+  for (int i = 0; i < count; i++) {
+    float w = glm::max(out[i].w, 1e-6f);
+    screen[i] = glm::vec3((out[i].x / w * 0.5f + 0.5f) * OCCLUSION_WIDTH,
+                          (out[i].y / w * 0.5f + 0.5f) * OCCLUSION_HEIGHT,
+                          glm::max(out[i].z / w * 0.5f + 0.5f, 0.0f));
+  }
+  for (int i = 1; i + 1 < count; i++) {
+    occlusion_raster_triangle(screen[0], screen[i], screen[i + 1]);
+  }
+}
+
+// Rasterizes the walls of open tile (x, z) that face the eye; false once
+// the occluder budget is spent.
+static bool occlusion_raster_tile(int x, int z) {
+  occlusion_buffer_t& ob = occlusionBuffer;
+  static const int dirs[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+  float x0 = ob.originX + (float)x * ob.cellSize;
+  float z0 = ob.originZ + (float)z * ob.cellSize;
+  float x1 = x0 + ob.cellSize, z1 = z0 + ob.cellSize;
+  for (const int* dir : dirs) {
+    if (occlusion_open(x + dir[0], z + dir[1])) {
+      continue;
+    }
+    // The wall's plane, and whether the eye is on the open side of it.
+    float plane = dir[0] ? (dir[0] < 0 ? x0 : x1) : (dir[1] < 0 ? z0 : z1);
+    float eye = dir[0] ? ob.eye.x : ob.eye.z;
+    if ((dir[0] + dir[1] < 0) ? eye < plane : eye > plane) {
+      continue;
+    }
+    if (ob.stats.occluders >= OCCLUSION_MAX_OCCLUDERS) {
+      return false;
+    }
+    glm::vec3 corners[4];
+    if (dir[0]) {
+      corners[0] = glm::vec3(plane, ob.floorY, z0);
+      corners[1] = glm::vec3(plane, ob.floorY, z1);
+      corners[2] = glm::vec3(plane, ob.ceilingY, z1);
+      corners[3] = glm::vec3(plane, ob.ceilingY, z0);
+    } else {
+      corners[0] = glm::vec3(x0, ob.floorY, plane);
+      corners[1] = glm::vec3(x1, ob.floorY, plane);
+      corners[2] = glm::vec3(x1, ob.ceilingY, plane);
+      corners[3] = glm::vec3(x0, ob.ceilingY, plane);
+    }
+    occlusion_raster_quad(ob.viewproj, corners);
+    ob.stats.occluders++;
+  }
+  return true;
+}
+
+static void occlusion_rasterize(void) {
+  occlusion_buffer_t& ob = occlusionBuffer;
+  uint64_t start = stm_now();
+  ob.stats.occluders = 0;
+  occlusion_clear();
+  int ex = (int)floorf((ob.eye.x - ob.originX) / ob.cellSize);
+  int ez = (int)floorf((ob.eye.z - ob.originZ) / ob.cellSize);
+  // Nearest first, so the budget goes to the walls that hide the most.
+  bool room = true;
+  for (int r = 0; room && r <= OCCLUSION_OCCLUDER_RADIUS; r++) {
+    for (int z = ez - r; room && z <= ez + r; z++) {
+      bool edge = z == ez - r || z == ez + r;
+      for (int x = ex - r; room && x <= ex + r; x += edge ? 1 : 2 * r) {
+        if (occlusion_open(x, z)) {
+          room = occlusion_raster_tile(x, z);
+        }
+        if (r == 0) {
+          break;
+        }
+      }
+    }
+  }
+  ob.stats.occluderMs = stm_ms(stm_since(start));
+}
+
+static void occlusion_worker(void) {
+  occlusion_buffer_t& ob = occlusionBuffer;
+  std::unique_lock<std::mutex> lock(ob.mutex);
+  for (;;) {
+    ob.wake.wait(lock, [] {
+      return occlusionBuffer.quit || occlusionBuffer.busy;
+    });
+    if (ob.quit) {
+      return;
+    }
+    // The caller leaves the buffer alone while busy is set.
+    lock.unlock();
+    occlusion_rasterize();
+    lock.lock();
+    ob.busy = false;
+    ob.done.notify_all();
+  }
+}
+
+//------------------------------------------------------------------------------
+// Public API
+//------------------------------------------------------------------------------
+
+// `layout` is indexed [x][z] with 1 for open tiles. Tile (0, 0) starts at
+// (originX, originZ); tiles are square and span floorY to ceilingY.
+static void initOcclusionBuffer(
+    const std::vector<std::vector<uint16_t>>& layout,
+    float originX,
+    float originZ,
+    float cellSize,
+    float floorY,
+    float ceilingY) {
+  occlusion_buffer_t& ob = occlusionBuffer;
+  if (ob.valid) {
+    return;
+  }
+  ob.width = (int)layout.size();
+  ob.length = ob.width > 0 ? (int)layout[0].size() : 0;
+  ob.originX = originX;
+  ob.originZ = originZ;
+  ob.cellSize = cellSize;
+  ob.floorY = floorY;
+  ob.ceilingY = ceilingY;
+  ob.open.assign((size_t)ob.width * ob.length, 0);
+  for (int x = 0; x < ob.width; x++) {
+    for (int z = 0; z < ob.length; z++) {
+      ob.open[(size_t)z * ob.width + x] = layout[x][z] == 1;
+    }
+  }
+  ob.busy = false;
+  ob.fresh = false;
+  ob.quit = false;
+  ob.stats = {};
+  ob.worker = std::thread(occlusion_worker);
+  ob.valid = true;
+}
+
+static void destroyOcclusionBuffer(void) {
+  occlusion_buffer_t& ob = occlusionBuffer;
+  if (!ob.valid) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(ob.mutex);
+    ob.quit = true;
+  }
+  ob.wake.notify_all();
+  ob.worker.join();
+  ob.open.clear();
+  ob.valid = false;
+}
+
+// Starts rasterizing the occluders for this frame's camera on the worker.
+static void beginOcclusionFrame(const glm::mat4& viewproj, glm::vec3 eye) {
+  occlusion_buffer_t& ob = occlusionBuffer;
+  if (!ob.valid) {
+    return;
+  }
+  {
+    std::unique_lock<std::mutex> lock(ob.mutex);
+    ob.done.wait(lock, [] { return !occlusionBuffer.busy; });
+    ob.viewproj = viewproj;
+    ob.eye = eye;
+    ob.busy = true;
+    ob.fresh = true;
+  }
+  ob.wake.notify_one();
+  ob.stats.tests = 0;
+  ob.stats.hidden = 0;
+  ob.stats.testMs = 0.0;
+}
+
+// Waits for the frame begun last; false if there is none to test against.
+static bool waitOcclusionFrame(void) {
+  occlusion_buffer_t& ob = occlusionBuffer;
+  if (!ob.valid) {
+    return false;
+  }
+  uint64_t start = stm_now();
+  std::unique_lock<std::mutex> lock(ob.mutex);
+  if (!ob.fresh) {
+    return false;
+  }
+  ob.done.wait(lock, [] { return !occlusionBuffer.busy; });
+  ob.fresh = false;
+  ob.stats.waitMs = stm_ms(stm_since(start));
+  return true;
+}
+
+// True if the world-space box is behind the occluders or off screen. Only
+// valid after waitOcclusionFrame() returned true, with the same viewproj.
+static bool occlusionBoxHidden(glm::vec3 boxMin, glm::vec3 boxMax) {
+  occlusion_buffer_t& ob = occlusionBuffer;
+  uint64_t start = stm_now();
+  ob.stats.tests++;
+  glm::vec4 corners[8];
+  // Planes of the clip volume every corner lies outside of.
+  int outside = 0x3f;
+  bool straddlesNear = false;
+  for (int i = 0; i < 8; i++) {
+    corners[i] = ob.viewproj * glm::vec4((i & 1) ? boxMax.x : boxMin.x,
+                                         (i & 2) ? boxMax.y : boxMin.y,
+                                         (i & 4) ? boxMax.z : boxMin.z, 1.0f);
+    const glm::vec4& p = corners[i];
+    outside &= (p.x < -p.w ? 1 : 0) | (p.x > p.w ? 2 : 0) |
+               (p.y < -p.w ? 4 : 0) | (p.y > p.w ? 8 : 0) |
+               (p.z < -p.w ? 16 : 0) | (p.z > p.w ? 32 : 0);
+    straddlesNear |= p.z < -p.w;
+  }
+  // Off screen counts as hidden; reaching in front of the near plane does
+  // not.
+  bool hidden = outside != 0 || !straddlesNear;
+  if (outside == 0 && !straddlesNear) {
+    float minX = 1e30f, minY = 1e30f, maxX = -1e30f, maxY = -1e30f;
+    float nearest = 1.0f;
+    for (const glm::vec4& p : corners) {
+      float sx = (p.x / p.w * 0.5f + 0.5f) * OCCLUSION_WIDTH;
+      float sy = (p.y / p.w * 0.5f + 0.5f) * OCCLUSION_HEIGHT;
+      minX = glm::min(minX, sx);
+      maxX = glm::max(maxX, sx);
+      minY = glm::min(minY, sy);
+      maxY = glm::max(maxY, sy);
+      nearest = glm::min(nearest, p.z / p.w * 0.5f + 0.5f);
+    }
+    int x0 = glm::max((int)floorf(minX) - 1, 0);
+    int x1 = glm::min((int)ceilf(maxX) + 1, OCCLUSION_WIDTH - 1);
+    int y0 = glm::max((int)floorf(minY) - 1, 0);
+    int y1 = glm::min((int)ceilf(maxY) + 1, OCCLUSION_HEIGHT - 1);
+    // Visible as soon as any pixel of its footprint is farther than its
+    // nearest point.
+    for (int y = y0; y <= y1 && hidden; y++) {
+      const float* row = ob.depth + (size_t)y * OCCLUSION_WIDTH;
+      for (int x = x0; x <= x1; x++) {
+        if (row[x] >= nearest) {
+          hidden = false;
+          break;
+        }
+      }
+    }
+  }
+  ob.stats.hidden += hidden ? 1 : 0;
+  ob.stats.testMs += stm_ms(stm_since(start));
+  return hidden;
+}
+
+static occlusion_stats_t occlusionBufferStats(void) {
+  return occlusionBuffer.stats;
+}
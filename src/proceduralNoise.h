@@ -0,0 +1,381 @@
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#if !defined(PROC_NO_SIMD) &&                          \
+    (defined(__SSE2__) || defined(_M_X64) ||             \
+     (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+  #include <emmintrin.h>
+  #define PROC_SSE2
+#endif
+
+// Tileable procedural noise for texture variations. Value, gradient (Perlin)
+// and cellular (Worley F1) noise are summed over octaves (fBm) and mapped
+// between two colours into an RGBA8 tile. Every octave doubles the lattice
+// frequency and wraps the lattice at its period, so tiles repeat seamlessly.
+//
+// Four horizontally adjacent pixels are evaluated at once with SSE2 (the
+// x86-64 baseline), falling back to plain 4-wide arrays elsewhere; rows are
+// split across worker threads.
+
+#define PROC_MAX_OCTAVES (8)
+
+enum procedural_noise_t {
+  ProceduralNoise_Value = 0,
+  ProceduralNoise_Perlin,
+  ProceduralNoise_Worley,
+};
+
+// Plain data, hashed byte-wise for the cache key: zero-initialize before
+// filling it in so padding is deterministic.
+typedef struct {
+  uint32_t noise;
+  uint32_t size;       // width and height, a multiple of 4
+  uint32_t seed;
+  uint32_t frequency;  // lattice cells across the tile at the first octave
+  uint32_t octaves;
+  float gain;          // amplitude falloff per octave
+  float contrast;      // around the 0.5 midpoint
+  uint8_t lowColor[4];
+  uint8_t highColor[4];
+} procedural_params_t;
+
+//------------------------------------------------------------------------------
+// 4-wide float/int lanes
+//------------------------------------------------------------------------------
+
+#if defined(PROC_SSE2)
+struct pf4 {
+  __m128 v;
+};
+struct pi4 {
+  __m128i v;
+};
+
+static inline pf4 pf4_set(float a) { return {_mm_set1_ps(a)}; }
+static inline pf4 pf4_set(float a, float b, float c, float d) {
+  return {_mm_setr_ps(a, b, c, d)};
+}
+static inline pi4 pi4_set(uint32_t a) { return {_mm_set1_epi32((int)a)}; }
+static inline pf4 operator+(pf4 a, pf4 b) { return {_mm_add_ps(a.v, b.v)}; }
+static inline pf4 operator-(pf4 a, pf4 b) { return {_mm_sub_ps(a.v, b.v)}; }
+static inline pf4 operator*(pf4 a, pf4 b) { return {_mm_mul_ps(a.v, b.v)}; }
+static inline pf4 pf4_min(pf4 a, pf4 b) { return {_mm_min_ps(a.v, b.v)}; }
+static inline pf4 pf4_max(pf4 a, pf4 b) { return {_mm_max_ps(a.v, b.v)}; }
+static inline pf4 pf4_sqrt(pf4 a) { return {_mm_sqrt_ps(a.v)}; }
+static inline pi4 operator+(pi4 a, pi4 b) { return {_mm_add_epi32(a.v, b.v)}; }
+static inline pi4 operator^(pi4 a, pi4 b) { return {_mm_xor_si128(a.v, b.v)}; }
+static inline pi4 operator&(pi4 a, pi4 b) { return {_mm_and_si128(a.v, b.v)}; }
+static inline pi4 operator>>(pi4 a, int n) { return {_mm_srli_epi32(a.v, n)}; }
+static inline pi4 operator<<(pi4 a, int n) { return {_mm_slli_epi32(a.v, n)}; }
+// SSE2 has no 32-bit mullo; multiply even and odd lanes separately.
+static inline pi4 operator*(pi4 a, pi4 b) {
+  __m128i even = _mm_mul_epu32(a.v, b.v);
+  __m128i odd =
+      _mm_mul_epu32(_mm_srli_si128(a.v, 4), _mm_srli_si128(b.v, 4));
+  return {_mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                             _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)))};
+}
+static inline pf4 pf4_floor(pf4 a) {
+  __m128 truncated = _mm_cvtepi32_ps(_mm_cvttps_epi32(a.v));
+  __m128 tooBig = _mm_cmpgt_ps(truncated, a.v);
+  return {_mm_sub_ps(truncated, _mm_and_ps(tooBig, _mm_set1_ps(1.0f)))};
+}
+static inline pi4 pf4_to_int(pf4 a) { return {_mm_cvttps_epi32(a.v)}; }
+static inline pf4 pi4_to_float(pi4 a) { return {_mm_cvtepi32_ps(a.v)}; }
+// Wraps lattice coordinates in [-period, 2 * period) into [0, period).
+static inline pi4 pi4_wrap(pi4 a, int period) {
+  __m128i p = _mm_set1_epi32(period);
+  __m128i below = _mm_cmplt_epi32(a.v, _mm_setzero_si128());
+  __m128i above = _mm_cmpgt_epi32(a.v, _mm_set1_epi32(period - 1));
+  __m128i v = _mm_add_epi32(a.v, _mm_and_si128(below, p));
+  return {_mm_sub_epi32(v, _mm_and_si128(above, p))};
+}
+// Flips the sign of lanes whose `bit` (0 or 1) is set.
+static inline pf4 pf4_negate_if(pf4 a, pi4 bit) {
+  return {_mm_xor_ps(a.v, _mm_castsi128_ps(_mm_slli_epi32(bit.v, 31)))};
+}
+static inline void pf4_store(float* out, pf4 a) { _mm_storeu_ps(out, a.v); }
+#else
+struct pf4 {
+  float v[4];
+};
+struct pi4 {
+  uint32_t v[4];
+};
+
+#define PROC_LANES(expr)         \
+  for (int i = 0; i < 4; i++) {  \
+    r.v[i] = expr;               \
+  }
+
+static inline pf4 pf4_set(float a) {
+  return {{a, a, a, a}};
+}
+static inline pf4 pf4_set(float a, float b, float c, float d) {
+  return {{a, b, c, d}};
+}
+static inline pi4 pi4_set(uint32_t a) {
+  return {{a, a, a, a}};
+}
+static inline pf4 operator+(pf4 a, pf4 b) {
+  pf4 r;
+  PROC_LANES(a.v[i] + b.v[i]);
+  return r;
+}
+static inline pf4 operator-(pf4 a, pf4 b) {
+  pf4 r;
+  PROC_LANES(a.v[i] - b.v[i]);
+  return r;
+}
+static inline pf4 operator*(pf4 a, pf4 b) {
+  pf4 r;
+  PROC_LANES(a.v[i] * b.v[i]);
+  return r;
+}
+static inline pf4 pf4_min(pf4 a, pf4 b) {
+  pf4 r;
+  PROC_LANES(a.v[i] < b.v[i] ? a.v[i] : b.v[i]);
+  return r;
+}
+static inline pf4 pf4_max(pf4 a, pf4 b) {
+  pf4 r;
+  PROC_LANES(a.v[i] > b.v[i] ? a.v[i] : b.v[i]);
+  return r;
+}
+static inline pf4 pf4_sqrt(pf4 a) {
+  pf4 r;
+  PROC_LANES(sqrtf(a.v[i]));
+  return r;
+}
+static inline pi4 operator+(pi4 a, pi4 b) {
+  pi4 r;
+  PROC_LANES(a.v[i] + b.v[i]);
+  return r;
+}
+static inline pi4 operator^(pi4 a, pi4 b) {
+  pi4 r;
+  PROC_LANES(a.v[i] ^ b.v[i]);
+  return r;
+}
+static inline pi4 operator&(pi4 a, pi4 b) {
+  pi4 r;
+  PROC_LANES(a.v[i] & b.v[i]);
+  return r;
+}
+static inline pi4 operator>>(pi4 a, int n) {
+  pi4 r;
+  PROC_LANES(a.v[i] >> n);
+  return r;
+}
+static inline pi4 operator<<(pi4 a, int n) {
+  pi4 r;
+  PROC_LANES(a.v[i] << n);
+  return r;
+}
+static inline pi4 operator*(pi4 a, pi4 b) {
+  pi4 r;
+  PROC_LANES(a.v[i] * b.v[i]);
+  return r;
+}
+static inline pf4 pf4_floor(pf4 a) {
+  pf4 r;
+  PROC_LANES(floorf(a.v[i]));
+  return r;
+}
+static inline pi4 pf4_to_int(pf4 a) {
+  pi4 r;
+  PROC_LANES((uint32_t)(int32_t)a.v[i]);
+  return r;
+}
+static inline pf4 pi4_to_float(pi4 a) {
+  pf4 r;
+  PROC_LANES((float)(int32_t)a.v[i]);
+  return r;
+}
+static inline pi4 pi4_wrap(pi4 a, int period) {
+  pi4 r;
+  PROC_LANES((uint32_t)((int32_t)a.v[i] < 0 ? (int32_t)a.v[i] + period
+                        : (int32_t)a.v[i] >= period ? (int32_t)a.v[i] - period
+                                                   : (int32_t)a.v[i]));
+  return r;
+}
+static inline pf4 pf4_negate_if(pf4 a, pi4 bit) {
+  pf4 r;
+  PROC_LANES(bit.v[i] ? -a.v[i] : a.v[i]);
+  return r;
+}
+static inline void pf4_store(float* out, pf4 a) {
+  memcpy(out, a.v, sizeof(a.v));
+}
+
+#undef PROC_LANES
+#endif
+
+//------------------------------------------------------------------------------
+// Noise kernels, one lattice octave each, results roughly in [0, 1]
+//------------------------------------------------------------------------------
+
+static inline pi4 proc_hash(pi4 x, pi4 y, uint32_t seed) {
+  pi4 h = (x * pi4_set(0x8da6b343u)) ^ (y * pi4_set(0xd8163841u)) ^
+          pi4_set(seed);
+  h = (h ^ (h >> 15)) * pi4_set(0x2c1b3c6du);
+  h = (h ^ (h >> 12)) * pi4_set(0x297a2d39u);
+  return h ^ (h >> 15);
+}
+
+// Top 24 bits of a hash as a float in [0, 1).
+static inline pf4 proc_unit(pi4 h) {
+  return pi4_to_float(h >> 8) * pf4_set(1.0f / 16777216.0f);
+}
+
+// Quintic fade, 6t^5 - 15t^4 + 10t^3.
+static inline pf4 proc_fade(pf4 t) {
+  pf4 inner = t * (t * pf4_set(6.0f) - pf4_set(15.0f)) + pf4_set(10.0f);
+  return t * t * t * inner;
+}
+
+static inline pf4 proc_lerp(pf4 a, pf4 b, pf4 t) {
+  return a + (b - a) * t;
+}
+
+// Corner gradients are the four diagonals, picked by two hash bits.
+static inline pf4 proc_grad(pi4 h, pf4 dx, pf4 dy) {
+  return pf4_negate_if(dx, h & pi4_set(1)) +
+         pf4_negate_if(dy, (h >> 1) & pi4_set(1));
+}
+
+static pf4 proc_octave(uint32_t noise,
+                       pf4 u,
+                       pf4 v,
+                       int period,
+                       uint32_t seed) {
+  pf4 fx = pf4_floor(u);
+  pf4 fy = pf4_floor(v);
+  pf4 tx = u - fx;
+  pf4 ty = v - fy;
+  pi4 ix = pi4_wrap(pf4_to_int(fx), period);
+  pi4 iy = pi4_wrap(pf4_to_int(fy), period);
+
+  if (noise == ProceduralNoise_Worley) {
+    pf4 best = pf4_set(8.0f);
+    for (int dy = -1; dy <= 1; dy++) {
+      pi4 cy = pi4_wrap(iy + pi4_set((uint32_t)dy), period);
+      for (int dx = -1; dx <= 1; dx++) {
+        pi4 cx = pi4_wrap(ix + pi4_set((uint32_t)dx), period);
+        pi4 h = proc_hash(cx, cy, seed);
+        pf4 px = pf4_set((float)dx) + proc_unit(h) - tx;
+        pf4 py = pf4_set((float)dy) +
+                 proc_unit(h * pi4_set(0x9e3779b1u) ^ (h >> 16)) - ty;
+        best = pf4_min(best, px * px + py * py);
+      }
+    }
+    return pf4_min(pf4_sqrt(best), pf4_set(1.0f));
+  }
+
+  pi4 ix1 = pi4_wrap(ix + pi4_set(1), period);
+  pi4 iy1 = pi4_wrap(iy + pi4_set(1), period);
+  pi4 h00 = proc_hash(ix, iy, seed);
+  pi4 h10 = proc_hash(ix1, iy, seed);
+  pi4 h01 = proc_hash(ix, iy1, seed);
+  pi4 h11 = proc_hash(ix1, iy1, seed);
+  pf4 sx = proc_fade(tx);
+  pf4 sy = proc_fade(ty);
+  if (noise == ProceduralNoise_Value) {
+    return proc_lerp(proc_lerp(proc_unit(h00), proc_unit(h10), sx),
+                     proc_lerp(proc_unit(h01), proc_unit(h11), sx), sy);
+  }
+  pf4 one = pf4_set(1.0f);
+  pf4 n00 = proc_grad(h00, tx, ty);
+  pf4 n10 = proc_grad(h10, tx - one, ty);
+  pf4 n01 = proc_grad(h01, tx, ty - one);
+  pf4 n11 = proc_grad(h11, tx - one, ty - one);
+  pf4 n = proc_lerp(proc_lerp(n00, n10, sx), proc_lerp(n01, n11, sx), sy);
+  return n * pf4_set(0.5f) + pf4_set(0.5f);
+}
+
+static void proc_generate_rows(const procedural_params_t& params,
+                               uint32_t firstRow,
+                               uint32_t lastRow,
+                               uint8_t* out) {
+  const uint32_t size = params.size;
+  const uint32_t octaves = params.octaves < 1 ? 1
+                           : params.octaves > PROC_MAX_OCTAVES
+                               ? PROC_MAX_OCTAVES
+                               : params.octaves;
+  float amplitudeSum = 0.0f;
+  float amplitude = 1.0f;
+  for (uint32_t o = 0; o < octaves; o++) {
+    amplitudeSum += amplitude;
+    amplitude *= params.gain;
+  }
+  const pf4 lanes = pf4_set(0.5f, 1.5f, 2.5f, 3.5f);
+  const pf4 scale = pf4_set(1.0f / amplitudeSum);
+  float values[4];
+  for (uint32_t y = firstRow; y < lastRow; y++) {
+    for (uint32_t x = 0; x < size; x += 4) {
+      pf4 px = pf4_set((float)x) + lanes;
+      pf4 py = pf4_set((float)y + 0.5f);
+      pf4 sum = pf4_set(0.0f);
+      amplitude = 1.0f;
+      for (uint32_t o = 0; o < octaves; o++) {
+        int period = (int)(params.frequency << o);
+        pf4 toLattice = pf4_set((float)period / (float)size);
+        pf4 n = proc_octave(params.noise, px * toLattice, py * toLattice,
+                            period, params.seed + o * 0x68e31da4u);
+        sum = sum + n * pf4_set(amplitude);
+        amplitude *= params.gain;
+      }
+      pf4 t = (sum * scale - pf4_set(0.5f)) * pf4_set(params.contrast) +
+              pf4_set(0.5f);
+      t = pf4_min(pf4_max(t, pf4_set(0.0f)), pf4_set(1.0f));
+      pf4_store(values, t);
+      for (uint32_t i = 0; i < 4; i++) {
+        uint8_t* pixel = &out[((size_t)y * size + x + i) * 4];
+        for (uint32_t c = 0; c < 4; c++) {
+          float low = params.lowColor[c];
+          float high = params.highColor[c];
+          pixel[c] = (uint8_t)lrintf(low + (high - low) * values[i]);
+        }
+      }
+    }
+  }
+}
+
+// Fills `out` (size * size * 4 bytes) with the tile described by `params`.
+// Rows are split across `numThreads` workers (0 = all hardware threads).
+static bool generateProceduralTexture(const procedural_params_t& params,
+                                      uint8_t* out,
+                                      uint32_t numThreads = 0) {
+  if (params.size == 0 || params.size % 4 != 0 || params.frequency == 0) {
+    return false;
+  }
+  const uint32_t rows = params.size;
+  if (numThreads == 0) {
+    numThreads = std::thread::hardware_concurrency();
+  }
+  if (numThreads == 0 || numThreads > rows) {
+    numThreads = numThreads == 0 ? 1 : rows;
+  }
+  std::vector<std::thread> workers;
+  uint32_t rowsPerThread = (rows + numThreads - 1) / numThreads;
+  for (uint32_t t = 1; t < numThreads; t++) {
+    uint32_t first = t * rowsPerThread;
+    uint32_t last = first + rowsPerThread < rows ? first + rowsPerThread : rows;
+    if (first < last) {
+      workers.emplace_back(proc_generate_rows, std::cref(params), first, last,
+                           out);
+    }
+  }
+  proc_generate_rows(params, 0, rowsPerThread < rows ? rowsPerThread : rows,
+                     out);
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  return true;
+}
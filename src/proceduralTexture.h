@@ -0,0 +1,181 @@
+#pragma once
+
+#include "sokol_gfx.h"
+#include "sokol_time.h"
+#include "textureLoader.h"
+#include "fnvHash.h"
+#include "proceduralNoise.h"
+
+// Procedural texture variations on top of proceduralNoise.h. Tiles are
+// looked up in the on-disk cache first and generated (then cached) on a
+// miss; either way they are uploaded like a decoded loadTexture() image.
+// Cache files are keyed by a hash of the tile's parameters.
+
+#define PROCEDURAL_CACHE_DIR "."
+#define PROC_CACHE_MAGIC (0x58455450)  // 'PTEX'
+// Bump when proceduralNoise.h's output changes so stale cache files miss.
+#define PROC_CACHE_VERSION (1)
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  uint64_t paramsHash;
+} procedural_cache_header_t;
+
+static uint64_t proceduralParamsHash(const procedural_params_t& params) {
+  const uint8_t version = PROC_CACHE_VERSION;
+  return fnvHash(&version, 1, fnvHash(&params, sizeof(params)));
+}
+
+static void proceduralCachePath(const char* cacheDir,
+                                const procedural_params_t& params,
+                                char* out,
+                                size_t outSize) {
+  snprintf(out, outSize, "%s/proc_%016llx.ptex", cacheDir,
+           (unsigned long long)proceduralParamsHash(params));
+}
+
+// Reads a cached tile into `out` (size * size * 4 bytes). Returns false on
+// a miss or if the file does not match `params`.
+static bool proceduralCacheRead(const char* path,
+                                const procedural_params_t& params,
+                                uint8_t* out) {
+  FILE* fp = fopen(path, "rb");
+  if (!fp) {
+    return false;
+  }
+  procedural_cache_header_t header;
+  size_t bytes = (size_t)params.size * params.size * 4;
+  bool ok = fread(&header, sizeof(header), 1, fp) == 1 &&
+            header.magic == PROC_CACHE_MAGIC &&
+            header.version == PROC_CACHE_VERSION &&
+            header.width == params.size && header.height == params.size &&
+            header.paramsHash == proceduralParamsHash(params) &&
+            fread(out, 1, bytes, fp) == bytes;
+  fclose(fp);
+  return ok;
+}
+
+static bool proceduralCacheWrite(const char* path,
+                                 const procedural_params_t& params,
+                                 const uint8_t* pixels) {
+  FILE* fp = fopen(path, "wb");
+  if (!fp) {
+    return false;
+  }
+  procedural_cache_header_t header = {};
+  header.magic = PROC_CACHE_MAGIC;
+  header.version = PROC_CACHE_VERSION;
+  header.width = params.size;
+  header.height = params.size;
+  header.paramsHash = proceduralParamsHash(params);
+  size_t bytes = (size_t)params.size * params.size * 4;
+  bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+            fwrite(pixels, 1, bytes, fp) == bytes;
+  fclose(fp);
+  return ok;
+}
+
+enum procedural_preset_t {
+  ProceduralPreset_Moss,
+  ProceduralPreset_Cracks,
+  ProceduralPreset_Wetness,
+  ProceduralPreset_Count,
+};
+
+typedef struct {
+  int generated;
+  int cacheHits;
+  double generateMs;
+  double worstGenerateMs;
+} procedural_stats_t;
+
+static procedural_stats_t proceduralStats;
+
+static void proc_set_color(uint8_t out[4],
+                           uint8_t r,
+                           uint8_t g,
+                           uint8_t b,
+                           uint8_t a) {
+  out[0] = r;
+  out[1] = g;
+  out[2] = b;
+  out[3] = a;
+}
+
+// Overlay variations meant to be blended over a material's albedo; alpha
+// carries the coverage.
+static procedural_params_t proceduralPreset(procedural_preset_t preset,
+                                            uint32_t seed,
+                                            uint32_t size = 256) {
+  procedural_params_t params;
+  memset(&params, 0, sizeof(params));
+  params.size = size;
+  params.seed = seed;
+  params.gain = 0.5f;
+  switch (preset) {
+    case ProceduralPreset_Moss:
+      params.noise = ProceduralNoise_Perlin;
+      params.frequency = 4;
+      params.octaves = 5;
+      params.contrast = 2.5f;
+      proc_set_color(params.lowColor, 40, 70, 20, 0);
+      proc_set_color(params.highColor, 70, 110, 30, 230);
+      break;
+    case ProceduralPreset_Cracks:
+      params.noise = ProceduralNoise_Worley;
+      params.frequency = 6;
+      params.octaves = 2;
+      params.gain = 0.35f;
+      params.contrast = 4.0f;
+      proc_set_color(params.lowColor, 15, 12, 10, 220);
+      proc_set_color(params.highColor, 15, 12, 10, 0);
+      break;
+    case ProceduralPreset_Wetness:
+    default:
+      params.noise = ProceduralNoise_Value;
+      params.frequency = 3;
+      params.octaves = 4;
+      params.contrast = 1.5f;
+      proc_set_color(params.lowColor, 30, 40, 50, 0);
+      proc_set_color(params.highColor, 30, 40, 50, 140);
+      break;
+  }
+  return params;
+}
+
+// Fills `imgLoc` with the tile described by `params`. Generation runs on
+// the calling thread plus workers and blocks until done, so call this at
+// load time rather than mid-frame.
+static bool loadProceduralTexture(const procedural_params_t& params,
+                                  sg_image imgLoc) {
+  size_t bytes = (size_t)params.size * params.size * 4;
+  uint8_t* pixels = (uint8_t*)arenaAlloc(&decodeArena, bytes);
+  if (!pixels) {
+    return false;
+  }
+  char path[MAX_PATH_LEN];
+  proceduralCachePath(PROCEDURAL_CACHE_DIR, params, path, sizeof(path));
+  if (proceduralCacheRead(path, params, pixels)) {
+    proceduralStats.cacheHits++;
+  } else {
+    uint64_t start = stm_now();
+    if (!generateProceduralTexture(params, pixels)) {
+      decode_free(pixels);
+      return false;
+    }
+    double ms = stm_ms(stm_since(start));
+    proceduralStats.generated++;
+    proceduralStats.generateMs += ms;
+    if (ms > proceduralStats.worstGenerateMs) {
+      proceduralStats.worstGenerateMs = ms;
+    }
+    // A failed write only costs a regeneration next time.
+    proceduralCacheWrite(path, params, pixels);
+  }
+  queueRGBA8Upload(imgLoc, pixels, (int)params.size, (int)params.size,
+                   decode_free);
+  return true;
+}
@@ -0,0 +1,179 @@
+// Headless check of proceduralNoise.h: generates tiles of every noise type
+// over a few seeds, frequencies and octave counts and compares them
+//
+//   - with the same tile from the scalar build (procedural_check_scalar.cpp,
+//     PROC_NO_SIMD), which must match byte for byte;
+//   - with the same tile generated on one thread;
+//   - across their wrap edges, which must be no rougher than between any
+//     two neighbouring pixels inside the tile.
+//
+//   procedural-check [--size N] [--seeds N]
+//
+// Exits non-zero if any tile fails. Without SSE2 both builds are scalar and
+// the first comparison only checks determinism.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+#include "proceduralNoise.h"
+
+bool generateScalarProceduralTexture(const void* params,
+                                     uint8_t* out,
+                                     uint32_t numThreads);
+
+typedef struct {
+  double meanDiff;
+  int maxDiff;
+} neighbour_diff_t;
+
+static void add_diff(const uint8_t* a,
+                     const uint8_t* b,
+                     double* sum,
+                     int* max) {
+  for (int c = 0; c < 4; c++) {
+    int diff = abs((int)a[c] - (int)b[c]);
+    *sum += diff;
+    *max = diff > *max ? diff : *max;
+  }
+}
+
+// Channel differences between horizontal and vertical neighbours, either
+// inside the tile or across its wrap edges.
+static neighbour_diff_t neighbour_diff(const uint8_t* pixels,
+                                       uint32_t size,
+                                       bool seams) {
+  neighbour_diff_t result = {};
+  double sum = 0.0;
+  size_t pairs = 0;
+  for (uint32_t y = 0; y < size; y++) {
+    for (uint32_t x = 0; x < size; x++) {
+      bool rightSeam = x + 1 == size;
+      bool downSeam = y + 1 == size;
+      const uint8_t* p = &pixels[((size_t)y * size + x) * 4];
+      if (rightSeam == seams) {
+        add_diff(p, &pixels[((size_t)y * size + (x + 1) % size) * 4], &sum,
+                 &result.maxDiff);
+        pairs++;
+      }
+      if (downSeam == seams) {
+        add_diff(p, &pixels[((size_t)((y + 1) % size) * size + x) * 4], &sum,
+                 &result.maxDiff);
+        pairs++;
+      }
+    }
+  }
+  result.meanDiff = pairs > 0 ? sum / (pairs * 4) : 0.0;
+  return result;
+}
+
+static size_t count_mismatches(const std::vector<uint8_t>& a,
+                               const std::vector<uint8_t>& b) {
+  size_t count = 0;
+  for (size_t i = 0; i < a.size(); i++) {
+    count += a[i] != b[i];
+  }
+  return count;
+}
+
+int main(int argc, char* argv[]) {
+  uint32_t size = 256;
+  uint32_t seeds = 4;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+      size = (uint32_t)atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--seeds") == 0 && i + 1 < argc) {
+      seeds = (uint32_t)atoi(argv[++i]);
+    } else {
+      fprintf(stderr, "usage: procedural-check [--size N] [--seeds N]\n");
+      return 2;
+    }
+  }
+  if (size == 0 || size % 4 != 0) {
+    fprintf(stderr, "procedural-check: size must be a multiple of 4\n");
+    return 2;
+  }
+
+#if defined(PROC_SSE2)
+  printf("comparing SSE2 against scalar, %ux%u tiles\n", size, size);
+#else
+  printf("no SSE2 in this build, comparing scalar against scalar, %ux%u "
+         "tiles\n",
+         size, size);
+#endif
+  static const char* noiseNames[] = {"value", "perlin", "worley"};
+  static const uint32_t frequencies[] = {1, 3, 8};
+  static const uint32_t octaves[] = {1, 5};
+  printf("%-7s %4s %4s %3s %9s %11s %11s %11s %11s\n", "noise", "seed",
+         "freq", "oct", "simd ms", "scalar ms", "seam mean", "inner mean",
+         "seam max");
+
+  size_t bytes = (size_t)size * size * 4;
+  std::vector<uint8_t> simd(bytes), scalar(bytes), single(bytes);
+  double simdMs = 0.0;
+  double scalarMs = 0.0;
+  int failures = 0;
+  for (uint32_t noise = 0; noise <= ProceduralNoise_Worley; noise++) {
+    for (uint32_t seed = 1; seed <= seeds; seed++) {
+      for (uint32_t frequency : frequencies) {
+        for (uint32_t octaveCount : octaves) {
+          procedural_params_t params;
+          memset(&params, 0, sizeof(params));
+          params.noise = noise;
+          params.size = size;
+          params.seed = seed * 0x9e3779b9u;
+          params.frequency = frequency;
+          params.octaves = octaveCount;
+          params.gain = 0.5f;
+          params.contrast = 2.0f;
+          uint8_t low[4] = {0, 64, 255, 0};
+          uint8_t high[4] = {255, 192, 0, 255};
+          memcpy(params.lowColor, low, sizeof(low));
+          memcpy(params.highColor, high, sizeof(high));
+
+          auto start = std::chrono::steady_clock::now();
+          generateProceduralTexture(params, simd.data(), 1);
+          auto mid = std::chrono::steady_clock::now();
+          generateScalarProceduralTexture(&params, scalar.data(), 1);
+          auto end = std::chrono::steady_clock::now();
+          generateProceduralTexture(params, single.data());
+          double tileSimdMs =
+              std::chrono::duration<double, std::milli>(mid - start).count();
+          double tileScalarMs =
+              std::chrono::duration<double, std::milli>(end - mid).count();
+          simdMs += tileSimdMs;
+          scalarMs += tileScalarMs;
+
+          neighbour_diff_t seam = neighbour_diff(simd.data(), size, true);
+          neighbour_diff_t inner = neighbour_diff(simd.data(), size, false);
+          size_t scalarMismatches = count_mismatches(simd, scalar);
+          size_t threadMismatches = count_mismatches(simd, single);
+          // A tile that doesn't wrap jumps between unrelated values at its
+          // edges, well past the typical step between neighbours.
+          bool seamless = seam.maxDiff <= inner.maxDiff &&
+                          seam.meanDiff <= inner.meanDiff * 2.0 + 1.0;
+          printf("%-7s %4u %4u %3u %9.2f %11.2f %11.2f %11.2f %5d/%-5d%s\n",
+                 noiseNames[noise], seed, frequency, octaveCount, tileSimdMs,
+                 tileScalarMs, seam.meanDiff, inner.meanDiff, seam.maxDiff,
+                 inner.maxDiff, seamless ? "" : "  SEAM");
+          if (scalarMismatches > 0) {
+            printf("%-7s %zu bytes differ from the scalar build\n", "",
+                   scalarMismatches);
+          }
+          if (threadMismatches > 0) {
+            printf("%-7s %zu bytes differ between thread counts\n", "",
+                   threadMismatches);
+          }
+          if (!seamless || scalarMismatches > 0 || threadMismatches > 0) {
+            failures++;
+          }
+        }
+      }
+    }
+  }
+  printf("single-threaded total: simd %.1f ms, scalar %.1f ms (%.2fx)\n",
+         simdMs, scalarMs, simdMs > 0.0 ? scalarMs / simdMs : 0.0);
+  printf("%d tiles failed\n", failures);
+  return failures == 0 ? 0 : 1;
+}
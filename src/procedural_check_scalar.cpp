@@ -0,0 +1,25 @@
+// The scalar half of procedural-check: proceduralNoise.h built with
+// PROC_NO_SIMD, inside its own namespace so its plain-array pf4/pi4 don't
+// clash with the SSE2 ones in procedural_check.cpp.
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#define PROC_NO_SIMD
+namespace proc_scalar {
+#include "proceduralNoise.h"
+}
+
+// `params` is a procedural_params_t from the SIMD build; the struct is
+// plain data with the same layout in both.
+bool generateScalarProceduralTexture(const void* params,
+                                     uint8_t* out,
+                                     uint32_t numThreads) {
+  proc_scalar::procedural_params_t scalarParams;
+  memcpy(&scalarParams, params, sizeof(scalarParams));
+  return proc_scalar::generateProceduralTexture(scalarParams, out,
+                                                numThreads);
+}
@@ -0,0 +1,281 @@
+#pragma once
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <utility>
+#include <vector>
+#include "sokol_gfx.h"
+#include "sokol_time.h"
+
+// Sort-keyed draw queue for one sokol pass. Renderers register the frame's
+// pipelines and bindings, then queue draws under a 64-bit key instead of
+// calling sg_apply_* themselves; submitRenderQueue() radix sorts the draws
+// by key and submits them in that order, applying a pipeline or bindings
+// only when they differ from the previous draw's.
+//
+// renderQueueKey() orders by state, from the most significant bits down:
+//
+//   63..60  layer      render_layer_t, drawn in order
+//   59..48  pipeline   id from renderQueuePipeline()
+//   47..32  bindings   id from renderQueueBindings(), i.e. the material
+//   31..0   depth      distance from the eye, front to back
+//
+// so state changes at most once per pipeline and material, and draws
+// sharing both go front to back for early depth rejection.
+// renderQueueDepthKey() moves the depth up under the layer instead, for
+// strictly front-to-back order at the cost of more state changes.
+
+#define RENDER_QUEUE_MAX_PIPELINES (1 << 12)
+#define RENDER_QUEUE_MAX_BINDINGS (1 << 16)
+// Uniform blocks applied along with each pipeline.
+#define RENDER_QUEUE_MAX_PIPELINE_UNIFORMS (4)
+
+enum render_layer_t {
+  RenderLayer_DepthPrepass = 0,
+  RenderLayer_Opaque,
+  RenderLayer_Overlay,
+  RenderLayer_Count
+};
+
+typedef struct {
+  int draws;
+  int pipelineChanges;
+  int bindingChanges;
+  double sortMs;
+  // Sorting and issuing the sg_* calls.
+  double submitMs;
+} render_queue_stats_t;
+
+typedef struct {
+  uint8_t stage;
+  uint8_t slot;
+  uint16_t size;
+  uint32_t offset;
+} render_uniforms_t;
+
+typedef struct {
+  sg_pipeline pipeline;
+  int numUniforms;
+  render_uniforms_t uniforms[RENDER_QUEUE_MAX_PIPELINE_UNIFORMS];
+} render_pipeline_t;
+
+typedef struct {
+  uint16_t pipeline;
+  uint16_t bindings;
+  // Per-draw uniform block; size 0 for none.
+  render_uniforms_t uniforms;
+  int baseElement;
+  int numElements;
+  int numInstances;
+} render_item_t;
+
+typedef struct {
+  uint64_t key;
+  uint32_t item;
+} render_sort_t;
+
+typedef struct {
+  std::vector<render_pipeline_t> pipelines;
+  std::vector<sg_bindings> bindings;
+  std::vector<render_item_t> items;
+  std::vector<render_sort_t> keys;
+  std::vector<render_sort_t> scratch;
+  // Copies of the uniform blocks, 16-byte aligned.
+  std::vector<uint8_t> uniformData;
+  render_queue_stats_t stats;
+} render_queue_t;
+
+static render_queue_t renderQueue;
+
+// Drops the last frame's pipelines, bindings and draws.
+static void beginRenderQueue(void) {
+  render_queue_t& rq = renderQueue;
+  rq.pipelines.clear();
+  rq.bindings.clear();
+  rq.items.clear();
+  rq.keys.clear();
+  rq.uniformData.clear();
+}
+
+static render_uniforms_t render_queue_copy_uniforms(sg_shader_stage stage,
+                                                    int slot,
+                                                    const sg_range& data) {
+  render_queue_t& rq = renderQueue;
+  assert(data.size <= UINT16_MAX);
+  render_uniforms_t uniforms;
+  uniforms.stage = (uint8_t)stage;
+  uniforms.slot = (uint8_t)slot;
+  uniforms.size = (uint16_t)data.size;
+  uniforms.offset = (uint32_t)rq.uniformData.size();
+  rq.uniformData.resize(uniforms.offset + ((data.size + 15) & ~(size_t)15));
+  memcpy(&rq.uniformData[uniforms.offset], data.ptr, data.size);
+  return uniforms;
+}
+
+// Registers a pipeline for this frame and returns its id for the key.
+static uint32_t renderQueuePipeline(sg_pipeline pipeline) {
+  render_queue_t& rq = renderQueue;
+  assert(rq.pipelines.size() < RENDER_QUEUE_MAX_PIPELINES);
+  render_pipeline_t entry = {};
+  entry.pipeline = pipeline;
+  rq.pipelines.push_back(entry);
+  return (uint32_t)rq.pipelines.size() - 1;
+}
+
+// Adds a uniform block that is applied, copied as it is now, every time
+// `pipeline` is.
+static void renderQueuePipelineUniforms(uint32_t pipeline,
+                                        sg_shader_stage stage,
+                                        int slot,
+                                        const sg_range& data) {
+  render_pipeline_t& entry = renderQueue.pipelines[pipeline];
+  assert(entry.numUniforms < RENDER_QUEUE_MAX_PIPELINE_UNIFORMS);
+  entry.uniforms[entry.numUniforms++] =
+      render_queue_copy_uniforms(stage, slot, data);
+}
+
+// Registers a copy of `bindings` for this frame and returns its id.
+static uint32_t renderQueueBindings(const sg_bindings& bindings) {
+  render_queue_t& rq = renderQueue;
+  assert(rq.bindings.size() < RENDER_QUEUE_MAX_BINDINGS);
+  rq.bindings.push_back(bindings);
+  return (uint32_t)rq.bindings.size() - 1;
+}
+
+// Non-negative floats order the same as their bit patterns.
+static uint32_t render_queue_depth_bits(float depth) {
+  uint32_t bits;
+  depth = depth > 0.0f ? depth : 0.0f;
+  memcpy(&bits, &depth, sizeof(bits));
+  return bits;
+}
+
+// `depth` is any non-negative distance; nearer sorts first.
+static uint64_t renderQueueKey(render_layer_t layer,
+                               uint32_t pipeline,
+                               uint32_t bindings,
+                               float depth) {
+  return ((uint64_t)layer << 60) | ((uint64_t)pipeline << 48) |
+         ((uint64_t)bindings << 32) | render_queue_depth_bits(depth);
+}
+
+// Front to back within the layer; draws at the same depth by state.
+static uint64_t renderQueueDepthKey(render_layer_t layer,
+                                    uint32_t pipeline,
+                                    uint32_t bindings,
+                                    float depth) {
+  return ((uint64_t)layer << 60) |
+         ((uint64_t)render_queue_depth_bits(depth) << 28) |
+         ((uint64_t)pipeline << 16) | bindings;
+}
+
+// Queues an indexed or non-indexed draw, as sg_draw(), with an optional
+// uniform block copied for it. Pass an empty `uniforms` range for none.
+static void renderQueueDraw(uint64_t key,
+                            uint32_t pipeline,
+                            uint32_t bindings,
+                            int baseElement,
+                            int numElements,
+                            int numInstances,
+                            sg_shader_stage stage,
+                            int slot,
+                            const sg_range& uniforms) {
+  render_queue_t& rq = renderQueue;
+  render_item_t item = {};
+  item.pipeline = (uint16_t)pipeline;
+  item.bindings = (uint16_t)bindings;
+  if (uniforms.size > 0) {
+    item.uniforms = render_queue_copy_uniforms(stage, slot, uniforms);
+  }
+  item.baseElement = baseElement;
+  item.numElements = numElements;
+  item.numInstances = numInstances;
+  rq.keys.push_back({key, (uint32_t)rq.items.size()});
+  rq.items.push_back(item);
+}
+
+// LSD radix sort on 8-bit digits, skipping the digits every key shares;
+// usually most of the layer, pipeline and bindings bytes.
+static void render_queue_sort(void) {
+  render_queue_t& rq = renderQueue;
+  size_t count = rq.keys.size();
+  rq.scratch.resize(count);
+  render_sort_t* src = rq.keys.data();
+  render_sort_t* dst = rq.scratch.data();
+  for (int shift = 0; shift < 64; shift += 8) {
+    uint32_t histogram[256] = {};
+    for (size_t i = 0; i < count; i++) {
+      histogram[(src[i].key >> shift) & 0xff]++;
+    }
+    if (histogram[(src[0].key >> shift) & 0xff] == count) {
+      continue;
+    }
+    uint32_t offset = 0;
+    for (int digit = 0; digit < 256; digit++) {
+      uint32_t n = histogram[digit];
+      histogram[digit] = offset;
+      offset += n;
+    }
+    for (size_t i = 0; i < count; i++) {
+      dst[histogram[(src[i].key >> shift) & 0xff]++] = src[i];
+    }
+    std::swap(src, dst);
+  }
+  if (src != rq.keys.data()) {
+    rq.keys.swap(rq.scratch);
+  }
+}
+
+static void render_queue_apply_uniforms(const render_uniforms_t& uniforms) {
+  sg_range range = {&renderQueue.uniformData[uniforms.offset], uniforms.size};
+  sg_apply_uniforms((sg_shader_stage)uniforms.stage, uniforms.slot, range);
+}
+
+// Sorts and draws everything queued since beginRenderQueue() into the
+// current pass.
+static void submitRenderQueue(void) {
+  render_queue_t& rq = renderQueue;
+  uint64_t start = stm_now();
+  rq.stats = {};
+  rq.stats.draws = (int)rq.keys.size();
+  if (rq.keys.empty()) {
+    return;
+  }
+  render_queue_sort();
+  rq.stats.sortMs = stm_ms(stm_since(start));
+
+  uint32_t pipeline = UINT32_MAX;
+  uint32_t bindings = UINT32_MAX;
+  for (const render_sort_t& entry : rq.keys) {
+    const render_item_t& item = rq.items[entry.item];
+    uint32_t nextPipeline = item.pipeline;
+    uint32_t nextBindings = item.bindings;
+    if (nextPipeline != pipeline) {
+      const render_pipeline_t& pip = rq.pipelines[nextPipeline];
+      sg_apply_pipeline(pip.pipeline);
+      for (int i = 0; i < pip.numUniforms; i++) {
+        render_queue_apply_uniforms(pip.uniforms[i]);
+      }
+      pipeline = nextPipeline;
+      // A new pipeline needs its bindings applied again.
+      bindings = UINT32_MAX;
+      rq.stats.pipelineChanges++;
+    }
+    if (nextBindings != bindings) {
+      sg_apply_bindings(&rq.bindings[nextBindings]);
+      bindings = nextBindings;
+      rq.stats.bindingChanges++;
+    }
+    if (item.uniforms.size > 0) {
+      render_queue_apply_uniforms(item.uniforms);
+    }
+    sg_draw(item.baseElement, item.numElements, item.numInstances);
+  }
+  rq.stats.submitMs = stm_ms(stm_since(start));
+}
+
+// Draws, state changes and timings of the last submitRenderQueue().
+static render_queue_stats_t renderQueueStats(void) {
+  return renderQueue.stats;
+}
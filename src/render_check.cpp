@@ -0,0 +1,269 @@
+// Headless render check: sets up sokol_gfx, builds a dungeon and records a
+// few frames through both the forward and the deferred lighting paths in
+// each draw order, then reports the CPU cost of each pass. Built against
+// sokol's dummy backend (DUNGEON_DUMMY_BACKEND) it needs no GPU or window,
+// so CI can run it and sokol's validation layer checks every resource and
+// pass in debug builds. It also loads each procedural texture preset
+// (proceduralTexture.h) through the upload queue.
+//
+//   render-check [--frames N] [--width W] [--height H]
+//
+// Exits non-zero if sokol_gfx is not valid afterwards, a G-buffer target
+// failed to build or a procedural texture didn't upload.
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "glm/glm.hpp"
+#include "glm/gtc/matrix_transform.hpp"
+
+#include "sokol_gfx.h"
+#include "sokol_time.h"
+
+#include "allocators.h"
+#include "dungeon.h"
+#include "dungeon_generator.h"
+#include "proceduralTexture.h"
+
+#define CHECK_DUNGEON_SIZE (25)
+#define CHECK_TORCHES (200)
+#define CHECK_PROCEDURAL_SIZE (128)
+#define CHECK_UPLOAD_PUMPS (64)
+
+typedef struct {
+  double frameMs;
+  double geometryMs;
+  double lightMs;
+  double composeMs;
+  double portalMs;
+  double occluderMs;
+  double occlusionTestMs;
+  double sortMs;
+  double submitMs;
+  int lights;
+  int cells;
+  int occluders;
+  int hiddenCells;
+  int surfaces;
+  int triangles;
+  int pipelineChanges;
+  int bindingChanges;
+} check_result_t;
+
+static bool check_targets_valid(void) {
+  const deferred_lighting_t& dl = deferredLighting;
+  for (int i = 0; i < DeferredTarget_Count; i++) {
+    if (sg_query_image_state(dl.targets[i]) != SG_RESOURCESTATE_VALID) {
+      return false;
+    }
+  }
+  return sg_query_image_state(dl.depth) == SG_RESOURCESTATE_VALID;
+}
+
+static check_result_t check_path(Dungeon* dungeon,
+                                 lighting_path_t path,
+                                 DungeonDrawOrder order,
+                                 int frames,
+                                 int width,
+                                 int height) {
+  check_result_t result = {};
+  glm::vec3 eye(0.0f, 0.5f, 0.0f);
+  glm::mat4 projection =
+      glm::perspective(glm::radians(45.0f), (float)width / (float)height,
+                       0.1f, dungeon->detail().farDistance);
+  sg_pass_action action = {0};
+  action.colors[0].action = SG_ACTION_CLEAR;
+  action.colors[0].value = sg_color{DUNGEON_FOG_COLOR.x, DUNGEON_FOG_COLOR.y,
+                                    DUNGEON_FOG_COLOR.z, 1.0f};
+
+  dungeon->set_lighting_path(path);
+  dungeon->set_draw_order(order);
+  for (int frame = 0; frame < frames; frame++) {
+    uint64_t start = stm_now();
+    float time = (float)frame / 60.0f;
+    glm::mat4 view =
+        glm::lookAt(eye, eye + glm::vec3(sinf(time), 0.0f, cosf(time)),
+                    glm::vec3(0.0f, 1.0f, 0.0f));
+    glm::mat4 viewproj = projection * view;
+    dungeon->begin_occlusion(viewproj, eye);
+    texturePump();
+    dungeon->carry_light(eye);
+    dungeon->update_lights(time);
+    if (path == LightingPath_Deferred) {
+      beginDeferredGeometryPass(width, height, action.colors[0].value);
+      dungeon->render(viewproj, eye);
+      endDeferredGeometryPass();
+      dungeon->render_lights(viewproj, eye);
+      sg_begin_default_pass(&action, width, height);
+      composeDeferredLighting();
+      sg_end_pass();
+      deferred_stats_t stats = deferredLightingStats();
+      result.geometryMs += stats.geometryMs;
+      result.lightMs += stats.lightMs;
+      result.composeMs += stats.composeMs;
+      result.lights = stats.lights;
+    } else {
+      uint64_t passStart = stm_now();
+      sg_begin_default_pass(&action, width, height);
+      dungeon->render(viewproj, eye);
+      sg_end_pass();
+      result.geometryMs += stm_ms(stm_since(passStart));
+    }
+    sg_commit();
+    DungeonPortalStats portals = dungeon->portal_stats();
+    result.portalMs += portals.visitMs;
+    result.cells = portals.visibleCells;
+    occlusion_stats_t occlusion = occlusionBufferStats();
+    result.occluderMs += occlusion.occluderMs;
+    result.occlusionTestMs += occlusion.testMs;
+    result.occluders = occlusion.occluders;
+    result.hiddenCells = occlusion.hidden;
+    result.surfaces = (int)dungeon->drawn_surface_count();
+    result.triangles = (int)dungeon->drawn_triangle_count();
+    render_queue_stats_t queue = renderQueueStats();
+    result.sortMs += queue.sortMs;
+    result.submitMs += queue.submitMs;
+    result.pipelineChanges = queue.pipelineChanges;
+    result.bindingChanges = queue.bindingChanges;
+    result.frameMs += stm_ms(stm_since(start));
+  }
+  result.frameMs /= frames;
+  result.geometryMs /= frames;
+  result.lightMs /= frames;
+  result.composeMs /= frames;
+  result.portalMs /= frames;
+  result.occluderMs /= frames;
+  result.occlusionTestMs /= frames;
+  result.sortMs /= frames;
+  result.submitMs /= frames;
+  return result;
+}
+
+// Loads every preset and pumps the upload queue until they are all valid.
+static bool check_procedural_textures(sg_image images[]) {
+  static const char* names[ProceduralPreset_Count] = {"moss", "cracks",
+                                                      "wetness"};
+  bool ok = true;
+  for (int i = 0; i < ProceduralPreset_Count; i++) {
+    images[i] = sg_alloc_image();
+    procedural_params_t params = proceduralPreset(
+        (procedural_preset_t)i, (uint32_t)i + 1, CHECK_PROCEDURAL_SIZE);
+    if (!loadProceduralTexture(params, images[i])) {
+      fprintf(stderr, "procedural: %s failed to generate\n", names[i]);
+      ok = false;
+    }
+  }
+  for (int pump = 0; pump < CHECK_UPLOAD_PUMPS; pump++) {
+    texturePump();
+  }
+  for (int i = 0; i < ProceduralPreset_Count; i++) {
+    if (sg_query_image_state(images[i]) != SG_RESOURCESTATE_VALID) {
+      fprintf(stderr, "procedural: %s did not upload\n", names[i]);
+      ok = false;
+    }
+  }
+  printf("procedural: %d generated in %.1f ms (worst %.1f ms), %d cached\n",
+         proceduralStats.generated, proceduralStats.generateMs,
+         proceduralStats.worstGenerateMs, proceduralStats.cacheHits);
+  return ok;
+}
+
+int main(int argc, char* argv[]) {
+  int frames = 8;
+  int width = 1280;
+  int height = 720;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      frames = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--width") == 0 && i + 1 < argc) {
+      width = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--height") == 0 && i + 1 < argc) {
+      height = atoi(argv[++i]);
+    } else {
+      fprintf(stderr,
+              "usage: render-check [--frames N] [--width W] [--height H]\n");
+      return 2;
+    }
+  }
+  frames = frames > 0 ? frames : 1;
+
+  sg_desc d = {0};
+  // Draws straight into a 4x MSAA default pass, the anti-aliasing
+  // dungeon-sapp starts with; the surface pipelines follow the context.
+  d.context.sample_count = 4;
+  d.allocator.alloc = sokolAlloc;
+  d.allocator.free = sokolFree;
+  d.allocator.user_data = (void*)(intptr_t)MemTag_Gfx;
+  sg_setup(&d);
+  assert(sg_isvalid());
+  stm_setup();
+  initTextureLoader();
+  initTextureStreamer(STREAM_DEFAULT_BUDGET);
+
+  Dungeon* dungeon = new Dungeon();
+  dungeon->create(generate_new_dungeon(CHECK_DUNGEON_SIZE, CHECK_DUNGEON_SIZE));
+  // Unbaked, so the point lights reach both paths' light loops.
+  dungeon->place_torches(CHECK_TORCHES);
+
+  int failures = 0;
+  sg_image proceduralImages[ProceduralPreset_Count];
+  if (!check_procedural_textures(proceduralImages)) {
+    failures++;
+  }
+  static const char* names[LightingPath_Count] = {"forward", "deferred"};
+  static const char* orders[DungeonDrawOrder_Count] = {"state", "front",
+                                                       "prepass"};
+  printf("%-9s %-7s %9s %11s %9s %11s %9s %7s %6s %9s %10s\n", "path",
+         "order", "frame ms", "geometry ms", "light ms", "compose ms",
+         "portal ms", "lights", "cells", "surfaces", "triangles");
+  for (int path = 0; path < LightingPath_Count; path++) {
+    if (path == LightingPath_Deferred && !deferredLightingSupported()) {
+      printf("%-9s unsupported by this backend\n", names[path]);
+      failures++;
+      continue;
+    }
+    for (int order = 0; order < DungeonDrawOrder_Count; order++) {
+      check_result_t result =
+          check_path(dungeon, (lighting_path_t)path, (DungeonDrawOrder)order,
+                     frames, width, height);
+      printf("%-9s %-7s %9.3f %11.3f %9.3f %11.3f %9.3f %7d %6d %9d %10d\n",
+             names[path], orders[order], result.frameMs, result.geometryMs,
+             result.lightMs, result.composeMs, result.portalMs,
+             result.lights, result.cells, result.surfaces, result.triangles);
+      printf("%-17s %d pipeline and %d binding changes, sort %.3f ms, "
+             "submit %.3f ms\n",
+             "", result.pipelineChanges, result.bindingChanges,
+             result.sortMs, result.submitMs);
+      if (order == DungeonDrawOrder_State) {
+        printf("%-17s %d occluders in %.3f ms, %d cells hidden, tests "
+               "%.3f ms\n",
+               "", result.occluders, result.occluderMs, result.hiddenCells,
+               result.occlusionTestMs);
+      }
+    }
+    if (path == LightingPath_Deferred && !check_targets_valid()) {
+      fprintf(stderr, "deferred: G-buffer targets failed to build\n");
+      failures++;
+    }
+  }
+  if (!sg_isvalid()) {
+    fprintf(stderr, "sokol_gfx is no longer valid\n");
+    failures++;
+  }
+
+  delete dungeon;
+  for (int i = 0; i < ProceduralPreset_Count; i++) {
+    sg_destroy_image(proceduralImages[i]);
+  }
+  destroyOcclusionBuffer();
+  destroyDeferredLighting();
+  destroyFloodLight();
+  destroyLightClusters();
+  destroyMaterials();
+  destroyTextureRegistry();
+  destroyTextureStreamer();
+  destroyTextureLoader();
+  sg_shutdown();
+  return failures == 0 ? 0 : 1;
+}
@@ -1,3 +1,7 @@
+#include <stdio.h>
+#include <mutex>
+#include <thread>
+
 #include "glm/glm.hpp"
 #include "glm/gtc/matrix_transform.hpp"
 
@@ -6,13 +10,51 @@
 #include "sokol_glue.h"
 #include "sokol_time.h"
 
+#include "allocators.h"
 #include "dungeon_camera.h"
 #include "dungeon.h"
 #include "dungeon_generator.h"
+#include "dynamicResolution.h"
+#include "fixedStep.h"
+#include "framePacing.h"
+#include "frameSnapshot.h"
 
 const int ScreenWidth = 1920;
 const int ScreenHeight = 1080;
 const float KeyCooldownTime = 0.15f;
+const uint64_t TextureBudgetBytes = STREAM_DEFAULT_BUDGET;
+const uint32_t TorchCount = 500;
+// Every Nth torch flickers as a clustered light; the rest are baked into a
+// lightmap. 1 keeps them all dynamic, 0 bakes them all.
+const uint32_t DynamicTorchEvery = 8;
+const float LightmapTexelsPerUnit = LIGHTMAP_DEFAULT_DENSITY;
+const uint32_t LightmapBounceSamples = 16;
+// World units per press of the detail keys.
+const float DetailStep = 4.0f;
+// Dynamic resolution holds frames to this.
+const double FrameTargetMs = 1000.0 / 60.0;
+const int SimStepsPerSecond = FIXED_STEP_DEFAULT_HZ;
+
+// Keys the simulation reads, as held and pressed since its last step.
+enum sim_key_t {
+  SimKey_Forward = 0,
+  SimKey_Backward,
+  SimKey_Left,
+  SimKey_Right,
+  SimKey_TurnLeft,
+  SimKey_TurnRight,
+  SimKey_Count
+};
+
+// What the render thread's events tell the simulation thread.
+typedef struct {
+  // A tap shorter than a step still counts as a press.
+  bool keyHeld[SimKey_Count];
+  bool keyPressed[SimKey_Count];
+  int screenWidth;
+  int screenHeight;
+  DungeonCullSettings cull;
+} sim_controls_t;
 
 typedef struct {
   int screenWidth;
@@ -26,49 +68,321 @@ typedef struct {
   bool showWireframe;
   bool freeLook;
   float lastX, lastY;
-  float deltaTime, lastPress, keyCooldown;
+  float deltaTime, keyCooldown;
   uint64_t lastFrameTimestamp;
+  // Set on the render thread, taken by the simulation thread.
+  std::mutex controlsMutex;
+  sim_controls_t controls;
+  // The simulation thread's own, along with the camera: the presses it has
+  // taken but not stepped yet, simulated seconds until a held key repeats,
+  // and the camera as of the previous step, which frames draw on from.
+  std::thread simThread;
+  bool keyPressed[SimKey_Count];
+  float moveCooldown;
+  glm::vec3 prevPosition, prevFront;
+  // What the render thread draws this frame.
+  const frame_snapshot_t* snapshot;
+  uint64_t lastSnapshot;
+  // Since the draw order or anti-aliasing last changed: CPU time in frame(),
+  // the simulation thread's time per snapshot, and the time between frames,
+  // which the GPU bounds once it is the bottleneck.
+  double modeCpuMs, modeSimMs, modeFrameMs;
+  int modeSimFrames;
+  int modeFrames;
+  // The dynamic resolution scale last reported.
+  float sceneScale;
 } app_state_t;
 
 static app_state_t app_state;
 
+// Hands the dungeon's current culling settings to the simulation thread.
+void sendCullSettings() {
+  std::lock_guard<std::mutex> lock(app_state.controlsMutex);
+  app_state.controls.cull = app_state.dungeon->cull_settings();
+}
+
+// Moves the LOD distance, or the far distance together with the fog band,
+// and reports what the last frame drew.
+void adjustDetail(float coarseStep, float farStep) {
+  Dungeon* dungeon = app_state.dungeon;
+  DungeonDetail detail = dungeon->detail();
+  detail.coarseDistance = glm::max(detail.coarseDistance + coarseStep, 0.0f);
+  if (detail.farDistance + farStep >= DetailStep) {
+    detail.farDistance += farStep;
+    detail.fogStart = glm::max(detail.fogStart + farStep, 0.0f);
+  }
+  dungeon->set_detail(detail);
+  sendCullSettings();
+  printf("coarse past %.0f, fog %.0f to %.0f, %u triangles\n",
+         detail.coarseDistance, detail.fogStart, detail.farDistance,
+         dungeon->drawn_triangle_count());
+}
+
+// Reports the average timings since the last mode change and starts over.
+void reportModeTimings(const char* mode) {
+  if (app_state.modeFrames > 0) {
+    frame_pacing_stats_t pacing = framePacingStats();
+    int simFrames = app_state.modeSimFrames > 0 ? app_state.modeSimFrames : 1;
+    printf("%s: cpu %.3f ms (sim thread %.3f ms), frame %.3f ms, input to "
+           "submit %.2f ms over %d frames\n",
+           mode, app_state.modeCpuMs / app_state.modeFrames,
+           app_state.modeSimMs / simFrames,
+           app_state.modeFrameMs / app_state.modeFrames, pacing.latencyMs,
+           app_state.modeFrames);
+  }
+  resetFramePacingStats();
+  app_state.modeCpuMs = 0.0;
+  app_state.modeSimMs = 0.0;
+  app_state.modeSimFrames = 0;
+  app_state.modeFrameMs = 0.0;
+  app_state.modeFrames = 0;
+}
+
+// Reports the current draw order's average timings and moves on to the
+// next order.
+void cycleDrawOrder() {
+  static const char* names[DungeonDrawOrder_Count] = {
+      "state", "front-to-back", "depth prepass"};
+  Dungeon* dungeon = app_state.dungeon;
+  DungeonDrawOrder order = dungeon->draw_order();
+  reportModeTimings(names[order]);
+  order = (DungeonDrawOrder)((order + 1) % DungeonDrawOrder_Count);
+  dungeon->set_draw_order(order);
+  printf("drawing in %s order\n", names[order]);
+}
+
+// Reports the current anti-aliasing's average timings and moves on to the
+// next mode the device supports.
+void cycleAntiAliasing() {
+  static const char* names[SceneAA_Count] = {"no AA", "MSAA 2x", "MSAA 4x",
+                                             "MSAA 8x", "FXAA"};
+  scene_aa_t aa = sceneAntiAliasing();
+  reportModeTimings(names[aa]);
+  do {
+    aa = (scene_aa_t)((aa + 1) % SceneAA_Count);
+  } while (!setSceneAntiAliasing(aa));
+  app_state.dungeon->set_sample_count(sceneSampleCount());
+  printf("anti-aliasing with %s\n", names[aa]);
+}
+
+int simKey(sapp_keycode key) {
+  switch (key) {
+    case SAPP_KEYCODE_W:
+      return SimKey_Forward;
+    case SAPP_KEYCODE_S:
+      return SimKey_Backward;
+    case SAPP_KEYCODE_A:
+      return SimKey_Left;
+    case SAPP_KEYCODE_D:
+      return SimKey_Right;
+    case SAPP_KEYCODE_Q:
+      return SimKey_TurnLeft;
+    case SAPP_KEYCODE_E:
+      return SimKey_TurnRight;
+    default:
+      return -1;
+  }
+}
+
+// One fixed step of the simulation, on the simulation thread. The crawl
+// moves a tile, or turns, on each press and then every keyCooldown while
+// the key stays held.
+void simulate(float stepSeconds, const sim_controls_t& controls) {
+  Camera* camera = app_state.camera;
+  app_state.prevPosition = camera->Position;
+  app_state.prevFront = camera->Front;
+  app_state.moveCooldown -= stepSeconds;
+  bool repeat = app_state.moveCooldown <= 0.0f;
+  bool moved = false;
+  for (int key = 0; key < SimKey_Count; key++) {
+    bool fire = app_state.keyPressed[key] ||
+                (repeat && controls.keyHeld[key]);
+    app_state.keyPressed[key] = false;
+    if (!fire) {
+      continue;
+    }
+    moved = true;
+    switch (key) {
+      case SimKey_Forward: {
+        camera->ProcessKeyboardMovement(MOVE_FORWARD, stepSeconds);
+      } break;
+      case SimKey_Backward: {
+        camera->ProcessKeyboardMovement(MOVE_BACKWARD, stepSeconds);
+      } break;
+      case SimKey_Left: {
+        camera->ProcessKeyboardMovement(MOVE_LEFT, stepSeconds);
+      } break;
+      case SimKey_Right: {
+        camera->ProcessKeyboardMovement(MOVE_RIGHT, stepSeconds);
+      } break;
+      case SimKey_TurnLeft: {
+        camera->ProcessKeyboardRotation(TURN_LEFT, stepSeconds);
+      } break;
+      case SimKey_TurnRight: {
+        camera->ProcessKeyboardRotation(TURN_RIGHT, stepSeconds);
+      } break;
+    }
+  }
+  if (moved) {
+    app_state.moveCooldown = app_state.keyCooldown;
+  }
+}
+
+// The view between the last two steps' cameras, at the clock's point
+// between them.
+void buildView(const sim_controls_t& controls, frame_snapshot_t* snapshot) {
+  Camera* camera = app_state.camera;
+  float aspectRatio = static_cast<float>(controls.screenWidth) /
+                      static_cast<float>(controls.screenHeight);
+  // The fog has hidden everything past the dungeon's far distance.
+  glm::mat4 projection =
+      glm::perspective(glm::radians(camera->Zoom), aspectRatio, 0.1f,
+                       controls.cull.farDistance);
+  float alpha = fixedStepAlpha();
+  glm::vec3 position =
+      glm::mix(app_state.prevPosition, camera->Position, alpha);
+  glm::vec3 front =
+      glm::normalize(glm::mix(app_state.prevFront, camera->Front, alpha));
+  snapshot->playerPos = camera->Position;
+  snapshot->viewPos = position;
+  snapshot->viewproj =
+      projection * glm::lookAt(position, position + front, camera->Up);
+  snapshot->fovY = camera->Zoom;
+  // The torches flicker on simulated time, at the same point.
+  snapshot->lightTime =
+      fixedStepTime() - (1.0 - alpha) * fixedStepSeconds();
+}
+
+// The simulation thread: takes the events since the last snapshot, steps
+// the crawl on the fixed-step clock and culls the view into the next
+// snapshot while the render thread submits the last one.
+void simulationThread() {
+  uint64_t lastStart = stm_now();
+  frame_snapshot_t* snapshot;
+  while ((snapshot = beginFrameSnapshot()) != nullptr) {
+    uint64_t start = stm_now();
+    sim_controls_t controls;
+    {
+      std::lock_guard<std::mutex> lock(app_state.controlsMutex);
+      controls = app_state.controls;
+      for (int key = 0; key < SimKey_Count; key++) {
+        app_state.keyPressed[key] |= controls.keyPressed[key];
+        app_state.controls.keyPressed[key] = false;
+      }
+    }
+    beginFixedStep(stm_sec(stm_diff(start, lastStart)));
+    lastStart = start;
+    while (fixedStepNext()) {
+      simulate((float)fixedStepSeconds(), controls);
+    }
+    buildView(controls, snapshot);
+    Dungeon* dungeon = app_state.dungeon;
+    dungeon->begin_occlusion(snapshot->viewproj, snapshot->viewPos,
+                             controls.cull);
+    dungeon->cull(snapshot->viewproj, snapshot->viewPos, controls.cull,
+                  snapshot->visible);
+    snapshot->steps = fixedStepStats();
+    snapshot->buildMs = stm_ms(stm_since(start));
+    publishFrameSnapshot();
+  }
+}
+
 void event(const sapp_event* e) {
+  // sokol_app hands over the frame's events just before frame(), so there
+  // is no later point to sample them at; they are only stamped here for
+  // the latency report. That makes its input to submit about frame start
+  // to submit: sokol_app doesn't say how long events queued before that,
+  // and presents itself, so there is no input to present either.
+  if (e->type == SAPP_EVENTTYPE_KEY_DOWN || e->type == SAPP_EVENTTYPE_KEY_UP ||
+      e->type == SAPP_EVENTTYPE_MOUSE_DOWN ||
+      e->type == SAPP_EVENTTYPE_MOUSE_UP ||
+      e->type == SAPP_EVENTTYPE_MOUSE_MOVE) {
+    framePacingInput(stm_now());
+  }
   switch (e->type) {
     case SAPP_EVENTTYPE_KEY_DOWN: {
       switch (e->key_code) {
-        case SAPP_KEYCODE_W: {
-          app_state.camera->ProcessKeyboardMovement(MOVE_FORWARD,
-                                                    app_state.deltaTime);
+        case SAPP_KEYCODE_W:
+        case SAPP_KEYCODE_S:
+        case SAPP_KEYCODE_A:
+        case SAPP_KEYCODE_D:
+        case SAPP_KEYCODE_Q:
+        case SAPP_KEYCODE_E: {
+          // Held keys repeat in the simulation, not at the OS repeat rate.
+          if (!e->key_repeat) {
+            int key = simKey(e->key_code);
+            std::lock_guard<std::mutex> lock(app_state.controlsMutex);
+            app_state.controls.keyHeld[key] = true;
+            app_state.controls.keyPressed[key] = true;
+          }
+        } break;
+        case SAPP_KEYCODE_L: {
+          // Switches between forward and deferred lighting.
+          if (!e->key_repeat) {
+            Dungeon* dungeon = app_state.dungeon;
+            dungeon->set_lighting_path(
+                dungeon->lighting_path() == LightingPath_Forward
+                    ? LightingPath_Deferred
+                    : LightingPath_Forward);
+          }
         } break;
-        case SAPP_KEYCODE_S: {
-          app_state.camera->ProcessKeyboardMovement(MOVE_BACKWARD,
-                                                    app_state.deltaTime);
+        case SAPP_KEYCODE_P: {
+          // Toggles portal culling, for comparing what gets drawn.
+          if (!e->key_repeat) {
+            Dungeon* dungeon = app_state.dungeon;
+            dungeon->set_portal_culling(!dungeon->portal_culling_enabled());
+            sendCullSettings();
+          }
         } break;
-        case SAPP_KEYCODE_A: {
-          app_state.camera->ProcessKeyboardMovement(MOVE_LEFT,
-                                                    app_state.deltaTime);
+        case SAPP_KEYCODE_O: {
+          // Toggles the software occlusion buffer.
+          if (!e->key_repeat) {
+            Dungeon* dungeon = app_state.dungeon;
+            dungeon->set_occlusion_culling(
+                !dungeon->occlusion_culling_enabled());
+            sendCullSettings();
+          }
         } break;
-        case SAPP_KEYCODE_D: {
-          app_state.camera->ProcessKeyboardMovement(MOVE_RIGHT,
-                                                    app_state.deltaTime);
+        case SAPP_KEYCODE_R: {
+          // Toggles dynamic resolution.
+          if (!e->key_repeat) {
+            setDynamicResolutionEnabled(!dynamicResolutionEnabled());
+          }
         } break;
-        case SAPP_KEYCODE_Q: {
-          if (app_state.lastPress > app_state.keyCooldown) {
-            app_state.camera->ProcessKeyboardRotation(TURN_LEFT,
-                                                      app_state.deltaTime);
+        case SAPP_KEYCODE_F: {
+          if (!e->key_repeat) {
+            cycleDrawOrder();
           }
         } break;
-        case SAPP_KEYCODE_E: {
-          if (app_state.lastPress > app_state.keyCooldown) {
-            app_state.camera->ProcessKeyboardRotation(TURN_RIGHT,
-                                                      app_state.deltaTime);
+        case SAPP_KEYCODE_M: {
+          if (!e->key_repeat) {
+            cycleAntiAliasing();
           }
         } break;
+        case SAPP_KEYCODE_LEFT_BRACKET: {
+          adjustDetail(-DetailStep, 0.0f);
+        } break;
+        case SAPP_KEYCODE_RIGHT_BRACKET: {
+          adjustDetail(DetailStep, 0.0f);
+        } break;
+        case SAPP_KEYCODE_MINUS: {
+          adjustDetail(0.0f, -DetailStep);
+        } break;
+        case SAPP_KEYCODE_EQUAL: {
+          adjustDetail(0.0f, DetailStep);
+        } break;
         case SAPP_KEYCODE_ESCAPE: {
           sapp_request_quit();
         } break;
       }
     } break;
+    case SAPP_EVENTTYPE_KEY_UP: {
+      int key = simKey(e->key_code);
+      if (key >= 0) {
+        std::lock_guard<std::mutex> lock(app_state.controlsMutex);
+        app_state.controls.keyHeld[key] = false;
+      }
+    } break;
     case SAPP_EVENTTYPE_MOUSE_DOWN: {
       if (e->mouse_button == SAPP_MOUSEBUTTON_RIGHT) {
         app_state.freeLook = true;
@@ -87,8 +401,6 @@ void updateFrameTime() {
   app_state.deltaTime = (float)(stm_sec(
       stm_diff(currentFrameTime, app_state.lastFrameTimestamp)));
   app_state.lastFrameTimestamp = currentFrameTime;
-
-  app_state.lastPress += app_state.deltaTime;
 }
 
 void init() {
@@ -97,22 +409,34 @@ void init() {
 
   sg_desc d = {0};
   d.context = sapp_sgcontext();
+  d.allocator.alloc = sokolAlloc;
+  d.allocator.free = sokolFree;
+  d.allocator.user_data = (void*)(intptr_t)MemTag_Gfx;
   sg_setup(&d);
   assert(sg_isvalid());
   stm_setup();
   initTextureLoader();
+  initTextureStreamer(TextureBudgetBytes);
 
   sg_pass_action pass = {0};
   pass.colors[0].action = SG_ACTION_CLEAR;
-  pass.colors[0].value = sg_color{0.05f, 0.05f, 0.05f, 1.0f};
+  // The fog fades into the clear color.
+  pass.colors[0].value = sg_color{DUNGEON_FOG_COLOR.x, DUNGEON_FOG_COLOR.y,
+                                  DUNGEON_FOG_COLOR.z, 1.0f};
   app_state.main_pass_action = pass;
 
   app_state.camera = new Camera(glm::vec3(0.0f, 0.5f, 0.0f));
   app_state.dungeon = new Dungeon();
   app_state.dungeon->create(generate_new_dungeon(25, 25));
+  app_state.dungeon->place_torches(TorchCount, DynamicTorchEvery);
+  if (DynamicTorchEvery != 1) {
+    app_state.dungeon->bake_lightmap(LightmapTexelsPerUnit, LightmapBounceSamples);
+  }
 
   app_state.keyCooldown = KeyCooldownTime;
-  app_state.lastPress = 0.0f;
+  app_state.moveCooldown = 0.0f;
+  app_state.prevPosition = app_state.camera->Position;
+  app_state.prevFront = app_state.camera->Front;
   app_state.firstMouse = true;
   app_state.lastX = 0;
   app_state.lastY = 0;
@@ -122,46 +446,119 @@ void init() {
   app_state.deltaTime = 0.0f;
   app_state.freeLook = false;
   app_state.lastFrameTimestamp = stm_now();
+  initFramePacing(FrameTargetMs);
+  initDynamicResolution(FrameTargetMs);
+  app_state.sceneScale = dynamicResolutionScale();
+  // The window is single-sampled; the scene target carries the MSAA.
+  setSceneAntiAliasing(SceneAA_MSAA4);
+  app_state.dungeon->set_sample_count(sceneSampleCount());
+
+  // From here on the camera and culling belong to the simulation thread.
+  app_state.controls = {};
+  app_state.controls.screenWidth = app_state.screenWidth;
+  app_state.controls.screenHeight = app_state.screenHeight;
+  app_state.controls.cull = app_state.dungeon->cull_settings();
+  app_state.lastSnapshot = UINT64_MAX;
+  initFixedStep(SimStepsPerSecond, FIXED_STEP_MAX_CATCH_UP);
+  initFrameSnapshots();
+  app_state.simThread = std::thread(simulationThread);
 }
 
+// Passes the window size on and takes the newest snapshot to draw.
 void update() {
   updateFrameTime();
-  texturePump();
-}
-
-void render() {
   int currWidth = sapp_width();
   int currHeight = sapp_height();
   if (currWidth != app_state.screenWidth ||
       currHeight != app_state.screenHeight) {
     app_state.screenWidth = currWidth;
     app_state.screenHeight = currHeight;
+    std::lock_guard<std::mutex> lock(app_state.controlsMutex);
+    app_state.controls.screenWidth = currWidth;
+    app_state.controls.screenHeight = currHeight;
+  }
+  const frame_snapshot_t* snapshot = acquireFrameSnapshot();
+  app_state.snapshot = snapshot;
+  if (snapshot->frame != app_state.lastSnapshot) {
+    app_state.lastSnapshot = snapshot->frame;
+    app_state.modeSimMs += snapshot->buildMs;
+    app_state.modeSimFrames++;
   }
+  texturePump();
+  // The lights upload to the GPU, so they follow the snapshot here.
+  app_state.dungeon->carry_light(snapshot->playerPos);
+  app_state.dungeon->update_lights((float)snapshot->lightTime);
+}
 
-  float aspectRatio =
-      static_cast<float>(currWidth) / static_cast<float>(currHeight);
-  glm::mat4 projection = glm::perspective(glm::radians(app_state.camera->Zoom),
-                                          aspectRatio, 0.1f, 100.0f);
-  glm::mat4 viewproj = projection * app_state.camera->GetViewMatrix();
+void render() {
+  int currWidth = app_state.screenWidth;
+  int currHeight = app_state.screenHeight;
+  const frame_snapshot_t* snapshot = app_state.snapshot;
+  const glm::mat4& viewproj = snapshot->viewproj;
+  const glm::vec3& viewPos = snapshot->viewPos;
+  int sceneWidth, sceneHeight;
+  dynamicResolutionSceneSize(currWidth, currHeight, &sceneWidth,
+                             &sceneHeight);
+
+  float pixelsPerUnit =
+      sceneHeight / (2.0f * tanf(glm::radians(snapshot->fovY) * 0.5f));
+  app_state.dungeon->update_texture_residency(viewPos, pixelsPerUnit);
+  textureStreamerUpdate();
 
-  sg_begin_default_pass(&app_state.main_pass_action, currWidth, currHeight);
-  app_state.dungeon->render(viewproj);
-  sg_end_pass();
+  // The scene pass is the default pass at full scale, otherwise an
+  // offscreen one that endScenePass() upscales.
+  if (app_state.dungeon->lighting_path() == LightingPath_Deferred) {
+    beginDeferredGeometryPass(sceneWidth, sceneHeight,
+                              app_state.main_pass_action.colors[0].value);
+    app_state.dungeon->draw(viewproj, viewPos, snapshot->visible);
+    endDeferredGeometryPass();
+    app_state.dungeon->render_lights(viewproj, viewPos);
+    beginScenePass(&app_state.main_pass_action, currWidth, currHeight);
+    composeDeferredLighting();
+    endScenePass();
+  } else {
+    beginScenePass(&app_state.main_pass_action, currWidth, currHeight);
+    app_state.dungeon->draw(viewproj, viewPos, snapshot->visible);
+    endScenePass();
+  }
   sg_commit();
+  submitPacedFrame();
   // glfwSwapBuffers(state->window);
   // glfwPollEvents();
 }
 
 void cleanup() {
+  stopFrameSnapshots();
+  app_state.simThread.join();
   delete app_state.camera;
   delete app_state.dungeon;
+  destroyOcclusionBuffer();
+  destroyDynamicResolution();
+  destroyDeferredLighting();
+  destroyFloodLight();
+  destroyLightClusters();
+  destroyMaterials();
+  destroyTextureRegistry();
+  destroyTextureStreamer();
   destroyTextureLoader();
   sg_shutdown();
 }
 
 void frame() {
+  uint64_t start = stm_now();
+  beginPacedFrame();
+  dynamicResolutionFrame();
+  if (dynamicResolutionScale() != app_state.sceneScale) {
+    dynamic_resolution_stats_t stats = dynamicResolutionStats();
+    app_state.sceneScale = stats.scale;
+    printf("scene at %.0f%%, frames averaging %.2f ms\n",
+           stats.scale * 100.0f, stats.frameMs);
+  }
   update();
   render();
+  app_state.modeCpuMs += stm_ms(stm_since(start));
+  app_state.modeFrameMs += app_state.deltaTime * 1000.0;
+  app_state.modeFrames++;
 }
 
 sapp_desc sokol_main(int argc, char* argv[]) {
@@ -173,7 +570,7 @@ sapp_desc sokol_main(int argc, char* argv[]) {
   desc.width = ScreenWidth;
   desc.height = ScreenHeight;
   desc.gl_force_gles2 = false;
-  desc.sample_count = 4;
+  desc.sample_count = 1;
   desc.window_title = "DungeonCrawl";
   desc.icon.sokol_default = true;
   return desc;
@@ -0,0 +1,557 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <thread>
+#include <vector>
+
+// Baked texture container written by the texture-baker tool and read by the
+// texture loader. The header is followed by the mip chain, largest mip first,
+// each mip tightly packed in the block layout of `format`.
+#define DTEX_MAGIC (0x58455444)  // 'DTEX'
+#define DTEX_VERSION (1)
+#define DTEX_MAX_MIPS (16)
+
+enum dtex_format_t {
+  DTEX_FORMAT_RGBA8 = 0,
+  DTEX_FORMAT_BC1,  // opaque albedo, 4 bits per texel
+  DTEX_FORMAT_BC3,  // albedo with alpha, 8 bits per texel
+  DTEX_FORMAT_BC5,  // two-channel normal maps (xy), 8 bits per texel
+  DTEX_FORMAT_COUNT
+};
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t format;
+  uint32_t width;
+  uint32_t height;
+  uint32_t numMips;
+} dtex_header_t;
+
+static uint32_t dtex_block_bytes(dtex_format_t format) {
+  switch (format) {
+    case DTEX_FORMAT_BC1:
+      return 8;
+    case DTEX_FORMAT_BC3:
+    case DTEX_FORMAT_BC5:
+      return 16;
+    default:
+      return 0;
+  }
+}
+
+static uint32_t dtex_mip_dim(uint32_t dim, uint32_t mip) {
+  uint32_t d = dim >> mip;
+  return d > 0 ? d : 1;
+}
+
+static uint32_t dtex_mip_size(dtex_format_t format,
+                              uint32_t width,
+                              uint32_t height) {
+  if (format == DTEX_FORMAT_RGBA8) {
+    return width * height * 4;
+  }
+  return ((width + 3) / 4) * ((height + 3) / 4) * dtex_block_bytes(format);
+}
+
+static uint32_t dtex_mip_count(uint32_t width, uint32_t height) {
+  uint32_t count = 1;
+  while ((width > 1 || height > 1) && count < DTEX_MAX_MIPS) {
+    width = width > 1 ? width / 2 : 1;
+    height = height > 1 ? height / 2 : 1;
+    count++;
+  }
+  return count;
+}
+
+// Fills `offsets` with the byte offset of every mip relative to the start of
+// the file and returns the total file size. Returns 0 if the header is bogus.
+static uint32_t dtex_layout(const dtex_header_t* header,
+                            uint32_t offsets[DTEX_MAX_MIPS]) {
+  if (header->magic != DTEX_MAGIC || header->version != DTEX_VERSION ||
+      header->format >= DTEX_FORMAT_COUNT || header->numMips == 0 ||
+      header->numMips > DTEX_MAX_MIPS) {
+    return 0;
+  }
+  uint32_t offset = sizeof(dtex_header_t);
+  for (uint32_t mip = 0; mip < header->numMips; mip++) {
+    offsets[mip] = offset;
+    offset += dtex_mip_size((dtex_format_t)header->format,
+                            dtex_mip_dim(header->width, mip),
+                            dtex_mip_dim(header->height, mip));
+  }
+  return offset;
+}
+
+//------------------------------------------------------------------------------
+// Mip generation
+//------------------------------------------------------------------------------
+
+// 2x2 box filter of an RGBA8 image. Odd dimensions clamp the last row/column.
+// For normal maps the xy channels are renormalized after filtering so short
+// vectors do not darken distant lighting.
+static void downsampleRGBA8(const uint8_t* src,
+                            uint32_t srcWidth,
+                            uint32_t srcHeight,
+                            uint8_t* dst,
+                            bool isNormalMap) {
+  uint32_t dstWidth = dtex_mip_dim(srcWidth, 1);
+  uint32_t dstHeight = dtex_mip_dim(srcHeight, 1);
+  for (uint32_t y = 0; y < dstHeight; y++) {
+    uint32_t y0 = y * 2;
+    uint32_t y1 = y0 + 1 < srcHeight ? y0 + 1 : y0;
+    for (uint32_t x = 0; x < dstWidth; x++) {
+      uint32_t x0 = x * 2;
+      uint32_t x1 = x0 + 1 < srcWidth ? x0 + 1 : x0;
+      uint8_t* out = &dst[(y * dstWidth + x) * 4];
+      for (uint32_t c = 0; c < 4; c++) {
+        uint32_t sum = src[(y0 * srcWidth + x0) * 4 + c] +
+                       src[(y0 * srcWidth + x1) * 4 + c] +
+                       src[(y1 * srcWidth + x0) * 4 + c] +
+                       src[(y1 * srcWidth + x1) * 4 + c];
+        out[c] = (uint8_t)((sum + 2) / 4);
+      }
+      if (isNormalMap) {
+        float nx = out[0] / 127.5f - 1.0f;
+        float ny = out[1] / 127.5f - 1.0f;
+        float nz = out[2] / 127.5f - 1.0f;
+        float len = sqrtf(nx * nx + ny * ny + nz * nz);
+        if (len > 1e-4f) {
+          out[0] = (uint8_t)lrintf((nx / len + 1.0f) * 127.5f);
+          out[1] = (uint8_t)lrintf((ny / len + 1.0f) * 127.5f);
+          out[2] = (uint8_t)lrintf((nz / len + 1.0f) * 127.5f);
+        }
+      }
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+// Block encoders
+//------------------------------------------------------------------------------
+
+static uint16_t bc_pack565(const float c[3]) {
+  int r = (int)lrintf(fminf(fmaxf(c[0], 0.0f), 255.0f) * 31.0f / 255.0f);
+  int g = (int)lrintf(fminf(fmaxf(c[1], 0.0f), 255.0f) * 63.0f / 255.0f);
+  int b = (int)lrintf(fminf(fmaxf(c[2], 0.0f), 255.0f) * 31.0f / 255.0f);
+  return (uint16_t)((r << 11) | (g << 5) | b);
+}
+
+static void bc_unpack565(uint16_t c, float out[3]) {
+  int r = (c >> 11) & 31;
+  int g = (c >> 5) & 63;
+  int b = c & 31;
+  out[0] = (float)((r << 3) | (r >> 2));
+  out[1] = (float)((g << 2) | (g >> 4));
+  out[2] = (float)((b << 3) | (b >> 2));
+}
+
+// Gathers a 4x4 block, replicating edge texels for images whose dimensions
+// are not a multiple of four.
+static void bc_fetch_block(const uint8_t* pixels,
+                           uint32_t width,
+                           uint32_t height,
+                           uint32_t bx,
+                           uint32_t by,
+                           uint8_t block[16][4]) {
+  for (uint32_t y = 0; y < 4; y++) {
+    uint32_t sy = by * 4 + y < height ? by * 4 + y : height - 1;
+    for (uint32_t x = 0; x < 4; x++) {
+      uint32_t sx = bx * 4 + x < width ? bx * 4 + x : width - 1;
+      memcpy(block[y * 4 + x], &pixels[(sy * width + sx) * 4], 4);
+    }
+  }
+}
+
+static uint32_t bc1_pick_indices(const uint8_t block[16][4],
+                                 const float palette[4][3],
+                                 float* outError) {
+  uint32_t indices = 0;
+  float error = 0.0f;
+  for (int i = 0; i < 16; i++) {
+    float best = 1e30f;
+    uint32_t bestIndex = 0;
+    for (uint32_t p = 0; p < 4; p++) {
+      float dr = block[i][0] - palette[p][0];
+      float dg = block[i][1] - palette[p][1];
+      float db = block[i][2] - palette[p][2];
+      float d = dr * dr + dg * dg + db * db;
+      if (d < best) {
+        best = d;
+        bestIndex = p;
+      }
+    }
+    indices |= bestIndex << (i * 2);
+    error += best;
+  }
+  *outError = error;
+  return indices;
+}
+
+static void bc1_build_palette(uint16_t c0, uint16_t c1, float palette[4][3]) {
+  bc_unpack565(c0, palette[0]);
+  bc_unpack565(c1, palette[1]);
+  for (int c = 0; c < 3; c++) {
+    palette[2][c] = (2.0f * palette[0][c] + palette[1][c]) / 3.0f;
+    palette[3][c] = (palette[0][c] + 2.0f * palette[1][c]) / 3.0f;
+  }
+}
+
+// Range-fit BC1 encoder: endpoints along the principal axis of the block,
+// followed by least-squares refinement of the endpoints. Always emits
+// the four-colour mode (c0 > c1), which BC3 requires.
+static void encodeBC1Block(const uint8_t block[16][4], uint8_t out[8]) {
+  float mean[3] = {0.0f, 0.0f, 0.0f};
+  for (int i = 0; i < 16; i++) {
+    for (int c = 0; c < 3; c++) {
+      mean[c] += block[i][c];
+    }
+  }
+  for (int c = 0; c < 3; c++) {
+    mean[c] /= 16.0f;
+  }
+
+  float cov[6] = {0.0f};
+  for (int i = 0; i < 16; i++) {
+    float r = block[i][0] - mean[0];
+    float g = block[i][1] - mean[1];
+    float b = block[i][2] - mean[2];
+    cov[0] += r * r;
+    cov[1] += r * g;
+    cov[2] += r * b;
+    cov[3] += g * g;
+    cov[4] += g * b;
+    cov[5] += b * b;
+  }
+
+  float axis[3] = {1.0f, 1.0f, 1.0f};
+  for (int iter = 0; iter < 4; iter++) {
+    float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+    float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+    float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+    float len = fmaxf(fabsf(x), fmaxf(fabsf(y), fabsf(z)));
+    if (len < 1e-6f) {
+      break;
+    }
+    axis[0] = x / len;
+    axis[1] = y / len;
+    axis[2] = z / len;
+  }
+
+  float minT = 1e30f, maxT = -1e30f;
+  for (int i = 0; i < 16; i++) {
+    float t = (block[i][0] - mean[0]) * axis[0] +
+              (block[i][1] - mean[1]) * axis[1] +
+              (block[i][2] - mean[2]) * axis[2];
+    minT = fminf(minT, t);
+    maxT = fmaxf(maxT, t);
+  }
+  float axisLen2 = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+  if (axisLen2 < 1e-6f) {
+    axisLen2 = 1.0f;
+  }
+  float e0[3], e1[3];
+  for (int c = 0; c < 3; c++) {
+    e0[c] = mean[c] + axis[c] * maxT / axisLen2;
+    e1[c] = mean[c] + axis[c] * minT / axisLen2;
+  }
+
+  uint16_t c0 = bc_pack565(e0);
+  uint16_t c1 = bc_pack565(e1);
+  if (c0 < c1) {
+    uint16_t tmp = c0;
+    c0 = c1;
+    c1 = tmp;
+  }
+  float palette[4][3];
+  float error;
+  bc1_build_palette(c0, c1, palette);
+  uint32_t indices = bc1_pick_indices(block, palette, &error);
+
+  // Least-squares refits of both endpoints against the chosen indices, kept
+  // only while they lower the block error.
+  static const float weights[4] = {1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f};
+  for (int iter = 0; iter < 2 && c0 != c1; iter++) {
+    float aa = 0.0f, bb = 0.0f, ab = 0.0f;
+    float ax[3] = {0.0f}, bx[3] = {0.0f};
+    for (int i = 0; i < 16; i++) {
+      float a = weights[(indices >> (i * 2)) & 3];
+      float b = 1.0f - a;
+      aa += a * a;
+      bb += b * b;
+      ab += a * b;
+      for (int c = 0; c < 3; c++) {
+        ax[c] += a * block[i][c];
+        bx[c] += b * block[i][c];
+      }
+    }
+    float det = aa * bb - ab * ab;
+    if (fabsf(det) < 1e-6f) {
+      break;
+    }
+    float r0[3], r1[3];
+    for (int c = 0; c < 3; c++) {
+      r0[c] = (ax[c] * bb - bx[c] * ab) / det;
+      r1[c] = (bx[c] * aa - ax[c] * ab) / det;
+    }
+    uint16_t rc0 = bc_pack565(r0);
+    uint16_t rc1 = bc_pack565(r1);
+    if (rc0 < rc1) {
+      uint16_t tmp = rc0;
+      rc0 = rc1;
+      rc1 = tmp;
+    }
+    if (rc0 == rc1) {
+      break;
+    }
+    float refitError;
+    bc1_build_palette(rc0, rc1, palette);
+    uint32_t refitIndices = bc1_pick_indices(block, palette, &refitError);
+    if (refitError >= error) {
+      break;
+    }
+    c0 = rc0;
+    c1 = rc1;
+    indices = refitIndices;
+    error = refitError;
+  }
+  if (c0 == c1) {
+    // Single colour block: every texel maps to the first endpoint.
+    indices = 0;
+  }
+
+  out[0] = (uint8_t)(c0 & 0xff);
+  out[1] = (uint8_t)(c0 >> 8);
+  out[2] = (uint8_t)(c1 & 0xff);
+  out[3] = (uint8_t)(c1 >> 8);
+  out[4] = (uint8_t)(indices & 0xff);
+  out[5] = (uint8_t)((indices >> 8) & 0xff);
+  out[6] = (uint8_t)((indices >> 16) & 0xff);
+  out[7] = (uint8_t)(indices >> 24);
+}
+
+// Single channel block (BC4), used for BC3 alpha and both BC5 channels.
+// Emits the eight-value mode (a0 > a1) spanning the block's range.
+static void encodeBC4Block(const uint8_t block[16][4],
+                           int channel,
+                           uint8_t out[8]) {
+  uint8_t lo = 255, hi = 0;
+  for (int i = 0; i < 16; i++) {
+    uint8_t v = block[i][channel];
+    lo = v < lo ? v : lo;
+    hi = v > hi ? v : hi;
+  }
+  out[0] = hi;
+  out[1] = lo;
+
+  uint64_t bits = 0;
+  if (hi > lo) {
+    float palette[8];
+    palette[0] = hi;
+    palette[1] = lo;
+    for (int p = 1; p < 7; p++) {
+      palette[p + 1] = ((7 - p) * hi + p * lo) / 7.0f;
+    }
+    for (int i = 0; i < 16; i++) {
+      float best = 1e30f;
+      uint64_t bestIndex = 0;
+      for (uint64_t p = 0; p < 8; p++) {
+        float d = fabsf(block[i][channel] - palette[p]);
+        if (d < best) {
+          best = d;
+          bestIndex = p;
+        }
+      }
+      bits |= bestIndex << (i * 3);
+    }
+  }
+  for (int b = 0; b < 6; b++) {
+    out[2 + b] = (uint8_t)((bits >> (b * 8)) & 0xff);
+  }
+}
+
+static void encodeBlock(dtex_format_t format,
+                        const uint8_t block[16][4],
+                        uint8_t* out) {
+  switch (format) {
+    case DTEX_FORMAT_BC1:
+      encodeBC1Block(block, out);
+      break;
+    case DTEX_FORMAT_BC3:
+      encodeBC4Block(block, 3, out);
+      encodeBC1Block(block, out + 8);
+      break;
+    case DTEX_FORMAT_BC5:
+      encodeBC4Block(block, 0, out);
+      encodeBC4Block(block, 1, out + 8);
+      break;
+    default:
+      break;
+  }
+}
+
+// Compresses one RGBA8 mip into `out`, which must hold
+// dtex_mip_size(format, width, height) bytes. Block rows are split across
+// `numThreads` workers (0 = all hardware threads).
+static void compressTexture(const uint8_t* pixels,
+                            uint32_t width,
+                            uint32_t height,
+                            dtex_format_t format,
+                            uint8_t* out,
+                            uint32_t numThreads = 0) {
+  if (format == DTEX_FORMAT_RGBA8) {
+    memcpy(out, pixels, (size_t)width * height * 4);
+    return;
+  }
+  const uint32_t blocksX = (width + 3) / 4;
+  const uint32_t blocksY = (height + 3) / 4;
+  const uint32_t blockBytes = dtex_block_bytes(format);
+  if (numThreads == 0) {
+    numThreads = std::thread::hardware_concurrency();
+  }
+  if (numThreads == 0 || numThreads > blocksY) {
+    numThreads = numThreads == 0 ? 1 : blocksY;
+  }
+
+  auto encodeRows = [=](uint32_t firstRow, uint32_t lastRow) {
+    uint8_t block[16][4];
+    for (uint32_t by = firstRow; by < lastRow; by++) {
+      for (uint32_t bx = 0; bx < blocksX; bx++) {
+        bc_fetch_block(pixels, width, height, bx, by, block);
+        encodeBlock(format, block, &out[(by * blocksX + bx) * blockBytes]);
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  uint32_t rowsPerThread = (blocksY + numThreads - 1) / numThreads;
+  for (uint32_t t = 1; t < numThreads; t++) {
+    uint32_t first = t * rowsPerThread;
+    uint32_t last = first + rowsPerThread < blocksY ? first + rowsPerThread
+                                                     : blocksY;
+    if (first < last) {
+      workers.emplace_back(encodeRows, first, last);
+    }
+  }
+  encodeRows(0, rowsPerThread < blocksY ? rowsPerThread : blocksY);
+  for (auto& worker : workers) {
+    worker.join();
+  }
+}
+
+//------------------------------------------------------------------------------
+// Block decoders, used by the baker to measure compression error
+//------------------------------------------------------------------------------
+
+static void decodeBC1Block(const uint8_t* in, uint8_t block[16][4]) {
+  uint16_t c0 = (uint16_t)(in[0] | (in[1] << 8));
+  uint16_t c1 = (uint16_t)(in[2] | (in[3] << 8));
+  uint32_t indices = in[4] | (in[5] << 8) | (in[6] << 16) | ((uint32_t)in[7] << 24);
+  float palette[4][3];
+  bc1_build_palette(c0, c1, palette);
+  if (c0 <= c1) {
+    for (int c = 0; c < 3; c++) {
+      palette[2][c] = (palette[0][c] + palette[1][c]) / 2.0f;
+      palette[3][c] = 0.0f;
+    }
+  }
+  for (int i = 0; i < 16; i++) {
+    uint32_t index = (indices >> (i * 2)) & 3;
+    for (int c = 0; c < 3; c++) {
+      block[i][c] = (uint8_t)lrintf(palette[index][c]);
+    }
+    block[i][3] = (c0 <= c1 && index == 3) ? 0 : 255;
+  }
+}
+
+static void decodeBC4Block(const uint8_t* in,
+                           int channel,
+                           uint8_t block[16][4]) {
+  float palette[8];
+  palette[0] = in[0];
+  palette[1] = in[1];
+  if (in[0] > in[1]) {
+    for (int p = 1; p < 7; p++) {
+      palette[p + 1] = ((7 - p) * in[0] + p * in[1]) / 7.0f;
+    }
+  } else {
+    for (int p = 1; p < 5; p++) {
+      palette[p + 1] = ((5 - p) * in[0] + p * in[1]) / 5.0f;
+    }
+    palette[6] = 0.0f;
+    palette[7] = 255.0f;
+  }
+  uint64_t bits = 0;
+  for (int b = 0; b < 6; b++) {
+    bits |= (uint64_t)in[2 + b] << (b * 8);
+  }
+  for (int i = 0; i < 16; i++) {
+    block[i][channel] = (uint8_t)lrintf(palette[(bits >> (i * 3)) & 7]);
+  }
+}
+
+// Decodes a compressed mip back to RGBA8. Channels a format does not store
+// are left untouched in `out`.
+static void decompressTexture(const uint8_t* data,
+                              uint32_t width,
+                              uint32_t height,
+                              dtex_format_t format,
+                              uint8_t* out) {
+  if (format == DTEX_FORMAT_RGBA8) {
+    memcpy(out, data, (size_t)width * height * 4);
+    return;
+  }
+  const uint32_t blocksX = (width + 3) / 4;
+  const uint32_t blocksY = (height + 3) / 4;
+  const uint32_t blockBytes = dtex_block_bytes(format);
+  uint8_t block[16][4];
+  for (uint32_t by = 0; by < blocksY; by++) {
+    for (uint32_t bx = 0; bx < blocksX; bx++) {
+      const uint8_t* in = &data[(by * blocksX + bx) * blockBytes];
+      bc_fetch_block(out, width, height, bx, by, block);
+      switch (format) {
+        case DTEX_FORMAT_BC1:
+          decodeBC1Block(in, block);
+          break;
+        case DTEX_FORMAT_BC3:
+          decodeBC1Block(in + 8, block);
+          decodeBC4Block(in, 3, block);
+          break;
+        case DTEX_FORMAT_BC5:
+          decodeBC4Block(in, 0, block);
+          decodeBC4Block(in + 8, 1, block);
+          break;
+        default:
+          break;
+      }
+      for (uint32_t y = 0; y < 4 && by * 4 + y < height; y++) {
+        for (uint32_t x = 0; x < 4 && bx * 4 + x < width; x++) {
+          memcpy(&out[((by * 4 + y) * width + bx * 4 + x) * 4],
+                 block[y * 4 + x], 4);
+        }
+      }
+    }
+  }
+}
+
+// Peak signal-to-noise ratio over the first `numChannels` channels.
+static double computePSNR(const uint8_t* a,
+                          const uint8_t* b,
+                          uint32_t width,
+                          uint32_t height,
+                          uint32_t numChannels) {
+  double sum = 0.0;
+  for (size_t i = 0; i < (size_t)width * height; i++) {
+    for (uint32_t c = 0; c < numChannels; c++) {
+      double d = (double)a[i * 4 + c] - (double)b[i * 4 + c];
+      sum += d * d;
+    }
+  }
+  double mse = sum / ((double)width * height * numChannels);
+  if (mse <= 0.0) {
+    return 99.0;
+  }
+  return 10.0 * log10(255.0 * 255.0 / mse);
+}
@@ -1,57 +1,503 @@
 #ifndef _TEXTURE_LOADER_H_
 #define _TEXTURE_LOADER_H_
+#include <stdio.h>
+#include <string.h>
 #include "stb_image.h"
+#include "stb/stb_image_alloc.h"
 
 #include "sokol_fetch.h"
+#include "fileReader.h"
+#include "textureCompressor.h"
+#include "assetPack.h"
+#include "uploadQueue.h"
+#include "allocators.h"
 
 #define MAX_FILE_SIZE (10 * 1024 * 1024)
 #define NUM_CHANNELS (4)
 #define NUM_LANES (8)
 uint8_t fileBuffer[NUM_CHANNELS][NUM_LANES][MAX_FILE_SIZE];
 
+#define MAX_PATH_LEN (256)
+// Scratch memory for stb_image decodes and staging copies of fetched data.
+// Both only live until their upload, so the arena keeps rewinding to empty.
+// The arena is not thread-safe: it is only touched from the main thread,
+// where texturePump() runs the read callbacks that decode and stage. Moving
+// decoding onto I/O or worker threads needs an arena per thread or a lock.
+#define DECODE_ARENA_SIZE (32 * 1024 * 1024)
+static arena_t decodeArena;
+
+static void* decode_malloc(size_t size) {
+  return arenaAlloc(&decodeArena, size);
+}
+
+static void* decode_realloc(void* ptr, size_t newSize) {
+  return arenaRealloc(&decodeArena, ptr, newSize);
+}
+
+static void decode_free(void* ptr) {
+  arenaFree(&decodeArena, ptr);
+}
+
+// Optional per-request hook that receives the fetched file before the loader
+// uploads it. Returning true means the data was consumed and the loader does
+// nothing further. Called with a null `data` when the request finally failed.
+// Ranged requests (loadBakedRange()) only ever end in the hook.
+typedef bool (*texture_data_cb)(const uint8_t* data,
+                                size_t size,
+                                bool baked,
+                                sg_image imgLoc,
+                                void* userData);
+
+// Where file reads go. sokol_fetch is the portable default; the file reader
+// batches reads through io_uring when built with DUNGEON_USE_IO_URING.
+enum texture_io_backend_t {
+  TextureIo_Fetch,
+  TextureIo_FileReader,
+};
+
 typedef struct {
-  sfetch_handle_t handle;
+  // sfetch_handle_t or file_read_handle_t id, depending on the backend.
+  uint32_t handle;
   sg_image imgLoc;
   int slotId;
   int requestId;
+  bool inUse;
+  bool baked;
+  bool cancelled;
+  texture_data_cb onData;
+  void* userData;
+  // Only [rangeOffset, rangeOffset + rangeSize) of the baked file is wanted.
+  bool ranged;
+  uint32_t rangeOffset;
+  uint32_t rangeSize;
+  char sourcePath[MAX_PATH_LEN];
 } request_t;
 
 #define NUM_REQUESTS (32)
 request_t requests[NUM_REQUESTS];
+// High-water mark of request slots; finished slots are reused.
 static int requestsMade = 0;
+// True when the GPU can sample every block format the texture baker emits,
+// in which case loadTexture() asks for the baked .dtex first.
+static bool bakedTexturesSupported = false;
+static texture_io_backend_t textureIoBackend = TextureIo_Fetch;
 
 static void fetch_callback(const sfetch_response_t* response);
+static void file_read_callback(const file_read_response_t* response);
 
-static void initTextureLoader(void) {
+static void initTextureLoader(texture_io_backend_t backend = TextureIo_Fetch) {
   // for (int i = 0; i < NUM_REQUESTS; i++) {
   //   requests[i].imgLoc = 0;
   // }
-  sfetch_desc_t fetchDesc = {0};
-  fetchDesc.num_channels = NUM_CHANNELS;
-  fetchDesc.num_lanes = NUM_LANES;
-  sfetch_setup(&fetchDesc);
+  textureIoBackend = backend;
+  arenaInit(&decodeArena, DECODE_ARENA_SIZE, MemTag_Decode);
+  stbi_malloc_hook = decode_malloc;
+  stbi_realloc_hook = decode_realloc;
+  stbi_free_hook = decode_free;
+  if (backend == TextureIo_FileReader) {
+    // The reader pools the same buffers sokol_fetch would bind to lanes.
+    file_reader_desc_t readerDesc = {0};
+    readerDesc.buffers = &fileBuffer[0][0][0];
+    readerDesc.numBuffers = NUM_CHANNELS * NUM_LANES;
+    readerDesc.bufferSize = MAX_FILE_SIZE;
+    if (!initFileReader(readerDesc)) {
+      textureIoBackend = TextureIo_Fetch;
+    }
+  }
+  if (textureIoBackend == TextureIo_Fetch) {
+    sfetch_desc_t fetchDesc = {0};
+    fetchDesc.num_channels = NUM_CHANNELS;
+    fetchDesc.num_lanes = NUM_LANES;
+    fetchDesc.allocator.alloc = sokolAlloc;
+    fetchDesc.allocator.free = sokolFree;
+    fetchDesc.allocator.user_data = (void*)(intptr_t)MemTag_Fetch;
+    sfetch_setup(&fetchDesc);
+  }
+  // Optional: without a pack every texture is fetched as a loose file.
+  openAssetPack(ASSET_PACK_PATH);
+
+  bakedTexturesSupported =
+      sg_query_pixelformat(SG_PIXELFORMAT_BC1_RGBA).sample &&
+      sg_query_pixelformat(SG_PIXELFORMAT_BC3_RGBA).sample &&
+      sg_query_pixelformat(SG_PIXELFORMAT_BC5_RG).sample;
 }
 
 static void destroyTextureLoader(void) {
-  sfetch_shutdown();
+  destroyUploadQueue();
+  if (textureIoBackend == TextureIo_FileReader) {
+    destroyFileReader();
+  } else {
+    sfetch_shutdown();
+  }
+  closeAssetPack();
+  stbi_malloc_hook = malloc;
+  stbi_realloc_hook = realloc;
+  stbi_free_hook = free;
+  arenaDestroy(&decodeArena);
 }
 
-static void loadTexture(const char* fileName, sg_image imgLoc, int slot) {
-  if (requestsMade >= NUM_REQUESTS) {
-    return;
+static sg_pixel_format dtex_pixel_format(dtex_format_t format) {
+  switch (format) {
+    case DTEX_FORMAT_BC1:
+      return SG_PIXELFORMAT_BC1_RGBA;
+    case DTEX_FORMAT_BC3:
+      return SG_PIXELFORMAT_BC3_RGBA;
+    case DTEX_FORMAT_BC5:
+      return SG_PIXELFORMAT_BC5_RG;
+    default:
+      return SG_PIXELFORMAT_RGBA8;
+  }
+}
+
+// Fetch buffers are reused as soon as the callback returns, so queued uploads
+// must copy out of them. Pack mappings and caller-owned memory are not.
+static bool isFetchBuffer(const uint8_t* data) {
+  const uint8_t* begin = &fileBuffer[0][0][0];
+  return data >= begin && data < begin + sizeof(fileBuffer);
+}
+
+// Queues a baked mip chain for upload straight from the file contents,
+// skipping the `firstMip` largest levels. The image may already be
+// initialized, in which case it is re-created in place so existing bindings
+// stay valid. Returns false if the file is not a valid .dtex or the GPU
+// cannot sample its format. `data` must outlive the upload unless it lives in
+// a fetch buffer, in which case the used mips are copied, or `ownsData` hands
+// it (allocated from decodeArena) to the upload to free once queued.
+static bool uploadBakedMips(const uint8_t* data,
+                            size_t size,
+                            sg_image imgLoc,
+                            uint32_t firstMip,
+                            uint32_t* outBytes,
+                            int priority = UploadPriority_Normal,
+                            bool ownsData = false) {
+  dtex_header_t header;
+  uint32_t offsets[DTEX_MAX_MIPS];
+  if (size < sizeof(header)) {
+    return false;
+  }
+  memcpy(&header, data, sizeof(header));
+  uint32_t fileSize = dtex_layout(&header, offsets);
+  if (fileSize == 0 || fileSize > size || firstMip >= header.numMips) {
+    return false;
+  }
+  const dtex_format_t format = (dtex_format_t)header.format;
+  sg_pixel_format pixelFormat = dtex_pixel_format(format);
+  if (!sg_query_pixelformat(pixelFormat).sample) {
+    return false;
   }
-  requests[requestsMade].slotId = slot;
-  requests[requestsMade].requestId = requestsMade;
-  requests[requestsMade].imgLoc = imgLoc;
 
+  sg_image_desc imageDesc = {0};
+  imageDesc.width = (int)dtex_mip_dim(header.width, firstMip);
+  imageDesc.height = (int)dtex_mip_dim(header.height, firstMip);
+  imageDesc.num_mipmaps = (int)(header.numMips - firstMip);
+  imageDesc.pixel_format = pixelFormat;
+  imageDesc.min_filter = imageDesc.num_mipmaps > 1
+                             ? SG_FILTER_LINEAR_MIPMAP_LINEAR
+                             : SG_FILTER_NEAREST;
+  imageDesc.mag_filter = SG_FILTER_LINEAR;
+  // Mips are stored contiguously, so the used range is a single span.
+  uint32_t bytes = fileSize - offsets[firstMip];
+  const uint8_t* mips = data + offsets[firstMip];
+  uint8_t* owned = ownsData ? (uint8_t*)data : nullptr;
+  if (!ownsData && isFetchBuffer(data)) {
+    owned = (uint8_t*)arenaAlloc(&decodeArena, bytes);
+    memcpy(owned, mips, bytes);
+    mips = owned;
+  }
+  for (uint32_t mip = firstMip; mip < header.numMips; mip++) {
+    uint32_t mipSize = dtex_mip_size(format, dtex_mip_dim(header.width, mip),
+                                     dtex_mip_dim(header.height, mip));
+    imageDesc.data.subimage[0][mip - firstMip].ptr =
+        mips + (offsets[mip] - offsets[firstMip]);
+    imageDesc.data.subimage[0][mip - firstMip].size = mipSize;
+  }
+  queueImageUpload(imgLoc, imageDesc, bytes, priority, owned, decode_free);
+  if (outBytes) {
+    *outBytes = bytes;
+  }
+  return true;
+}
+
+static bool uploadBakedTexture(const uint8_t* data,
+                               size_t size,
+                               sg_image imgLoc) {
+  return uploadBakedMips(data, size, imgLoc, 0, nullptr);
+}
+
+// Queues an RGBA8 image the way loadTexture() uploads decoded files.
+// `pixels` is handed to `freePixels` after the upload.
+static void queueRGBA8Upload(sg_image imgLoc,
+                             void* pixels,
+                             int width,
+                             int height,
+                             void (*freePixels)(void*)) {
+  sg_image_desc imageDesc = {0};
+  imageDesc.width = width;
+  imageDesc.height = height;
+  imageDesc.pixel_format = SG_PIXELFORMAT_RGBA8;
+  imageDesc.min_filter = SG_FILTER_NEAREST;
+  imageDesc.mag_filter = SG_FILTER_LINEAR;
+  imageDesc.data.subimage[0][0].ptr = pixels;
+  imageDesc.data.subimage[0][0].size = (size_t)width * height * 4;
+  queueImageUpload(imgLoc, imageDesc, imageDesc.data.subimage[0][0].size,
+                   UploadPriority_Normal, pixels, freePixels);
+}
+
+static void uploadEncodedTexture(const uint8_t* data,
+                                 size_t size,
+                                 sg_image imgLoc) {
+  int texWidth, texHeight, numChannels;
+  const int desiredChannels = 4;
+  stbi_uc* pixels = stbi_load_from_memory((const stbi_uc*)data, (int)size,
+                                          &texWidth, &texHeight, &numChannels,
+                                          desiredChannels);
+  if (pixels) {
+    queueRGBA8Upload(imgLoc, pixels, texWidth, texHeight, stbi_image_free);
+  }
+}
+
+// Hands fetched or mapped file contents to the request's hook or uploads
+// them. Returns false if baked data turned out unusable, in which case the
+// caller should retry with the source image; otherwise the request is done.
+static bool finishTextureData(request_t* request,
+                              const uint8_t* data,
+                              size_t size) {
+  if (request->ranged) {
+    request->onData(data, size, true, request->imgLoc, request->userData);
+    request->inUse = false;
+    return true;
+  }
+  if (request->onData && request->onData(data, size, request->baked,
+                                         request->imgLoc, request->userData)) {
+    request->inUse = false;
+    return true;
+  }
+  if (!request->baked) {
+    uploadEncodedTexture(data, size, request->imgLoc);
+    request->inUse = false;
+    return true;
+  }
+  if (uploadBakedTexture(data, size, request->imgLoc)) {
+    request->inUse = false;
+    return true;
+  }
+  return false;
+}
+
+// Resolves a request from the memory-mapped asset pack, if one is open and
+// holds the baked or source file. The data is used in place without copies.
+static bool loadFromAssetPack(request_t* request, const char* bakedPath) {
+  const uint8_t* data;
+  size_t size;
+  if (request->ranged) {
+    if (!assetPackFind(bakedPath, &data, &size)) {
+      return false;
+    }
+    bool inside = (uint64_t)request->rangeOffset + request->rangeSize <= size;
+    finishTextureData(request, inside ? data + request->rangeOffset : nullptr,
+                      inside ? request->rangeSize : 0);
+    return true;
+  }
+  if (request->baked && assetPackFind(bakedPath, &data, &size)) {
+    if (finishTextureData(request, data, size)) {
+      return true;
+    }
+  }
+  if (assetPackFind(request->sourcePath, &data, &size)) {
+    request->baked = false;
+    finishTextureData(request, data, size);
+    return true;
+  }
+  return false;
+}
+
+// sokol_fetch has no ranged reads, so with it a ranged request still reads
+// the whole file and texture_read_done() cuts the range out.
+static void sendTextureRequest(request_t* request, const char* path) {
+  if (textureIoBackend == TextureIo_FileReader) {
+    uint32_t size = request->ranged ? request->rangeSize : 0;
+    request->handle = fileReaderSend(path, file_read_callback, nullptr,
+                                     request->rangeOffset, size)
+                          .id;
+    return;
+  }
   sfetch_request_t fetchRequest = {0};
-  fetchRequest.path = fileName;
+  fetchRequest.path = path;
   fetchRequest.callback = fetch_callback;
-  requests[requestsMade++].handle = sfetch_send(&fetchRequest);
+  request->handle = sfetch_send(&fetchRequest).id;
+}
+
+static request_t* texture_request_alloc(const char* fileName,
+                                        sg_image imgLoc,
+                                        int slot,
+                                        texture_data_cb onData,
+                                        void* userData) {
+  int index = -1;
+  for (int i = 0; i < NUM_REQUESTS; i++) {
+    if (!requests[i].inUse) {
+      index = i;
+      break;
+    }
+  }
+  if (index < 0) {
+    return nullptr;
+  }
+  if (index >= requestsMade) {
+    requestsMade = index + 1;
+  }
+  request_t* request = &requests[index];
+  request->slotId = slot;
+  request->requestId = index;
+  request->imgLoc = imgLoc;
+  request->inUse = true;
+  request->cancelled = false;
+  request->onData = onData;
+  request->userData = userData;
+  request->ranged = false;
+  request->rangeOffset = 0;
+  request->rangeSize = 0;
+  snprintf(request->sourcePath, MAX_PATH_LEN, "%s", fileName);
+  return request;
+}
+
+static bool loadTextureData(const char* fileName,
+                            sg_image imgLoc,
+                            int slot,
+                            texture_data_cb onData,
+                            void* userData) {
+  request_t* request =
+      texture_request_alloc(fileName, imgLoc, slot, onData, userData);
+  if (!request) {
+    return false;
+  }
+  const char* ext = strrchr(fileName, '.');
+  request->baked = bakedTexturesSupported && ext;
+  char bakedPath[MAX_PATH_LEN] = {0};
+  if (request->baked) {
+    snprintf(bakedPath, MAX_PATH_LEN, "%.*s.dtex", (int)(ext - fileName),
+             fileName);
+  }
+  if (loadFromAssetPack(request, bakedPath)) {
+    return true;
+  }
+  sendTextureRequest(request, request->baked ? bakedPath : fileName);
+  return true;
+}
+
+// Reads only the `size` bytes at `offset` of the baked .dtex for `fileName`
+// and hands them to `onData`, which must consume them: a range of a file
+// has no source image to fall back to, so a failure just ends in `onData`
+// with null data. Where the I/O backend can't read ranges the whole file is
+// read and the range cut out of it.
+static bool loadBakedRange(const char* fileName,
+                           sg_image imgLoc,
+                           uint32_t offset,
+                           uint32_t size,
+                           texture_data_cb onData,
+                           void* userData) {
+  const char* ext = strrchr(fileName, '.');
+  if (!bakedTexturesSupported || !ext || !onData || size == 0) {
+    return false;
+  }
+  request_t* request =
+      texture_request_alloc(fileName, imgLoc, 0, onData, userData);
+  if (!request) {
+    return false;
+  }
+  request->baked = true;
+  request->ranged = true;
+  request->rangeOffset = offset;
+  request->rangeSize = size;
+  char bakedPath[MAX_PATH_LEN] = {0};
+  snprintf(bakedPath, MAX_PATH_LEN, "%.*s.dtex", (int)(ext - fileName),
+           fileName);
+  if (loadFromAssetPack(request, bakedPath)) {
+    return true;
+  }
+  sendTextureRequest(request, bakedPath);
+  return true;
+}
+
+// Drops every in-flight request and queued upload targeting `imgLoc`, e.g.
+// before the image is destroyed. Fetched data will be discarded when the
+// fetch completes.
+static void cancelTextureRequests(sg_image imgLoc) {
+  cancelImageUploads(imgLoc);
+  for (int i = 0; i < requestsMade; i++) {
+    if (requests[i].inUse && requests[i].imgLoc.id == imgLoc.id) {
+      requests[i].cancelled = true;
+      if (textureIoBackend == TextureIo_FileReader) {
+        fileReaderCancel(file_read_handle_t{requests[i].handle});
+      } else {
+        sfetch_cancel(sfetch_handle_t{requests[i].handle});
+      }
+    }
+  }
+}
+
+static void loadTexture(const char* fileName, sg_image imgLoc, int slot) {
+  loadTextureData(fileName, imgLoc, slot, nullptr, nullptr);
 }
 
+// Call once per frame: completes fetches, then spends the frame's upload
+// budget on whatever they (and earlier frames) queued.
 static void texturePump(void) {
-  sfetch_dowork();
+  if (textureIoBackend == TextureIo_FileReader) {
+    fileReaderDoWork();
+  } else {
+    sfetch_dowork();
+  }
+  pumpUploadQueue();
+}
+
+// Shared completion path of both I/O backends. `data` is null if the read
+// failed; `finished` is false only for intermediate sokol_fetch responses.
+static void texture_read_done(uint32_t handle,
+                              const uint8_t* data,
+                              size_t size,
+                              bool finished) {
+  int index = -1;
+  for (int i = 0; i < requestsMade; i++) {
+    if (requests[i].inUse && requests[i].handle == handle) {
+      index = i;
+      break;
+    }
+  }
+  if (index < 0) {
+    return;
+  }
+  request_t* request = &requests[index];
+  if (request->cancelled) {
+    if (finished) {
+      request->inUse = false;
+    }
+    return;
+  }
+  if (request->ranged) {
+    // sokol_fetch hands over the whole file; cut the range out.
+    if (data && textureIoBackend == TextureIo_Fetch) {
+      bool inside =
+          (uint64_t)request->rangeOffset + request->rangeSize <= size;
+      data = inside ? data + request->rangeOffset : nullptr;
+      size = inside ? request->rangeSize : 0;
+    }
+    finishTextureData(request, data, data ? size : 0);
+    return;
+  }
+  if (data) {
+    if (finishTextureData(request, data, size)) {
+      return;
+    }
+  } else if (!request->baked) {
+    if (request->onData) {
+      request->onData(nullptr, 0, false, request->imgLoc, request->userData);
+    }
+    request->inUse = false;
+    return;
+  }
+  // The baked file is missing or unusable, fall back to the source image.
+  request->baked = false;
+  sendTextureRequest(request, request->sourcePath);
 }
 
 static void fetch_callback(const sfetch_response_t* response) {
@@ -59,34 +505,20 @@ static void fetch_callback(const sfetch_response_t* response) {
     void* ptr = fileBuffer[response->channel][response->lane];
     sfetch_bind_buffer(response->handle, ptr, MAX_FILE_SIZE);
   }
-  if (response->fetched) {
-    int index = -1;
-    for (int i = 0; i < requestsMade; i++) {
-      if (requests[i].handle.id == response->handle.id) {
-        index = i;
-        break;
-      }
-    }
-    if (index >= 0) {
-      int texWidth, texHeight, numChannels;
-      const int desiredChannels = 4;
-      stbi_uc* pixels = stbi_load_from_memory(
-          (const stbi_uc*)response->buffer_ptr, (int)response->fetched_size,
-          &texWidth, &texHeight, &numChannels, desiredChannels);
-      if (pixels) {
-        sg_image_desc imageDesc = {0};
-        imageDesc.width = texWidth;
-        imageDesc.height = texHeight;
-        imageDesc.pixel_format = SG_PIXELFORMAT_RGBA8;
-        imageDesc.min_filter = SG_FILTER_NEAREST;
-        imageDesc.mag_filter = SG_FILTER_LINEAR;
-        imageDesc.data.subimage[0][0].ptr = pixels;
-        imageDesc.data.subimage[0][0].size = texWidth * texHeight * 4;
-        sg_init_image(requests[index].imgLoc, &imageDesc);
-        stbi_image_free(pixels);
-      }
-    }
+  if (!response->fetched && !response->failed) {
+    return;
   }
+  texture_read_done(response->handle.id,
+                    response->fetched ? (const uint8_t*)response->buffer_ptr
+                                      : nullptr,
+                    response->fetched_size, response->finished);
+}
+
+static void file_read_callback(const file_read_response_t* response) {
+  texture_read_done(response->handle.id,
+                    response->fetched ? (const uint8_t*)response->buffer_ptr
+                                      : nullptr,
+                    response->fetched_size, true);
 }
 
 #endif  // _TEXTURE_LOADER_H_
\ No newline at end of file
@@ -0,0 +1,251 @@
+#pragma once
+
+#include <string.h>
+#include <vector>
+#include "sokol_gfx.h"
+#include "fnvHash.h"
+#include "textureLoader.h"
+#include "textureStreamer.h"
+
+// Interns texture paths to one shared, refcounted sg_image. A second acquire
+// of the same path returns the same handle immediately, so it attaches to a
+// load that is still in flight instead of issuing a new one. When a load
+// completes, its file contents are hashed. If another path already produced
+// the same hash and size, that path's file is read back and compared byte for
+// byte before anything is uploaded: identical bytes make the new entry an
+// alias of that texture and release its own image, anything else loads it
+// again as a texture of its own.
+//
+// Handles are registry indices; resolve them with textureRegistryImage() at
+// bind time, since an alias only learns its final image after loading. Slots
+// of released textures are reused by later acquires.
+
+#define INVALID_TEXTURE_HANDLE (-1)
+
+typedef struct {
+  int uniqueTextures;
+  int acquires;
+  int pathHits;
+  int contentHits;
+} texture_registry_stats_t;
+
+typedef struct {
+  char path[MAX_PATH_LEN];
+  sg_image image;
+  // Only meaningful on canonical entries; aliases forward to their target.
+  int refCount;
+  // Index of the entry holding the identical texture, or -1.
+  int aliasOf;
+  bool hashed;
+  uint64_t contentHash;
+  size_t contentSize;
+  // While the bytes of a hash match are being compared: the entry they may
+  // alias and a copy of this entry's own file.
+  int verifyWith;
+  std::vector<uint8_t> verifyContent;
+  streamed_texture_t* streamed;
+} texture_entry_t;
+
+typedef struct {
+  std::vector<texture_entry_t> entries;
+  std::vector<int> freeEntries;
+  texture_registry_stats_t stats;
+} texture_registry_t;
+
+static texture_registry_t textureRegistry;
+
+static bool registry_on_data(const uint8_t* data,
+                             size_t size,
+                             bool baked,
+                             sg_image imgLoc,
+                             void* userData);
+
+static int registry_resolve(int handle) {
+  while (handle >= 0 && textureRegistry.entries[handle].aliasOf >= 0) {
+    handle = textureRegistry.entries[handle].aliasOf;
+  }
+  return handle;
+}
+
+// Loads the entry's own file again, after a hash match turned out not to be
+// the same texture.
+static void registry_reload(int handle) {
+  texture_entry_t& entry = textureRegistry.entries[handle];
+  if (!loadTextureData(entry.path, entry.image, 0, registry_on_data,
+                       (void*)(intptr_t)handle)) {
+    entry.streamed->loading = false;
+  }
+}
+
+// Receives the file of the entry a hash match pointed at. Always consumes
+// the data: it belongs to the other texture, not to this entry's image.
+static bool registry_on_verify(const uint8_t* data,
+                               size_t size,
+                               bool baked,
+                               sg_image imgLoc,
+                               void* userData) {
+  (void)baked;
+  (void)imgLoc;
+  int handle = (int)(intptr_t)userData;
+  texture_entry_t& entry = textureRegistry.entries[handle];
+  int target = entry.verifyWith;
+  std::vector<uint8_t> content;
+  content.swap(entry.verifyContent);
+  entry.verifyWith = -1;
+  if (!data || target < 0) {
+    if (!data) {
+      registry_reload(handle);
+    }
+    return true;
+  }
+  texture_entry_t& other = textureRegistry.entries[target];
+  bool same = other.refCount > 0 && other.aliasOf < 0 && other.hashed &&
+              other.contentHash == entry.contentHash &&
+              size == content.size() &&
+              memcmp(data, content.data(), size) == 0;
+  if (!same) {
+    registry_reload(handle);
+    return true;
+  }
+  other.refCount += entry.refCount;
+  entry.refCount = 0;
+  entry.aliasOf = target;
+  unregisterStreamedTexture(entry.image);
+  entry.streamed = nullptr;
+  sg_destroy_image(entry.image);
+  entry.image = other.image;
+  textureRegistry.stats.contentHits++;
+  textureRegistry.stats.uniqueTextures--;
+  return true;
+}
+
+static bool registry_on_data(const uint8_t* data,
+                             size_t size,
+                             bool baked,
+                             sg_image imgLoc,
+                             void* userData) {
+  int handle = (int)(intptr_t)userData;
+  if (data && !textureRegistry.entries[handle].hashed) {
+    uint64_t hash = fnvHash(data, size);
+    texture_entry_t& entry = textureRegistry.entries[handle];
+    entry.hashed = true;
+    entry.contentHash = hash;
+    entry.contentSize = size;
+    for (int i = 0; i < (int)textureRegistry.entries.size(); i++) {
+      texture_entry_t& other = textureRegistry.entries[i];
+      if (i == handle || !other.hashed || other.aliasOf >= 0 ||
+          other.refCount == 0 || other.contentHash != hash ||
+          other.contentSize != size) {
+        continue;
+      }
+      // The hash alone could collide; hold off uploading until the other
+      // file has been compared.
+      entry.verifyWith = i;
+      entry.verifyContent.assign(data, data + size);
+      if (loadTextureData(other.path, imgLoc, 0, registry_on_verify,
+                          (void*)(intptr_t)handle)) {
+        return true;
+      }
+      entry.verifyWith = -1;
+      entry.verifyContent.clear();
+      break;
+    }
+  }
+  texture_entry_t& entry = textureRegistry.entries[handle];
+  return streamer_on_data(data, size, baked, imgLoc, entry.streamed);
+}
+
+// Returns a handle to the texture at `path`, starting its load on first use.
+static int acquireTexture(const char* path) {
+  textureRegistry.stats.acquires++;
+  for (int i = 0; i < (int)textureRegistry.entries.size(); i++) {
+    if (strcmp(textureRegistry.entries[i].path, path) != 0) {
+      continue;
+    }
+    texture_entry_t& target = textureRegistry.entries[registry_resolve(i)];
+    if (target.refCount > 0) {
+      target.refCount++;
+      textureRegistry.stats.pathHits++;
+      return i;
+    }
+  }
+
+  int handle;
+  if (!textureRegistry.freeEntries.empty()) {
+    handle = textureRegistry.freeEntries.back();
+    textureRegistry.freeEntries.pop_back();
+  } else {
+    handle = (int)textureRegistry.entries.size();
+    textureRegistry.entries.push_back(texture_entry_t());
+  }
+  texture_entry_t& entry = textureRegistry.entries[handle];
+  entry = texture_entry_t();
+  snprintf(entry.path, MAX_PATH_LEN, "%s", path);
+  entry.image = sg_alloc_image();
+  entry.refCount = 1;
+  entry.aliasOf = -1;
+  entry.verifyWith = -1;
+  textureRegistry.stats.uniqueTextures++;
+
+  texture_entry_t& added = textureRegistry.entries[handle];
+  added.streamed = registerStreamedTexture(path, added.image);
+  if (!loadTextureData(path, added.image, 0, registry_on_data,
+                       (void*)(intptr_t)handle)) {
+    added.streamed->loading = false;
+  }
+  return handle;
+}
+
+static sg_image textureRegistryImage(int handle) {
+  if (handle < 0) {
+    return sg_image{SG_INVALID_ID};
+  }
+  return textureRegistry.entries[registry_resolve(handle)].image;
+}
+
+static void releaseTexture(int handle) {
+  if (handle < 0) {
+    return;
+  }
+  int target = registry_resolve(handle);
+  texture_entry_t& entry = textureRegistry.entries[target];
+  if (--entry.refCount > 0) {
+    return;
+  }
+  if (entry.streamed) {
+    unregisterStreamedTexture(entry.image);
+    entry.streamed = nullptr;
+  } else {
+    cancelTextureRequests(entry.image);
+  }
+  sg_destroy_image(entry.image);
+  textureRegistry.stats.uniqueTextures--;
+
+  // The texture and every alias of it are gone; their slots can be reused.
+  std::vector<int> freed;
+  for (int i = 0; i < (int)textureRegistry.entries.size(); i++) {
+    if (registry_resolve(i) == target) {
+      freed.push_back(i);
+    }
+  }
+  for (int i : freed) {
+    textureRegistry.entries[i] = texture_entry_t();
+    textureRegistry.entries[i].aliasOf = -1;
+    textureRegistry.entries[i].verifyWith = -1;
+    textureRegistry.freeEntries.push_back(i);
+  }
+}
+
+static void destroyTextureRegistry(void) {
+  for (texture_entry_t& entry : textureRegistry.entries) {
+    if (entry.aliasOf < 0 && entry.refCount > 0) {
+      sg_destroy_image(entry.image);
+    }
+  }
+  textureRegistry.entries.clear();
+  textureRegistry.freeEntries.clear();
+}
+
+static texture_registry_stats_t textureRegistryStats(void) {
+  return textureRegistry.stats;
+}
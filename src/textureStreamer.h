@@ -0,0 +1,361 @@
+#pragma once
+
+#include <math.h>
+#include <string.h>
+#include <vector>
+#include "sokol_gfx.h"
+#include "textureLoader.h"
+
+// Mip residency manager on top of loadTextureData(). Baked textures start
+// with only their small tail mips resident; renderers report how large each
+// texture appears on screen and the streamer re-uploads more of the chain as
+// needed, evicting least-recently-used textures back to their tail when the
+// VRAM budget would be exceeded. The tail mips are kept in CPU memory so an
+// eviction never has to touch the disk.
+//
+// The first load reads the whole .dtex, since its header is needed to find
+// the mips. A raise then reads only the mips it adds above the tail, from
+// the offsets in that header, and rebuilds the chain with the tail from CPU
+// memory. Mips that were resident before the raise are read again, which
+// costs at most a third of the new top mip. With sokol_fetch as the I/O
+// backend, which has no ranged reads, each raise still reads the whole file.
+
+#define STREAM_TAIL_MAX_DIM (64)
+#define STREAM_MAX_LOADS_PER_FRAME (2)
+#define STREAM_DEFAULT_BUDGET (64ull * 1024 * 1024)
+
+typedef struct {
+  uint64_t residentBytes;
+  uint64_t requestedBytes;
+  uint64_t budgetBytes;
+  int numTextures;
+  int pendingLoads;
+  int evictions;
+} texture_streamer_stats_t;
+
+typedef struct {
+  char path[MAX_PATH_LEN];
+  sg_image image;
+  bool loading;
+  // Source images without a baked mip chain are uploaded once and only
+  // counted towards the resident bytes.
+  bool fixedResidency;
+  dtex_header_t header;
+  uint32_t offsets[DTEX_MAX_MIPS];
+  uint32_t tailMip;
+  uint32_t residentMip;
+  uint32_t wantedMip;
+  uint32_t loadingMip;
+  uint64_t residentBytes;
+  uint64_t lastUsedFrame;
+  // Self-contained .dtex holding only mips [tailMip, numMips).
+  std::vector<uint8_t> tail;
+} streamed_texture_t;
+
+typedef struct {
+  std::vector<streamed_texture_t*> textures;
+  uint64_t budgetBytes;
+  uint64_t frame;
+  int evictions;
+} texture_streamer_t;
+
+static texture_streamer_t textureStreamer;
+
+static uint64_t streamer_bytes_from(const streamed_texture_t* tex,
+                                    uint32_t firstMip) {
+  uint64_t bytes = 0;
+  for (uint32_t mip = firstMip; mip < tex->header.numMips; mip++) {
+    bytes += dtex_mip_size((dtex_format_t)tex->header.format,
+                           dtex_mip_dim(tex->header.width, mip),
+                           dtex_mip_dim(tex->header.height, mip));
+  }
+  return bytes;
+}
+
+static streamed_texture_t* streamer_find(sg_image image) {
+  for (streamed_texture_t* tex : textureStreamer.textures) {
+    if (tex->image.id == image.id) {
+      return tex;
+    }
+  }
+  return nullptr;
+}
+
+// Copies mips [tailMip, numMips) into a self-contained .dtex whose top mip is
+// the tail, so uploadBakedMips() can re-create the image from it later.
+static void streamer_keep_tail(streamed_texture_t* tex, const uint8_t* data) {
+  dtex_header_t tailHeader = tex->header;
+  tailHeader.width = dtex_mip_dim(tex->header.width, tex->tailMip);
+  tailHeader.height = dtex_mip_dim(tex->header.height, tex->tailMip);
+  tailHeader.numMips = tex->header.numMips - tex->tailMip;
+  uint32_t tailOffset = tex->offsets[tex->tailMip];
+  uint32_t tailBytes = (uint32_t)streamer_bytes_from(tex, tex->tailMip);
+  tex->tail.resize(sizeof(dtex_header_t) + tailBytes);
+  memcpy(tex->tail.data(), &tailHeader, sizeof(dtex_header_t));
+  memcpy(tex->tail.data() + sizeof(dtex_header_t), data + tailOffset,
+         tailBytes);
+}
+
+// Drops everything above the tail by re-creating the image from CPU memory.
+// Queued ahead of other uploads since it is what frees the budget.
+static void streamer_evict(streamed_texture_t* tex) {
+  uint32_t bytes = 0;
+  uploadBakedMips(tex->tail.data(), tex->tail.size(), tex->image, 0, &bytes,
+                  UploadPriority_High);
+  tex->residentMip = tex->tailMip;
+  tex->residentBytes = bytes;
+  textureStreamer.evictions++;
+}
+
+// Completes a raise: `data` holds mips [loadingMip, tailMip) as stored in
+// the .dtex, and the tail is appended from CPU memory.
+static bool streamer_on_upgrade(const uint8_t* data,
+                                size_t size,
+                                bool baked,
+                                sg_image imgLoc,
+                                void* userData) {
+  (void)baked;
+  streamed_texture_t* tex = (streamed_texture_t*)userData;
+  tex->loading = false;
+  uint32_t first = tex->loadingMip;
+  if (!data || size != tex->offsets[tex->tailMip] - tex->offsets[first]) {
+    return true;
+  }
+  dtex_header_t header = tex->header;
+  header.width = dtex_mip_dim(tex->header.width, first);
+  header.height = dtex_mip_dim(tex->header.height, first);
+  header.numMips = tex->header.numMips - first;
+  size_t tailBytes = tex->tail.size() - sizeof(dtex_header_t);
+  size_t chainSize = sizeof(dtex_header_t) + size + tailBytes;
+  uint8_t* chain = (uint8_t*)arenaAlloc(&decodeArena, chainSize);
+  if (!chain) {
+    return true;
+  }
+  memcpy(chain, &header, sizeof(dtex_header_t));
+  memcpy(chain + sizeof(dtex_header_t), data, size);
+  memcpy(chain + sizeof(dtex_header_t) + size,
+         tex->tail.data() + sizeof(dtex_header_t), tailBytes);
+  uint32_t bytes = 0;
+  if (!uploadBakedMips(chain, chainSize, imgLoc, 0, &bytes,
+                       UploadPriority_Low, true)) {
+    decode_free(chain);
+    return true;
+  }
+  tex->residentMip = first;
+  tex->residentBytes = bytes;
+  return true;
+}
+
+static bool streamer_on_data(const uint8_t* data,
+                             size_t size,
+                             bool baked,
+                             sg_image imgLoc,
+                             void* userData) {
+  streamed_texture_t* tex = (streamed_texture_t*)userData;
+  tex->loading = false;
+  if (!data) {
+    return false;
+  }
+  if (!baked) {
+    int width = 0, height = 0, numChannels = 0;
+    stbi_info_from_memory(data, (int)size, &width, &height, &numChannels);
+    tex->fixedResidency = true;
+    tex->residentBytes = (uint64_t)width * height * 4;
+    return false;
+  }
+  if (size < sizeof(dtex_header_t)) {
+    return false;
+  }
+  memcpy(&tex->header, data, sizeof(dtex_header_t));
+  if (dtex_layout(&tex->header, tex->offsets) == 0) {
+    return false;
+  }
+  bool firstLoad = tex->tail.empty();
+  if (firstLoad) {
+    tex->tailMip = 0;
+    while (tex->tailMip + 1 < tex->header.numMips &&
+           (dtex_mip_dim(tex->header.width, tex->tailMip) >
+                STREAM_TAIL_MAX_DIM ||
+            dtex_mip_dim(tex->header.height, tex->tailMip) >
+                STREAM_TAIL_MAX_DIM)) {
+      tex->tailMip++;
+    }
+    tex->residentMip = tex->tailMip;
+    tex->wantedMip = tex->tailMip;
+    tex->loadingMip = tex->tailMip;
+    streamer_keep_tail(tex, data);
+  }
+  uint32_t bytes = 0;
+  int priority = firstLoad ? UploadPriority_Normal : UploadPriority_Low;
+  if (!uploadBakedMips(data, size, imgLoc, tex->loadingMip, &bytes,
+                       priority)) {
+    return false;
+  }
+  tex->residentMip = tex->loadingMip;
+  tex->residentBytes = bytes;
+  return true;
+}
+
+static void initTextureStreamer(uint64_t budgetBytes) {
+  textureStreamer.budgetBytes = budgetBytes;
+  textureStreamer.frame = 0;
+  textureStreamer.evictions = 0;
+}
+
+static void destroyTextureStreamer(void) {
+  for (streamed_texture_t* tex : textureStreamer.textures) {
+    delete tex;
+  }
+  textureStreamer.textures.clear();
+}
+
+static void textureStreamerSetBudget(uint64_t budgetBytes) {
+  textureStreamer.budgetBytes = budgetBytes;
+}
+
+// Registers `image` for streaming without loading anything. The first load
+// must be issued by the caller with streamer_on_data (or a hook forwarding to
+// it) so the tail mips get picked up.
+static streamed_texture_t* registerStreamedTexture(const char* fileName,
+                                                   sg_image image) {
+  streamed_texture_t* tex = new streamed_texture_t();
+  snprintf(tex->path, MAX_PATH_LEN, "%s", fileName);
+  tex->image = image;
+  tex->loading = true;
+  tex->loadingMip = DTEX_MAX_MIPS;
+  tex->wantedMip = DTEX_MAX_MIPS;
+  textureStreamer.textures.push_back(tex);
+  return tex;
+}
+
+static void unregisterStreamedTexture(sg_image image) {
+  cancelTextureRequests(image);
+  for (size_t i = 0; i < textureStreamer.textures.size(); i++) {
+    if (textureStreamer.textures[i]->image.id == image.id) {
+      delete textureStreamer.textures[i];
+      textureStreamer.textures.erase(textureStreamer.textures.begin() + i);
+      return;
+    }
+  }
+}
+
+// Registers `image` for streaming and starts loading its low mips.
+static void streamTexture(const char* fileName, sg_image image) {
+  streamed_texture_t* tex = registerStreamedTexture(fileName, image);
+  if (!loadTextureData(fileName, image, 0, streamer_on_data, tex)) {
+    tex->loading = false;
+  }
+}
+
+// Reports that `image` covers roughly `projectedPixels` pixels across on
+// screen this frame. The largest report of the frame wins.
+static void textureStreamerRequest(sg_image image, float projectedPixels) {
+  streamed_texture_t* tex = streamer_find(image);
+  if (!tex || tex->fixedResidency || tex->tail.empty()) {
+    return;
+  }
+  uint32_t wanted = tex->header.numMips - 1;
+  if (projectedPixels > 0.0f) {
+    float ratio = (float)tex->header.width / projectedPixels;
+    wanted = ratio <= 1.0f ? 0 : (uint32_t)floorf(log2f(ratio));
+  }
+  if (wanted > tex->tailMip) {
+    wanted = tex->tailMip;
+  }
+  if (tex->lastUsedFrame != textureStreamer.frame ||
+      wanted < tex->wantedMip) {
+    tex->wantedMip = wanted;
+  }
+  tex->lastUsedFrame = textureStreamer.frame;
+}
+
+static uint64_t streamer_resident_total(void) {
+  uint64_t total = 0;
+  for (streamed_texture_t* tex : textureStreamer.textures) {
+    total += tex->residentBytes;
+  }
+  return total;
+}
+
+// Evicts least-recently-used textures not needed this frame until `needed`
+// more bytes fit in the budget. Returns false if that is not possible.
+static bool streamer_make_room(uint64_t needed) {
+  uint64_t resident = streamer_resident_total();
+  while (resident + needed > textureStreamer.budgetBytes) {
+    streamed_texture_t* victim = nullptr;
+    for (streamed_texture_t* tex : textureStreamer.textures) {
+      if (tex->loading || tex->fixedResidency || tex->tail.empty() ||
+          tex->residentMip >= tex->tailMip ||
+          tex->lastUsedFrame == textureStreamer.frame) {
+        continue;
+      }
+      if (!victim || tex->lastUsedFrame < victim->lastUsedFrame) {
+        victim = tex;
+      }
+    }
+    if (!victim) {
+      return false;
+    }
+    resident -= victim->residentBytes;
+    streamer_evict(victim);
+    resident += victim->residentBytes;
+  }
+  return true;
+}
+
+// Call once per frame after all textureStreamerRequest() calls.
+static void textureStreamerUpdate(void) {
+  streamer_make_room(0);
+
+  int loadsIssued = 0;
+  for (streamed_texture_t* tex : textureStreamer.textures) {
+    if (loadsIssued >= STREAM_MAX_LOADS_PER_FRAME) {
+      break;
+    }
+    if (tex->loading || tex->fixedResidency || tex->tail.empty() ||
+        tex->lastUsedFrame != textureStreamer.frame ||
+        tex->wantedMip >= tex->residentMip) {
+      continue;
+    }
+    // Settle for a smaller mip if the wanted one does not fit.
+    uint32_t target = tex->wantedMip;
+    while (target < tex->residentMip &&
+           !streamer_make_room(streamer_bytes_from(tex, target) -
+                               tex->residentBytes)) {
+      target++;
+    }
+    if (target >= tex->residentMip) {
+      continue;
+    }
+    tex->loading = true;
+    tex->loadingMip = target;
+    uint32_t offset = tex->offsets[target];
+    if (!loadBakedRange(tex->path, tex->image, offset,
+                        tex->offsets[tex->tailMip] - offset,
+                        streamer_on_upgrade, tex)) {
+      tex->loading = false;
+      break;
+    }
+    loadsIssued++;
+  }
+  textureStreamer.frame++;
+}
+
+static texture_streamer_stats_t textureStreamerStats(void) {
+  texture_streamer_stats_t stats = {};
+  stats.budgetBytes = textureStreamer.budgetBytes;
+  stats.evictions = textureStreamer.evictions;
+  for (streamed_texture_t* tex : textureStreamer.textures) {
+    stats.numTextures++;
+    stats.residentBytes += tex->residentBytes;
+    if (tex->loading) {
+      stats.pendingLoads++;
+    }
+    if (tex->fixedResidency) {
+      stats.requestedBytes += tex->residentBytes;
+    } else if (!tex->tail.empty()) {
+      stats.requestedBytes += streamer_bytes_from(tex, tex->wantedMip);
+    }
+  }
+  return stats;
+}
@@ -0,0 +1,160 @@
+// Offline texture baker: reads the file list from assets.yml, decodes each
+// image and writes a block-compressed mip chain as <name>.dtex next to it.
+//
+//   texture-baker <assets.yml> <source dir> <output dir> [--min-psnr dB]
+//                 [--threads N]
+//
+// Opaque albedo maps become BC1, albedo with alpha BC3, and *_normal/*_norm
+// maps BC5. The top mip of every texture is decoded again and compared with
+// the source; the tool exits non-zero if any texture falls below the PSNR
+// threshold, so it doubles as a headless check of the encoder.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "assetList.h"
+#include "stb_image.h"
+#include "textureCompressor.h"
+
+static const double DefaultMinPSNR = 25.0;
+
+static std::string baked_name(const std::string& file) {
+  size_t dot = file.find_last_of('.');
+  return (dot == std::string::npos ? file : file.substr(0, dot)) + ".dtex";
+}
+
+static bool is_normal_map(const std::string& file) {
+  return file.find("_normal.") != std::string::npos ||
+         file.find("_norm.") != std::string::npos;
+}
+
+static bool has_alpha(const uint8_t* pixels, uint32_t width, uint32_t height) {
+  for (size_t i = 0; i < (size_t)width * height; i++) {
+    if (pixels[i * 4 + 3] != 255) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool bake_texture(const std::string& srcPath,
+                         const std::string& dstPath,
+                         bool normalMap,
+                         uint32_t numThreads,
+                         double* outPSNR,
+                         dtex_format_t* outFormat) {
+  int width, height, numChannels;
+  stbi_uc* pixels = stbi_load(srcPath.c_str(), &width, &height, &numChannels, 4);
+  if (!pixels) {
+    fprintf(stderr, "texture-baker: failed to load %s\n", srcPath.c_str());
+    return false;
+  }
+
+  dtex_format_t format = DTEX_FORMAT_BC1;
+  if (normalMap) {
+    format = DTEX_FORMAT_BC5;
+  } else if (has_alpha(pixels, width, height)) {
+    format = DTEX_FORMAT_BC3;
+  }
+
+  dtex_header_t header = {};
+  header.magic = DTEX_MAGIC;
+  header.version = DTEX_VERSION;
+  header.format = format;
+  header.width = (uint32_t)width;
+  header.height = (uint32_t)height;
+  header.numMips = dtex_mip_count(header.width, header.height);
+
+  uint32_t offsets[DTEX_MAX_MIPS];
+  uint32_t fileSize = dtex_layout(&header, offsets);
+  std::vector<uint8_t> file(fileSize);
+  memcpy(file.data(), &header, sizeof(header));
+
+  std::vector<uint8_t> mip(pixels, pixels + (size_t)width * height * 4);
+  std::vector<uint8_t> nextMip;
+  for (uint32_t level = 0; level < header.numMips; level++) {
+    uint32_t mipWidth = dtex_mip_dim(header.width, level);
+    uint32_t mipHeight = dtex_mip_dim(header.height, level);
+    compressTexture(mip.data(), mipWidth, mipHeight, format,
+                    &file[offsets[level]], numThreads);
+    if (level == 0) {
+      std::vector<uint8_t> decoded(mip);
+      decompressTexture(&file[offsets[0]], mipWidth, mipHeight, format,
+                        decoded.data());
+      *outPSNR = computePSNR(mip.data(), decoded.data(), mipWidth, mipHeight,
+                             format == DTEX_FORMAT_BC5 ? 2 : 3);
+    }
+    if (level + 1 < header.numMips) {
+      nextMip.resize((size_t)dtex_mip_dim(mipWidth, 1) *
+                     dtex_mip_dim(mipHeight, 1) * 4);
+      downsampleRGBA8(mip.data(), mipWidth, mipHeight, nextMip.data(),
+                      normalMap);
+      mip.swap(nextMip);
+    }
+  }
+  stbi_image_free(pixels);
+
+  FILE* fp = fopen(dstPath.c_str(), "wb");
+  if (!fp) {
+    fprintf(stderr, "texture-baker: failed to write %s\n", dstPath.c_str());
+    return false;
+  }
+  fwrite(file.data(), 1, file.size(), fp);
+  fclose(fp);
+  *outFormat = format;
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 4) {
+    fprintf(stderr,
+            "usage: texture-baker <assets.yml> <source dir> <output dir> "
+            "[--min-psnr dB] [--threads N]\n");
+    return 1;
+  }
+  double minPSNR = DefaultMinPSNR;
+  uint32_t numThreads = 0;
+  for (int i = 4; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "--min-psnr") == 0) {
+      minPSNR = atof(argv[i + 1]);
+    } else if (strcmp(argv[i], "--threads") == 0) {
+      numThreads = (uint32_t)atoi(argv[i + 1]);
+    }
+  }
+
+  std::vector<std::string> files = readAssetList(argv[1]);
+  if (files.empty()) {
+    fprintf(stderr, "texture-baker: no files listed in %s\n", argv[1]);
+    return 1;
+  }
+
+  static const char* formatNames[DTEX_FORMAT_COUNT] = {"RGBA8", "BC1", "BC3",
+                                                       "BC5"};
+  int failures = 0;
+  for (const std::string& file : files) {
+    std::string srcPath = std::string(argv[2]) + "/" + file;
+    std::string dstPath = std::string(argv[3]) + "/" + baked_name(file);
+    double psnr = 0.0;
+    dtex_format_t format = DTEX_FORMAT_RGBA8;
+    auto start = std::chrono::steady_clock::now();
+    if (!bake_texture(srcPath, dstPath, is_normal_map(file), numThreads, &psnr,
+                      &format)) {
+      failures++;
+      continue;
+    }
+    double ms = std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+    bool ok = psnr >= minPSNR;
+    printf("%-24s %-5s %6.2f dB %8.1f ms%s\n", file.c_str(),
+           formatNames[format], psnr, ms,
+           ok ? "" : "  BELOW THRESHOLD");
+    if (!ok) {
+      failures++;
+    }
+  }
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+#include "sokol_gfx.h"
+#include "sokol_time.h"
+
+// Main-thread GPU upload queue. Loaders queue image and buffer uploads
+// instead of calling sg_init_* directly; pumpUploadQueue() then drains them
+// by priority until the per-frame time or byte budget is spent and carries
+// the rest over to the next frame. At least one upload is made per frame so
+// a single oversized item cannot stall the queue.
+
+#define UPLOAD_DEFAULT_BUDGET_MS (2.0)
+#define UPLOAD_DEFAULT_BUDGET_BYTES (8 * 1024 * 1024)
+
+enum upload_priority_t {
+  UploadPriority_Low = 0,  // quality upgrades, e.g. higher texture mips
+  UploadPriority_Normal,   // first-time loads
+  UploadPriority_High,     // uploads that free memory or fix missing data
+};
+
+enum upload_kind_t { UploadKind_Image, UploadKind_Buffer };
+
+typedef struct {
+  int queueDepth;
+  int uploadsThisFrame;
+  size_t bytesThisFrame;
+  double frameUploadMs;
+  double worstUploadMs;
+} upload_queue_stats_t;
+
+typedef struct {
+  upload_kind_t kind;
+  int priority;
+  uint64_t sequence;
+  size_t bytes;
+  sg_image image;
+  sg_image_desc imageDesc;
+  sg_buffer buffer;
+  sg_buffer_desc bufferDesc;
+  // Released after the upload (or when the item is dropped), may be null.
+  void* ownedData;
+  void (*freeData)(void* ptr);
+} upload_item_t;
+
+typedef struct {
+  std::vector<upload_item_t> pending;
+  uint64_t nextSequence;
+  double budgetMs;
+  size_t budgetBytes;
+  upload_queue_stats_t stats;
+} upload_queue_t;
+
+static upload_queue_t uploadQueue = {{}, 0, UPLOAD_DEFAULT_BUDGET_MS,
+                                     UPLOAD_DEFAULT_BUDGET_BYTES, {}};
+
+// Heap order: highest priority first, FIFO within a priority.
+static bool upload_item_less(const upload_item_t& a, const upload_item_t& b) {
+  if (a.priority != b.priority) {
+    return a.priority < b.priority;
+  }
+  return a.sequence > b.sequence;
+}
+
+static void upload_item_release(upload_item_t* item) {
+  if (item->ownedData && item->freeData) {
+    item->freeData(item->ownedData);
+  }
+  item->ownedData = nullptr;
+}
+
+static void setUploadBudget(double budgetMs, size_t budgetBytes) {
+  uploadQueue.budgetMs = budgetMs;
+  uploadQueue.budgetBytes = budgetBytes;
+}
+
+// Drops pending uploads into `image`, e.g. because the image is about to be
+// destroyed or a newer upload supersedes them.
+static void cancelImageUploads(sg_image image) {
+  std::vector<upload_item_t>& pending = uploadQueue.pending;
+  size_t kept = 0;
+  for (size_t i = 0; i < pending.size(); i++) {
+    if (pending[i].kind == UploadKind_Image &&
+        pending[i].image.id == image.id) {
+      upload_item_release(&pending[i]);
+    } else {
+      pending[kept++] = pending[i];
+    }
+  }
+  if (kept != pending.size()) {
+    pending.resize(kept);
+    std::make_heap(pending.begin(), pending.end(), upload_item_less);
+  }
+}
+
+static void upload_push(upload_item_t& item) {
+  item.sequence = uploadQueue.nextSequence++;
+  uploadQueue.pending.push_back(item);
+  std::push_heap(uploadQueue.pending.begin(), uploadQueue.pending.end(),
+                 upload_item_less);
+}
+
+// Queues (re)initialization of `image`. Subimage pointers in `desc` must stay
+// valid until the upload happens; pass the allocation backing them as
+// `ownedData` to have it freed afterwards. Any older pending upload into the
+// same image is superseded.
+static void queueImageUpload(sg_image image,
+                             const sg_image_desc& desc,
+                             size_t bytes,
+                             int priority,
+                             void* ownedData = nullptr,
+                             void (*freeData)(void*) = free) {
+  cancelImageUploads(image);
+  upload_item_t item = {};
+  item.kind = UploadKind_Image;
+  item.priority = priority;
+  item.bytes = bytes;
+  item.image = image;
+  item.imageDesc = desc;
+  item.ownedData = ownedData;
+  item.freeData = freeData;
+  upload_push(item);
+}
+
+// Queues initialization of a buffer allocated with sg_alloc_buffer().
+static void queueBufferUpload(sg_buffer buffer,
+                              const sg_buffer_desc& desc,
+                              int priority,
+                              void* ownedData = nullptr,
+                              void (*freeData)(void*) = free) {
+  upload_item_t item = {};
+  item.kind = UploadKind_Buffer;
+  item.priority = priority;
+  item.bytes = desc.data.size;
+  item.buffer = buffer;
+  item.bufferDesc = desc;
+  item.ownedData = ownedData;
+  item.freeData = freeData;
+  upload_push(item);
+}
+
+static void upload_execute(upload_item_t* item) {
+  if (item->kind == UploadKind_Image) {
+    if (sg_query_image_state(item->image) != SG_RESOURCESTATE_ALLOC) {
+      sg_uninit_image(item->image);
+    }
+    sg_init_image(item->image, &item->imageDesc);
+  } else {
+    sg_init_buffer(item->buffer, &item->bufferDesc);
+  }
+  upload_item_release(item);
+}
+
+// Call once per frame on the thread that owns the sokol_gfx context.
+static void pumpUploadQueue(void) {
+  upload_queue_stats_t& stats = uploadQueue.stats;
+  stats.uploadsThisFrame = 0;
+  stats.bytesThisFrame = 0;
+  stats.frameUploadMs = 0.0;
+  stats.worstUploadMs = 0.0;
+
+  std::vector<upload_item_t>& pending = uploadQueue.pending;
+  uint64_t frameStart = stm_now();
+  while (!pending.empty()) {
+    if (stats.uploadsThisFrame > 0 &&
+        (stm_ms(stm_since(frameStart)) >= uploadQueue.budgetMs ||
+         stats.bytesThisFrame + pending.front().bytes >
+             uploadQueue.budgetBytes)) {
+      break;
+    }
+    std::pop_heap(pending.begin(), pending.end(), upload_item_less);
+    upload_item_t item = pending.back();
+    pending.pop_back();
+
+    uint64_t uploadStart = stm_now();
+    upload_execute(&item);
+    double uploadMs = stm_ms(stm_since(uploadStart));
+    stats.worstUploadMs = std::max(stats.worstUploadMs, uploadMs);
+    stats.uploadsThisFrame++;
+    stats.bytesThisFrame += item.bytes;
+  }
+  stats.frameUploadMs = stm_ms(stm_since(frameStart));
+  stats.queueDepth = (int)pending.size();
+}
+
+static void destroyUploadQueue(void) {
+  for (upload_item_t& item : uploadQueue.pending) {
+    upload_item_release(&item);
+  }
+  uploadQueue.pending.clear();
+}
+
+static upload_queue_stats_t uploadQueueStats(void) {
+  return uploadQueue.stats;
+}